@@ -0,0 +1,439 @@
+/***************************************************************************
+ *   Copyright (C) 2011 by James K. Larson                                 *
+ *   jlarson@pacifier.com                                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+// The bench itself: sets up a target and a flash bank for the driver, runs
+//  the driver entry points over a range of sectors and prints what each one
+//  cost in simulated time. Each round probes, reads the protection from the
+//  chip, erases, blank checks, writes a test pattern and reads it back; the
+//  read back is checked against the pattern. Driver commands can be run
+//  before the rounds (to turn on a write option, say) and the driver's own
+//  statistics printed after them.
+//
+// Build it against a configured OpenOCD 0.5 tree (its build directory for
+//  config.h, its src and src/flash/nor for the headers), one program per
+//  driver:
+//   cc -std=gnu99 -DHAVE_CONFIG_H -I$OPENOCD_BUILD -I$OPENOCD/src
+//      -I$OPENOCD/src/flash/nor -o stm32x_bench bench/stm32x_bench.c
+//      bench/bench.c bench/bench_target.c bench/bench_cpu.c
+//  and the same with nucX1_bench.c for the nuc driver. Nothing else of
+//  OpenOCD is linked in. Run it with --help for the options.
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "imp.h"
+
+#include <getopt.h>
+
+#include "bench.h"
+
+#define BENCH_PROBE			0
+#define BENCH_PROTECT_CHECK	1
+#define BENCH_ERASE			2
+#define BENCH_ERASE_CHECK	3
+#define BENCH_WRITE			4
+#define BENCH_READ			5
+#define BENCH_OPS			6
+
+#define BENCH_MAX_COMMANDS	16
+#define BENCH_MAX_ARGS		16
+
+struct bench_op
+{
+	const char *name;
+	uint32_t count;
+	uint64_t ps;
+	uint64_t bytes;
+	uint64_t round_trips;
+};
+
+static struct bench_op bench_ops[BENCH_OPS] = {
+	{ .name = "probe" },
+	{ .name = "protect_check" },
+	{ .name = "erase" },
+	{ .name = "erase_check" },
+	{ .name = "write" },
+	{ .name = "read" },
+};
+
+static uint64_t bench_op_start_ps;
+static uint64_t bench_op_start_round_trips;
+
+static void bench_op_start(void)
+{
+	bench_op_start_ps = bench_now();
+	bench_op_start_round_trips = bench_target_round_trips();
+}
+
+static int bench_op_end(int op, uint32_t bytes, int retval)
+{
+	bench_ops[op].count++;
+	bench_ops[op].ps += bench_now() - bench_op_start_ps;
+	bench_ops[op].bytes += bytes;
+	bench_ops[op].round_trips += bench_target_round_trips() - bench_op_start_round_trips;
+
+	if (retval != ERROR_OK)
+		fprintf(stderr, "bench: %s failed (%d)\n", bench_ops[op].name, retval);
+	return retval;
+}
+
+// The test pattern: pseudo random, with a run of 0xff and a run of 0x00 in
+//  every 2K, so blank skipping and compression both have something to do.
+static void bench_pattern(uint8_t *buffer, uint32_t count)
+{
+	uint32_t seed = 0x12345678;
+	uint32_t i;
+
+	for (i = 0; i < count; i++)
+	{
+		switch ((i / 256) % 8)
+		{
+			case 3:
+				buffer[i] = 0xff;
+				break;
+			case 6:
+				buffer[i] = 0x00;
+				break;
+			default:
+				seed = seed * 1103515245 + 12345;
+				buffer[i] = seed >> 16;
+				break;
+		}
+	}
+}
+
+// Runs a driver command the way the command line would, e.g.
+//  "stm32x compressed_write 0 on": the words name the way down the command
+//  groups, the rest are the arguments.
+static int bench_command(struct flash_driver *driver, const char *line)
+{
+	char *copy = strdup(line);
+	const char *argv[BENCH_MAX_ARGS];
+	unsigned argc = 0;
+	char *word;
+	const struct command_registration *regs = driver->commands;
+	const struct command_registration *found = NULL;
+	unsigned i = 0;
+	int retval;
+
+	for (word = strtok(copy, " \t"); word && argc < BENCH_MAX_ARGS; word = strtok(NULL, " \t"))
+		argv[argc++] = word;
+
+	while (regs && i < argc)
+	{
+		const struct command_registration *c;
+
+		for (c = regs; c->name; c++)
+			if (strcmp(c->name, argv[i]) == 0)
+				break;
+		if (!c->name)
+			break;
+		found = c;
+		regs = c->chain;
+		i++;
+	}
+
+	if (!found || !found->handler)
+	{
+		fprintf(stderr, "bench: no such command: %s\n", line);
+		free(copy);
+		return ERROR_COMMAND_SYNTAX_ERROR;
+	}
+
+	struct command_invocation cmd = {
+		.ctx = NULL,
+		.name = found->name,
+		.argc = argc - i,
+		.argv = argv + i,
+	};
+	retval = found->handler(&cmd);
+	if (retval != ERROR_OK)
+		fprintf(stderr, "bench: %s failed (%d)\n", line, retval);
+
+	free(copy);
+	return retval;
+}
+
+static void bench_report(void)
+{
+	int i;
+
+	printf("%-14s %6s %10s %10s %10s %10s\n",
+			"op", "count", "total(s)", "ops/s", "KiB/s", "trips/op");
+	for (i = 0; i < BENCH_OPS; i++)
+	{
+		struct bench_op *op = &bench_ops[i];
+		double seconds = (double)op->ps / (BENCH_PS_PER_MS * 1000);
+
+		if (op->count == 0)
+			continue;
+		printf("%-14s %6" PRIu32 " %10.4f", op->name, op->count, seconds);
+		if (seconds > 0)
+			printf(" %10.2f", op->count / seconds);
+		else
+			printf(" %10s", "-");
+		if (op->bytes && seconds > 0)
+			printf(" %10.2f", op->bytes / (1024.0 * seconds));
+		else
+			printf(" %10s", "-");
+		printf(" %10.1f\n", (double)op->round_trips / op->count);
+	}
+}
+
+static void bench_usage(const char *program)
+{
+	printf("usage: %s [options]\n"
+		"  --latency-us N   adapter round trip (default 1000)\n"
+		"  --bulk-kbps N    block transfer rate in KiB/s (default 256)\n"
+		"  --sram N         working area bytes (default: the part's SRAM)\n"
+		"  --program-us N   flash program time (default: the part's)\n"
+		"  --erase-ms N     page erase time (default: the part's)\n"
+		"  --device-id N    device id register (default: the model's part)\n"
+		"  --flash-kb N     flash size register (default: the part's)\n"
+		"  --first N        first sector (default 0)\n"
+		"  --last N         last sector (default: the last in the bank)\n"
+		"  --rounds N       rounds to run (default 1)\n"
+		"  --gdb            erase and write inside one gdb flash session, as a\n"
+		"                   gdb load does; erase_check is left out\n"
+		"  --command \"...\"  run a driver command first, e.g.\n"
+		"                   \"stm32x compressed_write 0 on\"\n"
+		"  --stats          print the driver's statistics at the end\n"
+		"  --debug N        log level, 3 for debug output\n",
+		program);
+}
+
+int bench_main(int argc, char **argv, const struct bench_driver *bench_driver)
+{
+	static const struct option long_options[] = {
+		{ "latency-us", required_argument, NULL, 'l' },
+		{ "bulk-kbps", required_argument, NULL, 'b' },
+		{ "sram", required_argument, NULL, 's' },
+		{ "program-us", required_argument, NULL, 'p' },
+		{ "erase-ms", required_argument, NULL, 'e' },
+		{ "device-id", required_argument, NULL, 'i' },
+		{ "flash-kb", required_argument, NULL, 'k' },
+		{ "first", required_argument, NULL, 'f' },
+		{ "last", required_argument, NULL, 'L' },
+		{ "rounds", required_argument, NULL, 'r' },
+		{ "gdb", no_argument, NULL, 'g' },
+		{ "command", required_argument, NULL, 'c' },
+		{ "stats", no_argument, NULL, 'S' },
+		{ "debug", required_argument, NULL, 'd' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+	struct bench_options options = {
+		.latency_us = 1000,
+		.bulk_kbps = 256,
+	};
+	struct flash_driver *driver = bench_driver->driver;
+	const char *commands[BENCH_MAX_COMMANDS];
+	int num_commands = 0;
+	uint32_t first = 0;
+	uint32_t last = UINT32_MAX;
+	uint32_t rounds = 1;
+	bool gdb = false;
+	bool stats = false;
+	uint32_t debug = debug_level;
+	uint32_t *value;
+	int c;
+	int i;
+
+	while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 'l': value = &options.latency_us; break;
+			case 'b': value = &options.bulk_kbps; break;
+			case 's': value = &options.sram_size; break;
+			case 'p': value = &options.program_us; break;
+			case 'e': value = &options.erase_ms; break;
+			case 'i': value = &options.device_id; break;
+			case 'k': value = &options.flash_kb; break;
+			case 'f': value = &first; break;
+			case 'L': value = &last; break;
+			case 'r': value = &rounds; break;
+			case 'd': value = &debug; break;
+			case 'g':
+				gdb = true;
+				continue;
+			case 'S':
+				stats = true;
+				continue;
+			case 'c':
+				if (num_commands == BENCH_MAX_COMMANDS)
+				{
+					fprintf(stderr, "bench: too many commands\n");
+					return 1;
+				}
+				commands[num_commands++] = optarg;
+				continue;
+			case 'h':
+				bench_usage(argv[0]);
+				return 0;
+			default:
+				bench_usage(argv[0]);
+				return 1;
+		}
+		if (parse_u32(optarg, value) != ERROR_OK)
+		{
+			fprintf(stderr, "bench: bad number '%s'\n", optarg);
+			return 1;
+		}
+	}
+	debug_level = debug;
+
+	struct bench_device *device = bench_driver->create_device(&options);
+	if (!device)
+		return 1;
+
+	struct target target;
+	memset(&target, 0, sizeof(target));
+	target.cmd_name = "bench.cpu";
+	bench_target_init(&target, device, &options);
+
+	// the bank, set up as "flash bank bench.flash <driver> <base> 0 0 0 bench.cpu"
+	struct flash_bank *bank = calloc(1, sizeof(struct flash_bank));
+	char base[16];
+	snprintf(base, sizeof(base), "0x%08" PRIx32, device->flash_base);
+	const char *bank_argv[] = {
+		"bench.flash", driver->name, base, "0", "0", "0", target.cmd_name,
+	};
+	struct command_invocation cmd = {
+		.ctx = NULL,
+		.name = "bank",
+		.argc = 7,
+		.argv = bank_argv,
+	};
+	bank->name = "bench.flash";
+	bank->target = &target;
+	bank->driver = driver;
+	bank->base = device->flash_base;
+	if (driver->flash_bank_command(&cmd, bank) != ERROR_OK)
+		return 1;
+	bench_flash_register(bank);
+
+	// the first probe finds the part; the ones in the rounds find it again
+	bench_op_start();
+	if (bench_op_end(BENCH_PROBE, 0, driver->probe(bank)) != ERROR_OK)
+		return 1;
+
+	for (i = 0; i < num_commands; i++)
+		if (bench_command(driver, commands[i]) != ERROR_OK)
+			return 1;
+
+	if (last == UINT32_MAX)
+		last = bank->num_sectors - 1;
+	if (first > last || last >= (uint32_t)bank->num_sectors)
+	{
+		fprintf(stderr, "bench: sectors %" PRIu32 "..%" PRIu32 " not in the bank (%d sectors)\n",
+				first, last, bank->num_sectors);
+		return 1;
+	}
+	uint32_t offset = bank->sectors[first].offset;
+	uint32_t length = bank->sectors[last].offset + bank->sectors[last].size - offset;
+
+	uint8_t *pattern = malloc(length);
+	uint8_t *readback = malloc(length);
+	bench_pattern(pattern, length);
+
+	uint32_t round;
+	for (round = 0; round < rounds; round++)
+	{
+		int retval;
+
+		if (round > 0)
+		{
+			bench_op_start();
+			if (bench_op_end(BENCH_PROBE, 0, driver->probe(bank)) != ERROR_OK)
+				return 1;
+		}
+
+		bench_driver->invalidate_protection(bank);
+		bench_op_start();
+		if (bench_op_end(BENCH_PROTECT_CHECK, 0, driver->protect_check(bank)) != ERROR_OK)
+			return 1;
+
+		bench_op_start();
+		if (gdb)
+			bench_target_event(&target, TARGET_EVENT_GDB_FLASH_ERASE_START);
+		retval = driver->erase(bank, first, last);
+		if (gdb)
+			bench_target_event(&target, TARGET_EVENT_GDB_FLASH_ERASE_END);
+		if (bench_op_end(BENCH_ERASE, length, retval) != ERROR_OK)
+			return 1;
+
+		if (!gdb)
+		{
+			bench_op_start();
+			if (bench_op_end(BENCH_ERASE_CHECK, bank->size, driver->erase_check(bank)) != ERROR_OK)
+				return 1;
+		}
+
+		// the flush at the end of a gdb session is part of the write
+		bench_op_start();
+		if (gdb)
+			bench_target_event(&target, TARGET_EVENT_GDB_FLASH_WRITE_START);
+		retval = driver->write(bank, pattern, offset, length);
+		if (gdb)
+			bench_target_event(&target, TARGET_EVENT_GDB_FLASH_WRITE_END);
+		if (bench_op_end(BENCH_WRITE, length, retval) != ERROR_OK)
+			return 1;
+
+		memset(readback, 0, length);
+		bench_op_start();
+		if (bench_op_end(BENCH_READ, length, driver->read(bank, readback, offset, length)) != ERROR_OK)
+			return 1;
+
+		if (memcmp(pattern, readback, length) != 0)
+		{
+			uint32_t n = 0;
+			while (pattern[n] == readback[n])
+				n++;
+			fprintf(stderr, "bench: round %" PRIu32 ": read back differs at 0x%08" PRIx32
+					" (0x%02x, expected 0x%02x)\n", round + 1, bank->base + offset + n,
+					readback[n], pattern[n]);
+			return 1;
+		}
+	}
+
+	printf("%s bench: %s, %" PRIu32 " KiB flash, %" PRIu32 " bytes of working area\n",
+			driver->name, device->name, bank->size / 1024, target.working_area_size);
+	printf("adapter: %" PRIu32 " us round trip, %" PRIu32 " KiB/s bulk; %s\n",
+			options.latency_us, options.bulk_kbps,
+			gdb ? "in a gdb flash session" : "no gdb session");
+	printf("sectors %" PRIu32 "..%" PRIu32 " (%" PRIu32 " bytes), %" PRIu32 " round%s, "
+			"read back ok, %.4fs in all\n\n", first, last, length, rounds,
+			(rounds == 1) ? "" : "s", (double)bench_now() / (BENCH_PS_PER_MS * 1000));
+	bench_report();
+
+	if (stats)
+	{
+		char line[64];
+
+		printf("\n");
+		snprintf(line, sizeof(line), "%s stats %d", driver->name, bank->bank_number);
+		if (bench_command(driver, line) != ERROR_OK)
+			return 1;
+	}
+
+	free(readback);
+	free(pattern);
+	return 0;
+}
@@ -0,0 +1,115 @@
+/***************************************************************************
+ *   Copyright (C) 2011 by James K. Larson                                 *
+ *   jlarson@pacifier.com                                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+// Shared declarations for the flash driver bench. The bench runs a driver
+//  without a target: bench_target.c supplies the target_* functions the
+//  driver calls, bench_cpu.c runs its loaders and a device model (one per
+//  driver, in <driver>_bench.c) stands in for the flash controller. Time is
+//  simulated, so the numbers only depend on the costs given on the command
+//  line, never on the host.
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The working area lives at the start of the on-chip SRAM, as in the
+//  target configs of both parts.
+#define BENCH_SRAM_BASE		0x20000000
+
+// Simulated time is kept in picoseconds, so a core clock period is exact
+//  enough to add up over millions of instructions.
+#define BENCH_PS_PER_US		1000000ULL
+#define BENCH_PS_PER_MS		1000000000ULL
+
+// What the adapter, the chip and its flash cost. Set from the command line;
+//  a device model reads the flash times and the sizes it is built for.
+struct bench_options
+{
+	uint32_t latency_us;		// one round trip over the adapter
+	uint32_t bulk_kbps;			// block transfer rate once a transfer is going
+	uint32_t sram_size;			// bytes of working area; 0 is the device default
+	uint32_t program_us;		// one flash program operation; 0 is the default
+	uint32_t erase_ms;			// one page erase; 0 is the default
+	uint32_t device_id;			// 0 is the device model's default part
+	uint32_t flash_kb;			// flash size register; 0 is the part's full size
+};
+
+// A device model: everything on the bus but the SRAM. read/write return
+//  false for an address the part does not decode, which is a bus fault for
+//  the core and a failed access for the adapter.
+struct bench_device
+{
+	const char *name;
+	uint32_t flash_base;
+	uint32_t sram_size;			// default working area
+	uint32_t core_hz;			// current core clock, kept up to date by the model
+	bool (*read)(struct bench_device *device, uint32_t address, unsigned size, uint32_t *value);
+	bool (*write)(struct bench_device *device, uint32_t address, unsigned size, uint32_t value);
+};
+
+// The part of a bench that knows the driver. <driver>_bench.c fills this in
+//  and calls bench_main.
+struct flash_driver;
+struct flash_bank;
+struct bench_driver
+{
+	struct flash_driver *driver;
+	// Creates the device model for the options given.
+	struct bench_device *(*create_device)(const struct bench_options *options);
+	// Forgets the cached protection state, so protect_check asks the chip.
+	void (*invalidate_protection)(struct flash_bank *bank);
+};
+
+int bench_main(int argc, char **argv, const struct bench_driver *bench_driver);
+
+// Simulated clock: the time of whoever is using the bus, the adapter or the
+//  core. A device model calls bench_stall_until when an access has to wait
+//  for the flash, which moves that clock forward.
+uint64_t bench_now(void);
+void bench_stall_until(uint64_t ps);
+
+// The bus as the core sees it: SRAM, then the device model.
+bool bench_bus_read(uint32_t address, unsigned size, uint32_t *value);
+bool bench_bus_write(uint32_t address, unsigned size, uint32_t value);
+
+// The target side of the bench (bench_target.c).
+struct target;
+void bench_target_init(struct target *target, struct bench_device *device,
+		const struct bench_options *options);
+void bench_target_event(struct target *target, int event);
+uint64_t bench_target_round_trips(void);
+void bench_flash_register(struct flash_bank *bank);
+
+// Core state for bench_cpu.c. Only what the loaders use of the Cortex-M3 is
+//  there: the sixteen registers, the flags and the IT state.
+struct bench_cpu
+{
+	uint32_t r[16];
+	bool n, z, c, v;
+	uint8_t itstate;
+	bool halted;				// stopped at a bkpt
+	bool faulted;				// stopped on an instruction or bus fault
+	uint64_t cycles;
+};
+
+// Runs one instruction; returns the number of core cycles it took.
+unsigned bench_cpu_step(struct bench_cpu *cpu);
+
+#endif /* BENCH_H */
@@ -0,0 +1,796 @@
+/***************************************************************************
+ *   Copyright (C) 2011 by James K. Larson                                 *
+ *   jlarson@pacifier.com                                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+// A small Thumb-2 interpreter for the flash loaders. It covers what the
+//  loaders in both drivers are built from: 16-bit data processing, loads and
+//  stores, branches and IT blocks, and the 32-bit data processing, load,
+//  store and branch forms. Anything else stops the core with a fault, which
+//  the bench reports, so a loader change that needs more shows up at once.
+// Cycle counts follow the Cortex-M3 roughly: one per instruction, one more
+//  for a load or store and two more for a taken branch. That is close enough
+//  to see how a loader compares with the adapter and the flash.
+#include <stdio.h>
+
+#include "bench.h"
+
+#define BENCH_CPU_PC	15
+#define BENCH_CPU_LR	14
+
+static uint32_t bench_cpu_ror(uint32_t value, unsigned n)
+{
+	n &= 31;
+	return n ? (value >> n) | (value << (32 - n)) : value;
+}
+
+static void bench_cpu_nz(struct bench_cpu *cpu, uint32_t result)
+{
+	cpu->n = (result >> 31) != 0;
+	cpu->z = (result == 0);
+}
+
+// AddWithCarry from the ARM ARM; sets the flags when asked to.
+static uint32_t bench_cpu_add(struct bench_cpu *cpu, uint32_t a, uint32_t b,
+		bool carry_in, bool set_flags)
+{
+	uint64_t unsigned_sum = (uint64_t)a + b + carry_in;
+	uint32_t result = (uint32_t)unsigned_sum;
+
+	if (set_flags)
+	{
+		bench_cpu_nz(cpu, result);
+		cpu->c = (unsigned_sum >> 32) != 0;
+		cpu->v = (((a ^ result) & (b ^ result)) >> 31) != 0;
+	}
+	return result;
+}
+
+static bool bench_cpu_condition(struct bench_cpu *cpu, unsigned cond)
+{
+	bool result;
+
+	switch (cond >> 1)
+	{
+		case 0: result = cpu->z; break;
+		case 1: result = cpu->c; break;
+		case 2: result = cpu->n; break;
+		case 3: result = cpu->v; break;
+		case 4: result = cpu->c && !cpu->z; break;
+		case 5: result = (cpu->n == cpu->v); break;
+		case 6: result = !cpu->z && (cpu->n == cpu->v); break;
+		default: return true;
+	}
+	return (cond & 1) ? !result : result;
+}
+
+// Shift_C: shifts value and gives the carry out; type is LSL, LSR, ASR, ROR
+//  and an immediate ROR by 0 is RRX, as in DecodeImmShift.
+static uint32_t bench_cpu_shift(struct bench_cpu *cpu, uint32_t value,
+		unsigned type, unsigned amount, bool *carry)
+{
+	*carry = cpu->c;
+	if (amount == 0 && type != 3)
+		return value;
+
+	switch (type)
+	{
+		case 0:
+			if (amount > 32)
+			{
+				*carry = false;
+				return 0;
+			}
+			*carry = (value >> (32 - amount)) & 1;
+			return (amount == 32) ? 0 : value << amount;
+		case 1:
+			if (amount > 32)
+			{
+				*carry = false;
+				return 0;
+			}
+			*carry = (value >> (amount - 1)) & 1;
+			return (amount == 32) ? 0 : value >> amount;
+		case 2:
+			if (amount >= 32)
+			{
+				*carry = (value >> 31) != 0;
+				return *carry ? 0xffffffff : 0;
+			}
+			*carry = (value >> (amount - 1)) & 1;
+			return (uint32_t)((int32_t)value >> amount);
+		default:
+			if (amount == 0)
+			{
+				*carry = value & 1;
+				return (value >> 1) | ((uint32_t)cpu->c << 31);
+			}
+			value = bench_cpu_ror(value, amount);
+			*carry = (value >> 31) != 0;
+			return value;
+	}
+}
+
+// ThumbExpandImm_C
+static uint32_t bench_cpu_expand_imm(struct bench_cpu *cpu, uint32_t imm12, bool *carry)
+{
+	uint32_t imm8 = imm12 & 0xff;
+
+	*carry = cpu->c;
+	switch (imm12 >> 8)
+	{
+		case 0: return imm8;
+		case 1: return imm8 | (imm8 << 16);
+		case 2: return (imm8 << 8) | (imm8 << 24);
+		case 3: return imm8 | (imm8 << 8) | (imm8 << 16) | (imm8 << 24);
+	}
+
+	uint32_t value = bench_cpu_ror(0x80 | (imm12 & 0x7f), imm12 >> 7);
+	*carry = (value >> 31) != 0;
+	return value;
+}
+
+// The data processing operations shared by the 32-bit immediate and shifted
+//  register forms. rd 15 with S set is the compare form (TST, TEQ, CMN, CMP)
+//  and rn 15 turns ORR and ORN into MOV and MVN. Returns false for an
+//  operation the interpreter does not do.
+static bool bench_cpu_data_op(struct bench_cpu *cpu, unsigned op, bool set_flags,
+		unsigned rn, unsigned rd, uint32_t operand, bool carry)
+{
+	uint32_t a = cpu->r[rn];
+	uint32_t result;
+	bool logical = true;
+
+	switch (op)
+	{
+		case 0: result = a & operand; break;
+		case 1: result = a & ~operand; break;
+		case 2: result = (rn == 15) ? operand : a | operand; break;
+		case 3: result = (rn == 15) ? ~operand : a | ~operand; break;
+		case 4: result = a ^ operand; break;
+		case 8:
+			result = bench_cpu_add(cpu, a, operand, false, set_flags);
+			logical = false;
+			break;
+		case 10:
+			result = bench_cpu_add(cpu, a, operand, cpu->c, set_flags);
+			logical = false;
+			break;
+		case 11:
+			result = bench_cpu_add(cpu, a, ~operand, cpu->c, set_flags);
+			logical = false;
+			break;
+		case 13:
+			result = bench_cpu_add(cpu, a, ~operand, true, set_flags);
+			logical = false;
+			break;
+		case 14:
+			result = bench_cpu_add(cpu, operand, ~a, true, set_flags);
+			logical = false;
+			break;
+		default:
+			return false;
+	}
+
+	if (logical && set_flags)
+	{
+		bench_cpu_nz(cpu, result);
+		cpu->c = carry;
+	}
+	if (rd != 15 || !set_flags)
+		cpu->r[rd] = result;
+	return true;
+}
+
+static void bench_cpu_fault(struct bench_cpu *cpu, uint32_t pc, const char *what,
+		uint32_t detail)
+{
+	fprintf(stderr, "bench: core fault at 0x%08x: %s 0x%08x\n",
+			(unsigned)pc, what, (unsigned)detail);
+	cpu->faulted = true;
+}
+
+static bool bench_cpu_load(struct bench_cpu *cpu, uint32_t pc, uint32_t address,
+		unsigned size, bool sign, uint32_t *value)
+{
+	if (!bench_bus_read(address, size, value))
+	{
+		bench_cpu_fault(cpu, pc, "bus fault reading", address);
+		return false;
+	}
+	if (sign && size == 1)
+		*value = (uint32_t)(int8_t)*value;
+	else if (sign && size == 2)
+		*value = (uint32_t)(int16_t)*value;
+	return true;
+}
+
+static bool bench_cpu_store(struct bench_cpu *cpu, uint32_t pc, uint32_t address,
+		unsigned size, uint32_t value)
+{
+	if (size < 4)
+		value &= (1u << (8 * size)) - 1;
+	if (!bench_bus_write(address, size, value))
+	{
+		bench_cpu_fault(cpu, pc, "bus fault writing", address);
+		return false;
+	}
+	return true;
+}
+
+// The 16-bit instructions. in_it is true inside an IT block, where the
+//  flag setting forms other than the compares leave the flags alone.
+static unsigned bench_cpu_step16(struct bench_cpu *cpu, uint32_t pc, uint16_t hw,
+		bool in_it)
+{
+	uint32_t *r = cpu->r;
+	uint32_t pc_value = pc + 4;
+	bool set_flags = !in_it;
+	uint32_t value;
+	bool carry;
+
+	r[BENCH_CPU_PC] = pc + 2;
+
+	if ((hw >> 11) < 3)
+	{
+		// LSL, LSR, ASR (immediate); LSL #0 is MOVS
+		unsigned type = hw >> 11;
+		unsigned amount = (hw >> 6) & 31;
+		if (type != 0 && amount == 0)
+			amount = 32;
+		value = bench_cpu_shift(cpu, r[(hw >> 3) & 7], type, amount, &carry);
+		r[hw & 7] = value;
+		if (set_flags)
+		{
+			bench_cpu_nz(cpu, value);
+			cpu->c = carry;
+		}
+		return 1;
+	}
+	if ((hw >> 11) == 3)
+	{
+		// ADDS, SUBS (register or 3-bit immediate)
+		uint32_t operand = (hw & (1 << 10)) ? (hw >> 6) & 7u : r[(hw >> 6) & 7];
+		uint32_t a = r[(hw >> 3) & 7];
+		if (hw & (1 << 9))
+			r[hw & 7] = bench_cpu_add(cpu, a, ~operand, true, set_flags);
+		else
+			r[hw & 7] = bench_cpu_add(cpu, a, operand, false, set_flags);
+		return 1;
+	}
+	if ((hw >> 13) == 1)
+	{
+		// MOVS, CMP, ADDS, SUBS (8-bit immediate)
+		unsigned rdn = (hw >> 8) & 7;
+		uint32_t imm8 = hw & 0xff;
+		switch ((hw >> 11) & 3)
+		{
+			case 0:
+				r[rdn] = imm8;
+				if (set_flags)
+					bench_cpu_nz(cpu, imm8);
+				break;
+			case 1:
+				bench_cpu_add(cpu, r[rdn], ~imm8, true, true);
+				break;
+			case 2:
+				r[rdn] = bench_cpu_add(cpu, r[rdn], imm8, false, set_flags);
+				break;
+			case 3:
+				r[rdn] = bench_cpu_add(cpu, r[rdn], ~imm8, true, set_flags);
+				break;
+		}
+		return 1;
+	}
+	if ((hw >> 10) == 0x10)
+	{
+		// data processing on low registers
+		unsigned rdn = hw & 7;
+		uint32_t a = r[rdn];
+		uint32_t b = r[(hw >> 3) & 7];
+		bool logical = true;
+		bool compare = false;
+
+		carry = cpu->c;
+		switch ((hw >> 6) & 15)
+		{
+			case 0: value = a & b; break;
+			case 1: value = a ^ b; break;
+			case 2: value = bench_cpu_shift(cpu, a, 0, b & 0xff, &carry); break;
+			case 3: value = bench_cpu_shift(cpu, a, 1, b & 0xff, &carry); break;
+			case 4: value = bench_cpu_shift(cpu, a, 2, b & 0xff, &carry); break;
+			case 5:
+				value = bench_cpu_add(cpu, a, b, cpu->c, set_flags);
+				logical = false;
+				break;
+			case 6:
+				value = bench_cpu_add(cpu, a, ~b, cpu->c, set_flags);
+				logical = false;
+				break;
+			case 7:
+				if ((b & 0xff) == 0)
+					value = a;
+				else
+				{
+					value = bench_cpu_ror(a, b & 31);
+					carry = (value >> 31) != 0;
+				}
+				break;
+			case 8:
+				value = a & b;
+				compare = true;
+				set_flags = true;
+				break;
+			case 9:
+				value = bench_cpu_add(cpu, ~b, 0, true, set_flags);
+				logical = false;
+				break;
+			case 10:
+				bench_cpu_add(cpu, a, ~b, true, true);
+				return 1;
+			case 11:
+				bench_cpu_add(cpu, a, b, false, true);
+				return 1;
+			case 12: value = a | b; break;
+			case 13: value = a * b; break;
+			case 14: value = a & ~b; break;
+			default: value = ~b; break;
+		}
+		if (logical && set_flags)
+		{
+			bench_cpu_nz(cpu, value);
+			cpu->c = carry;
+		}
+		if (!compare)
+			r[rdn] = value;
+		return 1;
+	}
+	if ((hw >> 10) == 0x11)
+	{
+		// ADD, CMP, MOV on any register, BX, BLX
+		unsigned rdn = (hw & 7) | ((hw >> 4) & 8);
+		unsigned rm = (hw >> 3) & 15;
+		uint32_t b = (rm == 15) ? pc_value : r[rm];
+		switch ((hw >> 8) & 3)
+		{
+			case 0:
+				value = ((rdn == 15) ? pc_value : r[rdn]) + b;
+				break;
+			case 1:
+				bench_cpu_add(cpu, r[rdn], ~b, true, true);
+				return 1;
+			case 2:
+				value = b;
+				break;
+			default:
+				if (hw & (1 << 7))
+					r[BENCH_CPU_LR] = (pc + 2) | 1;
+				r[BENCH_CPU_PC] = b & ~1u;
+				return 3;
+		}
+		if (rdn == 15)
+		{
+			r[BENCH_CPU_PC] = value & ~1u;
+			return 3;
+		}
+		r[rdn] = value;
+		return 1;
+	}
+	if ((hw >> 11) == 9)
+	{
+		// LDR (literal)
+		uint32_t address = (pc_value & ~3u) + (hw & 0xff) * 4;
+		if (!bench_cpu_load(cpu, pc, address, 4, false, &value))
+			return 1;
+		r[(hw >> 8) & 7] = value;
+		return 2;
+	}
+	if ((hw >> 12) == 5)
+	{
+		// loads and stores with a register offset
+		static const unsigned sizes[8] = { 4, 2, 1, 1, 4, 2, 1, 2 };
+		unsigned op = (hw >> 9) & 7;
+		uint32_t address = r[(hw >> 3) & 7] + r[(hw >> 6) & 7];
+		unsigned rt = hw & 7;
+		if (op < 3)
+		{
+			bench_cpu_store(cpu, pc, address, sizes[op], r[rt]);
+			return 2;
+		}
+		if (bench_cpu_load(cpu, pc, address, sizes[op], op == 3 || op == 7, &value))
+			r[rt] = value;
+		return 2;
+	}
+	if ((hw >> 13) == 3 || (hw >> 12) == 8)
+	{
+		// LDR, STR, LDRB, STRB, LDRH, STRH (5-bit immediate)
+		unsigned size = ((hw >> 12) == 8) ? 2 : ((hw & (1 << 12)) ? 1 : 4);
+		uint32_t address = r[(hw >> 3) & 7] + ((hw >> 6) & 31) * size;
+		unsigned rt = hw & 7;
+		if (hw & (1 << 11))
+		{
+			if (bench_cpu_load(cpu, pc, address, size, false, &value))
+				r[rt] = value;
+		}
+		else
+			bench_cpu_store(cpu, pc, address, size, r[rt]);
+		return 2;
+	}
+	if ((hw >> 12) == 9)
+	{
+		// LDR, STR (SP relative)
+		uint32_t address = r[13] + (hw & 0xff) * 4;
+		unsigned rt = (hw >> 8) & 7;
+		if (hw & (1 << 11))
+		{
+			if (bench_cpu_load(cpu, pc, address, 4, false, &value))
+				r[rt] = value;
+		}
+		else
+			bench_cpu_store(cpu, pc, address, 4, r[rt]);
+		return 2;
+	}
+	if ((hw >> 12) == 0xA)
+	{
+		// ADR, ADD (SP plus immediate)
+		uint32_t base = (hw & (1 << 11)) ? r[13] : (pc_value & ~3u);
+		r[(hw >> 8) & 7] = base + (hw & 0xff) * 4;
+		return 1;
+	}
+	if ((hw >> 12) == 0xB)
+	{
+		if ((hw >> 8) == 0xBE)
+		{
+			// BKPT: the end of every loader
+			r[BENCH_CPU_PC] = pc;
+			cpu->halted = true;
+			return 1;
+		}
+		if ((hw >> 8) == 0xBF)
+		{
+			// IT, or a hint (NOP and friends)
+			if (hw & 0xf)
+				cpu->itstate = hw & 0xff;
+			return 1;
+		}
+		if ((hw & 0xff00) == 0xB000)
+		{
+			uint32_t imm = (hw & 0x7f) * 4;
+			r[13] = (hw & (1 << 7)) ? r[13] - imm : r[13] + imm;
+			return 1;
+		}
+		if ((hw & 0xf500) == 0xB100)
+		{
+			// CBZ, CBNZ
+			uint32_t offset = ((hw >> 3) & 0x1f) * 2 + ((hw & (1 << 9)) ? 64 : 0);
+			bool zero = (r[hw & 7] == 0);
+			if (zero != ((hw & (1 << 11)) != 0))
+			{
+				r[BENCH_CPU_PC] = pc_value + offset;
+				return 3;
+			}
+			return 1;
+		}
+		if ((hw & 0xff00) == 0xB200)
+		{
+			// SXTH, SXTB, UXTH, UXTB
+			uint32_t b = r[(hw >> 3) & 7];
+			switch ((hw >> 6) & 3)
+			{
+				case 0: value = (uint32_t)(int16_t)b; break;
+				case 1: value = (uint32_t)(int8_t)b; break;
+				case 2: value = b & 0xffff; break;
+				default: value = b & 0xff; break;
+			}
+			r[hw & 7] = value;
+			return 1;
+		}
+		if ((hw & 0xfe00) == 0xB400 || (hw & 0xfe00) == 0xBC00)
+		{
+			// PUSH, POP
+			bool pop = (hw & (1 << 11)) != 0;
+			unsigned list = (hw & 0xff) | ((hw & (1 << 8)) ? (pop ? 0x8000 : 0x4000) : 0);
+			unsigned count = __builtin_popcount(list);
+			uint32_t address = pop ? r[13] : r[13] - 4 * count;
+			uint32_t sp = pop ? r[13] + 4 * count : address;
+			unsigned i;
+
+			for (i = 0; i < 16; i++)
+			{
+				if (!(list & (1u << i)))
+					continue;
+				if (pop)
+				{
+					if (!bench_cpu_load(cpu, pc, address, 4, false, &value))
+						return 1;
+					if (i == 15)
+						r[BENCH_CPU_PC] = value & ~1u;
+					else
+						r[i] = value;
+				}
+				else if (!bench_cpu_store(cpu, pc, address, 4, r[i]))
+					return 1;
+				address += 4;
+			}
+			r[13] = sp;
+			return 1 + count + ((list & 0x8000) ? 2 : 0);
+		}
+	}
+	if ((hw >> 12) == 0xD)
+	{
+		// B<cond>; 0xDE is UDF and 0xDF is SVC
+		unsigned cond = (hw >> 8) & 15;
+		if (cond >= 14)
+		{
+			bench_cpu_fault(cpu, pc, "undefined instruction", hw);
+			return 1;
+		}
+		if (!bench_cpu_condition(cpu, cond))
+			return 1;
+		r[BENCH_CPU_PC] = pc_value + (uint32_t)((int32_t)(int8_t)(hw & 0xff) * 2);
+		return 3;
+	}
+	if ((hw >> 11) == 0x1C)
+	{
+		int32_t offset = (int32_t)((uint32_t)(hw & 0x7ff) << 21) >> 20;
+		r[BENCH_CPU_PC] = pc_value + (uint32_t)offset;
+		return 3;
+	}
+
+	bench_cpu_fault(cpu, pc, "unsupported instruction", hw);
+	return 1;
+}
+
+// Loads and stores of one item with the 32-bit encodings: imm12, imm8 with
+//  pre or post indexing and writeback, register offset and literal.
+static unsigned bench_cpu_load_store32(struct bench_cpu *cpu, uint32_t pc,
+		uint16_t hw1, uint16_t hw2)
+{
+	uint32_t *r = cpu->r;
+	bool sign = (hw1 & (1 << 8)) != 0;
+	unsigned size = 1u << ((hw1 >> 5) & 3);
+	bool load = (hw1 & (1 << 4)) != 0;
+	unsigned rn = hw1 & 15;
+	unsigned rt = hw2 >> 12;
+	uint32_t address;
+	uint32_t value;
+
+	if (size > 4)
+	{
+		bench_cpu_fault(cpu, pc, "unsupported instruction", ((uint32_t)hw1 << 16) | hw2);
+		return 1;
+	}
+
+	if (rn == 15)
+	{
+		uint32_t base = (pc + 4) & ~3u;
+		address = (hw1 & (1 << 7)) ? base + (hw2 & 0xfff) : base - (hw2 & 0xfff);
+	}
+	else if (hw1 & (1 << 7))
+		address = r[rn] + (hw2 & 0xfff);
+	else if (hw2 & (1 << 11))
+	{
+		uint32_t imm8 = hw2 & 0xff;
+		uint32_t offset_address = (hw2 & (1 << 9)) ? r[rn] + imm8 : r[rn] - imm8;
+		address = (hw2 & (1 << 10)) ? offset_address : r[rn];
+		if (hw2 & (1 << 8))
+			r[rn] = offset_address;
+	}
+	else if ((hw2 & 0xfc0) == 0)
+		address = r[rn] + (r[hw2 & 15] << ((hw2 >> 4) & 3));
+	else
+	{
+		bench_cpu_fault(cpu, pc, "unsupported instruction", ((uint32_t)hw1 << 16) | hw2);
+		return 1;
+	}
+
+	if (!load)
+	{
+		bench_cpu_store(cpu, pc, address, size, r[rt]);
+		return 2;
+	}
+	if (!bench_cpu_load(cpu, pc, address, size, sign, &value))
+		return 1;
+	if (rt == 15)
+	{
+		r[BENCH_CPU_PC] = value & ~1u;
+		return 4;
+	}
+	r[rt] = value;
+	return 2;
+}
+
+static unsigned bench_cpu_step32(struct bench_cpu *cpu, uint32_t pc, uint16_t hw1,
+		uint16_t hw2)
+{
+	uint32_t *r = cpu->r;
+	uint32_t pc_value = pc + 4;
+	uint32_t opcode = ((uint32_t)hw1 << 16) | hw2;
+	bool carry;
+
+	r[BENCH_CPU_PC] = pc + 4;
+
+	if ((hw1 & 0xfe00) == 0xea00)
+	{
+		// data processing (shifted register)
+		unsigned amount = ((hw2 >> 10) & 0x1c) | ((hw2 >> 6) & 3);
+		unsigned type = (hw2 >> 4) & 3;
+		if (type != 0 && type != 3 && amount == 0)
+			amount = 32;
+		uint32_t operand = bench_cpu_shift(cpu, r[hw2 & 15], type, amount, &carry);
+		if (bench_cpu_data_op(cpu, (hw1 >> 5) & 15, (hw1 >> 4) & 1, hw1 & 15,
+				(hw2 >> 8) & 15, operand, carry))
+			return 1;
+	}
+	else if ((hw1 & 0xf800) == 0xf000 && !(hw2 & 0x8000))
+	{
+		unsigned rd = (hw2 >> 8) & 15;
+		uint32_t imm12 = ((hw1 & (1 << 10)) >> 10 << 11) | ((hw2 >> 4) & 0x700) | (hw2 & 0xff);
+
+		if (!(hw1 & (1 << 9)))
+		{
+			// data processing (modified immediate)
+			uint32_t operand = bench_cpu_expand_imm(cpu, imm12, &carry);
+			if (bench_cpu_data_op(cpu, (hw1 >> 5) & 15, (hw1 >> 4) & 1, hw1 & 15, rd,
+					operand, carry))
+				return 1;
+		}
+		else
+		{
+			// data processing (plain binary immediate)
+			uint32_t base = ((hw1 & 15) == 15) ? (pc_value & ~3u) : r[hw1 & 15];
+			switch ((hw1 >> 4) & 0x1f)
+			{
+				case 0x00:
+					r[rd] = base + imm12;
+					return 1;
+				case 0x04:
+					r[rd] = ((uint32_t)(hw1 & 15) << 12) | imm12;
+					return 1;
+				case 0x0a:
+					r[rd] = base - imm12;
+					return 1;
+				case 0x0c:
+					r[rd] = (r[rd] & 0xffff) | (((uint32_t)(hw1 & 15) << 12 | imm12) << 16);
+					return 1;
+			}
+		}
+	}
+	else if ((hw1 & 0xf800) == 0xf000)
+	{
+		// branches and miscellaneous control
+		uint32_t s = (hw1 >> 10) & 1;
+		uint32_t j1 = (hw2 >> 13) & 1;
+		uint32_t j2 = (hw2 >> 11) & 1;
+
+		if ((hw2 & 0x5000) == 0x5000 || (hw2 & 0x5000) == 0x1000)
+		{
+			// BL, B.W
+			uint32_t i1 = !(j1 ^ s);
+			uint32_t i2 = !(j2 ^ s);
+			uint32_t imm = (s << 24) | (i1 << 23) | (i2 << 22) |
+					((uint32_t)(hw1 & 0x3ff) << 12) | ((uint32_t)(hw2 & 0x7ff) << 1);
+			int32_t offset = (int32_t)(imm << 7) >> 7;
+			if (hw2 & 0x4000)
+				r[BENCH_CPU_LR] = (pc + 4) | 1;
+			r[BENCH_CPU_PC] = pc_value + (uint32_t)offset;
+			return 4;
+		}
+		if ((hw2 & 0x5000) == 0 && ((hw1 >> 7) & 7) != 7)
+		{
+			// B<cond>.W
+			uint32_t imm = (s << 20) | (j2 << 19) | (j1 << 18) |
+					((uint32_t)(hw1 & 0x3f) << 12) | ((uint32_t)(hw2 & 0x7ff) << 1);
+			int32_t offset = (int32_t)(imm << 11) >> 11;
+			if (!bench_cpu_condition(cpu, (hw1 >> 6) & 15))
+				return 1;
+			r[BENCH_CPU_PC] = pc_value + (uint32_t)offset;
+			return 4;
+		}
+		if ((hw1 & 0xfff0) == 0xf3b0 || hw1 == 0xf3af)
+		{
+			// DSB, DMB, ISB and the hints; nothing to wait for here
+			return 1;
+		}
+	}
+	else if ((hw1 & 0xfe00) == 0xf800)
+		return bench_cpu_load_store32(cpu, pc, hw1, hw2);
+	else if ((hw1 & 0xff80) == 0xfa00 && (hw2 & 0xf0f0) == 0xf000)
+	{
+		// LSL, LSR, ASR, ROR (register)
+		uint32_t value = bench_cpu_shift(cpu, r[hw1 & 15], (hw1 >> 5) & 3,
+				r[hw2 & 15] & 0xff, &carry);
+		r[(hw2 >> 8) & 15] = value;
+		if (hw1 & (1 << 4))
+		{
+			bench_cpu_nz(cpu, value);
+			cpu->c = carry;
+		}
+		return 1;
+	}
+	else if ((hw1 & 0xfff0) == 0xfb00 && (hw2 & 0xe0) == 0)
+	{
+		// MUL, MLA, MLS
+		unsigned ra = hw2 >> 12;
+		uint32_t product = r[hw1 & 15] * r[hw2 & 15];
+		if (hw2 & 0x10)
+			product = r[ra] - product;
+		else if (ra != 15)
+			product += r[ra];
+		r[(hw2 >> 8) & 15] = product;
+		return 1;
+	}
+	else if ((hw1 & 0xfff0) == 0xfbb0 && (hw2 & 0xf0f0) == 0xf0f0)
+	{
+		// UDIV; division by zero gives zero, as with DIV_0_TRP clear
+		uint32_t divisor = r[hw2 & 15];
+		r[(hw2 >> 8) & 15] = divisor ? r[hw1 & 15] / divisor : 0;
+		return 8;
+	}
+
+	bench_cpu_fault(cpu, pc, "unsupported instruction", opcode);
+	return 1;
+}
+
+unsigned bench_cpu_step(struct bench_cpu *cpu)
+{
+	uint32_t pc = cpu->r[BENCH_CPU_PC];
+	uint32_t hw1;
+	uint32_t hw2;
+	bool in_it = (cpu->itstate & 0xf) != 0;
+	bool execute = true;
+	unsigned cycles;
+
+	if (cpu->halted || cpu->faulted)
+		return 0;
+
+	if (!bench_bus_read(pc, 2, &hw1))
+	{
+		bench_cpu_fault(cpu, pc, "bus fault fetching", pc);
+		return 1;
+	}
+	bool wide = (hw1 >> 11) >= 0x1d;
+	if (wide && !bench_bus_read(pc + 2, 2, &hw2))
+	{
+		bench_cpu_fault(cpu, pc, "bus fault fetching", pc + 2);
+		return 1;
+	}
+
+	// An instruction in an IT block runs if its condition holds; either way
+	//  the block moves on by one.
+	if (in_it)
+	{
+		execute = bench_cpu_condition(cpu, cpu->itstate >> 4);
+		if ((cpu->itstate & 7) == 0)
+			cpu->itstate = 0;
+		else
+			cpu->itstate = (cpu->itstate & 0xe0) | ((cpu->itstate << 1) & 0x1f);
+	}
+
+	if (!execute)
+	{
+		cpu->r[BENCH_CPU_PC] = pc + (wide ? 4 : 2);
+		cycles = 1;
+	}
+	else if (wide)
+		cycles = bench_cpu_step32(cpu, pc, hw1, hw2);
+	else
+		cycles = bench_cpu_step16(cpu, pc, hw1, in_it);
+
+	cpu->cycles += cycles;
+	return cycles;
+}
@@ -0,0 +1,949 @@
+/***************************************************************************
+ *   Copyright (C) 2011 by James K. Larson                                 *
+ *   jlarson@pacifier.com                                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+// Stand-ins for the parts of OpenOCD a flash driver links against: the
+//  target_* functions, the working area allocator, the algorithm calls and
+//  the few helpers from the flash, command, log and time modules. They
+//  follow what OpenOCD 0.5 does closely where a driver can tell the
+//  difference (the working area allocator above all), and cost what the
+//  options say:
+//  - every access over the adapter is a round trip, a block transfer is one
+//    round trip plus its bytes at the bulk rate;
+//  - starting an algorithm writes each register, waiting polls once per
+//    round trip and reads the registers back;
+//  - the core runs the loader in step with the adapter's clock, so whatever
+//    the driver does while a loader runs, overlaps with it.
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "imp.h"
+#include <helper/binarybuffer.h>
+#include <helper/fileio.h>
+#include <helper/time_support.h>
+#include <target/algorithm.h>
+#include <target/image.h>
+
+#include <stdarg.h>
+
+#include "bench.h"
+
+// One poll of a running algorithm never takes less than this, so a bench
+//  with no adapter latency still moves on.
+#define BENCH_MIN_POLL_PS	BENCH_PS_PER_US
+
+// The core registers an algorithm can be given, by their OpenOCD names.
+static const char *bench_reg_names[16] = {
+	"r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
+	"r8", "r9", "r10", "r11", "r12", "sp", "lr", "pc",
+};
+
+struct bench_callback
+{
+	int (*callback)(struct target *target, enum target_event event, void *priv);
+	void *priv;
+	struct bench_callback *next;
+};
+
+int debug_level = LOG_LVL_WARNING;
+
+static struct target *bench_target;
+static struct bench_device *bench_device;
+static uint8_t *bench_sram;
+static uint32_t bench_sram_size;
+static struct flash_bank *bench_banks;
+static struct bench_callback *bench_callbacks;
+
+// The adapter and the core each keep their own time; bench_clock points at
+//  the one using the bus, which is what a device model sees.
+static uint64_t bench_host_ps;
+static uint64_t bench_core_ps;
+static uint64_t *bench_clock = &bench_host_ps;
+static uint64_t bench_latency_ps;
+static uint64_t bench_ps_per_byte;
+static uint64_t bench_round_trip_count;
+
+static struct bench_cpu bench_core;
+static bool bench_core_running;
+
+uint64_t bench_now(void)
+{
+	return *bench_clock;
+}
+
+void bench_stall_until(uint64_t ps)
+{
+	if (*bench_clock < ps)
+		*bench_clock = ps;
+}
+
+uint64_t bench_target_round_trips(void)
+{
+	return bench_round_trip_count;
+}
+
+bool bench_bus_read(uint32_t address, unsigned size, uint32_t *value)
+{
+	uint32_t offset = address - BENCH_SRAM_BASE;
+
+	if (offset < bench_sram_size && offset + size <= bench_sram_size)
+	{
+		uint32_t result = 0;
+		unsigned i;
+
+		for (i = 0; i < size; i++)
+			result |= (uint32_t)bench_sram[offset + i] << (8 * i);
+		*value = result;
+		return true;
+	}
+	return bench_device->read(bench_device, address, size, value);
+}
+
+bool bench_bus_write(uint32_t address, unsigned size, uint32_t value)
+{
+	uint32_t offset = address - BENCH_SRAM_BASE;
+
+	if (offset < bench_sram_size && offset + size <= bench_sram_size)
+	{
+		unsigned i;
+
+		for (i = 0; i < size; i++)
+			bench_sram[offset + i] = value >> (8 * i);
+		return true;
+	}
+	return bench_device->write(bench_device, address, size, value);
+}
+
+// Runs the core until it has caught up with the adapter. A stall on the
+//  flash moves the core's clock, so it may end up a little ahead.
+static void bench_core_catch_up(void)
+{
+	if (bench_core_ps < bench_host_ps && !bench_core_running)
+		bench_core_ps = bench_host_ps;
+
+	bench_clock = &bench_core_ps;
+	while (bench_core_running && bench_core_ps < bench_host_ps &&
+			!bench_core.halted && !bench_core.faulted)
+	{
+		uint64_t period = BENCH_PS_PER_MS * 1000 / bench_device->core_hz;
+		bench_core_ps += bench_cpu_step(&bench_core) * period;
+	}
+	bench_clock = &bench_host_ps;
+}
+
+// The adapter's side of an access: a round trip plus the bytes moved.
+static void bench_host_access(uint32_t bytes)
+{
+	bench_round_trip_count++;
+	bench_host_ps += bench_latency_ps + bytes * bench_ps_per_byte;
+	bench_core_catch_up();
+}
+
+static void bench_host_wait(uint64_t ps)
+{
+	bench_host_ps += ps;
+	bench_core_catch_up();
+}
+
+void bench_target_init(struct target *target, struct bench_device *device,
+		const struct bench_options *options)
+{
+	bench_target = target;
+	bench_device = device;
+	bench_sram_size = options->sram_size ? options->sram_size : device->sram_size;
+	bench_sram = calloc(1, bench_sram_size);
+	bench_latency_ps = options->latency_us * BENCH_PS_PER_US;
+	bench_ps_per_byte = options->bulk_kbps ?
+			BENCH_PS_PER_MS * 1000 / ((uint64_t)options->bulk_kbps * 1024) : 0;
+
+	target->state = TARGET_HALTED;
+	target->working_area = BENCH_SRAM_BASE;
+	target->working_area_size = bench_sram_size;
+	target->backup_working_area = 0;
+	target->working_areas = NULL;
+}
+
+void bench_target_event(struct target *target, int event)
+{
+	struct bench_callback *callback;
+
+	for (callback = bench_callbacks; callback; callback = callback->next)
+		callback->callback(target, event, callback->priv);
+}
+
+void bench_flash_register(struct flash_bank *bank)
+{
+	struct flash_bank **p = &bench_banks;
+
+	while (*p)
+		p = &(*p)->next;
+	bank->next = NULL;
+	bank->bank_number = (p == &bench_banks) ? 0 : 1;
+	*p = bank;
+}
+
+/* ---- log, command and time helpers ---- */
+
+void log_printf_lf(enum log_levels level, const char *file, unsigned line,
+		const char *function, const char *format, ...)
+{
+	va_list args;
+
+	if (level > debug_level)
+		return;
+
+	switch (level)
+	{
+		case LOG_LVL_ERROR:
+			fprintf(stderr, "Error: ");
+			break;
+		case LOG_LVL_WARNING:
+			fprintf(stderr, "Warn : ");
+			break;
+		case LOG_LVL_INFO:
+			fprintf(stderr, "Info : ");
+			break;
+		case LOG_LVL_DEBUG:
+			fprintf(stderr, "Debug: %s:%u %s(): ", file, line, function);
+			break;
+		default:
+			break;
+	}
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fputc('\n', stderr);
+}
+
+void command_print(struct command_context *context, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+	putchar('\n');
+}
+
+int parse_u32(const char *str, uint32_t *ul)
+{
+	char *end;
+	unsigned long value;
+
+	if (*str == '\0')
+		return ERROR_COMMAND_SYNTAX_ERROR;
+	value = strtoul(str, &end, 0);
+	if (*end != '\0' || value > 0xffffffffUL)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+	*ul = value;
+	return ERROR_OK;
+}
+
+int64_t timeval_ms(void)
+{
+	return bench_host_ps / BENCH_PS_PER_MS;
+}
+
+void keep_alive(void)
+{
+}
+
+void alive_sleep(uint64_t ms)
+{
+	bench_host_wait(ms * BENCH_PS_PER_MS);
+}
+
+void busy_sleep(uint64_t ms)
+{
+	bench_host_wait(ms * BENCH_PS_PER_MS);
+}
+
+// The drivers call usleep between status polls; it has to cost simulated
+//  time, not real time.
+int usleep(useconds_t us)
+{
+	bench_host_wait(us * BENCH_PS_PER_US);
+	return 0;
+}
+
+static struct timeval bench_timeval(uint64_t ps)
+{
+	struct timeval tv;
+
+	tv.tv_sec = ps / (BENCH_PS_PER_MS * 1000);
+	tv.tv_usec = (ps / BENCH_PS_PER_US) % 1000000;
+	return tv;
+}
+
+int duration_start(struct duration *duration)
+{
+	duration->start = bench_timeval(bench_host_ps);
+	return ERROR_OK;
+}
+
+int duration_measure(struct duration *duration)
+{
+	struct timeval end = bench_timeval(bench_host_ps);
+
+	timersub(&end, &duration->start, &duration->elapsed);
+	return ERROR_OK;
+}
+
+float duration_elapsed(struct duration *duration)
+{
+	float t = duration->elapsed.tv_sec;
+	t += (float)duration->elapsed.tv_usec / 1000000.0;
+	return t;
+}
+
+float duration_kbps(struct duration *duration, size_t count)
+{
+	return count / (1024.0 * duration_elapsed(duration));
+}
+
+/* ---- files and checksums ---- */
+
+int fileio_open(struct fileio *fileio, const char *url,
+		enum fileio_access access_type, enum fileio_type type)
+{
+	static const char *modes[] = { "", "rb", "wb", "r+b", "ab", "a+b" };
+	FILE *file;
+
+	if (access_type == FILEIO_NONE || access_type > FILEIO_APPENDREAD)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	file = fopen(url, modes[access_type]);
+	if (!file)
+	{
+		LOG_ERROR("couldn't open %s", url);
+		return ERROR_FAIL;
+	}
+
+	fseek(file, 0, SEEK_END);
+	fileio->size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	fileio->url = strdup(url);
+	fileio->type = type;
+	fileio->access = access_type;
+	fileio->file = file;
+	return ERROR_OK;
+}
+
+int fileio_close(struct fileio *fileio)
+{
+	int retval = fclose(fileio->file) ? ERROR_FAIL : ERROR_OK;
+
+	free((void *)fileio->url);
+	fileio->url = NULL;
+	return retval;
+}
+
+int fileio_read(struct fileio *fileio, size_t size, void *buffer, size_t *size_read)
+{
+	*size_read = fread(buffer, 1, size, fileio->file);
+	return ferror((FILE *)fileio->file) ? ERROR_FAIL : ERROR_OK;
+}
+
+// CRC32 as OpenOCD computes it: polynomial 0x04c11db7, MSB first, starting
+//  from all ones and with no final inversion. The loaders compute the same.
+static uint32_t bench_crc32(uint32_t crc, uint8_t byte)
+{
+	int i;
+
+	crc ^= (uint32_t)byte << 24;
+	for (i = 0; i < 8; i++)
+		crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+	return crc;
+}
+
+int image_calculate_checksum(uint8_t *buffer, uint32_t nbytes, uint32_t *checksum)
+{
+	uint32_t crc = 0xffffffff;
+	uint32_t i;
+
+	for (i = 0; i < nbytes; i++)
+		crc = bench_crc32(crc, buffer[i]);
+	*checksum = crc;
+	return ERROR_OK;
+}
+
+/* ---- memory access ---- */
+
+static int bench_read(uint32_t address, unsigned size, uint32_t *value)
+{
+	if (!bench_bus_read(address, size, value))
+	{
+		LOG_ERROR("bench: read of %u bytes at 0x%08" PRIx32 " failed", size, address);
+		return ERROR_FAIL;
+	}
+	return ERROR_OK;
+}
+
+static int bench_write(uint32_t address, unsigned size, uint32_t value)
+{
+	if (!bench_bus_write(address, size, value))
+	{
+		LOG_ERROR("bench: write of %u bytes at 0x%08" PRIx32 " failed", size, address);
+		return ERROR_FAIL;
+	}
+	return ERROR_OK;
+}
+
+void target_buffer_set_u32(struct target *target, uint8_t *buffer, uint32_t value)
+{
+	buffer[0] = value;
+	buffer[1] = value >> 8;
+	buffer[2] = value >> 16;
+	buffer[3] = value >> 24;
+}
+
+uint32_t target_buffer_get_u32(struct target *target, const uint8_t *buffer)
+{
+	return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+void target_buffer_set_u16(struct target *target, uint8_t *buffer, uint16_t value)
+{
+	buffer[0] = value;
+	buffer[1] = value >> 8;
+}
+
+uint16_t target_buffer_get_u16(struct target *target, const uint8_t *buffer)
+{
+	return buffer[0] | (buffer[1] << 8);
+}
+
+int target_read_u32(struct target *target, uint32_t address, uint32_t *value)
+{
+	bench_host_access(0);
+	return bench_read(address, 4, value);
+}
+
+int target_read_u16(struct target *target, uint32_t address, uint16_t *value)
+{
+	uint32_t v;
+
+	bench_host_access(0);
+	int retval = bench_read(address, 2, &v);
+	*value = v;
+	return retval;
+}
+
+int target_write_u32(struct target *target, uint32_t address, uint32_t value)
+{
+	bench_host_access(0);
+	return bench_write(address, 4, value);
+}
+
+int target_write_u16(struct target *target, uint32_t address, uint16_t value)
+{
+	bench_host_access(0);
+	return bench_write(address, 2, value);
+}
+
+// The element loops behind the memory and buffer calls, run once the
+//  transfer has been paid for.
+static int bench_read_elements(uint32_t address, uint32_t size, uint32_t count,
+		uint8_t *buffer)
+{
+	uint32_t i;
+	uint32_t value;
+
+	for (i = 0; i < count; i++)
+	{
+		int retval = bench_read(address + i * size, size, &value);
+		if (retval != ERROR_OK)
+			return retval;
+		if (size == 4)
+			target_buffer_set_u32(bench_target, buffer + i * size, value);
+		else if (size == 2)
+			target_buffer_set_u16(bench_target, buffer + i * size, value);
+		else
+			buffer[i] = value;
+	}
+	return ERROR_OK;
+}
+
+static int bench_write_elements(uint32_t address, uint32_t size, uint32_t count,
+		const uint8_t *buffer)
+{
+	uint32_t i;
+
+	for (i = 0; i < count; i++)
+	{
+		uint32_t value;
+		if (size == 4)
+			value = target_buffer_get_u32(bench_target, buffer + i * size);
+		else if (size == 2)
+			value = target_buffer_get_u16(bench_target, buffer + i * size);
+		else
+			value = buffer[i];
+
+		int retval = bench_write(address + i * size, size, value);
+		if (retval != ERROR_OK)
+			return retval;
+	}
+	return ERROR_OK;
+}
+
+int target_read_memory(struct target *target, uint32_t address, uint32_t size,
+		uint32_t count, uint8_t *buffer)
+{
+	bench_host_access(size * count);
+	return bench_read_elements(address, size, count, buffer);
+}
+
+int target_write_memory(struct target *target, uint32_t address, uint32_t size,
+		uint32_t count, const uint8_t *buffer)
+{
+	bench_host_access(size * count);
+	return bench_write_elements(address, size, count, buffer);
+}
+
+// As in OpenOCD: bytes up to a word boundary, then words, then the bytes
+//  left over, all in one transfer.
+int target_read_buffer(struct target *target, uint32_t address, uint32_t size,
+		uint8_t *buffer)
+{
+	uint32_t head = (4 - (address & 3)) & 3;
+	int retval;
+
+	if (head > size)
+		head = size;
+	bench_host_access(size);
+
+	retval = bench_read_elements(address, 1, head, buffer);
+	if (retval == ERROR_OK)
+		retval = bench_read_elements(address + head, 4, (size - head) / 4, buffer + head);
+	if (retval == ERROR_OK)
+	{
+		uint32_t done = head + ((size - head) & ~3u);
+		retval = bench_read_elements(address + done, 1, size - done, buffer + done);
+	}
+	return retval;
+}
+
+int target_write_buffer(struct target *target, uint32_t address, uint32_t size,
+		const uint8_t *buffer)
+{
+	uint32_t head = (4 - (address & 3)) & 3;
+	int retval;
+
+	if (head > size)
+		head = size;
+	bench_host_access(size);
+
+	retval = bench_write_elements(address, 1, head, buffer);
+	if (retval == ERROR_OK)
+		retval = bench_write_elements(address + head, 4, (size - head) / 4, buffer + head);
+	if (retval == ERROR_OK)
+	{
+		uint32_t done = head + ((size - head) & ~3u);
+		retval = bench_write_elements(address + done, 1, size - done, buffer + done);
+	}
+	return retval;
+}
+
+// OpenOCD runs a bitwise CRC loader for this; it costs a few round trips to
+//  set up and about fifty core cycles a byte.
+int target_checksum_memory(struct target *target, uint32_t address, uint32_t size,
+		uint32_t *crc)
+{
+	uint32_t checksum = 0xffffffff;
+	uint32_t i;
+	uint32_t value;
+
+	if (target->state != TARGET_HALTED)
+	{
+		LOG_WARNING("target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	for (i = 0; i < 6; i++)
+		bench_host_access(0);
+	for (i = 0; i < size; i++)
+	{
+		int retval = bench_read(address + i, 1, &value);
+		if (retval != ERROR_OK)
+			return retval;
+		checksum = bench_crc32(checksum, value);
+	}
+	bench_host_wait((uint64_t)size * 50 * BENCH_PS_PER_MS * 1000 / bench_device->core_hz);
+
+	*crc = checksum;
+	return ERROR_OK;
+}
+
+/* ---- working areas, as allocated by OpenOCD 0.5 ---- */
+
+// A free area is only reused for a request of exactly its size; anything
+//  else goes after the last area, freed or not.
+int target_alloc_working_area_try(struct target *target, uint32_t size,
+		struct working_area **area)
+{
+	struct working_area *c = target->working_areas;
+	struct working_area *new_wa = NULL;
+
+	if (target->working_area_size == 0)
+	{
+		LOG_ERROR("No working memory available. Specify -work-area-phys to target.");
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	}
+
+	// only allocate multiples of 4 byte
+	if (size % 4)
+		size = (size + 3) & ~3u;
+
+	while (c)
+	{
+		if (c->free && (c->size == size))
+		{
+			new_wa = c;
+			break;
+		}
+		c = c->next;
+	}
+
+	if (!new_wa)
+	{
+		struct working_area **p = &target->working_areas;
+		uint32_t first_free = target->working_area;
+		uint32_t free_size = target->working_area_size;
+
+		c = target->working_areas;
+		while (c)
+		{
+			first_free += c->size;
+			free_size -= c->size;
+			p = &c->next;
+			c = c->next;
+		}
+
+		if (free_size < size)
+			return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+
+		LOG_DEBUG("allocated new working area at address 0x%08" PRIx32, first_free);
+
+		new_wa = malloc(sizeof(struct working_area));
+		new_wa->next = NULL;
+		new_wa->size = size;
+		new_wa->address = first_free;
+		new_wa->backup = NULL;
+		*p = new_wa;
+	}
+
+	new_wa->free = 0;
+	*area = new_wa;
+	new_wa->user = area;
+
+	return ERROR_OK;
+}
+
+int target_alloc_working_area(struct target *target, uint32_t size,
+		struct working_area **area)
+{
+	int retval = target_alloc_working_area_try(target, size, area);
+
+	if (retval == ERROR_TARGET_RESOURCE_NOT_AVAILABLE)
+	{
+		uint32_t free_size = target->working_area_size;
+		struct working_area *c;
+
+		for (c = target->working_areas; c; c = c->next)
+			free_size -= c->size;
+		LOG_WARNING("not enough working area available(requested %u, free %u)",
+				(unsigned)size, (unsigned)free_size);
+	}
+	return retval;
+}
+
+int target_free_working_area(struct target *target, struct working_area *area)
+{
+	if (!area || area->free)
+		return ERROR_OK;
+
+	area->free = 1;
+	if (area->user != NULL)
+		*area->user = NULL;
+	area->user = NULL;
+
+	return ERROR_OK;
+}
+
+int target_register_event_callback(int (*callback)(struct target *target,
+		enum target_event event, void *priv), void *priv)
+{
+	struct bench_callback **p = &bench_callbacks;
+
+	while (*p)
+		p = &(*p)->next;
+	*p = malloc(sizeof(struct bench_callback));
+	(*p)->callback = callback;
+	(*p)->priv = priv;
+	(*p)->next = NULL;
+
+	return ERROR_OK;
+}
+
+/* ---- algorithms, run on bench_cpu.c ---- */
+
+void init_reg_param(struct reg_param *param, char *reg_name, uint32_t size,
+		enum param_direction direction)
+{
+	param->reg_name = reg_name;
+	param->size = size;
+	param->value = malloc((size + 7) / 8);
+	param->direction = direction;
+}
+
+void destroy_reg_param(struct reg_param *param)
+{
+	free(param->value);
+}
+
+static int bench_reg_number(const char *name)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		if (strcmp(name, bench_reg_names[i]) == 0)
+			return i;
+	LOG_ERROR("BUG: register '%s' not found", name);
+	return -1;
+}
+
+static uint32_t bench_exit_point;
+
+int target_start_algorithm(struct target *target, int num_mem_params,
+		struct mem_param *mem_params, int num_reg_params, struct reg_param *reg_params,
+		uint32_t entry_point, uint32_t exit_point, void *arch_info)
+{
+	int i;
+
+	if (target->state != TARGET_HALTED)
+	{
+		LOG_WARNING("target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	for (i = 0; i < num_mem_params; i++)
+	{
+		int retval = target_write_buffer(target, mem_params[i].address,
+				mem_params[i].size, mem_params[i].value);
+		if (retval != ERROR_OK)
+			return retval;
+	}
+
+	for (i = 0; i < num_reg_params; i++)
+	{
+		int reg = bench_reg_number(reg_params[i].reg_name);
+		if (reg < 0)
+			return ERROR_INVALID_ARGUMENTS;
+		bench_host_access(0);
+		bench_core.r[reg] = buf_get_u32(reg_params[i].value, 0, 32);
+	}
+
+	// the pc, then the resume
+	bench_host_access(0);
+	bench_core.r[15] = entry_point & ~1u;
+	bench_core.itstate = 0;
+	bench_core.halted = false;
+	bench_core.faulted = false;
+	bench_exit_point = exit_point;
+	bench_core_ps = bench_host_ps;
+	bench_core_running = true;
+	target->state = TARGET_DEBUG_RUNNING;
+	bench_host_access(0);
+
+	return ERROR_OK;
+}
+
+int target_wait_algorithm(struct target *target, int num_mem_params,
+		struct mem_param *mem_params, int num_reg_params, struct reg_param *reg_params,
+		uint32_t exit_point, int timeout_ms, void *arch_info)
+{
+	uint64_t deadline = bench_host_ps + (uint64_t)timeout_ms * BENCH_PS_PER_MS;
+	int i;
+
+	// poll until the core stops at the breakpoint
+	while (!bench_core.halted)
+	{
+		if (bench_core.faulted)
+			bench_host_ps = deadline;
+		if (bench_host_ps >= deadline)
+		{
+			LOG_ERROR("timed out while waiting for target halted");
+			bench_core_running = false;
+			target->state = TARGET_HALTED;
+			return ERROR_TARGET_TIMEOUT;
+		}
+		if (bench_latency_ps < BENCH_MIN_POLL_PS)
+			bench_host_wait(BENCH_MIN_POLL_PS - bench_latency_ps);
+		bench_host_access(0);
+	}
+	bench_core_running = false;
+	target->state = TARGET_HALTED;
+
+	bench_host_access(0);
+	if (exit_point && (bench_core.r[15] != exit_point))
+	{
+		LOG_DEBUG("failed algorithm halted at 0x%" PRIx32 " ", bench_core.r[15]);
+		return ERROR_TARGET_TIMEOUT;
+	}
+
+	for (i = 0; i < num_mem_params; i++)
+	{
+		if (mem_params[i].direction == PARAM_OUT)
+			continue;
+		int retval = target_read_buffer(target, mem_params[i].address,
+				mem_params[i].size, mem_params[i].value);
+		if (retval != ERROR_OK)
+			return retval;
+	}
+
+	for (i = 0; i < num_reg_params; i++)
+	{
+		if (reg_params[i].direction == PARAM_OUT)
+			continue;
+		int reg = bench_reg_number(reg_params[i].reg_name);
+		if (reg < 0)
+			return ERROR_INVALID_ARGUMENTS;
+		bench_host_access(0);
+		buf_set_u32(reg_params[i].value, 0, 32, bench_core.r[reg]);
+	}
+
+	return ERROR_OK;
+}
+
+int target_run_algorithm(struct target *target, int num_mem_params,
+		struct mem_param *mem_params, int num_reg_params, struct reg_param *reg_param,
+		uint32_t entry_point, uint32_t exit_point, int timeout_ms, void *arch_info)
+{
+	int retval = target_start_algorithm(target, num_mem_params, mem_params,
+			num_reg_params, reg_param, entry_point, exit_point, arch_info);
+
+	if (retval == ERROR_OK)
+		retval = target_wait_algorithm(target, num_mem_params, mem_params,
+				num_reg_params, reg_param, exit_point, timeout_ms, arch_info);
+	return retval;
+}
+
+const char *target_name(struct target *target)
+{
+	return target->cmd_name;
+}
+
+/* ---- flash core ---- */
+
+struct flash_bank *flash_bank_list(void)
+{
+	return bench_banks;
+}
+
+// As in OpenOCD: a bank by name, else by number, probed on the way.
+COMMAND_HELPER(flash_command_get_bank, unsigned name_index, struct flash_bank **bank)
+{
+	struct flash_bank *p;
+	uint32_t bank_num;
+
+	if (name_index >= CMD_ARGC)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	for (p = bench_banks; p; p = p->next)
+	{
+		if (strcmp(p->name, CMD_ARGV[name_index]) == 0)
+		{
+			*bank = p;
+			return ERROR_OK;
+		}
+	}
+
+	COMMAND_PARSE_NUMBER(u32, CMD_ARGV[name_index], bank_num);
+	for (p = bench_banks; p; p = p->next)
+	{
+		if (p->bank_number == (int)bank_num)
+		{
+			int retval = p->driver->auto_probe(p);
+			if (retval != ERROR_OK)
+			{
+				LOG_ERROR("auto_probe failed %d\n", retval);
+				return retval;
+			}
+			*bank = p;
+			return ERROR_OK;
+		}
+	}
+
+	command_print(CMD_CTX, "flash bank '%s' not found", CMD_ARGV[name_index]);
+	return ERROR_INVALID_ARGUMENTS;
+}
+
+int default_flash_read(struct flash_bank *bank, uint8_t *buffer, uint32_t offset,
+		uint32_t count)
+{
+	return target_read_buffer(bank->target, offset + bank->base, count, buffer);
+}
+
+int default_flash_mem_blank_check(struct flash_bank *bank)
+{
+	struct target *target = bank->target;
+	const uint32_t buffer_size = 1024;
+	uint8_t *buffer;
+	int retval = ERROR_OK;
+	int i;
+
+	if (target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	buffer = malloc(buffer_size);
+	for (i = 0; i < bank->num_sectors; i++)
+	{
+		uint32_t j;
+
+		bank->sectors[i].is_erased = 1;
+		for (j = 0; j < bank->sectors[i].size; j += buffer_size)
+		{
+			uint32_t chunk = bank->sectors[i].size - j;
+			uint32_t n;
+
+			if (chunk > buffer_size)
+				chunk = buffer_size;
+			retval = target_read_memory(target, bank->base + bank->sectors[i].offset + j,
+					4, chunk / 4, buffer);
+			if (retval != ERROR_OK)
+				goto done;
+
+			for (n = 0; n < chunk; n++)
+			{
+				if (buffer[n] != 0xff)
+				{
+					bank->sectors[i].is_erased = 0;
+					break;
+				}
+			}
+		}
+	}
+
+done:
+	free(buffer);
+	return retval;
+}
@@ -0,0 +1,361 @@
+/***************************************************************************
+ *   Copyright (C) 2011 by James K. Larson                                 *
+ *   jlarson@pacifier.com                                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+// The nucX1 driver on the bench, against a model of the nuc120 ISP
+//  controller. The model has the register lock (SYS_WRPROT) and the
+//  registers it guards, the clock settings the core speed follows, and the
+//  ISP commands, which keep ISPGO set for as long as a program or erase
+//  takes. A read of the APROM while ISP is busy stalls, as on the chip.
+// The driver source is included, so the bench sees its static functions and
+//  the flash_driver it exports.
+#include "../nucX1.c"
+
+#include "bench.h"
+
+#define NUCX1_BENCH_DEVICE_ID	0x00012000
+#define NUCX1_BENCH_SRAM_SIZE	0x4000
+#define NUCX1_BENCH_ISP_SIZE	0x14
+
+#define NUCX1_BENCH_XTL_HZ		12000000
+#define NUCX1_BENCH_OSC22M_HZ	22118400
+#define NUCX1_BENCH_PLL_HZ		48000000
+#define NUCX1_BENCH_LIRC_HZ		10000
+
+// the data sheet's typical times
+#define NUCX1_BENCH_PROGRAM_US	40
+#define NUCX1_BENCH_ERASE_MS	20
+
+// ISPCMD values, as the loaders and the driver write them
+#define NUCX1_BENCH_CMD_READ	0x00
+#define NUCX1_BENCH_CMD_PROGRAM	0x21
+#define NUCX1_BENCH_CMD_ERASE	0x22
+
+struct nucX1_bench_device
+{
+	struct bench_device device;
+	uint32_t device_id;
+	uint32_t flash_size;
+	uint32_t page_size;
+	uint8_t *flash;
+	uint64_t program_ps;
+	uint64_t erase_ps;
+
+	// SYS_WRPROT: how far into the key sequence, and the lock
+	int keys_seen;
+	bool unlocked;
+
+	uint32_t pwrcon;
+	uint32_t ahbclk;
+	uint32_t clksel0;
+	uint32_t clkdiv;
+
+	uint32_t ispcon;
+	uint32_t ispadr;
+	uint32_t ispdat;
+	uint32_t ispcmd;
+	bool busy;
+	uint64_t busy_until;
+};
+
+// HCLK from the source selected and the divider.
+static void nucX1_bench_clock(struct nucX1_bench_device *chip)
+{
+	uint32_t hz;
+
+	switch (chip->clksel0 & CLKSEL0_HCLK_MASK)
+	{
+		case 0: hz = NUCX1_BENCH_XTL_HZ; break;
+		case 2: hz = NUCX1_BENCH_PLL_HZ; break;
+		case 3: hz = NUCX1_BENCH_LIRC_HZ; break;
+		case 7: hz = NUCX1_BENCH_OSC22M_HZ; break;
+		default: hz = NUCX1_BENCH_XTL_HZ; break;
+	}
+	chip->device.core_hz = hz / ((chip->clkdiv & CLKDIV_HCLK_MASK) + 1);
+}
+
+// Ends the ISP command in progress if its time is up.
+static void nucX1_bench_update(struct nucX1_bench_device *chip)
+{
+	uint32_t address = chip->ispadr;
+
+	if (!chip->busy || bench_now() < chip->busy_until)
+		return;
+	chip->busy = false;
+
+	if (address >= chip->flash_size)
+	{
+		chip->ispcon |= ISPCON_ISPFF;
+		return;
+	}
+
+	switch (chip->ispcmd)
+	{
+		case NUCX1_BENCH_CMD_ERASE:
+			address &= ~(chip->page_size - 1);
+			memset(chip->flash + address, 0xff, chip->page_size);
+			break;
+		case NUCX1_BENCH_CMD_PROGRAM:
+			if (address & 3)
+			{
+				chip->ispcon |= ISPCON_ISPFF;
+				break;
+			}
+			// programming can only clear bits
+			chip->flash[address] &= chip->ispdat;
+			chip->flash[address + 1] &= chip->ispdat >> 8;
+			chip->flash[address + 2] &= chip->ispdat >> 16;
+			chip->flash[address + 3] &= chip->ispdat >> 24;
+			break;
+		case NUCX1_BENCH_CMD_READ:
+			chip->ispdat = target_buffer_get_u32(NULL, chip->flash + (address & ~3u));
+			break;
+		default:
+			chip->ispcon |= ISPCON_ISPFF;
+			break;
+	}
+}
+
+static void nucX1_bench_trigger(struct nucX1_bench_device *chip)
+{
+	uint64_t ps;
+
+	if (!(chip->ispcon & ISPCON_ISPEN))
+	{
+		chip->ispcon |= ISPCON_ISPFF;
+		return;
+	}
+
+	switch (chip->ispcmd)
+	{
+		case NUCX1_BENCH_CMD_ERASE:
+			ps = chip->erase_ps;
+			break;
+		case NUCX1_BENCH_CMD_PROGRAM:
+			ps = chip->program_ps;
+			break;
+		default:
+			ps = BENCH_PS_PER_US;
+			break;
+	}
+	chip->busy = true;
+	chip->busy_until = bench_now() + ps;
+}
+
+static bool nucX1_bench_read(struct bench_device *device, uint32_t address,
+		unsigned size, uint32_t *value)
+{
+	struct nucX1_bench_device *chip = (struct nucX1_bench_device *)device;
+	uint32_t result = 0;
+	unsigned i;
+
+	nucX1_bench_update(chip);
+
+	if (address < chip->flash_size)
+	{
+		if (address + size > chip->flash_size)
+			return false;
+		if (chip->busy)
+		{
+			bench_stall_until(chip->busy_until);
+			nucX1_bench_update(chip);
+		}
+		for (i = 0; i < size; i++)
+			result |= (uint32_t)chip->flash[address + i] << (8 * i);
+		*value = result;
+		return true;
+	}
+
+	if (size != 4 || (address & 3))
+		return false;
+
+	switch (address)
+	{
+		case NUCX1_SYS_BASE:
+			*value = chip->device_id;
+			return true;
+		case NUCX1_SYS_WRPROT:
+			*value = chip->unlocked ? 1 : 0;
+			return true;
+		case NUCX1_SYSCLK_PWRCON:
+			*value = chip->pwrcon;
+			return true;
+		case NUCX1_SYSCLK_AHBCLK:
+			*value = chip->ahbclk;
+			return true;
+		case NUCX1_SYSCLK_CLKSEL0:
+			*value = chip->clksel0;
+			return true;
+		case NUCX1_SYSCLK_CLKDIV:
+			*value = chip->clkdiv;
+			return true;
+	}
+
+	if (address - NUCX1_FLASH_BASE < NUCX1_BENCH_ISP_SIZE)
+	{
+		// without its clock the ISP controller reads as zero
+		if (!(chip->ahbclk & AHBCLK_ISP_EN))
+			*value = 0;
+		else if (address == NUCX1_FLASH_ISPCON)
+			*value = chip->ispcon;
+		else if (address == NUCX1_FLASH_ISPADR)
+			*value = chip->ispadr;
+		else if (address == NUCX1_FLASH_ISPDAT)
+			*value = chip->ispdat;
+		else if (address == NUCX1_FLASH_ISPCMD)
+			*value = chip->ispcmd;
+		else
+			*value = chip->busy ? ISPTRG_ISPGO : 0;
+		return true;
+	}
+
+	return false;
+}
+
+static bool nucX1_bench_write(struct bench_device *device, uint32_t address,
+		unsigned size, uint32_t value)
+{
+	struct nucX1_bench_device *chip = (struct nucX1_bench_device *)device;
+	static const uint32_t keys[] = { KEY1, KEY2, KEY3 };
+
+	nucX1_bench_update(chip);
+
+	// the APROM is only written through ISP
+	if (size != 4 || (address & 3) || address < chip->flash_size)
+		return false;
+
+	switch (address)
+	{
+		case NUCX1_SYS_WRPROT:
+			if (chip->keys_seen < 3 && value == keys[chip->keys_seen])
+			{
+				if (++chip->keys_seen == 3)
+					chip->unlocked = true;
+			}
+			else
+			{
+				chip->keys_seen = 0;
+				chip->unlocked = false;
+			}
+			return true;
+		case NUCX1_SYSCLK_PWRCON:
+			if (chip->unlocked)
+				chip->pwrcon = value;
+			return true;
+		case NUCX1_SYSCLK_AHBCLK:
+			chip->ahbclk = value;
+			return true;
+		case NUCX1_SYSCLK_CLKSEL0:
+			if (chip->unlocked)
+				chip->clksel0 = value;
+			nucX1_bench_clock(chip);
+			return true;
+		case NUCX1_SYSCLK_CLKDIV:
+			chip->clkdiv = value;
+			nucX1_bench_clock(chip);
+			return true;
+	}
+
+	if (address - NUCX1_FLASH_BASE < NUCX1_BENCH_ISP_SIZE)
+	{
+		if (!(chip->ahbclk & AHBCLK_ISP_EN))
+			return true;
+		if (chip->busy)
+		{
+			LOG_ERROR("bench: ISP register written while ISPGO is set");
+			return false;
+		}
+
+		if (address == NUCX1_FLASH_ISPCON)
+		{
+			// ISPCON is locked; ISPFF is cleared by writing a one
+			if (chip->unlocked)
+				chip->ispcon = (value & ~ISPCON_ISPFF) |
+						(chip->ispcon & ISPCON_ISPFF & ~value);
+		}
+		else if (address == NUCX1_FLASH_ISPADR)
+			chip->ispadr = value;
+		else if (address == NUCX1_FLASH_ISPDAT)
+			chip->ispdat = value;
+		else if (address == NUCX1_FLASH_ISPCMD)
+			chip->ispcmd = value;
+		else if ((value & ISPTRG_ISPGO) && chip->unlocked)
+			nucX1_bench_trigger(chip);
+		return true;
+	}
+
+	return false;
+}
+
+static struct bench_device *nucX1_bench_create(const struct bench_options *options)
+{
+	struct nucX1_bench_device *chip = calloc(1, sizeof(struct nucX1_bench_device));
+	const struct nucX1_device *part;
+
+	chip->device_id = options->device_id ? options->device_id : NUCX1_BENCH_DEVICE_ID;
+	part = nucX1_find_device(chip->device_id);
+	if (!part)
+	{
+		fprintf(stderr, "bench: no nucX1 part with id 0x%08" PRIx32 "\n", chip->device_id);
+		return NULL;
+	}
+
+	chip->page_size = part->page_size;
+	chip->flash_size = options->flash_kb ? options->flash_kb * 1024 :
+			part->page_size * part->num_pages;
+	chip->flash = malloc(chip->flash_size);
+	memset(chip->flash, 0xff, chip->flash_size);
+
+	chip->program_ps = (options->program_us ? options->program_us : NUCX1_BENCH_PROGRAM_US) *
+			BENCH_PS_PER_US;
+	chip->erase_ps = (options->erase_ms ? options->erase_ms : NUCX1_BENCH_ERASE_MS) *
+			BENCH_PS_PER_MS;
+
+	// out of reset on the crystal, the 22 MHz oscillator and ISP off
+	chip->pwrcon = PWRCON_XTL12M | 0x10;
+	chip->ahbclk = 0x09;
+	chip->clksel0 = 0x38;
+	chip->clkdiv = 0;
+
+	chip->device.name = part->name;
+	chip->device.flash_base = 0;
+	chip->device.sram_size = NUCX1_BENCH_SRAM_SIZE;
+	chip->device.read = nucX1_bench_read;
+	chip->device.write = nucX1_bench_write;
+	nucX1_bench_clock(chip);
+
+	return &chip->device;
+}
+
+static void nucX1_bench_invalidate_protection(struct flash_bank *bank)
+{
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+
+	nucX1_info->protection_valid = false;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct bench_driver nucX1_bench = {
+		.driver = &nucX1_flash,
+		.create_device = nucX1_bench_create,
+		.invalidate_protection = nucX1_bench_invalidate_protection,
+	};
+
+	return bench_main(argc, argv, &nucX1_bench);
+}
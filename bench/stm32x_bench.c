@@ -0,0 +1,470 @@
+/***************************************************************************
+ *   Copyright (C) 2011 by James K. Larson                                 *
+ *   jlarson@pacifier.com                                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+// The stm32x driver on the bench, against a model of the 32F1xx flash
+//  controller (FPEC). The model does what the driver can see: the key
+//  sequences, BSY for as long as a program or erase takes, PGERR for a
+//  half-word that isn't erased, the option bytes and the id registers. A
+//  read of the flash while it is busy stalls, as on the chip.
+// The driver source is included, so the bench sees its static functions and
+//  the flash_driver it exports.
+#include "../stm32x_doc.c"
+
+#include "bench.h"
+
+#define STM32X_BENCH_FLASH_BASE		0x08000000
+#define STM32X_BENCH_BANK1_BASE		0x08080000
+#define STM32X_BENCH_OB_SIZE		16
+#define STM32X_BENCH_DEVICE_ID		0xE0042000
+#define STM32X_BENCH_FLASH_SIZE_REG	0x1FFFF7E0
+#define STM32X_BENCH_HSI_HZ			8000000
+#define STM32X_BENCH_SRAM_SIZE		0x4000
+
+// the datasheet's typical times
+#define STM32X_BENCH_PROGRAM_US		52
+#define STM32X_BENCH_ERASE_MS		20
+
+enum stm32x_bench_job
+{
+	STM32X_BENCH_IDLE,
+	STM32X_BENCH_PROGRAM,
+	STM32X_BENCH_PAGE_ERASE,
+	STM32X_BENCH_MASS_ERASE,
+	STM32X_BENCH_OB_PROGRAM,
+	STM32X_BENCH_OB_ERASE,
+};
+
+// One FPEC; the XL parts have a second one for the upper 512K.
+struct stm32x_bench_fpec
+{
+	uint32_t sr;
+	uint32_t cr;
+	uint32_t ar;
+	bool locked;
+	bool key1_seen;
+	bool key_fault;			// a wrong key: locked until reset
+	bool opt_key1_seen;
+	enum stm32x_bench_job job;
+	uint32_t job_address;
+	uint16_t job_value;
+	uint64_t busy_until;
+};
+
+struct stm32x_bench_device
+{
+	struct bench_device device;
+	uint32_t device_id;
+	uint16_t flash_kb;
+	uint32_t flash_size;
+	uint32_t page_size;
+	uint32_t ppage_size;		// pages per write protection bit
+	uint8_t *flash;
+	uint8_t ob[STM32X_BENCH_OB_SIZE];
+	uint32_t obr;			// loaded from the option bytes at reset
+	uint32_t wrpr;
+	uint32_t acr;
+	uint64_t program_ps;
+	uint64_t erase_ps;
+	struct stm32x_bench_fpec fpec[2];
+};
+
+// Ends the job in progress if its time is up.
+static void stm32x_bench_update(struct stm32x_bench_device *chip,
+		struct stm32x_bench_fpec *fpec)
+{
+	uint32_t offset = fpec->job_address - STM32X_BENCH_FLASH_BASE;
+
+	if (fpec->job == STM32X_BENCH_IDLE || bench_now() < fpec->busy_until)
+		return;
+
+	switch (fpec->job)
+	{
+		case STM32X_BENCH_PROGRAM:
+			chip->flash[offset] = fpec->job_value;
+			chip->flash[offset + 1] = fpec->job_value >> 8;
+			break;
+		case STM32X_BENCH_PAGE_ERASE:
+			offset &= ~(chip->page_size - 1);
+			if (offset < chip->flash_size)
+				memset(chip->flash + offset, 0xff, chip->page_size);
+			break;
+		case STM32X_BENCH_MASS_ERASE:
+			if (fpec == &chip->fpec[1])
+				memset(chip->flash + 0x80000, 0xff, chip->flash_size - 0x80000);
+			else if (chip->flash_size > 0x80000 && (chip->device_id & 0x7ff) == 0x430)
+				memset(chip->flash, 0xff, 0x80000);
+			else
+				memset(chip->flash, 0xff, chip->flash_size);
+			break;
+		case STM32X_BENCH_OB_PROGRAM:
+			offset = fpec->job_address - STM32_OB_RDP;
+			chip->ob[offset] = fpec->job_value;
+			chip->ob[offset + 1] = ~fpec->job_value;
+			break;
+		case STM32X_BENCH_OB_ERASE:
+			memset(chip->ob, 0xff, sizeof(chip->ob));
+			break;
+		default:
+			break;
+	}
+
+	fpec->job = STM32X_BENCH_IDLE;
+	fpec->sr = (fpec->sr & ~FLASH_BSY) | FLASH_EOP;
+}
+
+static void stm32x_bench_start(struct stm32x_bench_device *chip,
+		struct stm32x_bench_fpec *fpec, enum stm32x_bench_job job, uint32_t address,
+		uint16_t value, uint64_t ps)
+{
+	fpec->job = job;
+	fpec->job_address = address;
+	fpec->job_value = value;
+	fpec->busy_until = bench_now() + ps;
+	fpec->sr |= FLASH_BSY;
+}
+
+// The flash is held off while its controller is busy.
+static struct stm32x_bench_fpec *stm32x_bench_wait(struct stm32x_bench_device *chip,
+		uint32_t address)
+{
+	struct stm32x_bench_fpec *fpec = &chip->fpec[0];
+
+	if (((chip->device_id & 0x7ff) == 0x430) && (address >= STM32X_BENCH_BANK1_BASE))
+		fpec = &chip->fpec[1];
+	if (fpec->job != STM32X_BENCH_IDLE)
+		bench_stall_until(fpec->busy_until);
+	stm32x_bench_update(chip, fpec);
+	return fpec;
+}
+
+static void stm32x_bench_reset(struct stm32x_bench_device *chip)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		memset(&chip->fpec[i], 0, sizeof(chip->fpec[i]));
+		chip->fpec[i].cr = FLASH_LOCK;
+		chip->fpec[i].locked = true;
+	}
+
+	// RDPRT from the RDP byte, then USER, DATA0 and DATA1
+	chip->obr = ((chip->ob[0] != 0xa5) ? 2 : 0) | (chip->ob[2] << 2) |
+			(chip->ob[4] << 10) | (chip->ob[6] << 18);
+	chip->wrpr = chip->ob[8] | (chip->ob[10] << 8) | (chip->ob[12] << 16) |
+			((uint32_t)chip->ob[14] << 24);
+}
+
+static bool stm32x_bench_read_memory(uint8_t *memory, uint32_t offset, unsigned size,
+		uint32_t *value)
+{
+	uint32_t result = 0;
+	unsigned i;
+
+	for (i = 0; i < size; i++)
+		result |= (uint32_t)memory[offset + i] << (8 * i);
+	*value = result;
+	return true;
+}
+
+static bool stm32x_bench_read(struct bench_device *device, uint32_t address,
+		unsigned size, uint32_t *value)
+{
+	struct stm32x_bench_device *chip = (struct stm32x_bench_device *)device;
+
+	if (address - STM32X_BENCH_FLASH_BASE < chip->flash_size)
+	{
+		uint32_t offset = address - STM32X_BENCH_FLASH_BASE;
+		if (offset + size > chip->flash_size)
+			return false;
+		stm32x_bench_wait(chip, address);
+		return stm32x_bench_read_memory(chip->flash, offset, size, value);
+	}
+
+	if (address - STM32_OB_RDP < STM32X_BENCH_OB_SIZE)
+	{
+		uint32_t offset = address - STM32_OB_RDP;
+		if (offset + size > STM32X_BENCH_OB_SIZE)
+			return false;
+		stm32x_bench_update(chip, &chip->fpec[0]);
+		return stm32x_bench_read_memory(chip->ob, offset, size, value);
+	}
+
+	if (address == STM32X_BENCH_DEVICE_ID && size == 4)
+	{
+		*value = chip->device_id;
+		return true;
+	}
+	if (address == STM32X_BENCH_FLASH_SIZE_REG && size == 2)
+	{
+		*value = chip->flash_kb;
+		return true;
+	}
+
+	if (address - STM32_FLASH_BASE < 0x80 && size == 4 && !(address & 3))
+	{
+		uint32_t offset = address - STM32_FLASH_BASE;
+		struct stm32x_bench_fpec *fpec = &chip->fpec[offset / FLASH_OFFSET_B1];
+
+		stm32x_bench_update(chip, fpec);
+		switch (offset % FLASH_OFFSET_B1)
+		{
+			case STM32_FLASH_ACR - STM32_FLASH_BASE:
+				*value = chip->acr;
+				break;
+			case STM32_FLASH_SR - STM32_FLASH_BASE:
+				*value = fpec->sr;
+				break;
+			case STM32_FLASH_CR - STM32_FLASH_BASE:
+				*value = fpec->cr;
+				break;
+			case STM32_FLASH_AR - STM32_FLASH_BASE:
+				*value = fpec->ar;
+				break;
+			case STM32_FLASH_OBR - STM32_FLASH_BASE:
+				*value = chip->obr;
+				break;
+			case STM32_FLASH_WRPR - STM32_FLASH_BASE:
+				*value = chip->wrpr;
+				break;
+			default:
+				*value = 0;
+				break;
+		}
+		return true;
+	}
+
+	return false;
+}
+
+// The WRPR bit for a flash offset; the last one covers the rest of the flash.
+static unsigned stm32x_bench_wrp_bit(struct stm32x_bench_device *chip, uint32_t offset)
+{
+	uint32_t bit = offset / chip->page_size / chip->ppage_size;
+
+	return (bit > 31) ? 31 : bit;
+}
+
+// A write to CR: the lock, and the erases started by STRT.
+static bool stm32x_bench_write_cr(struct stm32x_bench_device *chip,
+		struct stm32x_bench_fpec *fpec, uint32_t value)
+{
+	if (fpec->locked)
+		return true;
+	if (fpec->job != STM32X_BENCH_IDLE)
+	{
+		LOG_ERROR("bench: FLASH_CR written while busy");
+		return false;
+	}
+
+	// OPTWRE can only be cleared by software
+	if (!(value & FLASH_OPTWRE))
+		fpec->cr &= ~FLASH_OPTWRE;
+	fpec->cr = (value & ~(FLASH_STRT | FLASH_OPTWRE)) | (fpec->cr & FLASH_OPTWRE);
+
+	if (value & FLASH_LOCK)
+	{
+		fpec->locked = true;
+		fpec->cr &= ~FLASH_OPTWRE;
+	}
+	if (!(value & FLASH_STRT))
+		return true;
+
+	if (value & FLASH_PER)
+		stm32x_bench_start(chip, fpec, STM32X_BENCH_PAGE_ERASE, fpec->ar, 0, chip->erase_ps);
+	else if (value & FLASH_MER)
+		stm32x_bench_start(chip, fpec, STM32X_BENCH_MASS_ERASE, 0, 0, chip->erase_ps);
+	else if (value & FLASH_OPTER)
+	{
+		if (fpec->cr & FLASH_OPTWRE)
+			stm32x_bench_start(chip, fpec, STM32X_BENCH_OB_ERASE, 0, 0, chip->erase_ps);
+		else
+			fpec->sr |= FLASH_WRPRTERR;
+	}
+	return true;
+}
+
+static bool stm32x_bench_write(struct bench_device *device, uint32_t address,
+		unsigned size, uint32_t value)
+{
+	struct stm32x_bench_device *chip = (struct stm32x_bench_device *)device;
+
+	if (address - STM32X_BENCH_FLASH_BASE < chip->flash_size)
+	{
+		uint32_t offset = address - STM32X_BENCH_FLASH_BASE;
+		struct stm32x_bench_fpec *fpec;
+
+		// only half-words with PG set; anything else is a bus error
+		if (size != 2 || (offset & 1))
+			return false;
+		fpec = stm32x_bench_wait(chip, address);
+		if (!(fpec->cr & FLASH_PG))
+			return false;
+
+		uint16_t current = chip->flash[offset] | (chip->flash[offset + 1] << 8);
+		if (current != 0xffff && value != 0)
+		{
+			fpec->sr |= FLASH_PGERR;
+			return true;
+		}
+		if (!(chip->wrpr & (1u << stm32x_bench_wrp_bit(chip, offset))))
+		{
+			fpec->sr |= FLASH_WRPRTERR;
+			return true;
+		}
+		stm32x_bench_start(chip, fpec, STM32X_BENCH_PROGRAM, address, value, chip->program_ps);
+		return true;
+	}
+
+	if (address - STM32_OB_RDP < STM32X_BENCH_OB_SIZE)
+	{
+		uint32_t offset = address - STM32_OB_RDP;
+		struct stm32x_bench_fpec *fpec = &chip->fpec[0];
+
+		if (size != 2 || (offset & 1))
+			return false;
+		if (fpec->job != STM32X_BENCH_IDLE)
+			bench_stall_until(fpec->busy_until);
+		stm32x_bench_update(chip, fpec);
+		if (!(fpec->cr & FLASH_OPTPG) || !(fpec->cr & FLASH_OPTWRE))
+			return false;
+		if (chip->ob[offset] != 0xff || chip->ob[offset + 1] != 0xff)
+		{
+			fpec->sr |= FLASH_PGERR;
+			return true;
+		}
+		stm32x_bench_start(chip, fpec, STM32X_BENCH_OB_PROGRAM, address, value & 0xff,
+				chip->program_ps);
+		return true;
+	}
+
+	if (address - STM32_FLASH_BASE < 0x80 && size == 4 && !(address & 3))
+	{
+		uint32_t offset = address - STM32_FLASH_BASE;
+		struct stm32x_bench_fpec *fpec = &chip->fpec[offset / FLASH_OFFSET_B1];
+
+		stm32x_bench_update(chip, fpec);
+		switch (offset % FLASH_OFFSET_B1)
+		{
+			case STM32_FLASH_ACR - STM32_FLASH_BASE:
+				chip->acr = value;
+				break;
+			case STM32_FLASH_KEYR - STM32_FLASH_BASE:
+				if (fpec->key_fault)
+					break;
+				if (value == KEY1 && !fpec->key1_seen && fpec->locked)
+					fpec->key1_seen = true;
+				else if (value == KEY2 && fpec->key1_seen)
+				{
+					fpec->key1_seen = false;
+					fpec->locked = false;
+					fpec->cr &= ~FLASH_LOCK;
+				}
+				else
+				{
+					LOG_WARNING("bench: wrong FLASH_KEYR sequence, the FPEC stays locked");
+					fpec->key_fault = true;
+					fpec->locked = true;
+					fpec->cr |= FLASH_LOCK;
+				}
+				break;
+			case STM32_FLASH_OPTKEYR - STM32_FLASH_BASE:
+				if (value == KEY1)
+					fpec->opt_key1_seen = true;
+				else if (value == KEY2 && fpec->opt_key1_seen && !fpec->locked)
+					fpec->cr |= FLASH_OPTWRE;
+				else
+					fpec->opt_key1_seen = false;
+				break;
+			case STM32_FLASH_SR - STM32_FLASH_BASE:
+				fpec->sr &= ~(value & (FLASH_PGERR | FLASH_WRPRTERR | FLASH_EOP));
+				break;
+			case STM32_FLASH_CR - STM32_FLASH_BASE:
+				return stm32x_bench_write_cr(chip, fpec, value);
+			case STM32_FLASH_AR - STM32_FLASH_BASE:
+				if (fpec->job == STM32X_BENCH_IDLE)
+					fpec->ar = value;
+				break;
+			default:
+				break;
+		}
+		return true;
+	}
+
+	return false;
+}
+
+static struct bench_device *stm32x_bench_create(const struct bench_options *options)
+{
+	struct stm32x_bench_device *chip = calloc(1, sizeof(struct stm32x_bench_device));
+	const struct stm32x_device *part;
+
+	chip->device_id = options->device_id ? options->device_id : 0x20036410;
+	part = stm32x_find_device(chip->device_id);
+	if (!part)
+	{
+		fprintf(stderr, "bench: no stm32x part with id 0x%08" PRIx32 "\n", chip->device_id);
+		return NULL;
+	}
+
+	chip->flash_kb = options->flash_kb ? options->flash_kb : part->default_size;
+	chip->flash_size = chip->flash_kb * 1024;
+	chip->page_size = part->page_size;
+	chip->ppage_size = part->ppage_size;
+	chip->flash = malloc(chip->flash_size);
+	memset(chip->flash, 0xff, chip->flash_size);
+
+	// a part as shipped: not read protected, nothing write protected
+	memset(chip->ob, 0xff, sizeof(chip->ob));
+	chip->ob[0] = 0xa5;
+	chip->ob[1] = 0x5a;
+	stm32x_bench_reset(chip);
+
+	chip->program_ps = (options->program_us ? options->program_us : STM32X_BENCH_PROGRAM_US) *
+			BENCH_PS_PER_US;
+	chip->erase_ps = (options->erase_ms ? options->erase_ms : STM32X_BENCH_ERASE_MS) *
+			BENCH_PS_PER_MS;
+
+	chip->device.name = part->name;
+	chip->device.flash_base = STM32X_BENCH_FLASH_BASE;
+	chip->device.sram_size = STM32X_BENCH_SRAM_SIZE;
+	chip->device.core_hz = STM32X_BENCH_HSI_HZ;
+	chip->device.read = stm32x_bench_read;
+	chip->device.write = stm32x_bench_write;
+
+	return &chip->device;
+}
+
+static void stm32x_bench_invalidate_protection(struct flash_bank *bank)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+
+	stm32x_info->protection_valid = false;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct bench_driver stm32x_bench = {
+		.driver = &stm32x_flash,
+		.create_device = stm32x_bench_create,
+		.invalidate_protection = stm32x_bench_invalidate_protection,
+	};
+
+	return bench_main(argc, argv, &stm32x_bench);
+}
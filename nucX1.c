@@ -27,6 +27,12 @@
 #endif
 
 #include "imp.h"
+#include <helper/binarybuffer.h>
+#include <helper/fileio.h>
+#include <helper/time_support.h>
+#include <target/algorithm.h>
+#include <target/armv7m.h>
+#include <target/image.h>
 
 /* nucX1 register locations */
 #define NUCX1_SYS_BASE		0x50000000
@@ -42,7 +48,7 @@
 #define NUCX1_FLASH_ISPCON	0x5000C000
 #define NUCX1_FLASH_ISPCMD	0x5000C00C
 #define NUCX1_FLASH_ISPADR	0x5000C004
-//#define NUCX1_FLASH_ISPDAT	0x5000C00?
+#define NUCX1_FLASH_ISPDAT	0x5000C008
 #define NUCX1_FLASH_ISPTRG	0x5000C010
 
 
@@ -51,6 +57,10 @@
 #define PWRCON_OSC22M		(1 << 2)
 #define PWRCON_XTL12M		(1 << 0)
 
+#define CLKSEL0_HCLK_MASK	(0x7)
+#define CLKSEL0_HCLK_22M	(0x7)
+#define CLKDIV_HCLK_MASK	(0xf)
+
 #define AHBCLK_ISP_EN		(1 << 2)
 
 #define ISPCON_ISPEN		(1 << 0)
@@ -62,6 +72,8 @@
 #define ISPCMD_FOEN		(1 << 5)
 // The above three terms combine to make the erase command
 #define ISPCMD_ERASE		(ISPCMD_FCTRL |  ISPCMD_FOEN)
+// FCTRL of 1 with FOEN is the (32 bit) program command
+#define ISPCMD_WRITE		(0x1 | ISPCMD_FOEN)
 
 #define ISPTRG_ISPGO		(1 << 0)
 
@@ -72,13 +84,286 @@
 #define KEY3			0x88
 #define LOCK			0x00
 
+/* typical ISP command times (us) used as polling hints, timeouts (ms) */
+
+#define NUCX1_PROGRAM_TIME	40
+#define NUCX1_ERASE_TIME	20000
+#define NUCX1_PROGRAM_TIMEOUT	10
+#define NUCX1_ERASE_TIMEOUT	100
+
+#define NUCX1_POLL_SPINS	4
+#define NUCX1_POLL_MIN_DELAY_US	10
+
+// Trace points for the ISP sequences: every poll, page and register step.
+//  They cost nothing unless the driver is built with NUCX1_TRACE defined,
+//  and even then they are only formatted at debug level (-d3). The if (0)
+//  keeps the arguments type checked in normal builds.
+#ifdef NUCX1_TRACE
+#define NUCX1_TRACE_LOG(expr ...) \
+	do { if (debug_level >= LOG_LVL_DEBUG) LOG_DEBUG(expr); } while (0)
+#else
+#define NUCX1_TRACE_LOG(expr ...) \
+	do { if (0) LOG_DEBUG(expr); } while (0)
+#endif
+
+// Per-phase statistics, shown by the stats command. An algorithm run
+//  counts as one event, not as the transfers it takes.
+#define NUCX1_PHASE_NONE	-1
+#define NUCX1_PHASE_ALLOC	0
+#define NUCX1_PHASE_UPLOAD	1
+#define NUCX1_PHASE_ERASE	2
+#define NUCX1_PHASE_PROGRAM	3
+#define NUCX1_PHASE_VERIFY	4
+#define NUCX1_PHASE_READ	5
+#define NUCX1_NUM_PHASES	6
+
+struct nucX1_phase_stats
+{
+	uint32_t count;
+	uint32_t round_trips;
+	uint32_t polls;
+	uint32_t algorithm_runs;
+	uint64_t bytes;
+	float total_time;
+	float peak_time;
+};
+
+// The clock registers the driver changes for a flash session.
+struct nucX1_clocks
+{
+	uint32_t pwrcon;
+	uint32_t clksel0;
+	uint32_t clkdiv;
+	uint32_t ahbclk;
+};
+
+// The uniform page layout the sector array was last built from (see
+//  nucX1_probe). Every page is the same size, so a sector is found from an
+//  offset by dividing.
+struct nucX1_geometry
+{
+	uint32_t page_size;
+	int num_pages;
+};
+
 // Private bank information for nucX1.
 struct nucX1_flash_bank
 {
-	struct working_area *write_algorithm;	// this will be used later
+	struct working_area *write_algorithm;	// block write loader, kept between writes
+	struct working_area *write_buffer;		// and its fifo
+	uint32_t write_buffer_size;
 	int probed;
+	bool differential;	// only erase and program the pages a write changes
+	bool compressed_read;	// pack runs of erased words when reading
+	struct nucX1_phase_stats stats[NUCX1_NUM_PHASES];
+	int phase;			// the phase events are charged to
+	uint32_t device_id;	// as read by the last probe
+	bool protection_valid;	// is_protected of every sector matches SYS_WRPROT
+	bool clock_saved;	// the session clock is set up; saved_clock has the target's
+	struct nucX1_clocks saved_clock;
+	bool unlocked;		// the protected registers are unlocked for a session
+	bool isp_ready;		// and ISP is enabled
+	bool gdb_flash;		// a gdb flash erase or write is under way
+	struct nucX1_geometry geometry;
 };
 
+// Release the block write loader and fifo kept in sram between writes.
+//  Freeing a working area also clears the pointer to it.
+static void nucX1_free_working_areas(struct flash_bank *bank)
+{
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+
+	if (nucX1_info->write_buffer)
+		target_free_working_area(bank->target, nucX1_info->write_buffer);
+	if (nucX1_info->write_algorithm)
+		target_free_working_area(bank->target, nucX1_info->write_algorithm);
+
+	nucX1_info->write_buffer = NULL;
+	nucX1_info->write_algorithm = NULL;
+	nucX1_info->write_buffer_size = 0;
+}
+
+// The sectors that length bytes at offset touch, clipped to the bank.
+//  Returns how many, 0 for none.
+static int nucX1_sector_span(struct flash_bank *bank, uint32_t offset, uint32_t length,
+		int *first, int *last)
+{
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+	uint32_t page_size = nucX1_info->geometry.page_size;
+
+	if ((page_size == 0) || (length == 0) || (offset >= bank->size))
+		return 0;
+	if (length > bank->size - offset)
+		length = bank->size - offset;
+
+	*first = offset / page_size;
+	*last = (offset + length - 1) / page_size;
+	return *last - *first + 1;
+}
+
+// Size the block write and read fifos to what is left of the working area
+//  (its size less every area in the list, freed ones included). A freed
+//  area is only handed out again for a request of the same size, so the
+//  erase, crc, blank check and read loaders all take one area of
+//  NUCX1_AUX_AREA_SIZE for their code and data, and the write loader one of
+//  NUCX1_WRITE_AREA_SIZE; NUCX1_SRAM_RESERVE keeps back room for whichever
+//  of the two is not in the list yet. The crc results are done in batches
+//  that fit. The data part is a whole number of flash pages where there is
+//  room for one.
+#define NUCX1_AUX_AREA_SIZE		1536
+#define NUCX1_WRITE_AREA_SIZE	128
+#define NUCX1_SRAM_RESERVE		(NUCX1_AUX_AREA_SIZE + NUCX1_WRITE_AREA_SIZE)
+#define NUCX1_FIFO_MIN			512
+
+static uint32_t nucX1_working_area_avail(struct target *target)
+{
+	struct working_area *area;
+	uint32_t used = 0;
+
+	for (area = target->working_areas; area; area = area->next)
+		used += area->size;
+
+	return (used < target->working_area_size) ? target->working_area_size - used : 0;
+}
+
+static int nucX1_alloc_aux(struct target *target, struct working_area **area)
+{
+	return target_alloc_working_area(target, NUCX1_AUX_AREA_SIZE, area);
+}
+
+// Allocate the largest fifo that fits, or take a freed one that is at least
+//  that large as it is; step down a page (below a page, 256 bytes) at a
+//  time should the allocation fail.
+static int nucX1_alloc_fifo(struct flash_bank *bank, struct working_area **area,
+		uint32_t *size)
+{
+	struct target *target = bank->target;
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+	uint32_t page = (nucX1_info->geometry.page_size > 0) ? nucX1_info->geometry.page_size : 512;
+	uint32_t avail = nucX1_working_area_avail(target);
+	uint32_t reserve = NUCX1_SRAM_RESERVE;
+	uint32_t reuse = 0;
+	bool have_aux = false, have_write = false;
+	struct working_area *c;
+	uint32_t fifo_size;
+
+	for (c = target->working_areas; c; c = c->next)
+	{
+		if (c->size == NUCX1_AUX_AREA_SIZE)
+			have_aux = true;
+		else if (c->size == NUCX1_WRITE_AREA_SIZE)
+			have_write = true;
+		else if (c->free && (c->size > reuse))
+			reuse = c->size;
+	}
+	if (have_aux)
+		reserve -= NUCX1_AUX_AREA_SIZE;
+	if (have_write)
+		reserve -= NUCX1_WRITE_AREA_SIZE;
+
+	fifo_size = (avail > reserve) ? avail - reserve : 0;
+	if (fifo_size >= page + 8)
+		fifo_size = ((fifo_size - 8) / page) * page + 8;
+	else
+		fifo_size &= ~255;
+
+	if ((reuse >= fifo_size) && (reuse >= NUCX1_FIFO_MIN))
+		fifo_size = reuse;
+
+	while (fifo_size >= NUCX1_FIFO_MIN)
+	{
+		if (target_alloc_working_area_try(target, fifo_size, area) == ERROR_OK)
+		{
+			LOG_DEBUG("nucX1 fifo of %" PRIu32 " bytes (%" PRIu32 " free)",
+					fifo_size, avail);
+			*size = fifo_size;
+			return ERROR_OK;
+		}
+
+		if (fifo_size >= 2 * page + 8)
+			fifo_size -= page;
+		else if (fifo_size >= page + 8)
+			fifo_size = page & ~255;
+		else
+			fifo_size -= 256;
+	}
+
+	return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+}
+
+// SYS_WRPROT changes when the driver unlocks or locks it, and the target's
+//  own code may change it too. protect_check reads it again after this.
+static void nucX1_invalidate_protection(struct flash_bank *bank)
+{
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+
+	nucX1_info->protection_valid = false;
+}
+
+// Defined further down with the ISP helpers.
+static int nucX1_clock_end(struct flash_bank *bank);
+static int nucX1_relock(struct flash_bank *bank);
+
+// The flash session ends when the target runs its own code or is reset;
+//  drop the cached loader then. Algorithm runs are debug execution and
+//  raise a different event. The saved clock settings are written back
+//  while the target is still halted: at the end of each driver call or
+//  command outside a gdb flash session (see nucX1_session_end), at the end
+//  of a gdb flash write, or with the clock_restore command. Once the
+//  target runs they can't be (its own code may be setting the clock), so a
+//  resume with them still saved is only reported; a reset puts back its own
+//  settings. A gdb flash session runs from its first erase or write to the
+//  end of the write, and the registers are locked again then, with the
+//  target halted.
+//  SYS_WRPROT is not written once the target runs, as its own code may
+//  have unlocked it; only the flags are cleared, and nucX1_unlock reads
+//  the real state back.
+static int nucX1_target_event(struct target *target, enum target_event event, void *priv)
+{
+	struct flash_bank *bank = priv;
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+
+	if (target != bank->target)
+		return ERROR_OK;
+
+	switch (event)
+	{
+		case TARGET_EVENT_RESUMED:
+			nucX1_invalidate_protection(bank);
+			nucX1_free_working_areas(bank);
+			if (nucX1_info->clock_saved)
+				LOG_WARNING("nucX1 target resumed on the flash session clock, "
+						"its clock settings were not restored");
+			nucX1_info->clock_saved = false;
+			nucX1_info->unlocked = false;
+			nucX1_info->isp_ready = false;
+			nucX1_info->gdb_flash = false;
+			break;
+		case TARGET_EVENT_RESET_START:
+			nucX1_invalidate_protection(bank);
+			nucX1_free_working_areas(bank);
+			nucX1_info->clock_saved = false;
+			nucX1_info->unlocked = false;
+			nucX1_info->isp_ready = false;
+			nucX1_info->gdb_flash = false;
+			break;
+		case TARGET_EVENT_GDB_FLASH_ERASE_START:
+		case TARGET_EVENT_GDB_FLASH_WRITE_START:
+			nucX1_info->gdb_flash = true;
+			break;
+		case TARGET_EVENT_GDB_FLASH_WRITE_END:
+			nucX1_info->gdb_flash = false;
+			nucX1_clock_end(bank);
+			nucX1_relock(bank);
+			nucX1_free_working_areas(bank);
+			break;
+		default:
+			break;
+	}
+
+	return ERROR_OK;
+}
+
 // This is the function called in the config file.
 FLASH_BANK_COMMAND_HANDLER(nucX1_flash_bank_command)
 {
@@ -94,16 +379,78 @@ FLASH_BANK_COMMAND_HANDLER(nucX1_flash_bank_command)
 	bank->driver_priv = nucX1_info;
 
 	nucX1_info->write_algorithm = NULL;
+	nucX1_info->write_buffer = NULL;
+	nucX1_info->write_buffer_size = 0;
 	nucX1_info->probed = 0;
+	nucX1_info->differential = false;
+	nucX1_info->compressed_read = true;
+	memset(nucX1_info->stats, 0, sizeof(nucX1_info->stats));
+	nucX1_info->phase = NUCX1_PHASE_NONE;
+	nucX1_info->device_id = 0;
+	nucX1_info->protection_valid = false;
+	nucX1_info->clock_saved = false;
+	nucX1_info->unlocked = false;
+	nucX1_info->gdb_flash = false;
+	nucX1_info->isp_ready = false;
+	memset(&nucX1_info->geometry, 0, sizeof(nucX1_info->geometry));
+
+	target_register_event_callback(nucX1_target_event, bank);
 
 	return ERROR_OK;
 }
 
+// Begin a phase; returns the one in progress, to be put back by phase_end.
+static int nucX1_phase_begin(struct flash_bank *bank, int phase, struct duration *duration)
+{
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+	int previous = nucX1_info->phase;
+
+	nucX1_info->phase = phase;
+	duration_start(duration);
+
+	return previous;
+}
+
+static void nucX1_phase_end(struct flash_bank *bank, int previous,
+		struct duration *duration, uint32_t bytes)
+{
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+	struct nucX1_phase_stats *stats = &nucX1_info->stats[nucX1_info->phase];
+	float elapsed;
+
+	duration_measure(duration);
+	elapsed = duration_elapsed(duration);
+
+	stats->count++;
+	stats->bytes += bytes;
+	stats->total_time += elapsed;
+	if (elapsed > stats->peak_time)
+		stats->peak_time = elapsed;
+
+	nucX1_info->phase = previous;
+}
+
+// Charge events to the phase in progress, if any.
+static void nucX1_count(struct flash_bank *bank, int round_trips, int polls,
+		int algorithm_runs)
+{
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+	struct nucX1_phase_stats *stats;
+
+	if (nucX1_info->phase == NUCX1_PHASE_NONE)
+		return;
+
+	stats = &nucX1_info->stats[nucX1_info->phase];
+	stats->round_trips += round_trips;
+	stats->polls += polls;
+	stats->algorithm_runs += algorithm_runs;
+}
+
 // Protection checking - examines the lock bit.
 static int nucX1_protect_check(struct flash_bank *bank)
 {
 	struct target *target = bank->target;
-	//struct stm32x_flash_bank *nucX1_info = bank->driver_priv;
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
 
 	uint32_t protected;
 	int s;
@@ -115,11 +462,16 @@ static int nucX1_protect_check(struct flash_bank *bank)
 		return ERROR_TARGET_NOT_HALTED;
 	}
 
+	// the sectors already show the lock state until something changes it
+	if (nucX1_info->protection_valid)
+		return ERROR_OK;
+
 	// Check to see if Nuc is unlocked or not
 	int retval = target_read_u32(target, NUCX1_SYS_WRPROT, &protected);
+	nucX1_count(bank, 1, 0, 0);
 	if (retval != ERROR_OK)
 		return retval;
-	LOG_INFO("protected = 0x%08" PRIx32 "", protected);
+	NUCX1_TRACE_LOG("protected = 0x%08" PRIx32 "", protected);
 	if (protected == 0){	// means protected 
 		set = 1;
 	}
@@ -128,32 +480,37 @@ static int nucX1_protect_check(struct flash_bank *bank)
 	}
 	for (s = 0; s < bank->num_sectors; s++)
 				bank->sectors[s].is_protected = set;
+	nucX1_info->protection_valid = true;
 
 	return ERROR_OK;
 }
 
-// The erase routine - active development is here.
-// As of 7/31/11, this does not work. 
-static int nucX1_erase(struct flash_bank *bank, int first, int last)
+// A flash session unlocks the protected registers once and keeps them
+//  unlocked, with the clock set up and ISP enabled, for the erases, writes
+//  and checks that follow; a gdb load then writes the keys once instead of
+//  for every call. nucX1_relock ends it: at the end of a gdb flash write, at
+//  the end of each driver call or command outside one (see
+//  nucX1_session_end), with clock_restore, and after a failure, when
+//  nothing is assumed about the state of the ISP. A reset locks the
+//  registers by itself.
+static int nucX1_unlock(struct flash_bank *bank)
 {
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
 	struct target *target = bank->target;
-	int i, timeout;
-	//uint32_t protected;
-	uint32_t protected, clockSelection, status, dummy;
+	uint32_t protected;
 
-	if (bank->target->state != TARGET_HALTED)
-	{
-		LOG_ERROR("Target not halted");
-		return ERROR_TARGET_NOT_HALTED;
-	}
+	if (nucX1_info->unlocked)
+		return ERROR_OK;
 
-	LOG_INFO("NucX1: Sector Erase begins.");
+	// SYS_WRPROT is the protection state protect_check reports
+	nucX1_invalidate_protection(bank);
 
 	// Check to see if Nuc is unlocked or not
 	int retval = target_read_u32(target, NUCX1_SYS_WRPROT, &protected);
+	nucX1_count(bank, 1, 0, 0);
 	if (retval != ERROR_OK)
 		return retval;
-	LOG_INFO("protected = 0x%08" PRIx32 "", protected);
+	NUCX1_TRACE_LOG("protected = 0x%08" PRIx32 "", protected);
 	if (protected == 0){	// means protected - so unlock it
 		/* unlock flash registers */
 		retval = target_write_u32(target,  NUCX1_SYS_WRPROT, KEY1);
@@ -165,52 +522,197 @@ static int nucX1_erase(struct flash_bank *bank, int first, int last)
 		retval = target_write_u32(target,  NUCX1_SYS_WRPROT, KEY3);
 		if (retval != ERROR_OK)
 			return retval;
+
+		// Check that unlock worked
+		retval = target_read_u32(target, NUCX1_SYS_WRPROT, &protected);
+		nucX1_count(bank, 4, 0, 0);
+		if (retval != ERROR_OK)
+			return retval;
+		NUCX1_TRACE_LOG("protected = 0x%08" PRIx32 "", protected);
 	}
-	// Check that unlock worked
-	retval = target_read_u32(target, NUCX1_SYS_WRPROT, &protected);
-	if (retval != ERROR_OK)
-		return retval;
-	LOG_INFO("protected = 0x%08" PRIx32 "", protected);
 	if (protected == 1){	// means unprotected
-		LOG_INFO("protection removed\n");
+		NUCX1_TRACE_LOG("protection removed");
 	} else {
-		LOG_INFO("still protected!!\n");
+		LOG_WARNING("nucX1 registers still protected after unlock");
+	}
+
+	nucX1_info->unlocked = true;
+
+	return ERROR_OK;
+}
+
+static int nucX1_relock(struct flash_bank *bank)
+{
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+
+	if (!nucX1_info->unlocked)
+		return ERROR_OK;
+	nucX1_info->unlocked = false;
+	nucX1_info->isp_ready = false;
+
+	// only a halted target gets SYS_WRPROT written
+	if (bank->target->state != TARGET_HALTED)
+		return ERROR_TARGET_NOT_HALTED;
+
+	int retval = target_write_u32(bank->target,  NUCX1_SYS_WRPROT, LOCK);
+	nucX1_invalidate_protection(bank);
+	nucX1_count(bank, 1, 0, 0);
+
+	return retval;
+}
+
+// Ends a driver call or command that may have started a session: outside a
+//  gdb flash session the clock settings are put back and the registers
+//  locked again now; within one they stay as they are for the next call.
+//  Returns retval, or the first error of the restore and relock if only
+//  those failed.
+static int nucX1_session_end(struct flash_bank *bank, int retval)
+{
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+	int retval2 = ERROR_OK, retval3;
+
+	if (!nucX1_info->gdb_flash)
+	{
+		retval2 = nucX1_clock_end(bank);
+		retval3 = nucX1_relock(bank);
+		if (retval2 == ERROR_OK)
+			retval2 = retval3;
 	}
-	// select the internal clock and enable programming
-	retval = target_read_u32(target, NUCX1_SYSCLK_PWRCON, &clockSelection);
+
+	return (retval != ERROR_OK) ? retval : retval2;
+}
+
+// The flash operations run with HCLK from the internal 22.1184 MHz
+//  oscillator, undivided. Every part has it (a 12 MHz crystal is up to the
+//  board), ISP can run from it, and it is the fastest clock that needs no PLL
+//  set up. The registers are saved and the clock set up once per flash
+//  session rather than for every erase and write; nucX1_clock_end puts the
+//  target's settings back. PWRCON and CLKSEL0 are write protected, so this
+//  starts the session if there isn't one.
+static int nucX1_clock_begin(struct flash_bank *bank)
+{
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+	struct nucX1_clocks *saved = &nucX1_info->saved_clock;
+	struct target *target = bank->target;
+	int retval;
+
+	if (nucX1_info->clock_saved)
+		return ERROR_OK;
+
+	retval = nucX1_unlock(bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	retval = target_read_u32(target, NUCX1_SYSCLK_PWRCON, &saved->pwrcon);
+	if (retval == ERROR_OK)
+		retval = target_read_u32(target, NUCX1_SYSCLK_CLKSEL0, &saved->clksel0);
+	if (retval == ERROR_OK)
+		retval = target_read_u32(target, NUCX1_SYSCLK_CLKDIV, &saved->clkdiv);
+	if (retval == ERROR_OK)
+		retval = target_read_u32(target, NUCX1_SYSCLK_AHBCLK, &saved->ahbclk);
+	nucX1_count(bank, 4, 0, 0);
 	if (retval != ERROR_OK)
 		return retval;
-	LOG_INFO("clock selection = 0x%08" PRIx32 "", clockSelection);
-	if ((clockSelection & PWRCON_XTL12M ) == 0){	// internal 22MHz not selected - select it
-		retval = target_write_u32(target,  NUCX1_SYSCLK_PWRCON, PWRCON_XTL12M);
+	NUCX1_TRACE_LOG("saved clocks: PWRCON 0x%08" PRIx32 " CLKSEL0 0x%08" PRIx32
+			" CLKDIV 0x%08" PRIx32 " AHBCLK 0x%08" PRIx32,
+			saved->pwrcon, saved->clksel0, saved->clkdiv, saved->ahbclk);
+
+	// start the oscillator first, and give it time to settle if it was off
+	if ((saved->pwrcon & PWRCON_OSC22M) == 0)
+	{
+		retval = target_write_u32(target, NUCX1_SYSCLK_PWRCON, saved->pwrcon | PWRCON_OSC22M);
+		nucX1_count(bank, 1, 0, 0);
 		if (retval != ERROR_OK)
 			return retval;
-		// Delay to allow settling
-		alive_sleep(5);	// can use busy sleep for short times - but what's short??
-		LOG_INFO("12MHz clock is now selected\n");
+		alive_sleep(5);
 	}
-	else {
-		LOG_INFO("12MHz clock already selected\n");
+
+	retval = target_write_u32(target, NUCX1_SYSCLK_CLKSEL0,
+			(saved->clksel0 & ~CLKSEL0_HCLK_MASK) | CLKSEL0_HCLK_22M);
+	if (retval == ERROR_OK)
+		retval = target_write_u32(target, NUCX1_SYSCLK_CLKDIV,
+				saved->clkdiv & ~CLKDIV_HCLK_MASK);
+	if (retval == ERROR_OK)
+		retval = target_write_u32(target, NUCX1_SYSCLK_AHBCLK,
+				saved->ahbclk | AHBCLK_ISP_EN);
+	nucX1_count(bank, 3, 0, 0);
+	if (retval != ERROR_OK)
+		return retval;
+
+	nucX1_info->clock_saved = true;
+	LOG_DEBUG("nucX1 flash session clock: 22.1184 MHz");
+
+	return ERROR_OK;
+}
+
+// Put back the clock settings saved by nucX1_clock_begin. The divider goes
+//  back before the source, so HCLK is never faster than either setting, and
+//  the oscillator is only stopped once nothing runs from it. ISP may have
+//  lost its clock after this, so it is set up again before the next use.
+static int nucX1_clock_end(struct flash_bank *bank)
+{
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+	struct nucX1_clocks *saved = &nucX1_info->saved_clock;
+	struct target *target = bank->target;
+	int retval;
+
+	if (!nucX1_info->clock_saved)
+		return ERROR_OK;
+	nucX1_info->clock_saved = false;
+	nucX1_info->isp_ready = false;
+
+	if (target->state != TARGET_HALTED)
+	{
+		LOG_WARNING("target not halted, nucX1 clock settings not restored");
+		return ERROR_TARGET_NOT_HALTED;
 	}
-	retval = target_write_u32(target,  NUCX1_SYSCLK_CLKSEL0, 0x00);	// try all 0s - may be wrong?
+
+	retval = nucX1_unlock(bank);
 	if (retval != ERROR_OK)
 		return retval;
-	retval = target_write_u32(target,  NUCX1_SYSCLK_CLKDIV, 0x00);	// all 0s are OK.
+
+	retval = target_write_u32(target, NUCX1_SYSCLK_CLKDIV, saved->clkdiv);
+	if (retval == ERROR_OK)
+		retval = target_write_u32(target, NUCX1_SYSCLK_CLKSEL0, saved->clksel0);
+	if (retval == ERROR_OK)
+		retval = target_write_u32(target, NUCX1_SYSCLK_AHBCLK, saved->ahbclk);
+	if (retval == ERROR_OK)
+		retval = target_write_u32(target, NUCX1_SYSCLK_PWRCON, saved->pwrcon);
+	nucX1_count(bank, 4, 0, 0);
+
+	return retval;
+}
+
+// Starts the session if needed: unlocks the protected registers, sets up
+//  the clocks and enables ISP. Both erase and write need this before
+//  touching the ISP registers.
+static int nucX1_init_isp(struct flash_bank *bank)
+{
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+	struct target *target = bank->target;
+	uint32_t dummy;
+
+	if (nucX1_info->unlocked && nucX1_info->isp_ready)
+		return ERROR_OK;
+
+	int retval = nucX1_unlock(bank);
 	if (retval != ERROR_OK)
 		return retval;
 
-	// most of these, I need to read the value, then set or clear the bit, then write it back out
-	retval = target_write_u32(target,  NUCX1_SYSCLK_AHBCLK, AHBCLK_ISP_EN);	// should be the only bit set
+	// select the session clock (this also enables the ISP clock)
+	retval = nucX1_clock_begin(bank);
 	if (retval != ERROR_OK)
 		return retval;
+
 	retval = target_read_u32(target, NUCX1_FLASH_ISPCON, &dummy);
 	if (retval != ERROR_OK)
 		return retval;
-	LOG_INFO("ISPCON = 0x%08" PRIx32 "", dummy);
+	NUCX1_TRACE_LOG("ISPCON = 0x%08" PRIx32 "", dummy);
 	//dummy = dummy | ISPCON_ISPEN | ISPCON_APUEN;
 	dummy = dummy | ISPCON_ISPEN ;
-	LOG_INFO("ISPCON becomes 0x%08" PRIx32 "", dummy);
+	NUCX1_TRACE_LOG("ISPCON becomes 0x%08" PRIx32 "", dummy);
 	retval = target_write_u32(target,  NUCX1_FLASH_ISPCON, dummy);
+	nucX1_count(bank, 2, 0, 0);
 	if (retval != ERROR_OK)
 		return retval;
 /*
@@ -221,149 +723,1628 @@ static int nucX1_erase(struct flash_bank *bank, int first, int last)
 	if (retval != ERROR_OK)
 		return retval;
 */
-	LOG_INFO("ISPCMD gets 0x%08" PRIx32 "", ISPCMD_ERASE);
-	retval = target_write_u32(target,  NUCX1_FLASH_ISPCMD, ISPCMD_ERASE);	// This is the whole command
-	if (retval != ERROR_OK)
-		return retval;
+	nucX1_info->isp_ready = true;
 
-	for (i = first; i <= last; i++)
+	return ERROR_OK;
+}
+
+// Wait for the ISP GO bit to clear after an ISP command is triggered.
+//  Same scheme as stm32x_wait_status_busy: expected_us is how long the
+//  command normally takes, so ISPTRG is read back to back for a few reads,
+//  then the delay between reads doubles up to a quarter of that time.
+//  timeout_ms is a wall clock limit.
+static int nucX1_wait_isp_busy(struct flash_bank *bank, int expected_us, int timeout_ms)
+{
+	struct target *target = bank->target;
+	uint32_t status;
+	int retval;
+	long long then = timeval_ms();
+	int max_delay_us = expected_us / 4;
+	int delay_us = 0;
+	int spins = 0;
+
+	//wait for busy to clear - check the GO flag 
+	for (;;)
 	{
-		LOG_INFO("erasing sector %d at addresss 0x%" PRIx32 "\n",i,bank->base + bank->sectors[i].offset);
-		
-		retval = target_write_u32(target, NUCX1_FLASH_ISPADR, bank->base + bank->sectors[i].offset); // need size here??
-		if (retval != ERROR_OK)
-			return retval;
-		retval = target_write_u32(target, NUCX1_FLASH_ISPTRG, ISPTRG_ISPGO); // This is the only bit available
+		retval = target_read_u32(target, NUCX1_FLASH_ISPTRG, &status);
+		nucX1_count(bank, 1, 1, 0);
 		if (retval != ERROR_OK)
 			return retval;
-
-		//wait for busy to clear - check the GO flag 
-		timeout = 100;
-		for (;;)
+		NUCX1_TRACE_LOG("status: 0x%" PRIx32 "", status);
+		if (status == 0)
+			break;
+		if (timeval_ms() - then > timeout_ms)
 		{
-			retval = target_read_u32(target, NUCX1_FLASH_ISPTRG, &status);
-			if (retval != ERROR_OK)
-				return retval;
-			LOG_INFO("status: 0x%" PRIx32 "", status);
-			if (status == 0)
-				break;
-			if (timeout-- <= 0)
-			{
-				LOG_INFO("timed out waiting for flash");
-				return ERROR_FAIL;
-			}
-			busy_sleep(1);	// can use busy sleep for short times.
+			LOG_ERROR("timed out waiting for flash");
+			return ERROR_FAIL;
 		}
-		// check for failure
-		retval = target_read_u32(target, NUCX1_FLASH_ISPCON, &status);
-		if (retval != ERROR_OK)
-			return retval;
-		if ((status & ISPCON_ISPFF) != 0){
-			LOG_DEBUG("failure: 0x%" PRIx32 "", status);
-			// if bit is set, then must write to it to clear it.
-			retval = target_write_u32(target,  NUCX1_FLASH_ISPCON, ISPCON_ISPFF);
-			if (retval != ERROR_OK)
-				return retval;
-		} else {
-			LOG_INFO ("erased OK\n");
-			bank->sectors[i].is_erased = 1;
+		if (spins < NUCX1_POLL_SPINS)
+		{
+			spins++;
+			continue;
+		}
+		delay_us = delay_us ? (delay_us * 2) : (expected_us / 16);
+		if (delay_us > max_delay_us)
+			delay_us = max_delay_us;
+		if (delay_us < NUCX1_POLL_MIN_DELAY_US)
+			delay_us = NUCX1_POLL_MIN_DELAY_US;
+		if (delay_us >= 1000)
+			alive_sleep(delay_us / 1000);
+		else
+		{
+			usleep(delay_us);
+			keep_alive();
 		}
 	}
-	// done, so restore the protection
-	retval = target_write_u32(target,  NUCX1_SYS_WRPROT, LOCK);
+	return ERROR_OK;
+}
+
+// Check the ISP fail flag for the last command. It is cleared if set.
+static int nucX1_check_isp_failure(struct flash_bank *bank)
+{
+	struct target *target = bank->target;
+	uint32_t status;
+
+	int retval = target_read_u32(target, NUCX1_FLASH_ISPCON, &status);
+	nucX1_count(bank, 1, 0, 0);
 	if (retval != ERROR_OK)
 		return retval;
-	LOG_INFO("Erase done\n" );
-
+	if ((status & ISPCON_ISPFF) != 0){
+		LOG_DEBUG("failure: 0x%" PRIx32 "", status);
+		// if bit is set, then must write to it to clear it.
+		retval = target_write_u32(target,  NUCX1_FLASH_ISPCON, status);
+		if (retval != ERROR_OK)
+			return retval;
+		return ERROR_FLASH_OPERATION_FAILED;
+	}
 	return ERROR_OK;
 }
 
-// The write routine stub.
-static int nucX1_write_block(struct flash_bank *bank, uint8_t *buffer, uint32_t offset, uint32_t count)
+// Erase a run of pages with a loop running in sram. Each page costs only
+//  flash time instead of several debug link round trips. Failed pages are
+//  reported as set bits in a bitmap the loop fills in next to the code.
+static int nucX1_erase_block(struct flash_bank *bank, int first, int last)
 {
+	struct target *target = bank->target;
+	struct working_area *erase_algorithm;
+	struct reg_param reg_params[5];
+	struct armv7m_algorithm armv7m_info;
+	uint32_t num_pages = last - first + 1;
+	uint32_t result_size = ((num_pages + 31) / 32) * 4;
+	uint32_t result;
+	uint8_t *bitmap;
+	int i, failed = 0;
+	int retval;
+
+	// r0 - ISP register base (in), failed page count (out)
+	// r1 - address of the first page
+	// r2 - number of pages
+	// r3 - page size
+	// r4 - result bitmap, one bit per page, cleared by the host
+	static const uint8_t nucX1_flash_erase_code[] = {
+									/* erase: */
+		0x22, 0x25,					/* movs	r5, #ISPCMD_ERASE */
+		0xc5, 0x60,					/* str	r5, [r0, #NUCX1_ISPCMD_OFFSET] */
+		0x01, 0x26,					/* movs	r6, #0x01 */
+		0x00, 0x27,					/* movs	r7, #0x00 */
+									/* erase_page: */
+		0x41, 0x60,					/* str	r1, [r0, #NUCX1_ISPADR_OFFSET] */
+		0x01, 0x25,					/* movs	r5, #0x01 */
+		0x05, 0x61,					/* str	r5, [r0, #NUCX1_ISPTRG_OFFSET] */
+		0xbf, 0xf3, 0x6f, 0x8f,		/* isb */
+									/* busy: */
+		0x05, 0x69,					/* ldr	r5, [r0, #NUCX1_ISPTRG_OFFSET] */
+		0xed, 0x07,					/* lsls	r5, r5, #31 */
+		0xfc, 0xd1,					/* bne	busy */
+		0x05, 0x68,					/* ldr	r5, [r0, #NUCX1_ISPCON_OFFSET] */
+		0x6d, 0x06,					/* lsls	r5, r5, #25 */
+		0x05, 0xd5,					/* bpl	next_page */
+		0x05, 0x68,					/* ldr	r5, [r0, #NUCX1_ISPCON_OFFSET] */
+		0x05, 0x60,					/* str	r5, [r0, #NUCX1_ISPCON_OFFSET] */
+		0x25, 0x68,					/* ldr	r5, [r4, #0x00] */
+		0x35, 0x43,					/* orrs	r5, r6 */
+		0x25, 0x60,					/* str	r5, [r4, #0x00] */
+		0x7f, 0x1c,					/* adds	r7, r7, #0x01 */
+									/* next_page: */
+		0xc9, 0x18,					/* adds	r1, r1, r3 */
+		0x76, 0x00,					/* lsls	r6, r6, #1 */
+		0x01, 0xd1,					/* bne	count_page */
+		0x24, 0x1d,					/* adds	r4, r4, #0x04 */
+		0x01, 0x26,					/* movs	r6, #0x01 */
+									/* count_page: */
+		0x52, 0x1e,					/* subs	r2, r2, #0x01 */
+		0xe7, 0xd1,					/* bne	erase_page */
+		0x38, 0x46,					/* mov	r0, r7 */
+		0x00, 0xbe,					/* bkpt	#0x00 */
+	};
+
+	// The bitmap follows the code in the same auxiliary area.
+	uint32_t result_offset = (sizeof(nucX1_flash_erase_code) + 3) & ~3;
+
+	if ((result_offset + result_size > NUCX1_AUX_AREA_SIZE)
+			|| (nucX1_alloc_aux(target, &erase_algorithm) != ERROR_OK))
+	{
+		LOG_DEBUG("no working area for the erase algorithm");
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	}
+	result = erase_algorithm->address + result_offset;
 
-	int retval = ERROR_OK;
+	bitmap = calloc(result_size, 1);
+	if (bitmap == NULL)
+	{
+		retval = ERROR_FAIL;
+		goto cleanup;
+	}
+
+	retval = target_write_buffer(target, erase_algorithm->address,
+			sizeof(nucX1_flash_erase_code), (uint8_t *)nucX1_flash_erase_code);
+	if (retval != ERROR_OK)
+		goto cleanup;
+	retval = target_write_buffer(target, result, result_size, bitmap);
+	if (retval != ERROR_OK)
+		goto cleanup;
+	nucX1_count(bank, 2, 0, 0);
+
+	armv7m_info.common_magic = ARMV7M_COMMON_MAGIC;
+	armv7m_info.core_mode = ARMV7M_MODE_ANY;
+
+	init_reg_param(&reg_params[0], "r0", 32, PARAM_IN_OUT);
+	init_reg_param(&reg_params[1], "r1", 32, PARAM_OUT);
+	init_reg_param(&reg_params[2], "r2", 32, PARAM_OUT);
+	init_reg_param(&reg_params[3], "r3", 32, PARAM_OUT);
+	init_reg_param(&reg_params[4], "r4", 32, PARAM_OUT);
+
+	buf_set_u32(reg_params[0].value, 0, 32, NUCX1_FLASH_BASE);
+	buf_set_u32(reg_params[1].value, 0, 32, bank->base + bank->sectors[first].offset);
+	buf_set_u32(reg_params[2].value, 0, 32, num_pages);
+	buf_set_u32(reg_params[3].value, 0, 32, bank->sectors[first].size);
+	buf_set_u32(reg_params[4].value, 0, 32, result);
+
+	// allow the same 100ms per page the register driven loop does
+	nucX1_count(bank, 0, 0, 1);
+	retval = target_run_algorithm(target, 0, NULL, 5, reg_params,
+			erase_algorithm->address, 0, 1000 + num_pages * 100, &armv7m_info);
+	if (retval != ERROR_OK)
+		LOG_ERROR("error executing nucX1 flash erase algorithm");
+
+	if (retval == ERROR_OK)
+	{
+		retval = target_read_buffer(target, result, result_size, bitmap);
+		nucX1_count(bank, 1, 0, 0);
+	}
+
+	if (retval == ERROR_OK)
+	{
+		for (i = first; i <= last; i++)
+		{
+			int bit = i - first;
+			if (bitmap[bit / 8] & (1 << (bit % 8)))
+			{
+				LOG_ERROR("failed erasing sector %d", i);
+				failed++;
+			}
+			else
+				bank->sectors[i].is_erased = 1;
+		}
+		if (failed)
+			retval = ERROR_FLASH_OPERATION_FAILED;
+	}
 
-	LOG_INFO("Novoton NUC: FLASH Write ...");
+	destroy_reg_param(&reg_params[0]);
+	destroy_reg_param(&reg_params[1]);
+	destroy_reg_param(&reg_params[2]);
+	destroy_reg_param(&reg_params[3]);
+	destroy_reg_param(&reg_params[4]);
 
+cleanup:
+	free(bitmap);
+	target_free_working_area(target, erase_algorithm);
 
 	return retval;
 }
 
-// The probe routine for the nuc. Only recognizes the nuc120 right now.
-static int nucX1_probe(struct flash_bank *bank)
+// Erases a contiguous range of pages: one run of the loop in sram when
+//  there is a working area, otherwise one ISP command per page from here.
+static int nucX1_erase_pages(struct flash_bank *bank, int first, int last)
 {
 	struct target *target = bank->target;
-	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
-	int i;
-	uint16_t num_pages;
-	uint32_t device_id;
-	int page_size;
-	uint32_t base_address = 0x00000000;
+	struct duration phase_time;
+	int previous_phase;
+	uint32_t erased_bytes = 0;
+	int i, failed = 0;
 
-	nucX1_info->probed = 0;
+	LOG_DEBUG("erasing sectors %d to %d", first, last);
 
-	// don't know for sure if this is required??
-	if (bank->target->state != TARGET_HALTED)
+	previous_phase = nucX1_phase_begin(bank, NUCX1_PHASE_ERASE, &phase_time);
+
+	int retval = nucX1_init_isp(bank);
+	if (retval != ERROR_OK)
 	{
-		LOG_ERROR("Target not halted");
-		return ERROR_TARGET_NOT_HALTED;
+		nucX1_phase_end(bank, previous_phase, &phase_time, 0);
+		return retval;
 	}
 
-	/* read nucX1 device id register */
-	int retval = target_read_u32(target, 0x50000000, &device_id);
+	// try the loop in sram first; fall back to driving the registers from here
+	retval = nucX1_erase_block(bank, first, last);
+	if (retval != ERROR_TARGET_RESOURCE_NOT_AVAILABLE)
+		goto done;
+
+	NUCX1_TRACE_LOG("ISPCMD gets 0x%08" PRIx32 "", ISPCMD_ERASE);
+	retval = target_write_u32(target,  NUCX1_FLASH_ISPCMD, ISPCMD_ERASE);	// This is the whole command
 	if (retval != ERROR_OK)
-		return retval;
-	LOG_INFO("device id = 0x%08" PRIx32 "", device_id);
+		goto done;
+	nucX1_count(bank, 1, 0, 0);
 
-	if ((device_id ) == 0x00012000)
+	for (i = first; i <= last; i++)
 	{
-		/* medium density - we have 1k pages
-		 * 4 pages for a protection area */
-		page_size = 512;		// This may be better thought of as "sectors"
-		num_pages = 256;	// 128K
-		LOG_INFO("Nuc 120 Type");
-		//nucX1_info->ppage_size = 4;
-	}
-	else if ((device_id ) != 0x00000000)	// probably a nuc of some sort
+		NUCX1_TRACE_LOG("erasing sector %d at address 0x%" PRIx32, i, bank->base + bank->sectors[i].offset);
+		
+		retval = target_write_u32(target, NUCX1_FLASH_ISPADR, bank->base + bank->sectors[i].offset); // need size here??
+		if (retval != ERROR_OK)
+			goto done;
+		retval = target_write_u32(target, NUCX1_FLASH_ISPTRG, ISPTRG_ISPGO); // This is the only bit available
+		if (retval != ERROR_OK)
+			goto done;
+		nucX1_count(bank, 2, 0, 0);
+
+		retval = nucX1_wait_isp_busy(bank, NUCX1_ERASE_TIME, NUCX1_ERASE_TIMEOUT);
+		if (retval != ERROR_OK)
+			goto done;
+
+		// check for failure
+		retval = nucX1_check_isp_failure(bank);
+		if (retval == ERROR_OK) {
+			NUCX1_TRACE_LOG("erased OK");
+			bank->sectors[i].is_erased = 1;
+		} else if (retval == ERROR_FLASH_OPERATION_FAILED) {
+			LOG_ERROR("failed erasing sector %d", i);
+			failed++;
+		} else {
+			goto done;
+		}
+	}
+	retval = failed ? ERROR_FLASH_OPERATION_FAILED : ERROR_OK;
+
+done:
+	// the session stays unlocked unless something went wrong
+	if (retval != ERROR_OK)
+		nucX1_relock(bank);
+	LOG_DEBUG("erase done");
+
+	if (retval == ERROR_OK)
+		for (i = first; i <= last; i++)
+			erased_bytes += bank->sectors[i].size;
+	nucX1_phase_end(bank, previous_phase, &phase_time, erased_bytes);
+
+	return retval;
+}
+
+// The NUC1xx ISP has no chip erase command (that is only reachable over
+//  ICP), so the cheapest whole bank erase is the sram loop over every page:
+//  one algorithm run instead of a command sequence per page.
+static int nucX1_mass_erase(struct flash_bank *bank)
+{
+	struct target *target = bank->target;
+
+	if (target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	LOG_INFO("Novoton NUC: Chip Erase ... (may take several seconds)");
+
+	return nucX1_erase_pages(bank, 0, bank->num_sectors - 1);
+}
+
+// The erase planner. The core hands over one contiguous range; the whole
+//  bank goes to the mass erase, anything less to the page erase, and both
+//  fall back to the register loop without a working area.
+static int nucX1_erase_range(struct flash_bank *bank, int first, int last)
+{
+	if (bank->target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	if ((first == 0) && (last == (bank->num_sectors - 1)))
+		return nucX1_mass_erase(bank);
+
+	return nucX1_erase_pages(bank, first, last);
+}
+
+// The erase routine named in the driver structure.
+static int nucX1_erase(struct flash_bank *bank, int first, int last)
+{
+	return nucX1_session_end(bank, nucX1_erase_range(bank, first, last));
+}
+
+// CRC32 table for image_calculate_checksum's CRC (poly 0x04c11db7, msb
+//  first), in target byte order so it can be downloaded as is.
+static void nucX1_crc32_table(struct target *target, uint8_t *table)
+{
+	uint32_t i, j, c;
+
+	for (i = 0; i < 256; i++)
+	{
+		c = i << 24;
+		for (j = 0; j < 8; j++)
+			c = (c & 0x80000000) ? (c << 1) ^ 0x04c11db7 : (c << 1);
+		target_buffer_set_u32(target, table + i * 4, c);
+	}
+}
+
+// Table driven CRC32 in sram, one checksum per block of block_size bytes.
+//  Same CRC as image_calculate_checksum so the host compares against the
+//  image directly. Used per page by differential writes and with a single
+//  block by verify_crc. The code, the table and the results of up to
+//  NUCX1_CRC_BATCH blocks share the auxiliary area; more blocks take more
+//  runs.
+#define NUCX1_CRC_BATCH		64
+
+static int nucX1_crc_blocks(struct flash_bank *bank, uint32_t address,
+		uint32_t block_size, uint32_t num_blocks, uint32_t *crcs)
+{
+	struct target *target = bank->target;
+	struct working_area *crc_algorithm;
+	struct reg_param reg_params[5];
+	struct armv7m_algorithm armv7m_info;
+	struct duration phase_time;
+	int previous_phase;
+	uint32_t total = num_blocks * block_size;
+	uint32_t results, batch;
+	uint8_t *table;
+	uint32_t i;
+	int retval;
+
+	// r0 - address of the first block
+	// r1 - block size
+	// r2 - number of blocks
+	// r3 - checksum results, one word per block
+	// r4 - CRC32 table, right after the code
+	static const uint8_t nucX1_flash_crc_code[] = {
+									/* crc: */
+		0x8c, 0x46,					/* mov	r12, r1 */
+									/* next_block: */
+		0x00, 0x25,					/* movs	r5, #0x00 */
+		0xed, 0x43,					/* mvns	r5, r5 */
+		0x06, 0x46,					/* mov	r6, r0 */
+		0x66, 0x44,					/* add	r6, r12 */
+									/* next_byte: */
+		0x07, 0x78,					/* ldrb	r7, [r0, #0x00] */
+		0x40, 0x1c,					/* adds	r0, r0, #0x01 */
+		0x29, 0x0e,					/* lsrs	r1, r5, #24 */
+		0x4f, 0x40,					/* eors	r7, r1 */
+		0xbf, 0x00,					/* lsls	r7, r7, #2 */
+		0xe7, 0x59,					/* ldr	r7, [r4, r7] */
+		0x2d, 0x02,					/* lsls	r5, r5, #8 */
+		0x7d, 0x40,					/* eors	r5, r7 */
+		0xb0, 0x42,					/* cmp	r0, r6 */
+		0xf5, 0xd1,					/* bne	next_byte */
+		0x1d, 0x60,					/* str	r5, [r3, #0x00] */
+		0x1b, 0x1d,					/* adds	r3, r3, #0x04 */
+		0x52, 0x1e,					/* subs	r2, r2, #0x01 */
+		0xed, 0xd1,					/* bne	next_block */
+		0x00, 0xbe,					/* bkpt	#0x00 */
+	};
+	uint32_t table_offset = (sizeof(nucX1_flash_crc_code) + 3) & ~3;
+
+	if (nucX1_alloc_aux(target, &crc_algorithm) != ERROR_OK)
+	{
+		LOG_DEBUG("no working area for the checksum algorithm");
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	}
+	results = crc_algorithm->address + table_offset + 1024;
+
+	// the checksum loop runs at the session clock too
+	retval = nucX1_clock_begin(bank);
+	if (retval != ERROR_OK)
+	{
+		target_free_working_area(target, crc_algorithm);
+		return retval;
+	}
+
+	previous_phase = nucX1_phase_begin(bank, NUCX1_PHASE_VERIFY, &phase_time);
+
+	// code and table go down together; the results come back in the same buffer
+	table = calloc(1, table_offset + 1024 + NUCX1_CRC_BATCH * 4);
+	if (table == NULL)
+	{
+		retval = ERROR_FAIL;
+		goto cleanup;
+	}
+	memcpy(table, nucX1_flash_crc_code, sizeof(nucX1_flash_crc_code));
+	nucX1_crc32_table(target, table + table_offset);
+
+	retval = target_write_buffer(target, crc_algorithm->address, table_offset + 1024, table);
+	nucX1_count(bank, 1, 0, 0);
+	if (retval != ERROR_OK)
+		goto cleanup;
+
+	armv7m_info.common_magic = ARMV7M_COMMON_MAGIC;
+	armv7m_info.core_mode = ARMV7M_MODE_ANY;
+
+	init_reg_param(&reg_params[0], "r0", 32, PARAM_OUT);
+	init_reg_param(&reg_params[1], "r1", 32, PARAM_OUT);
+	init_reg_param(&reg_params[2], "r2", 32, PARAM_OUT);
+	init_reg_param(&reg_params[3], "r3", 32, PARAM_OUT);
+	init_reg_param(&reg_params[4], "r4", 32, PARAM_OUT);
+
+	while ((retval == ERROR_OK) && (num_blocks > 0))
+	{
+		batch = (num_blocks > NUCX1_CRC_BATCH) ? NUCX1_CRC_BATCH : num_blocks;
+
+		buf_set_u32(reg_params[0].value, 0, 32, address);
+		buf_set_u32(reg_params[1].value, 0, 32, block_size);
+		buf_set_u32(reg_params[2].value, 0, 32, batch);
+		buf_set_u32(reg_params[3].value, 0, 32, results);
+		buf_set_u32(reg_params[4].value, 0, 32, crc_algorithm->address + table_offset);
+
+		// about a us per byte at the reset clock
+		nucX1_count(bank, 0, 0, 1);
+		retval = target_run_algorithm(target, 0, NULL, 5, reg_params,
+				crc_algorithm->address, 0, 1000 + (batch * block_size) / 256, &armv7m_info);
+		if (retval != ERROR_OK)
+			LOG_ERROR("error executing nucX1 flash checksum algorithm");
+
+		if (retval == ERROR_OK)
+		{
+			retval = target_read_buffer(target, results, batch * 4, table);
+			nucX1_count(bank, 1, 0, 0);
+		}
+
+		if (retval == ERROR_OK)
+		{
+			for (i = 0; i < batch; i++)
+				crcs[i] = target_buffer_get_u32(target, table + i * 4);
+		}
+
+		address += batch * block_size;
+		crcs += batch;
+		num_blocks -= batch;
+	}
+
+	destroy_reg_param(&reg_params[0]);
+	destroy_reg_param(&reg_params[1]);
+	destroy_reg_param(&reg_params[2]);
+	destroy_reg_param(&reg_params[3]);
+	destroy_reg_param(&reg_params[4]);
+
+cleanup:
+	free(table);
+	target_free_working_area(target, crc_algorithm);
+
+	nucX1_phase_end(bank, previous_phase, &phase_time,
+			(retval == ERROR_OK) ? total : 0);
+
+	return retval;
+}
+
+// Blank check in sram instead of reading the bank back over the debug link.
+//  The loop reads each page a word at a time, stops at the first word that
+//  isn't 0xffffffff and sets the page's bit in a bitmap. One run covers the
+//  whole bank. Falls back to the default check without a working area.
+static int nucX1_blank_check(struct flash_bank *bank)
+{
+	struct target *target = bank->target;
+	struct working_area *blank_check_algorithm;
+	struct reg_param reg_params[4];
+	struct armv7m_algorithm armv7m_info;
+	uint32_t num_pages = bank->num_sectors;
+	uint32_t result_size = ((num_pages + 31) / 32) * 4;
+	uint32_t result;
+	struct duration phase_time;
+	int previous_phase;
+	uint8_t *bitmap;
+	uint32_t i;
+	int retval;
+
+	if (target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	// r0 - address of the first page
+	// r1 - page size
+	// r2 - number of pages
+	// r3 - bitmap of pages that aren't blank, cleared by the host
+	static const uint8_t nucX1_flash_blank_check_code[] = {
+									/* blank_check: */
+		0x01, 0x24,					/* movs	r4, #0x01 */
+									/* next_page: */
+		0x0d, 0x46,					/* mov	r5, r1 */
+									/* next_word: */
+		0x06, 0x68,					/* ldr	r6, [r0, #0x00] */
+		0x00, 0x1d,					/* adds	r0, r0, #0x04 */
+		0x76, 0x1c,					/* adds	r6, r6, #0x01 */
+		0x02, 0xd1,					/* bne	not_blank */
+		0x2d, 0x1f,					/* subs	r5, r5, #0x04 */
+		0xf9, 0xd1,					/* bne	next_word */
+		0x04, 0xe0,					/* b	next_bit */
+									/* not_blank: */
+		0x40, 0x19,					/* adds	r0, r0, r5 */
+		0x00, 0x1f,					/* subs	r0, r0, #0x04 */
+		0x1e, 0x68,					/* ldr	r6, [r3, #0x00] */
+		0x26, 0x43,					/* orrs	r6, r4 */
+		0x1e, 0x60,					/* str	r6, [r3, #0x00] */
+									/* next_bit: */
+		0x64, 0x00,					/* lsls	r4, r4, #1 */
+		0x01, 0xd1,					/* bne	count_page */
+		0x1b, 0x1d,					/* adds	r3, r3, #0x04 */
+		0x01, 0x24,					/* movs	r4, #0x01 */
+									/* count_page: */
+		0x52, 0x1e,					/* subs	r2, r2, #0x01 */
+		0xec, 0xd1,					/* bne	next_page */
+		0x00, 0xbe,					/* bkpt	#0x00 */
+	};
+
+	retval = nucX1_clock_begin(bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	// the bitmap follows the code in the same auxiliary area
+	uint32_t result_offset = (sizeof(nucX1_flash_blank_check_code) + 3) & ~3;
+
+	previous_phase = nucX1_phase_begin(bank, NUCX1_PHASE_VERIFY, &phase_time);
+
+	if ((result_offset + result_size > NUCX1_AUX_AREA_SIZE)
+			|| (nucX1_alloc_aux(target, &blank_check_algorithm) != ERROR_OK))
+	{
+		LOG_DEBUG("no working area for the blank check algorithm");
+		retval = default_flash_mem_blank_check(bank);
+		nucX1_phase_end(bank, previous_phase, &phase_time, bank->size);
+		return retval;
+	}
+	result = blank_check_algorithm->address + result_offset;
+
+	bitmap = calloc(result_size, 1);
+	if (bitmap == NULL)
+	{
+		retval = ERROR_FAIL;
+		goto cleanup;
+	}
+
+	retval = target_write_buffer(target, blank_check_algorithm->address,
+			sizeof(nucX1_flash_blank_check_code), (uint8_t *)nucX1_flash_blank_check_code);
+	if (retval != ERROR_OK)
+		goto cleanup;
+	retval = target_write_buffer(target, result, result_size, bitmap);
+	if (retval != ERROR_OK)
+		goto cleanup;
+	nucX1_count(bank, 2, 0, 0);
+
+	armv7m_info.common_magic = ARMV7M_COMMON_MAGIC;
+	armv7m_info.core_mode = ARMV7M_MODE_ANY;
+
+	init_reg_param(&reg_params[0], "r0", 32, PARAM_OUT);
+	init_reg_param(&reg_params[1], "r1", 32, PARAM_OUT);
+	init_reg_param(&reg_params[2], "r2", 32, PARAM_OUT);
+	init_reg_param(&reg_params[3], "r3", 32, PARAM_OUT);
+
+	buf_set_u32(reg_params[0].value, 0, 32, bank->base);
+	buf_set_u32(reg_params[1].value, 0, 32, bank->sectors[0].size);
+	buf_set_u32(reg_params[2].value, 0, 32, num_pages);
+	buf_set_u32(reg_params[3].value, 0, 32, result);
+
+	// worst case is a blank bank, where every word gets read
+	nucX1_count(bank, 0, 0, 1);
+	retval = target_run_algorithm(target, 0, NULL, 4, reg_params,
+			blank_check_algorithm->address, 0, 1000 + bank->size / 1024, &armv7m_info);
+	if (retval != ERROR_OK)
+		LOG_ERROR("error executing nucX1 flash blank check algorithm");
+
+	if (retval == ERROR_OK)
+	{
+		retval = target_read_buffer(target, result, result_size, bitmap);
+		nucX1_count(bank, 1, 0, 0);
+	}
+
+	if (retval == ERROR_OK)
+	{
+		for (i = 0; i < num_pages; i++)
+			bank->sectors[i].is_erased = (bitmap[i / 8] & (1 << (i % 8))) ? 0 : 1;
+	}
+
+	destroy_reg_param(&reg_params[0]);
+	destroy_reg_param(&reg_params[1]);
+	destroy_reg_param(&reg_params[2]);
+	destroy_reg_param(&reg_params[3]);
+
+cleanup:
+	free(bitmap);
+	target_free_working_area(target, blank_check_algorithm);
+
+	nucX1_phase_end(bank, previous_phase, &phase_time,
+			(retval == ERROR_OK) ? bank->size : 0);
+
+	return retval;
+}
+
+// The erase_check routine named in the driver structure.
+static int nucX1_erase_check(struct flash_bank *bank)
+{
+	return nucX1_session_end(bank, nucX1_blank_check(bank));
+}
+
+// Where a write gets its data from, as in the stm32x driver: read copies the
+//  next size bytes of the image into chunk. The block write asks for the
+//  next chunk only when the fifo has room, so a file can be read while the
+//  target programs and never has to be in memory as a whole.
+struct nucX1_source
+{
+	int (*read)(struct nucX1_source *source, uint8_t *chunk, uint32_t size);
+	const uint8_t *buffer;	// for nucX1_buffer_read
+	struct fileio *fileio;	// for nucX1_file_read
+};
+
+static int nucX1_buffer_read(struct nucX1_source *source, uint8_t *chunk,
+		uint32_t size)
+{
+	memcpy(chunk, source->buffer, size);
+	source->buffer += size;
+
+	return ERROR_OK;
+}
+
+static int nucX1_file_read(struct nucX1_source *source, uint8_t *chunk,
+		uint32_t size)
+{
+	size_t read_bytes;
+	int retval;
+
+	retval = fileio_read(source->fileio, size, chunk, &read_bytes);
+	if ((retval == ERROR_OK) && (read_bytes != size))
+	{
+		LOG_ERROR("unexpected end of the image file");
+		retval = ERROR_FAIL;
+	}
+
+	return retval;
+}
+
+// Block write using a loader in sram, modeled on the stm32x driver. The
+//  working area is a fifo: word 0 is the host's write pointer, word 1 is the
+//  loader's read pointer and the data follows. The loader is started
+//  asynchronously so the host refills the fifo while the target programs.
+//  A wp of 0 aborts the loader; an rp of 0 means programming failed.
+// The NUC1xx is a Cortex-M0, so the loader sticks to 16 bit Thumb.
+// Nothing is taken from the source before the working areas are there, so
+//  after ERROR_TARGET_RESOURCE_NOT_AVAILABLE it still holds the whole image.
+static int nucX1_write_block(struct flash_bank *bank, struct nucX1_source *data,
+		uint32_t offset, uint32_t count)
+{
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+	struct target *target = bank->target;
+	uint32_t buffer_size;
+	struct working_area *source;
+	uint32_t address = bank->base + offset;
+	struct reg_param reg_params[5];
+	struct armv7m_algorithm armv7m_info;
+	struct duration phase_time;
+	int previous_phase;
+	uint8_t *chunk = NULL;
+	int retval = ERROR_OK;
+
+	// r0 - ISP register base (in), ISPCON (out)
+	// r1 - count of words to program
+	// r2 - fifo start (wp at +0, rp at +4, data from +8)
+	// r3 - fifo end
+	// r4 - flash address to program
+	static const uint8_t nucX1_flash_write_code[] = {
+									/* #define NUCX1_ISPCON_OFFSET	0x00 */
+									/* #define NUCX1_ISPADR_OFFSET	0x04 */
+									/* #define NUCX1_ISPDAT_OFFSET	0x08 */
+									/* #define NUCX1_ISPCMD_OFFSET	0x0C */
+									/* #define NUCX1_ISPTRG_OFFSET	0x10 */
+									/* write: */
+		0x21, 0x25,					/* movs	r5, #ISPCMD_WRITE */
+		0xc5, 0x60,					/* str	r5, [r0, #NUCX1_ISPCMD_OFFSET] */
+									/* wait_fifo: */
+		0x16, 0x68,					/* ldr	r6, [r2, #0x00] */
+		0x00, 0x2e,					/* cmp	r6, #0x00 */
+		0x1c, 0xd0,					/* beq	exit */
+		0x55, 0x68,					/* ldr	r5, [r2, #0x04] */
+		0xb5, 0x42,					/* cmp	r5, r6 */
+		0xf9, 0xd0,					/* beq	wait_fifo */
+		0x2e, 0x68,					/* ldr	r6, [r5, #0x00] */
+		0x44, 0x60,					/* str	r4, [r0, #NUCX1_ISPADR_OFFSET] */
+		0x86, 0x60,					/* str	r6, [r0, #NUCX1_ISPDAT_OFFSET] */
+		0x01, 0x26,					/* movs	r6, #0x01 */
+		0x06, 0x61,					/* str	r6, [r0, #NUCX1_ISPTRG_OFFSET] */
+		0xbf, 0xf3, 0x6f, 0x8f,		/* isb */
+									/* busy: */
+		0x06, 0x69,					/* ldr	r6, [r0, #NUCX1_ISPTRG_OFFSET] */
+		0xf6, 0x07,					/* lsls	r6, r6, #31 */
+		0xfc, 0xd1,					/* bne	busy */
+		0x06, 0x68,					/* ldr	r6, [r0, #NUCX1_ISPCON_OFFSET] */
+		0x40, 0x27,					/* movs	r7, #ISPCON_ISPFF */
+		0x3e, 0x42,					/* tst	r6, r7 */
+		0x09, 0xd1,					/* bne	error */
+		0x24, 0x1d,					/* adds	r4, r4, #0x04 */
+		0x2d, 0x1d,					/* adds	r5, r5, #0x04 */
+		0x9d, 0x42,					/* cmp	r5, r3 */
+		0x01, 0xd3,					/* bcc	no_wrap */
+		0x15, 0x00,					/* movs	r5, r2 */
+		0x08, 0x35,					/* adds	r5, r5, #0x08 */
+									/* no_wrap: */
+		0x55, 0x60,					/* str	r5, [r2, #0x04] */
+		0x49, 0x1e,					/* subs	r1, r1, #0x01 */
+		0xe2, 0xd1,					/* bne	wait_fifo */
+		0x01, 0xe0,					/* b	exit */
+									/* error: */
+		0x00, 0x25,					/* movs	r5, #0x00 */
+		0x55, 0x60,					/* str	r5, [r2, #0x04] */
+									/* exit: */
+		0x30, 0x46,					/* mov	r0, r6 */
+		0x00, 0xbe,					/* bkpt	#0x00 */
+	};
+
+	// loader and fifo stay resident between calls, see nucX1_free_working_areas
+	if (nucX1_info->write_algorithm == NULL)
+	{
+		previous_phase = nucX1_phase_begin(bank, NUCX1_PHASE_ALLOC, &phase_time);
+		if (target_alloc_working_area(target, NUCX1_WRITE_AREA_SIZE,
+				&nucX1_info->write_algorithm) != ERROR_OK)
+		{
+			nucX1_phase_end(bank, previous_phase, &phase_time, 0);
+			LOG_WARNING("no working area available, can't do block memory writes");
+			return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+		}
+		nucX1_phase_end(bank, previous_phase, &phase_time, sizeof(nucX1_flash_write_code));
+
+		previous_phase = nucX1_phase_begin(bank, NUCX1_PHASE_UPLOAD, &phase_time);
+		retval = target_write_buffer(target, nucX1_info->write_algorithm->address,
+				sizeof(nucX1_flash_write_code), (uint8_t *)nucX1_flash_write_code);
+		nucX1_count(bank, 1, 0, 0);
+		nucX1_phase_end(bank, previous_phase, &phase_time,
+				(retval == ERROR_OK) ? sizeof(nucX1_flash_write_code) : 0);
+		if (retval != ERROR_OK)
+		{
+			nucX1_free_working_areas(bank);
+			return retval;
+		}
+	}
+
+	if (nucX1_info->write_buffer == NULL)
+	{
+		previous_phase = nucX1_phase_begin(bank, NUCX1_PHASE_ALLOC, &phase_time);
+		if (nucX1_alloc_fifo(bank, &nucX1_info->write_buffer, &buffer_size) != ERROR_OK)
+		{
+			nucX1_phase_end(bank, previous_phase, &phase_time, 0);
+			nucX1_free_working_areas(bank);
+			LOG_WARNING("no large enough working area available, can't do block memory writes");
+			return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+		}
+		nucX1_info->write_buffer_size = buffer_size;
+		nucX1_phase_end(bank, previous_phase, &phase_time, buffer_size);
+	}
+
+	source = nucX1_info->write_buffer;
+	buffer_size = nucX1_info->write_buffer_size;
+
+	previous_phase = nucX1_phase_begin(bank, NUCX1_PHASE_PROGRAM, &phase_time);
+
+	chunk = malloc(buffer_size);	// host copy of what goes into the fifo next
+	if (chunk == NULL)
+	{
+		retval = ERROR_FAIL;
+		goto cleanup;
+	}
+
+	uint32_t fifo_start = source->address + 8;
+	uint32_t fifo_end = source->address + buffer_size;
+	uint32_t wp = fifo_start;
+	uint32_t rp = fifo_start;
+	uint8_t fifo_header[8];
+
+	buf_set_u32(fifo_header, 0, 32, wp);
+	buf_set_u32(fifo_header + 4, 0, 32, rp);
+	retval = target_write_buffer(target, source->address, sizeof(fifo_header), fifo_header);
+	nucX1_count(bank, 1, 0, 0);
+	if (retval != ERROR_OK)
+		goto cleanup;
+
+	armv7m_info.common_magic = ARMV7M_COMMON_MAGIC;
+	armv7m_info.core_mode = ARMV7M_MODE_ANY;
+
+	init_reg_param(&reg_params[0], "r0", 32, PARAM_IN_OUT);
+	init_reg_param(&reg_params[1], "r1", 32, PARAM_OUT);
+	init_reg_param(&reg_params[2], "r2", 32, PARAM_OUT);
+	init_reg_param(&reg_params[3], "r3", 32, PARAM_OUT);
+	init_reg_param(&reg_params[4], "r4", 32, PARAM_OUT);
+
+	buf_set_u32(reg_params[0].value, 0, 32, NUCX1_FLASH_BASE);
+	buf_set_u32(reg_params[1].value, 0, 32, count);
+	buf_set_u32(reg_params[2].value, 0, 32, source->address);
+	buf_set_u32(reg_params[3].value, 0, 32, fifo_end);
+	buf_set_u32(reg_params[4].value, 0, 32, address);
+
+	nucX1_count(bank, 0, 0, 1);
+	retval = target_start_algorithm(target, 0, NULL, 5, reg_params,
+			nucX1_info->write_algorithm->address, 0, &armv7m_info);
+	if (retval != ERROR_OK)
+	{
+		LOG_ERROR("error starting nucX1 flash write algorithm");
+		goto cleanup_params;
+	}
+
+	uint32_t bytes_left = count * 4;
+	long long last_progress = timeval_ms();
+
+	while (bytes_left > 0)
+	{
+		retval = target_read_u32(target, source->address + 4, &rp);
+		nucX1_count(bank, 1, 1, 0);
+		if (retval != ERROR_OK)
+			break;
+		if (rp == 0)	// loader gave up
+			break;
+
+		// free space - one word stays unused so wp == rp means empty
+		uint32_t thisrun_bytes;
+		if (rp > wp)
+			thisrun_bytes = rp - wp - 4;
+		else
+			thisrun_bytes = fifo_end - wp - ((rp == fifo_start) ? 4 : 0);
+
+		if (thisrun_bytes == 0)
+		{
+			if (timeval_ms() - last_progress > 10000)
+			{
+				LOG_ERROR("timed out waiting for nucX1 flash write algorithm");
+				retval = ERROR_TARGET_TIMEOUT;
+				break;
+			}
+			keep_alive();
+			continue;
+		}
+
+		if (thisrun_bytes > bytes_left)
+			thisrun_bytes = bytes_left;
+
+		// the target keeps programming meanwhile
+		retval = data->read(data, chunk, thisrun_bytes);
+		if (retval != ERROR_OK)
+			break;
+
+		retval = target_write_buffer(target, wp, thisrun_bytes, chunk);
+		nucX1_count(bank, 1, 0, 0);
+		if (retval != ERROR_OK)
+			break;
+
+		bytes_left -= thisrun_bytes;
+		wp += thisrun_bytes;
+		if (wp >= fifo_end)
+			wp = fifo_start;
+
+		retval = target_write_u32(target, source->address, wp);
+		nucX1_count(bank, 1, 0, 0);
+		if (retval != ERROR_OK)
+			break;
+
+		last_progress = timeval_ms();
+	}
+
+	if (retval != ERROR_OK)
+		target_write_u32(target, source->address, 0);	// stop the loader
+
+	int retval2 = target_wait_algorithm(target, 0, NULL, 5, reg_params,
+			0, 10000, &armv7m_info);
+	if (retval2 != ERROR_OK)
+	{
+		LOG_ERROR("error waiting for nucX1 flash write algorithm");
+		if (retval == ERROR_OK)
+			retval = retval2;
+	}
+
+	if ((retval == ERROR_OK) && (buf_get_u32(reg_params[0].value, 0, 32) & ISPCON_ISPFF))
+	{
+		LOG_ERROR("nucX1 flash write failed");
+		nucX1_check_isp_failure(bank);	// clears ISPFF
+		retval = ERROR_FLASH_OPERATION_FAILED;
+	}
+
+cleanup_params:
+	destroy_reg_param(&reg_params[0]);
+	destroy_reg_param(&reg_params[1]);
+	destroy_reg_param(&reg_params[2]);
+	destroy_reg_param(&reg_params[3]);
+	destroy_reg_param(&reg_params[4]);
+
+cleanup:
+	// don't trust the loader after a failure; with backed up working areas
+	//  the backup would be restored while the target runs, so don't cache
+	if ((retval != ERROR_OK) || target->backup_working_area)
+		nucX1_free_working_areas(bank);
+
+	free(chunk);
+
+	nucX1_phase_end(bank, previous_phase, &phase_time,
+			(retval == ERROR_OK) ? count * 4 : 0);
+
+	return retval;
+}
+
+// The program routine. Uses the loader above when there is a working area,
+//  otherwise falls back to programming one word at a time over the debug link.
+//  nucX1_program below is the same for a buffer in memory.
+static int nucX1_program_source(struct flash_bank *bank, struct nucX1_source *data,
+		uint32_t offset, uint32_t count)
+{
+	struct target *target = bank->target;
+	uint32_t words_remaining = (count / 4);
+	uint32_t bytes_remaining = (count & 0x00000003);
+	uint32_t address = bank->base + offset;
+	uint32_t bytes_written = 0;
+	uint32_t fallback_start;
+	struct duration phase_time;
+	int previous_phase;
+	int retval;
+
+	if (bank->target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	if (offset & 0x3)
+	{
+		LOG_WARNING("offset 0x%" PRIx32 " breaks required 4-byte alignment", offset);
+		return ERROR_FLASH_DST_BREAKS_ALIGNMENT;
+	}
+
+	LOG_DEBUG("writing 0x%" PRIx32 " bytes at offset 0x%" PRIx32, count, offset);
+
+	retval = nucX1_init_isp(bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (words_remaining > 0)
+	{
+		retval = nucX1_write_block(bank, data, offset, words_remaining);
+		if (retval == ERROR_OK)
+		{
+			bytes_written = words_remaining * 4;
+			address += bytes_written;
+			words_remaining = 0;
+		}
+		else if (retval == ERROR_TARGET_RESOURCE_NOT_AVAILABLE)
+		{
+			LOG_WARNING("couldn't use block writes, falling back to single memory accesses");
+			retval = ERROR_OK;
+		}
+		else
+			goto done;
+	}
+
+	if ((words_remaining == 0) && (bytes_remaining == 0))
+		goto done;
+
+	previous_phase = nucX1_phase_begin(bank, NUCX1_PHASE_PROGRAM, &phase_time);
+	fallback_start = bytes_written;
+
+	retval = target_write_u32(target, NUCX1_FLASH_ISPCMD, ISPCMD_WRITE);
+	nucX1_count(bank, 1, 0, 0);
+	if (retval != ERROR_OK)
+		goto program_done;
+
+	// the tail (and everything if the loader couldn't run) goes one word at a time
+	while ((words_remaining > 0) || (bytes_remaining > 0))
+	{
+		uint8_t last_word[4] = {0xff, 0xff, 0xff, 0xff};
+		uint32_t value;
+
+		if (words_remaining > 0)
+			retval = data->read(data, last_word, 4);
+		else
+		{
+			retval = data->read(data, last_word, bytes_remaining);
+			bytes_remaining = 0;
+		}
+		if (retval != ERROR_OK)
+			goto program_done;
+		value = buf_get_u32(last_word, 0, 32);
+
+		retval = target_write_u32(target, NUCX1_FLASH_ISPADR, address);
+		if (retval != ERROR_OK)
+			goto program_done;
+		retval = target_write_u32(target, NUCX1_FLASH_ISPDAT, value);
+		if (retval != ERROR_OK)
+			goto program_done;
+		retval = target_write_u32(target, NUCX1_FLASH_ISPTRG, ISPTRG_ISPGO);
+		if (retval != ERROR_OK)
+			goto program_done;
+		nucX1_count(bank, 3, 0, 0);
+
+		retval = nucX1_wait_isp_busy(bank, NUCX1_PROGRAM_TIME, NUCX1_PROGRAM_TIMEOUT);
+		if (retval != ERROR_OK)
+			goto program_done;
+		retval = nucX1_check_isp_failure(bank);
+		if (retval != ERROR_OK)
+			goto program_done;
+
+		if (words_remaining > 0)
+			words_remaining--;
+		bytes_written += 4;
+		address += 4;
+	}
+
+program_done:
+	nucX1_phase_end(bank, previous_phase, &phase_time, bytes_written - fallback_start);
+
+done:
+	// the session stays unlocked unless something went wrong
+	if (retval != ERROR_OK)
+		nucX1_relock(bank);
+
+	return retval;
+}
+
+static int nucX1_program(struct flash_bank *bank, uint8_t *buffer, uint32_t offset, uint32_t count)
+{
+	struct nucX1_source source = { nucX1_buffer_read, buffer, NULL };
+
+	return nucX1_program_source(bank, &source, offset, count);
+}
+
+// actions for one page in a differential write
+#define DIFF_PROGRAM	(1 << 0)
+#define DIFF_ERASE		(1 << 1)
+
+// Differential write, modeled on stm32x_write_differential: checksum every
+//  page the write touches on the chip and compare with the image. Matching
+//  pages are skipped, blank pages only programmed, and only changed pages
+//  erased first. Partly covered pages are read back and merged so whole
+//  pages are compared and rewritten. Use without the write_image erase option.
+static int nucX1_write_differential(struct flash_bank *bank, uint8_t *buffer,
+		uint32_t offset, uint32_t count)
+{
+	struct target *target = bank->target;
+	uint32_t end = offset + count;
+	uint32_t start, length, crc, blank_crc;
+	uint32_t *crcs = NULL;
+	uint8_t *image = NULL;
+	uint8_t *action = NULL;
+	uint8_t *blank;
+	int first, last, num_pages;
+	int unchanged = 0, programmed = 0, erased = 0;
+	int i, j;
+	int retval;
+
+	if (target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	if (count == 0)
+		return ERROR_OK;
+
+	// the span is clipped to the bank, the copy into image below is not
+	if ((offset >= bank->size) || (count > bank->size - offset))
+		return ERROR_FLASH_DST_OUT_OF_BANK;
+
+	if (!nucX1_sector_span(bank, offset, count, &first, &last))
+		return ERROR_FLASH_DST_OUT_OF_BANK;
+
+	num_pages = last - first + 1;
+	start = bank->sectors[first].offset;
+	length = bank->sectors[last].offset + bank->sectors[last].size - start;
+
+	image = malloc(length);
+	crcs = malloc(num_pages * sizeof(uint32_t));
+	action = malloc(num_pages);
+	if ((image == NULL) || (crcs == NULL) || (action == NULL))
+	{
+		retval = ERROR_FAIL;
+		goto done;
+	}
+
+	// merge the new data with what is around it in the first and last page
+	if (offset > start)
+	{
+		retval = target_read_buffer(target, bank->base + start, offset - start, image);
+		if (retval != ERROR_OK)
+			goto done;
+	}
+	if (end < start + length)
+	{
+		retval = target_read_buffer(target, bank->base + end,
+				start + length - end, image + (end - start));
+		if (retval != ERROR_OK)
+			goto done;
+	}
+	memcpy(image + (offset - start), buffer, count);
+
+	retval = nucX1_crc_blocks(bank, bank->base + start,
+			bank->sectors[first].size, num_pages, crcs);
+	if (retval == ERROR_TARGET_RESOURCE_NOT_AVAILABLE)
+	{
+		// the pages are not blank (no erase option); the ISP program
+		//  would AND over the old data without an error
+		LOG_WARNING("couldn't checksum pages, erasing and writing all of them");
+		retval = nucX1_erase_range(bank, first, last);
+		if (retval == ERROR_OK)
+			retval = nucX1_program(bank, image, start, length);
+		if (retval == ERROR_OK)
+			for (i = first; i <= last; i++)
+				bank->sectors[i].is_erased = 0;
+		goto done;
+	}
+	if (retval != ERROR_OK)
+		goto done;
+
+	blank = malloc(bank->sectors[first].size);
+	if (blank == NULL)
+	{
+		retval = ERROR_FAIL;
+		goto done;
+	}
+	memset(blank, 0xff, bank->sectors[first].size);
+	image_calculate_checksum(blank, bank->sectors[first].size, &blank_crc);
+	free(blank);
+
+	for (i = 0; i < num_pages; i++)
+	{
+		struct flash_sector *sector = &bank->sectors[first + i];
+
+		image_calculate_checksum(image + (sector->offset - start), sector->size, &crc);
+		if (crc == crcs[i])
+		{
+			action[i] = 0;
+			unchanged++;
+			if (crc == blank_crc)
+				sector->is_erased = 1;
+		}
+		else if (crcs[i] == blank_crc)
+		{
+			action[i] = DIFF_PROGRAM;
+			programmed++;
+		}
+		else
+		{
+			action[i] = DIFF_PROGRAM | DIFF_ERASE;
+			programmed++;
+			erased++;
+		}
+	}
+
+	LOG_INFO("nucX1 differential write: %d pages unchanged, %d to program, %d of them to erase",
+			unchanged, programmed, erased);
+
+	// erase the changed runs, then program every run that is blank now
+	for (i = 0; i < num_pages; i = j)
+	{
+		for (j = i; (j < num_pages) && (action[j] & DIFF_ERASE); j++)
+			;
+		if (j == i)
+		{
+			j++;
+			continue;
+		}
+		retval = nucX1_erase_range(bank, first + i, first + j - 1);
+		if (retval != ERROR_OK)
+			goto done;
+	}
+
+	for (i = 0; i < num_pages; i = j)
+	{
+		for (j = i; (j < num_pages) && (action[j] & DIFF_PROGRAM); j++)
+			;
+		if (j == i)
+		{
+			j++;
+			continue;
+		}
+		uint32_t run_offset = bank->sectors[first + i].offset;
+		uint32_t run_end = bank->sectors[first + j - 1].offset + bank->sectors[first + j - 1].size;
+		retval = nucX1_program(bank, image + (run_offset - start),
+				run_offset, run_end - run_offset);
+		if (retval != ERROR_OK)
+			goto done;
+		while (i < j)
+			bank->sectors[first + i++].is_erased = 0;
+	}
+
+done:
+	free(action);
+	free(crcs);
+	free(image);
+
+	return retval;
+}
+
+// The write routine named in the driver structure.
+static int nucX1_write(struct flash_bank *bank, uint8_t *buffer, uint32_t offset, uint32_t count)
+{
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+	int retval;
+
+	if (nucX1_info->differential)
+		retval = nucX1_write_differential(bank, buffer, offset, count);
+	else
+		retval = nucX1_program(bank, buffer, offset, count);
+
+	return nucX1_session_end(bank, retval);
+}
+
+// blank runs shorter than this are sent as they are, see nucX1_read
+#define NUCX1_RLE_RUN_MIN	8
+
+// Read through a routine in sram instead of over the debug link, as in the
+//  stm32x driver: the routine copies a window of flash into a buffer, packing
+//  runs of erased words, and the host reads the buffer back in one go.
+//  A header word with bit 31 set stands for that many erased words, one
+//  without is followed by that many words as they are. Runs shorter than
+//  NUCX1_RLE_RUN_MIN aren't packed, so a window grows by one word at most.
+//  Falls back to the default read without a working area.
+static int nucX1_read(struct flash_bank *bank, uint8_t *buffer,
+		uint32_t offset, uint32_t count)
+{
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+	struct target *target = bank->target;
+	struct working_area *read_algorithm;
+	struct working_area *output = NULL;
+	uint32_t output_size;
+	bool own_output = false;
+	struct reg_param reg_params[4];
+	struct armv7m_algorithm armv7m_info;
+	struct duration phase_time;
+	int previous_phase;
+	uint32_t start = offset & ~3;
+	uint32_t end = (offset + count + 3) & ~3;
+	uint32_t window_words, address;
+	uint8_t *packed = NULL;
+	uint8_t *words = NULL;
+	int retval;
+	int i;
+
+	// r0 - flash address (in), end of the records (out)
+	// r1 - number of words
+	// r2 - where to put the records
+	// r3 - shortest run of erased words to pack
+	static const uint8_t nucX1_flash_read_code[] = {
+		0x00, 0x27,					/* movs	r7, #0x00 */
+									/* next: */
+		0x00, 0x29,					/* cmp	r1, #0x00 */
+		0x28, 0xd0,					/* beq	exit */
+		0x00, 0x24,					/* movs	r4, #0x00 */
+		0x05, 0x46,					/* mov	r5, r0 */
+									/* scan: */
+		0x8c, 0x42,					/* cmp	r4, r1 */
+		0x05, 0xd2,					/* bhs	scanned */
+		0x2e, 0x68,					/* ldr	r6, [r5, #0x00] */
+		0x76, 0x1c,					/* adds	r6, r6, #0x01 */
+		0x02, 0xd1,					/* bne	scanned */
+		0x64, 0x1c,					/* adds	r4, r4, #0x01 */
+		0x2d, 0x1d,					/* adds	r5, r5, #0x04 */
+		0xf7, 0xe7,					/* b	scan */
+									/* scanned: */
+		0x9c, 0x42,					/* cmp	r4, r3 */
+		0x08, 0xd3,					/* blo	literal */
+		0x01, 0x26,					/* movs	r6, #0x01 */
+		0xf6, 0x07,					/* lsls	r6, r6, #31 */
+		0x26, 0x43,					/* orrs	r6, r4 */
+		0x16, 0x60,					/* str	r6, [r2, #0x00] */
+		0x12, 0x1d,					/* adds	r2, r2, #0x04 */
+		0x28, 0x46,					/* mov	r0, r5 */
+		0x09, 0x1b,					/* subs	r1, r1, r4 */
+		0x00, 0x27,					/* movs	r7, #0x00 */
+		0xe8, 0xe7,					/* b	next */
+									/* literal: */
+		0x00, 0x2c,					/* cmp	r4, #0x00 */
+		0x00, 0xd1,					/* bne	have_count */
+		0x01, 0x24,					/* movs	r4, #0x01 */
+									/* have_count: */
+		0x00, 0x2f,					/* cmp	r7, #0x00 */
+		0x03, 0xd1,					/* bne	have_header */
+		0x17, 0x46,					/* mov	r7, r2 */
+		0x00, 0x26,					/* movs	r6, #0x00 */
+		0x16, 0x60,					/* str	r6, [r2, #0x00] */
+		0x12, 0x1d,					/* adds	r2, r2, #0x04 */
+									/* have_header: */
+		0x3e, 0x68,					/* ldr	r6, [r7, #0x00] */
+		0x36, 0x19,					/* adds	r6, r6, r4 */
+		0x3e, 0x60,					/* str	r6, [r7, #0x00] */
+		0x09, 0x1b,					/* subs	r1, r1, r4 */
+									/* copy: */
+		0x06, 0x68,					/* ldr	r6, [r0, #0x00] */
+		0x16, 0x60,					/* str	r6, [r2, #0x00] */
+		0x00, 0x1d,					/* adds	r0, r0, #0x04 */
+		0x12, 0x1d,					/* adds	r2, r2, #0x04 */
+		0x64, 0x1e,					/* subs	r4, r4, #0x01 */
+		0xf9, 0xd1,					/* bne	copy */
+		0xd4, 0xe7,					/* b	next */
+									/* exit: */
+		0x10, 0x46,					/* mov	r0, r2 */
+		0x00, 0xbe,					/* bkpt	#0x00 */
+	};
+
+	// The read loader needs the core; a running target is read over the bus.
+	if (target->state != TARGET_HALTED)
+	{
+		LOG_DEBUG("target not halted, using the default read");
+		return default_flash_read(bank, buffer, offset, count);
+	}
+
+	if (count == 0)
+		return ERROR_OK;
+
+	if (nucX1_alloc_aux(target, &read_algorithm) != ERROR_OK)
+	{
+		LOG_DEBUG("no working area for the read algorithm, using the default read");
+		return default_flash_read(bank, buffer, offset, count);
+	}
+
+	// the block write fifo will do if it's there
+	if (nucX1_info->write_buffer)
+	{
+		output = nucX1_info->write_buffer;
+		output_size = nucX1_info->write_buffer_size;
+	}
+	else
+	{
+		if (nucX1_alloc_fifo(bank, &output, &output_size) != ERROR_OK)
+		{
+			target_free_working_area(target, read_algorithm);
+			LOG_DEBUG("no working area for the read buffer, using the default read");
+			return default_flash_read(bank, buffer, offset, count);
+		}
+		own_output = true;
+	}
+
+	previous_phase = nucX1_phase_begin(bank, NUCX1_PHASE_READ, &phase_time);
+
+	window_words = output_size / 4 - 1;
+	packed = malloc(output_size);
+	words = malloc(window_words * 4);
+	if ((packed == NULL) || (words == NULL))
+	{
+		retval = ERROR_FAIL;
+		goto cleanup;
+	}
+
+	retval = target_write_buffer(target, read_algorithm->address,
+			sizeof(nucX1_flash_read_code), (uint8_t *)nucX1_flash_read_code);
+	nucX1_count(bank, 1, 0, 0);
+	if (retval != ERROR_OK)
+		goto cleanup;
+
+	armv7m_info.common_magic = ARMV7M_COMMON_MAGIC;
+	armv7m_info.core_mode = ARMV7M_MODE_ANY;
+
+	init_reg_param(&reg_params[0], "r0", 32, PARAM_IN_OUT);
+	init_reg_param(&reg_params[1], "r1", 32, PARAM_OUT);
+	init_reg_param(&reg_params[2], "r2", 32, PARAM_OUT);
+	init_reg_param(&reg_params[3], "r3", 32, PARAM_OUT);
+
+	for (address = start; address < end; address += window_words * 4)
+	{
+		uint32_t num_words = (end - address) / 4;
+		uint32_t packed_size, from, to, first, last;
+
+		if (num_words > window_words)
+			num_words = window_words;
+
+		buf_set_u32(reg_params[0].value, 0, 32, bank->base + address);
+		buf_set_u32(reg_params[1].value, 0, 32, num_words);
+		buf_set_u32(reg_params[2].value, 0, 32, output->address);
+		buf_set_u32(reg_params[3].value, 0, 32,
+				nucX1_info->compressed_read ? NUCX1_RLE_RUN_MIN : 0xFFFFFFFF);
+
+		nucX1_count(bank, 0, 0, 1);
+		retval = target_run_algorithm(target, 0, NULL, 4, reg_params,
+				read_algorithm->address, 0, 1000, &armv7m_info);
+		if (retval != ERROR_OK)
+		{
+			LOG_ERROR("error executing nucX1 flash read algorithm");
+			break;
+		}
+
+		packed_size = buf_get_u32(reg_params[0].value, 0, 32) - output->address;
+		if (packed_size > output_size)
+		{
+			LOG_ERROR("nucX1 flash read algorithm overran its buffer");
+			retval = ERROR_FAIL;
+			break;
+		}
+
+		retval = target_read_buffer(target, output->address, packed_size, packed);
+		nucX1_count(bank, 1, 0, 0);
+		if (retval != ERROR_OK)
+			break;
+
+		// unpack into the window
+		for (from = 0, to = 0; (from + 4 <= packed_size) && (retval == ERROR_OK); )
+		{
+			uint32_t header = target_buffer_get_u32(target, packed + from);
+			uint32_t length = (header & 0x7FFFFFFF) * 4;
+
+			from += 4;
+			if ((length > num_words * 4 - to) ||
+					(!(header & 0x80000000) && (length > packed_size - from)))
+			{
+				retval = ERROR_FAIL;
+				break;
+			}
+
+			if (header & 0x80000000)
+				memset(words + to, 0xff, length);
+			else
+			{
+				memcpy(words + to, packed + from, length);
+				from += length;
+			}
+			to += length;
+		}
+		if ((retval != ERROR_OK) || (to != num_words * 4))
+		{
+			LOG_ERROR("nucX1 flash read algorithm returned bad records");
+			retval = ERROR_FAIL;
+			break;
+		}
+
+		// only the part that was asked for goes to the caller
+		first = (address < offset) ? offset : address;
+		last = address + num_words * 4;
+		if (last > offset + count)
+			last = offset + count;
+		memcpy(buffer + (first - offset), words + (first - address), last - first);
+	}
+
+	for (i = 0; i < 4; i++)
+		destroy_reg_param(&reg_params[i]);
+
+cleanup:
+	free(words);
+	free(packed);
+	if (own_output)
+		target_free_working_area(target, output);
+	target_free_working_area(target, read_algorithm);
+
+	nucX1_phase_end(bank, previous_phase, &phase_time,
+			(retval == ERROR_OK) ? count : 0);
+
+	return retval;
+}
+
+// Known parts, sorted by the id read from 0x50000000 for a binary search.
+//  Shared by probe and info; add new NUC1xx variants here.
+struct nucX1_device
+{
+	uint32_t device_id;
+	const char *name;
+	int page_size;
+	int num_pages;
+};
+
+static const struct nucX1_device nucX1_devices[] = {
+	{ 0x00012000, "nuc120USB (Medium Density)", 512, 256 },	// 128K
+};
+
+// Any other non-zero id is probably a nuc of some sort; assume the
+//  standard page size and an arbitrary 32K.
+static const struct nucX1_device nucX1_unknown_device = {
+	0, "nuc device likely - add to driver", 512, 64,
+};
+
+// Returns the table entry for an id, the generic entry for an unknown
+//  non-zero id or NULL if the target isn't a nuc at all.
+static const struct nucX1_device *nucX1_find_device(uint32_t device_id)
+{
+	int lo = 0;
+	int hi = (sizeof(nucX1_devices) / sizeof(nucX1_devices[0])) - 1;
+
+	if (device_id == 0)
+		return NULL;
+
+	while (lo <= hi)
 	{
-		
-		page_size = 512;		// this is the standard size
-		//nucX1_info->ppage_size = 4;
-		num_pages = 64;		// 32K (Arbitrary)
+		int mid = (lo + hi) / 2;
+
+		if (nucX1_devices[mid].device_id == device_id)
+			return &nucX1_devices[mid];
+		if (nucX1_devices[mid].device_id < device_id)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
 
-		LOG_WARNING("Undefined NUC type??");
+	return &nucX1_unknown_device;
+}
+
+// The probe routine for the nuc.
+static int nucX1_probe(struct flash_bank *bank)
+{
+	struct target *target = bank->target;
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+	const struct nucX1_device *device;
+	int i;
+	uint16_t num_pages;
+	uint32_t device_id;
+	int page_size;
+	uint32_t base_address = 0x00000000;
+
+	// don't know for sure if this is required??
+	if (bank->target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
 	}
-	
-	else
+
+	/* read nucX1 device id register */
+	int retval = target_read_u32(target, 0x50000000, &device_id);
+	if (retval != ERROR_OK)
+		return retval;
+	LOG_DEBUG("device id = 0x%08" PRIx32 "", device_id);
+
+	// same part as last time - the geometry still holds
+	if (nucX1_info->probed && bank->sectors && (device_id == nucX1_info->device_id))
+		return ERROR_OK;
+
+	nucX1_info->probed = 0;
+	nucX1_info->device_id = device_id;
+	nucX1_invalidate_protection(bank);
+
+	device = nucX1_find_device(device_id);
+	if (device == NULL)
 	{
 		LOG_WARNING("Cannot identify target as a nuc family.");
 		return ERROR_FAIL;
 	}
+	if (device == &nucX1_unknown_device)
+		LOG_WARNING("Undefined NUC type??");
+	else
+		LOG_INFO("%s", device->name);
+
+	page_size = device->page_size;	// This may be better thought of as "sectors"
+	num_pages = device->num_pages;
 
-	if (bank->sectors)
+	// The flash core reads the sector array itself, so it has to be there;
+	//  it is laid out again only for a different geometry.
+	if (bank->sectors && ((nucX1_info->geometry.page_size != (uint32_t)page_size) ||
+			(nucX1_info->geometry.num_pages != num_pages)))
 	{
 		free(bank->sectors);
 		bank->sectors = NULL;
+		bank->num_sectors = 0;
+		memset(&nucX1_info->geometry, 0, sizeof(nucX1_info->geometry));
 	}
 
 	bank->base = base_address;
+	if (bank->sectors == NULL)
+	{
+		bank->sectors = malloc(sizeof(struct flash_sector) * num_pages);
+		if (bank->sectors == NULL)
+		{
+			bank->num_sectors = 0;
+			return ERROR_FAIL;
+		}
+
+		for (i = 0; i < num_pages; i++)
+		{
+			bank->sectors[i].offset = i * page_size;
+			bank->sectors[i].size = page_size;
+			NUCX1_TRACE_LOG("sector %d at offset 0x%" PRIx32, i, bank->sectors[i].offset);
+		}
+	}
+
 	bank->size = (num_pages * page_size);
 	bank->num_sectors = num_pages;
-	bank->sectors = malloc(sizeof(struct flash_sector) * num_pages);
-
 	for (i = 0; i < num_pages; i++)
 	{
-		bank->sectors[i].offset = i * page_size;
-		bank->sectors[i].size = page_size;
 		bank->sectors[i].is_erased = -1;
 		bank->sectors[i].is_protected = 1;
-		//LOG_INFO("sector id = %x", i);
 	}
 
+	nucX1_info->geometry.page_size = page_size;
+	nucX1_info->geometry.num_pages = num_pages;
+
 	nucX1_info->probed = 1;
 	
-  	LOG_INFO("Novoton NUC: Probed ...");
+  	LOG_DEBUG("Novoton NUC: Probed ...");
 
 
 	return ERROR_OK;
@@ -378,60 +2359,68 @@ static int nucX1_auto_probe(struct flash_bank *bank)
 	return nucX1_probe(bank);
 }
 
-// Info doesn't really add much, but works correctly.
+// Info names the part from the device table.
 static int nucX1_info(struct flash_bank *bank, char *buf, int buf_size)
 {
 	struct target *target = bank->target;
-	uint32_t device_id;
-	int printed;
-
-	/* read nucX1 device id register */
-	int retval = target_read_u32(target, 0x50000000, &device_id);
-	if (retval != ERROR_OK)
-		return retval;
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+	const struct nucX1_device *device;
+	uint32_t device_id = nucX1_info->device_id;
 
-	if ((device_id) == 0x00012000)
-	{
-		LOG_INFO("nuc120USB (Medium Density)");
-	}
-	else if ((device_id) != 0x00000000)
+	/* read nucX1 device id register, unless probed already */
+	if (!nucX1_info->probed)
 	{
-		LOG_INFO("nuc device likely - add to driver");
+		int retval = target_read_u32(target, 0x50000000, &device_id);
+		if (retval != ERROR_OK)
+			return retval;
 	}
-	
-	else
+
+	device = nucX1_find_device(device_id);
+	if (device == NULL)
 	{
-		LOG_INFO("Cannot identify target as a nuc1xx");
+		snprintf(buf, buf_size, "Cannot identify target as a nuc1xx");
 		return ERROR_FAIL;
 	}
 
+	snprintf(buf, buf_size, "%s", device->name);
+
 	return ERROR_OK;
 }
-/*
-// The nuc120 doesn't support mass erase, so this will probably be removed soon.
-// The structure is left for now until I am sure I don't want to add any custom
-//  commands.
-static int nucX1_mass_erase(struct flash_bank *bank)
+
+// Puts back the clock settings the flash session changed (see
+//  nucX1_clock_begin) and locks the registers again, ending the session
+//  before the target is resumed.
+COMMAND_HANDLER(nucX1_handle_clock_restore_command)
 {
-	struct target *target = bank->target;
-	int retval = ERROR_OK;
-	
-	//uint32_t u32DummyRead;
-	//int32_t flashflag;
-	//uint32_t ucDQ6_read1, ucDQ6_read2, ucDQ5_read;
+	if (CMD_ARGC < 1)
+	{
+		command_print(CMD_CTX, "nucX1 clock_restore <bank>");
+		return ERROR_OK;
+	}
 
-	if (target->state != TARGET_HALTED)
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (ERROR_OK != retval)
+		return retval;
+
+	struct nucX1_flash_bank *nucX1_info = bank->driver_priv;
+	if (!nucX1_info->clock_saved)
 	{
-		LOG_ERROR("Target not halted");
-		return ERROR_TARGET_NOT_HALTED;
+		command_print(CMD_CTX, "nucX1 clock settings not changed");
+		return ERROR_OK;
 	}
 
-	LOG_INFO("Novoton NUC: Chip Erase ... (may take several seconds)");
+	retval = nucX1_clock_end(bank);
+	int retval2 = nucX1_relock(bank);
+	if (retval == ERROR_OK)
+		retval = retval2;
+	if (retval == ERROR_OK)
+		command_print(CMD_CTX, "nucX1 clock settings restored");
 
-       
 	return retval;
 }
 
+// Erases the whole bank, see nucX1_mass_erase.
 COMMAND_HANDLER(nucX1_handle_mass_erase_command)
 {
 	int i;	// for erasing sectors
@@ -446,7 +2435,7 @@ COMMAND_HANDLER(nucX1_handle_mass_erase_command)
 	if (ERROR_OK != retval)
 		return retval;
 
-	retval = nucX1_mass_erase(bank);
+	retval = nucX1_session_end(bank, nucX1_mass_erase(bank));
 	if (retval == ERROR_OK)
 	{
 		// set all sectors as erased 
@@ -465,6 +2454,264 @@ COMMAND_HANDLER(nucX1_handle_mass_erase_command)
 	return retval;
 }
 
+// Turns differential writes on or off for a bank, or shows the setting.
+COMMAND_HANDLER(nucX1_handle_differential_command)
+{
+	struct nucX1_flash_bank *nucX1_info;
+
+	if (CMD_ARGC < 1)
+	{
+		command_print(CMD_CTX, "nucX1 differential <bank> ['on'|'off']");
+		return ERROR_OK;
+	}
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (ERROR_OK != retval)
+		return retval;
+
+	nucX1_info = bank->driver_priv;
+
+	if (CMD_ARGC > 1)
+		COMMAND_PARSE_ON_OFF(CMD_ARGV[1], nucX1_info->differential);
+
+	command_print(CMD_CTX, "nucX1 differential writes %s",
+			nucX1_info->differential ? "on" : "off");
+
+	return ERROR_OK;
+}
+
+// Turns the packing of erased words in reads on or off, or shows the setting.
+COMMAND_HANDLER(nucX1_handle_compressed_read_command)
+{
+	struct nucX1_flash_bank *nucX1_info;
+
+	if (CMD_ARGC < 1)
+	{
+		command_print(CMD_CTX, "nucX1 compressed_read <bank> ['on'|'off']");
+		return ERROR_OK;
+	}
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (ERROR_OK != retval)
+		return retval;
+
+	nucX1_info = bank->driver_priv;
+
+	if (CMD_ARGC > 1)
+		COMMAND_PARSE_ON_OFF(CMD_ARGV[1], nucX1_info->compressed_read);
+
+	command_print(CMD_CTX, "nucX1 compressed reads %s",
+			nucX1_info->compressed_read ? "on" : "off");
+
+	return ERROR_OK;
+}
+
+// Write a binary file to erased flash, reading it while the target programs
+//  instead of loading it into memory first.
+COMMAND_HANDLER(nucX1_handle_write_file_command)
+{
+	struct fileio fileio;
+	struct duration bench;
+	struct nucX1_source source;
+	uint32_t offset = 0;
+	uint32_t length;
+
+	if (CMD_ARGC < 2)
+	{
+		command_print(CMD_CTX, "nucX1 write_file <bank> <filename> [offset]");
+		return ERROR_OK;
+	}
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (ERROR_OK != retval)
+		return retval;
+
+	if (CMD_ARGC > 2)
+		COMMAND_PARSE_NUMBER(u32, CMD_ARGV[2], offset);
+
+	if (bank->target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	retval = nucX1_auto_probe(bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (fileio_open(&fileio, CMD_ARGV[1], FILEIO_READ, FILEIO_BINARY) != ERROR_OK)
+		return ERROR_FAIL;
+
+	length = fileio.size;
+	if ((length == 0) || (offset > bank->size) || (length > bank->size - offset))
+	{
+		fileio_close(&fileio);
+		command_print(CMD_CTX, "file doesn't fit in the bank");
+		return ERROR_FLASH_DST_OUT_OF_BANK;
+	}
+
+	source.read = nucX1_file_read;
+	source.buffer = NULL;
+	source.fileio = &fileio;
+
+	duration_start(&bench);
+
+	retval = nucX1_session_end(bank, nucX1_program_source(bank, &source, offset, length));
+	fileio_close(&fileio);
+
+	if ((retval == ERROR_OK) && (duration_measure(&bench) == ERROR_OK))
+		command_print(CMD_CTX, "wrote %" PRIu32 " bytes from file %s to flash at 0x%8.8" PRIx32
+				" in %fs (%0.3f KiB/s)", length, CMD_ARGV[1], bank->base + offset,
+				duration_elapsed(&bench), duration_kbps(&bench, length));
+	else if (retval != ERROR_OK)
+		command_print(CMD_CTX, "nucX1 write_file failed");
+
+	return retval;
+}
+
+// CRC32 of a flash range computed on the chip, compared with the CRC32 of
+//  the first <length> bytes of a binary file if one is given.
+COMMAND_HANDLER(nucX1_handle_verify_crc_command)
+{
+	struct fileio fileio;
+	uint32_t offset, length;
+	uint32_t flash_crc, image_crc;
+	uint8_t *image;
+	size_t read_bytes;
+
+	if (CMD_ARGC < 3)
+	{
+		command_print(CMD_CTX, "nucX1 verify_crc <bank> <offset> <length> [file]");
+		return ERROR_OK;
+	}
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (ERROR_OK != retval)
+		return retval;
+
+	COMMAND_PARSE_NUMBER(u32, CMD_ARGV[1], offset);
+	COMMAND_PARSE_NUMBER(u32, CMD_ARGV[2], length);
+
+	if ((length == 0) || (offset > bank->size) || (length > bank->size - offset))
+	{
+		command_print(CMD_CTX, "range is outside of the flash bank");
+		return ERROR_FLASH_DST_OUT_OF_BANK;
+	}
+
+	if (bank->target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	retval = nucX1_session_end(bank,
+			nucX1_crc_blocks(bank, bank->base + offset, length, 1, &flash_crc));
+	if (retval != ERROR_OK)
+	{
+		command_print(CMD_CTX, "nucX1 flash checksum failed");
+		return retval;
+	}
+
+	if (CMD_ARGC < 4)
+	{
+		command_print(CMD_CTX, "nucX1 crc32 of 0x%" PRIx32 " bytes at 0x%8.8" PRIx32 ": 0x%8.8" PRIx32,
+				length, bank->base + offset, flash_crc);
+		return ERROR_OK;
+	}
+
+	if (fileio_open(&fileio, CMD_ARGV[3], FILEIO_READ, FILEIO_BINARY) != ERROR_OK)
+		return ERROR_FAIL;
+
+	image = malloc(length);
+	if (image == NULL)
+	{
+		fileio_close(&fileio);
+		return ERROR_FAIL;
+	}
+
+	retval = fileio_read(&fileio, length, image, &read_bytes);
+	fileio_close(&fileio);
+	if ((retval == ERROR_OK) && (read_bytes != length))
+	{
+		command_print(CMD_CTX, "file %s is shorter than 0x%" PRIx32 " bytes", CMD_ARGV[3], length);
+		retval = ERROR_FAIL;
+	}
+
+	if (retval == ERROR_OK)
+		retval = image_calculate_checksum(image, length, &image_crc);
+	free(image);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (flash_crc != image_crc)
+	{
+		command_print(CMD_CTX, "nucX1 verify failed: flash crc32 0x%8.8" PRIx32
+				", file crc32 0x%8.8" PRIx32, flash_crc, image_crc);
+		return ERROR_FAIL;
+	}
+
+	command_print(CMD_CTX, "nucX1 verified 0x%" PRIx32 " bytes at 0x%8.8" PRIx32 " (crc32 0x%8.8" PRIx32 ")",
+			length, bank->base + offset, flash_crc);
+
+	return ERROR_OK;
+}
+
+// Show the per-phase statistics, or reset them.
+COMMAND_HANDLER(nucX1_handle_stats_command)
+{
+	static const char *phase_names[NUCX1_NUM_PHASES] = {
+		"alloc", "upload", "erase", "program", "verify", "read",
+	};
+	struct nucX1_flash_bank *nucX1_info;
+	int i;
+
+	if (CMD_ARGC < 1)
+	{
+		command_print(CMD_CTX, "nucX1 stats <bank> ['reset']");
+		return ERROR_OK;
+	}
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (ERROR_OK != retval)
+		return retval;
+
+	nucX1_info = bank->driver_priv;
+
+	if (CMD_ARGC > 1)
+	{
+		if (strcmp(CMD_ARGV[1], "reset") != 0)
+			return ERROR_COMMAND_SYNTAX_ERROR;
+
+		memset(nucX1_info->stats, 0, sizeof(nucX1_info->stats));
+		command_print(CMD_CTX, "nucX1 statistics reset");
+		return ERROR_OK;
+	}
+
+	command_print(CMD_CTX, "%-8s %6s %9s %9s %8s %7s %5s %10s %9s",
+			"phase", "count", "total(s)", "peak(s)", "trips", "polls", "algos", "bytes", "KiB/s");
+
+	for (i = 0; i < NUCX1_NUM_PHASES; i++)
+	{
+		struct nucX1_phase_stats *stats = &nucX1_info->stats[i];
+		float rate = 0;
+
+		if (stats->total_time > 0)
+			rate = stats->bytes / 1024.0 / stats->total_time;
+
+		command_print(CMD_CTX, "%-8s %6" PRIu32 " %9.3f %9.3f %8" PRIu32 " %7" PRIu32
+				" %5" PRIu32 " %10" PRIu64 " %9.1f",
+				phase_names[i], stats->count, stats->total_time, stats->peak_time,
+				stats->round_trips, stats->polls, stats->algorithm_runs,
+				stats->bytes, rate);
+	}
+
+	return ERROR_OK;
+}
 
 static const struct command_registration nucX1_exec_command_handlers[] = {
 	{
@@ -472,7 +2719,52 @@ static const struct command_registration nucX1_exec_command_handlers[] = {
 		.handler = nucX1_handle_mass_erase_command,
 		.mode = COMMAND_EXEC,
 		.usage = "bank_id",
-		.help = "Erase entire Flash device.",
+		.help = "Erase entire flash device.",
+	},
+	{
+		.name = "clock_restore",
+		.handler = nucX1_handle_clock_restore_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id",
+		.help = "Restore the clock settings changed for flash programming.",
+	},
+	{
+		.name = "differential",
+		.handler = nucX1_handle_differential_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id ['on'|'off']",
+		.help = "Only erase and program the pages a write changes.",
+	},
+	{
+		.name = "compressed_read",
+		.handler = nucX1_handle_compressed_read_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id ['on'|'off']",
+		.help = "Pack runs of erased words when reading the flash.",
+	},
+	{
+		.name = "write_file",
+		.handler = nucX1_handle_write_file_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id filename [offset]",
+		.help = "Write a binary file to erased flash, reading the file "
+			"while the target programs.",
+	},
+	{
+		.name = "verify_crc",
+		.handler = nucX1_handle_verify_crc_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id offset length [filename]",
+		.help = "Compare the CRC32 of a flash range, computed on the "
+			"target, with the CRC32 of a binary file.",
+	},
+	{
+		.name = "stats",
+		.handler = nucX1_handle_stats_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id ['reset']",
+		.help = "Show (or reset) time and transfer statistics for each "
+			"flash operation phase.",
 	},
 	COMMAND_REGISTRATION_DONE
 };
@@ -486,19 +2778,17 @@ static const struct command_registration nucX1_command_handlers[] = {
 	},
 	COMMAND_REGISTRATION_DONE
 };
-*/
 
 struct flash_driver nucX1_flash = {
 	.name = "nucX1",
-	//.commands = nucX1_command_handlers,
-	.commands = NULL,
+	.commands = nucX1_command_handlers,
 	.flash_bank_command = nucX1_flash_bank_command,
 	.erase = nucX1_erase,
-	.write = nucX1_write_block,
-	.read = default_flash_read,
+	.write = nucX1_write,
+	.read = nucX1_read,
 	.probe = nucX1_probe,
 	.auto_probe = nucX1_auto_probe,
-	.erase_check = default_flash_mem_blank_check,
+	.erase_check = nucX1_erase_check,
 	.protect_check = nucX1_protect_check,
 	.info = nucX1_info,
 };
@@ -36,16 +36,20 @@
 #endif
 
 #include "imp.h"
-// The next three includes are specifically needed for this driver. They may or
+// The next six includes are specifically needed for this driver. They may or
 //   may not be needed in drivers for other chips.
 #include <helper/binarybuffer.h>
+#include <helper/fileio.h>
+#include <helper/time_support.h>
 #include <target/algorithm.h>
 #include <target/armv7m.h>
+#include <target/image.h>
 
 // The following defines are specific to the STM321xx chip. They should be replaced
 //   with meaningful defines applicable to another target chip.
 /* stm32x register locations */
 
+#define STM32_FLASH_BASE	0x40022000
 #define STM32_FLASH_ACR		0x40022000
 #define STM32_FLASH_KEYR	0x40022004
 #define STM32_FLASH_OPTKEYR	0x40022008
@@ -98,6 +102,23 @@
 #define KEY1			0x45670123
 #define KEY2			0xCDEF89AB
 
+/* typical flash operation times in microseconds (used as polling hints)
+ * and wall clock timeouts in milliseconds */
+
+#define FLASH_PROGRAM_TIME		50
+#define FLASH_ERASE_TIME		20000
+#define FLASH_PROGRAM_TIMEOUT	10
+#define FLASH_ERASE_TIMEOUT		100
+
+/* status polling: back to back reads before backing off, and the shortest sleep */
+
+#define STM32_POLL_SPINS		4
+#define STM32_POLL_MIN_DELAY_US	10
+
+/* half-words per memory write when programming without a loader */
+
+#define STM32X_PROGRAM_BATCH	256
+
 // The following bank scheme is specific to the ST 32F1xx chip. Other chips
 //    may or may not need or want to use it.
 /* we use an offset to access the second bank on dual flash devices
@@ -112,9 +133,40 @@ struct stm32x_options
 {
 	uint16_t RDP;
 	uint16_t user_options;
+	uint16_t data[2];
 	uint16_t protection[4];
 };
 
+// The option bytes are programmed as half-words, in this order: RDP, USER,
+//  DATA0, DATA1, WRP0 to WRP3.
+#define STM32X_OB_SLOTS		8
+
+// The driver keeps statistics for each phase of its flash operations, so
+//  it is possible to see where programming time goes (see the stats command
+//  near the end of this file). Each phase counts operations, wall clock time
+//  (total and the longest single operation), bytes, round trips to the
+//  debug adapter, status polls and algorithm runs. An algorithm run is
+//  counted as one event of its own, not as the transfers it takes.
+#define STM32X_PHASE_NONE		-1
+#define STM32X_PHASE_ALLOC		0
+#define STM32X_PHASE_UPLOAD		1
+#define STM32X_PHASE_ERASE		2
+#define STM32X_PHASE_PROGRAM	3
+#define STM32X_PHASE_VERIFY		4
+#define STM32X_PHASE_READ		5
+#define STM32X_NUM_PHASES		6
+
+struct stm32x_phase_stats
+{
+	uint32_t count;
+	uint32_t round_trips;
+	uint32_t polls;
+	uint32_t algorithm_runs;
+	uint64_t bytes;
+	float total_time;
+	float peak_time;
+};
+
 // This is an important structure and most (probably all) chips will 
 //    want their own version of this. It holds information needed by
 //    any operations the driver will perform on any bank. A pointer to
@@ -125,7 +177,8 @@ struct stm32x_options
 //	    other chips.
 //	The write algorithm pointer points to the code which will be loaded
 //	    into the chip sram to program the chip flash quickly. Most chips
-//	    will need this.
+//	    will need this. The write buffer is the fifo the code reads from.
+//	    Both are kept between writes; see stm32x_free_working_areas.
 //	Ppage size is the protection page size for those chips which have 
 //	    protection implemented in sizes other than the sector size. This
 //	    doesn't apply to many chips.
@@ -134,10 +187,43 @@ struct stm32x_options
 //	    all implementations.
 //	Dual banks and a register offset are meaningful in only the largest of
 //	    the stm32x chips. This is often not required.
+//	The fast write flag selects the faster of the two block write
+//	    loaders. The probe sets it.
+//	The differential flag selects differential writes (see
+//	    stm32x_write_differential below). It is set with a command.
+//	The compressed read flag lets the read routine pack runs of erased
+//	    words (see stm32x_read below). It is on unless turned off with
+//	    a command.
+//	The statistics are kept per phase, and phase is the one in progress.
+//	The device id and the raw flash size register are what the last probe
+//	    read. A probe that reads the same values keeps the geometry it
+//	    found before, and info answers from the cached id.
+//	The protection is WRPR as protect_check last read it: one bit per
+//	    protection page (ppage_size sectors), clear when the page is write
+//	    protected. protect_check only reads it again once it has been
+//	    invalidated (see stm32x_invalidate_protection), and protect starts
+//	    from it instead of reading WRPR while it is valid.
+//	The unlocked flag is set while the bank's flash controller is unlocked
+//	    for a flash session (see stm32x_unlock). gdb_flash is set from the
+//	    start of a gdb flash erase or write to the end of the gdb flash
+//	    write (see stm32x_target_event).
+//	erase_pending has a flag for each sector that erase has put off while
+//	    erase_ahead is on (see stm32x_erase_request), or is NULL.
+//	The geometry is what the sector array was last laid out from (see
+//	    stm32x_probe); the pages are all the same size, so the driver finds
+//	    a sector from an offset without walking the array.
+struct stm32x_geometry
+{
+	uint32_t page_size;
+	int num_pages;
+};
+
 struct stm32x_flash_bank
 {
 	struct stm32x_options option_bytes;
 	struct working_area *write_algorithm;
+	struct working_area *write_buffer;
+	uint32_t write_buffer_size;
 	int ppage_size;
 	int probed;
 
@@ -146,12 +232,238 @@ struct stm32x_flash_bank
 	 * 0x00 will address bank 0 flash
 	 * 0x40 will address bank 1 flash */
 	int register_offset;
+
+	bool differential;
+	bool compressed_read;
+	bool compressed_write;
+	bool fast_write;
+	bool erase_ahead;
+	uint8_t *erase_pending;
+
+	struct stm32x_geometry geometry;
+
+	struct stm32x_phase_stats stats[STM32X_NUM_PHASES];
+	int phase;
+
+	uint32_t device_id;
+	uint16_t flash_size_reg;
+
+	uint32_t protection;
+	bool protection_valid;
+
+	bool unlocked;
+	bool gdb_flash;
 };
 
 // Forward declaration of the mass erase function. Provide if
 //	necessary. See discussion of mass erase below.
 static int stm32x_mass_erase(struct flash_bank *bank);
 
+// These are below with the other helpers; the target events need them.
+static int stm32x_relock(struct flash_bank *bank);
+static struct flash_bank *stm32x_partner_bank(struct flash_bank *bank);
+static int stm32x_erase_flush(struct flash_bank *bank, uint32_t offset, uint32_t length);
+static void stm32x_erase_drop(struct flash_bank *bank);
+
+// The block write below keeps its loader and fifo in sram from one write to
+//  the next. This releases them; the next block write allocates and uploads
+//  them again. Freeing a working area also clears the pointer to it.
+static void stm32x_free_working_areas(struct flash_bank *bank)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+
+	if (stm32x_info->write_buffer)
+		target_free_working_area(bank->target, stm32x_info->write_buffer);
+	if (stm32x_info->write_algorithm)
+		target_free_working_area(bank->target, stm32x_info->write_algorithm);
+
+	stm32x_info->write_buffer = NULL;
+	stm32x_info->write_algorithm = NULL;
+	stm32x_info->write_buffer_size = 0;
+}
+
+// The fifos of the block write, the dual bank write and the read take what
+//  the target has left in its working area rather than a fixed 16 KiB. The
+//  working area is handed out front to back, so what is left is its size
+//  less the areas in the list (a freed area stays in the list, and is only
+//  handed out again for a request of the same size).
+// The smaller loaders that come and go while the write fifo is kept (erase,
+//  crc, blank check, option bytes, the read and dual bank loaders) each take
+//  one area of STM32X_AUX_AREA_SIZE for their code and data together. With
+//  one size for all of them they keep reusing the same area, so keeping
+//  that much back for it (until it is in the list) is always enough. The
+//  crc results and the erase sector list are done in batches that fit. The
+//  block write loaders, which are kept with the fifo, share a size of
+//  STM32X_WRITE_AREA_SIZE in the same way and are kept back for too. The
+//  data part of a fifo is a whole number of flash pages where there is room
+//  for one, so a ring that wraps does so on a page, and otherwise a whole
+//  number of 256 bytes.
+#define STM32X_AUX_AREA_SIZE	1536
+#define STM32X_WRITE_AREA_SIZE	256
+#define STM32X_SRAM_RESERVE		(STM32X_AUX_AREA_SIZE + STM32X_WRITE_AREA_SIZE)
+#define STM32X_FIFO_MIN			512
+
+static uint32_t stm32x_working_area_avail(struct target *target)
+{
+	struct working_area *area;
+	uint32_t used = 0;
+
+	for (area = target->working_areas; area; area = area->next)
+		used += area->size;
+
+	return (used < target->working_area_size) ? target->working_area_size - used : 0;
+}
+
+static int stm32x_alloc_aux(struct target *target, struct working_area **area)
+{
+	return target_alloc_working_area(target, STM32X_AUX_AREA_SIZE, area);
+}
+
+// Allocates a fifo (8 bytes of pointers and the data) as large as the
+//  working area allows. A freed fifo that is at least as large is taken
+//  again as it is. Should the allocation fail anyway, the size steps down a
+//  page at a time, and 256 bytes at a time below two pages.
+static int stm32x_alloc_fifo(struct flash_bank *bank, struct working_area **area,
+		uint32_t *size)
+{
+	struct target *target = bank->target;
+	uint32_t page = (bank->num_sectors > 0) ? bank->sectors[0].size : 1024;
+	uint32_t avail = stm32x_working_area_avail(target);
+	uint32_t reserve = STM32X_SRAM_RESERVE;
+	uint32_t reuse = 0;
+	bool have_aux = false, have_write = false;
+	struct working_area *c;
+	uint32_t fifo_size;
+
+	for (c = target->working_areas; c; c = c->next)
+	{
+		if (c->size == STM32X_AUX_AREA_SIZE)
+			have_aux = true;
+		else if (c->size == STM32X_WRITE_AREA_SIZE)
+			have_write = true;
+		else if (c->free && (c->size > reuse))
+			reuse = c->size;
+	}
+	if (have_aux)
+		reserve -= STM32X_AUX_AREA_SIZE;
+	if (have_write)
+		reserve -= STM32X_WRITE_AREA_SIZE;
+
+	fifo_size = (avail > reserve) ? avail - reserve : 0;
+	if (fifo_size >= page + 8)
+		fifo_size = ((fifo_size - 8) / page) * page + 8;
+	else if (fifo_size >= 256 + 8)
+		fifo_size = ((fifo_size - 8) & ~255) + 8;
+	else
+		fifo_size = 0;
+
+	if ((reuse >= fifo_size) && (reuse >= STM32X_FIFO_MIN))
+		fifo_size = reuse;
+
+	while (fifo_size >= STM32X_FIFO_MIN)
+	{
+		if (target_alloc_working_area_try(target, fifo_size, area) == ERROR_OK)
+		{
+			LOG_DEBUG("stm32x fifo of %" PRIu32 " bytes (%" PRIu32 " free)",
+					fifo_size, avail);
+			*size = fifo_size;
+			return ERROR_OK;
+		}
+
+		if (fifo_size >= 2 * page + 8)
+			fifo_size -= page;
+		else
+			fifo_size -= 256;
+	}
+
+	return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+}
+
+// The protection bitmap is only good until the option bytes are written or
+//  loaded again. Writing them (protect, lock, unlock, options_write) and a
+//  reset invalidate it, and so does a probe that builds a new sector array.
+static void stm32x_invalidate_protection(struct flash_bank *bank)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+
+	stm32x_info->protection_valid = false;
+}
+
+// Finds the sectors that length bytes at offset touch, clipped to the bank.
+//  Returns how many there are, 0 for none.
+static int stm32x_sector_span(struct flash_bank *bank, uint32_t offset, uint32_t length,
+		int *first, int *last)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+	uint32_t page_size = stm32x_info->geometry.page_size;
+
+	if ((page_size == 0) || (length == 0) || (offset >= bank->size))
+		return 0;
+	if (length > bank->size - offset)
+		length = bank->size - offset;
+
+	*first = offset / page_size;
+	*last = (offset + length - 1) / page_size;
+	return *last - *first + 1;
+}
+
+// Target events end a flash session. Once the target runs its own code again
+//  (or is reset) the sram may hold anything, so the cached loader is dropped.
+//  A gdb flash session runs from the first erase or write to the end of the
+//  write; the flash controller is locked again then, while the target is
+//  still halted. Writing CR of a running target could clear the PG or PER
+//  of its own flash code, so when the target runs only the unlocked flag is
+//  cleared; stm32x_unlock finds out from LOCK what state it is really in.
+//  A reset locks the controller by itself.
+//  The callback is registered once for each bank and sees the events for all
+//  targets, so others are ignored. Algorithm runs resume the target in debug
+//  execution mode, which is a different event, so they don't end the session.
+static int stm32x_target_event(struct target *target, enum target_event event, void *priv)
+{
+	struct flash_bank *bank = priv;
+
+	if (target != bank->target)
+		return ERROR_OK;
+
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+
+	switch (event)
+	{
+		case TARGET_EVENT_RESET_START:
+			// The option bytes are loaded again at reset.
+			stm32x_invalidate_protection(bank);
+			stm32x_free_working_areas(bank);
+			stm32x_erase_drop(bank);
+			stm32x_info->unlocked = false;
+			stm32x_info->gdb_flash = false;
+			break;
+		case TARGET_EVENT_GDB_FLASH_ERASE_START:
+		case TARGET_EVENT_GDB_FLASH_WRITE_START:
+			stm32x_info->gdb_flash = true;
+			break;
+		case TARGET_EVENT_GDB_FLASH_WRITE_END:
+			// gdb has written all it wanted; erase what it erased beyond that.
+			//  The event can't fail the load, so say so if this does; the
+			//  controller is locked again either way.
+			if (stm32x_erase_flush(bank, 0, bank->size) != ERROR_OK)
+				LOG_ERROR("stm32x couldn't erase the sectors put off during the gdb load");
+			stm32x_info->gdb_flash = false;
+			stm32x_relock(bank);
+			stm32x_free_working_areas(bank);
+			break;
+		case TARGET_EVENT_RESUMED:
+			stm32x_erase_drop(bank);
+			stm32x_info->unlocked = false;
+			stm32x_info->gdb_flash = false;
+			stm32x_free_working_areas(bank);
+			break;
+		default:
+			break;
+	}
+
+	return ERROR_OK;
+}
+
 // The flash bank command handler is a key function and will be discussed
 //  at length. This command is unique; while it configures the private
 //  bank structure and must be entered in the flash_driver structure at
@@ -186,9 +498,29 @@ FLASH_BANK_COMMAND_HANDLER(stm32x_flash_bank_command)
 	// Now the private data structure is initialized. This
 	//  data is (not surprisingly) specific to a particular device.
 	stm32x_info->write_algorithm = NULL;
+	stm32x_info->write_buffer = NULL;
+	stm32x_info->write_buffer_size = 0;
 	stm32x_info->probed = 0;
 	stm32x_info->has_dual_banks = false;
 	stm32x_info->register_offset = FLASH_OFFSET_B0;
+	stm32x_info->differential = false;
+	stm32x_info->compressed_read = true;
+	stm32x_info->compressed_write = false;
+	stm32x_info->fast_write = false;
+	stm32x_info->erase_ahead = false;
+	stm32x_info->erase_pending = NULL;
+	memset(&stm32x_info->geometry, 0, sizeof(stm32x_info->geometry));
+	memset(stm32x_info->stats, 0, sizeof(stm32x_info->stats));
+	stm32x_info->phase = STM32X_PHASE_NONE;
+	stm32x_info->device_id = 0;
+	stm32x_info->flash_size_reg = 0;
+	stm32x_info->protection = 0;
+	stm32x_info->protection_valid = false;
+	stm32x_info->unlocked = false;
+	stm32x_info->gdb_flash = false;
+
+	// The cached write loader has to be dropped when the target runs again.
+	target_register_event_callback(stm32x_target_event, bank);
 
 	return ERROR_OK;
 }
@@ -205,28 +537,209 @@ static inline int stm32x_get_flash_status(struct flash_bank *bank, uint32_t *sta
 	struct target *target = bank->target;
 	return target_read_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_SR), status);
 }
+
+// Helpers for the statistics. A phase is begun before an operation and ended
+//  after it; the events counted in between are charged to it. Ending a phase
+//  puts back the one that was in progress when it began.
+static int stm32x_phase_begin(struct flash_bank *bank, int phase, struct duration *duration)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+	int previous = stm32x_info->phase;
+
+	stm32x_info->phase = phase;
+	duration_start(duration);
+
+	return previous;
+}
+
+static void stm32x_phase_end(struct flash_bank *bank, int previous,
+		struct duration *duration, uint32_t bytes)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+	struct stm32x_phase_stats *stats = &stm32x_info->stats[stm32x_info->phase];
+	float elapsed;
+
+	duration_measure(duration);
+	elapsed = duration_elapsed(duration);
+
+	stats->count++;
+	stats->bytes += bytes;
+	stats->total_time += elapsed;
+	if (elapsed > stats->peak_time)
+		stats->peak_time = elapsed;
+
+	stm32x_info->phase = previous;
+}
+
+static void stm32x_count(struct flash_bank *bank, int round_trips, int polls,
+		int algorithm_runs)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+	struct stm32x_phase_stats *stats;
+
+	if (stm32x_info->phase == STM32X_PHASE_NONE)
+		return;
+
+	stats = &stm32x_info->stats[stm32x_info->phase];
+	stats->round_trips += round_trips;
+	stats->polls += polls;
+	stats->algorithm_runs += algorithm_runs;
+}
+
+// Ends an operation in a session: the controller stays unlocked.
+static int stm32x_idle(struct flash_bank *bank)
+{
+	int retval = target_write_u32(bank->target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), 0);
+	stm32x_count(bank, 1, 0, 0);
+
+	return retval;
+}
+
+// A flash session unlocks a bank's controller once and leaves it unlocked
+//  for the erases and writes that follow, so a gdb load (erase, write,
+//  verify) writes the keys once instead of for every call. After an
+//  operation only CR is cleared (stm32x_idle), so no PG, PER or MER is left
+//  set. The controller is locked again at the end of each driver call or
+//  command outside a gdb flash session (see stm32x_session_end), when the
+//  session ends (see stm32x_target_event), or after a failure, when nothing
+//  is assumed about its state. The key sequence is only accepted once after
+//  each lock; a wrong one locks the controller until the next reset, so
+//  LOCK is read first (a target that ran may have left it unlocked) and the
+//  unlock is checked.
+static int stm32x_unlock(struct flash_bank *bank)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+	struct target *target = bank->target;
+	uint32_t cr;
+
+	if (stm32x_info->unlocked)
+		return ERROR_OK;
+
+	int retval = target_read_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), &cr);
+	stm32x_count(bank, 1, 0, 0);
+	if (retval != ERROR_OK)
+		return retval;
+	if (!(cr & FLASH_LOCK))
+	{
+		stm32x_info->unlocked = true;
+		return stm32x_idle(bank);
+	}
+
+	/* unlock flash registers */
+	retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_KEYR), KEY1);
+	if (retval != ERROR_OK)
+		return retval;
+	retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_KEYR), KEY2);
+	if (retval != ERROR_OK)
+		return retval;
+	retval = target_read_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), &cr);
+	stm32x_count(bank, 3, 0, 0);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (cr & FLASH_LOCK)
+	{
+		LOG_ERROR("stm32x flash controller stays locked (until the next reset)");
+		return ERROR_FAIL;
+	}
+
+	stm32x_info->unlocked = true;
+
+	return ERROR_OK;
+}
+
+// Locks the controller again. Only a halted target is written to; the
+//  flag is cleared either way.
+static int stm32x_relock(struct flash_bank *bank)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+
+	if (!stm32x_info->unlocked)
+		return ERROR_OK;
+	stm32x_info->unlocked = false;
+
+	if (bank->target->state != TARGET_HALTED)
+		return ERROR_TARGET_NOT_HALTED;
+
+	int retval = target_write_u32(bank->target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_LOCK);
+	stm32x_count(bank, 1, 0, 0);
+
+	return retval;
+}
+
+// Ends a driver call or command that may have unlocked the controller.
+//  Outside a gdb flash session it is locked again now, while the target is
+//  halted; within one it stays unlocked for the next call. retval is the
+//  result of the call and is returned unless the relock fails after a call
+//  that didn't.
+static int stm32x_session_end(struct flash_bank *bank, int retval)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+	int retval2 = ERROR_OK;
+
+	if (!stm32x_info->gdb_flash)
+		retval2 = stm32x_relock(bank);
+
+	return (retval != ERROR_OK) ? retval : retval2;
+}
 // This helper function is specific to the stm32x. Other chips may or may not use this method.
-static int stm32x_wait_status_busy(struct flash_bank *bank, int timeout)
+// The flash operations take very different amounts of time: a half-word
+//  program is done in some tens of microseconds while an erase takes tens of
+//  milliseconds. The caller passes the typical duration of the operation as
+//  a hint. The status register is first polled back to back (each read is a
+//  debug link round trip anyway), then the delay between reads grows
+//  exponentially up to a quarter of the expected time. The timeout is a
+//  wall clock limit in milliseconds, not a number of reads.
+static void stm32x_poll_delay(int delay_us)
+{
+	if (delay_us >= 1000)
+		alive_sleep(delay_us / 1000);
+	else
+	{
+		usleep(delay_us);
+		keep_alive();
+	}
+}
+
+static int stm32x_wait_status_busy(struct flash_bank *bank, int expected_us, int timeout_ms)
 {
 	struct target *target = bank->target;
 	uint32_t status;
 	int retval = ERROR_OK;
+	long long then = timeval_ms();
+	int max_delay_us = expected_us / 4;
+	int delay_us = 0;
+	int spins = 0;
 
 	/* wait for busy to clear */
 	for (;;)
 	{
 		retval = stm32x_get_flash_status(bank, &status);
+		stm32x_count(bank, 1, 1, 0);
 		if (retval != ERROR_OK)
 			return retval;
 		LOG_DEBUG("status: 0x%" PRIx32 "", status);
 		if ((status & FLASH_BSY) == 0)
 			break;
-		if (timeout-- <= 0)
+		if (timeval_ms() - then > timeout_ms)
 		{
 			LOG_ERROR("timed out waiting for flash");
 			return ERROR_FAIL;
 		}
-		alive_sleep(1);
+		if (spins < STM32_POLL_SPINS)
+		{
+			spins++;
+			continue;
+		}
+		if (delay_us == 0)
+			delay_us = expected_us / 16;
+		else
+			delay_us *= 2;
+		if (delay_us > max_delay_us)
+			delay_us = max_delay_us;
+		if (delay_us < STM32_POLL_MIN_DELAY_US)
+			delay_us = STM32_POLL_MIN_DELAY_US;
+		stm32x_poll_delay(delay_us);
 	}
 
 	if (status & FLASH_WRPRTERR)
@@ -269,173 +782,332 @@ int stm32x_check_operation_supported(struct flash_bank *bank)
 	return ERROR_OK;
 }
 // stm32x specific function to read the option byte.
+// The option bytes proper live in a 16 byte block at STM32_OB_RDP: RDP,
+//  USER, DATA0, DATA1 and WRP0 to WRP3, each a half-word holding the value
+//  in its low byte and the complement in the high byte. The whole block is
+//  read in one transfer. These are the programmed values; OBR and WRPR only
+//  show them as they were loaded at the last reset.
 static int stm32x_read_options(struct flash_bank *bank)
 {
-	uint32_t optiondata;
+	uint8_t raw[STM32X_OB_SLOTS * 2];
+	uint16_t slots[STM32X_OB_SLOTS];
 	struct stm32x_flash_bank *stm32x_info = NULL;
 	struct target *target = bank->target;
+	int i;
 
 	stm32x_info = bank->driver_priv;
 
 	/* read current option bytes */
-	int retval = target_read_u32(target, STM32_FLASH_OBR, &optiondata);
+	int retval = target_read_buffer(target, STM32_OB_RDP, sizeof(raw), raw);
+	stm32x_count(bank, 1, 0, 0);
 	if (retval != ERROR_OK)
 		return retval;
 
-	stm32x_info->option_bytes.user_options = (uint16_t)0xFFF8 | ((optiondata >> 2) & 0x07);
-	stm32x_info->option_bytes.RDP = (optiondata & (1 << OPT_READOUT)) ? 0xFFFF : 0x5AA5;
-
-	if (optiondata & (1 << OPT_READOUT))
-		LOG_INFO("Device Security Bit Set");
+	for (i = 0; i < STM32X_OB_SLOTS; i++)
+		slots[i] = target_buffer_get_u16(target, raw + i * 2);
 
-	/* each bit refers to a 4bank protection */
-	retval = target_read_u32(target, STM32_FLASH_WRPR, &optiondata);
-	if (retval != ERROR_OK)
-		return retval;
+	stm32x_info->option_bytes.RDP = slots[0];
+	stm32x_info->option_bytes.user_options = slots[1];
+	stm32x_info->option_bytes.data[0] = slots[2];
+	stm32x_info->option_bytes.data[1] = slots[3];
+	for (i = 0; i < 4; i++)
+		stm32x_info->option_bytes.protection[i] = slots[4 + i];
 
-	stm32x_info->option_bytes.protection[0] = (uint16_t)optiondata;
-	stm32x_info->option_bytes.protection[1] = (uint16_t)(optiondata >> 8);
-	stm32x_info->option_bytes.protection[2] = (uint16_t)(optiondata >> 16);
-	stm32x_info->option_bytes.protection[3] = (uint16_t)(optiondata >> 24);
+	if ((slots[0] & 0xFF) != 0xA5)
+		LOG_INFO("Device Security Bit Set");
 
 	return ERROR_OK;
 }
-// stm32x specific function to erase the option byte. On the ST chip, this allows
-//	reprogramming. Other chips will have other methods of doing this.
-static int stm32x_erase_options(struct flash_bank *bank)
+// The values to program, in the order of the half-words in the block.
+static void stm32x_options_to_slots(struct stm32x_options *options,
+		uint16_t *slots)
+{
+	int i;
+
+	slots[0] = options->RDP;
+	slots[1] = options->user_options;
+	slots[2] = options->data[0];
+	slots[3] = options->data[1];
+	for (i = 0; i < 4; i++)
+		slots[4 + i] = options->protection[i];
+}
+// Runs the option byte update as a single routine on the target: an erase
+//  of the block if asked, then every half-word in the mask programmed and
+//  polled in turn. Each half-word done from here would otherwise be a write
+//  and a few status reads over the debug link.
+// The flash and option registers must already be unlocked.
+static int stm32x_program_options_block(struct flash_bank *bank,
+		uint16_t *slots, uint32_t mask, int erase)
 {
-	struct stm32x_flash_bank *stm32x_info = NULL;
 	struct target *target = bank->target;
+	struct working_area *options_algorithm;
+	struct reg_param reg_params[5];
+	struct armv7m_algorithm armv7m_info;
+	uint8_t values[STM32X_OB_SLOTS * 2];
+	uint32_t status;
+	int i;
+	int retval;
 
-	stm32x_info = bank->driver_priv;
+	// Parameters:
+	//  r0 - flash register base
+	//  r1 - the values to program, one half-word per slot
+	//  r2 - mask of the slots to program, bit 0 for RDP
+	//  r3 - STM32_OB_RDP
+	//  r4 - erase the block first if not zero
+	// Returns the last status read in r0.
 
-	/* read current options */
-	stm32x_read_options(bank);
+	static const uint8_t stm32x_flash_options_code[] = {
+									/* #define STM32_FLASH_SR_OFFSET	0x0C */
+									/* #define STM32_FLASH_CR_OFFSET	0x10 */
+									/* options: */
+		0x00, 0x25,					/* movs	r5, #0x00 */
+		0x00, 0x2c,					/* cmp	r4, #0x00 */
+		0x0c, 0xd0,					/* beq	program */
+		0x40, 0xf2, 0x20, 0x24,		/* mov	r4, #0x220 */
+		0x04, 0x61,					/* str	r4, [r0, #STM32_FLASH_CR_OFFSET] */
+		0x40, 0xf2, 0x60, 0x24,		/* mov	r4, #0x260 */
+		0x04, 0x61,					/* str	r4, [r0, #STM32_FLASH_CR_OFFSET] */
+									/* erase_busy: */
+		0xc5, 0x68,					/* ldr	r5, [r0, #STM32_FLASH_SR_OFFSET] */
+		0x15, 0xf0, 0x01, 0x0f,		/* tst	r5, #0x01 */
+		0xfb, 0xd1,					/* bne	erase_busy */
+		0x15, 0xf0, 0x14, 0x0f,		/* tst	r5, #0x14 */
+		0x11, 0xd1,					/* bne	exit */
+									/* program: */
+		0x40, 0xf2, 0x10, 0x24,		/* mov	r4, #0x210 */
+		0x04, 0x61,					/* str	r4, [r0, #STM32_FLASH_CR_OFFSET] */
+									/* next: */
+		0x52, 0x08,					/* lsrs	r2, r2, #1 */
+		0x08, 0xd3,					/* bcc	skip */
+		0x0c, 0x88,					/* ldrh	r4, [r1, #0x00] */
+		0x1c, 0x80,					/* strh	r4, [r3, #0x00] */
+									/* busy: */
+		0xc5, 0x68,					/* ldr	r5, [r0, #STM32_FLASH_SR_OFFSET] */
+		0x15, 0xf0, 0x01, 0x0f,		/* tst	r5, #0x01 */
+		0xfb, 0xd1,					/* bne	busy */
+		0x15, 0xf0, 0x14, 0x0f,		/* tst	r5, #0x14 */
+		0x03, 0xd1,					/* bne	exit */
+									/* skip: */
+		0x89, 0x1c,					/* adds	r1, r1, #0x02 */
+		0x9b, 0x1c,					/* adds	r3, r3, #0x02 */
+		0x00, 0x2a,					/* cmp	r2, #0x00 */
+		0xf0, 0xd1,					/* bne	next */
+									/* exit: */
+		0x28, 0x46,					/* mov	r0, r5 */
+		0x00, 0xbe,					/* bkpt	#0x00 */
+	};
+	// The values follow the code, on a word boundary.
+	uint32_t values_offset = (sizeof(stm32x_flash_options_code) + 3) & ~3;
+	uint8_t image[((sizeof(stm32x_flash_options_code) + 3) & ~3) + sizeof(values)];
 
-	/* unlock flash registers */
-	int retval = target_write_u32(target, STM32_FLASH_KEYR, KEY1);
-	if (retval != ERROR_OK)
-		return retval;
+	if (stm32x_alloc_aux(target, &options_algorithm) != ERROR_OK)
+	{
+		LOG_DEBUG("no working area for the option byte algorithm");
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	}
 
-	retval = target_write_u32(target, STM32_FLASH_KEYR, KEY2);
-	if (retval != ERROR_OK)
-		return retval;
+	for (i = 0; i < STM32X_OB_SLOTS; i++)
+		target_buffer_set_u16(target, values + i * 2, slots[i]);
 
-	/* unlock option flash registers */
-	retval = target_write_u32(target, STM32_FLASH_OPTKEYR, KEY1);
-	if (retval != ERROR_OK)
-		return retval;
-	retval = target_write_u32(target, STM32_FLASH_OPTKEYR, KEY2);
-	if (retval != ERROR_OK)
-		return retval;
+	// Code and values go down in one transfer.
+	memset(image, 0, sizeof(image));
+	memcpy(image, stm32x_flash_options_code, sizeof(stm32x_flash_options_code));
+	memcpy(image + values_offset, values, sizeof(values));
 
-	/* erase option bytes */
-	retval = target_write_u32(target, STM32_FLASH_CR, FLASH_OPTER | FLASH_OPTWRE);
-	if (retval != ERROR_OK)
-		return retval;
-	retval = target_write_u32(target, STM32_FLASH_CR, FLASH_OPTER | FLASH_STRT | FLASH_OPTWRE);
+	retval = target_write_buffer(target, options_algorithm->address,
+			sizeof(image), image);
+	stm32x_count(bank, 1, 0, 0);
 	if (retval != ERROR_OK)
+	{
+		target_free_working_area(target, options_algorithm);
 		return retval;
+	}
+
+	armv7m_info.common_magic = ARMV7M_COMMON_MAGIC;
+	armv7m_info.core_mode = ARMV7M_MODE_ANY;
+
+	init_reg_param(&reg_params[0], "r0", 32, PARAM_IN_OUT);
+	init_reg_param(&reg_params[1], "r1", 32, PARAM_OUT);
+	init_reg_param(&reg_params[2], "r2", 32, PARAM_OUT);
+	init_reg_param(&reg_params[3], "r3", 32, PARAM_OUT);
+	init_reg_param(&reg_params[4], "r4", 32, PARAM_OUT);
+
+	buf_set_u32(reg_params[0].value, 0, 32, STM32_FLASH_BASE);
+	buf_set_u32(reg_params[1].value, 0, 32, options_algorithm->address + values_offset);
+	buf_set_u32(reg_params[2].value, 0, 32, mask);
+	buf_set_u32(reg_params[3].value, 0, 32, STM32_OB_RDP);
+	buf_set_u32(reg_params[4].value, 0, 32, erase ? 1 : 0);
+
+	// An option byte erase takes as long as a page erase.
+	stm32x_count(bank, 0, 0, 1);
+	if ((retval = target_run_algorithm(target, 0, NULL, 5, reg_params,
+			options_algorithm->address, 0,
+			FLASH_ERASE_TIMEOUT + 100, &armv7m_info)) != ERROR_OK)
+	{
+		LOG_ERROR("error executing stm32x option byte algorithm");
+	}
+	else
+	{
+		status = buf_get_u32(reg_params[0].value, 0, 32);
+		if (status & (FLASH_WRPRTERR | FLASH_PGERR))
+		{
+			LOG_ERROR("stm32x option byte programming failed, status 0x%" PRIx32, status);
+			target_write_u32(target, STM32_FLASH_SR, FLASH_WRPRTERR | FLASH_PGERR);
+			retval = ERROR_FLASH_OPERATION_FAILED;
+		}
+	}
+
+	for (i = 0; i < 5; i++)
+		destroy_reg_param(&reg_params[i]);
+
+	target_free_working_area(target, options_algorithm);
+
+	return retval;
+}
+// The same thing done from here, for when there is no working area.
+static int stm32x_program_options_regs(struct flash_bank *bank,
+		uint16_t *slots, uint32_t mask, int erase)
+{
+	struct target *target = bank->target;
+	int retval;
+	int i;
+
+	if (erase)
+	{
+		/* erase option bytes */
+		retval = target_write_u32(target, STM32_FLASH_CR, FLASH_OPTER | FLASH_OPTWRE);
+		if (retval != ERROR_OK)
+			return retval;
+		retval = target_write_u32(target, STM32_FLASH_CR, FLASH_OPTER | FLASH_STRT | FLASH_OPTWRE);
+		if (retval != ERROR_OK)
+			return retval;
+
+		retval = stm32x_wait_status_busy(bank, FLASH_ERASE_TIME, FLASH_ERASE_TIMEOUT);
+		if (retval != ERROR_OK)
+			return retval;
+	}
 
-	retval = stm32x_wait_status_busy(bank, 10);
+	/* program option bytes */
+	retval = target_write_u32(target, STM32_FLASH_CR, FLASH_OPTPG | FLASH_OPTWRE);
 	if (retval != ERROR_OK)
 		return retval;
 
-	/* clear readout protection and complementary option bytes
-	 * this will also force a device unlock if set */
-	stm32x_info->option_bytes.RDP = 0x5AA5;
+	for (i = 0; i < STM32X_OB_SLOTS; i++)
+	{
+		if (!(mask & (1 << i)))
+			continue;
+
+		retval = target_write_u16(target, STM32_OB_RDP + i * 2, slots[i]);
+		if (retval != ERROR_OK)
+			return retval;
+
+		retval = stm32x_wait_status_busy(bank, FLASH_PROGRAM_TIME, FLASH_PROGRAM_TIMEOUT);
+		if (retval != ERROR_OK)
+			return retval;
+	}
 
 	return ERROR_OK;
 }
 // stm32x specific function to reprogram the option byte. On the ST chip, this 
 //	prevents reprogramming. Other chips will have other methods of doing this.
+// The caller reads the options (stm32x_read_options), changes what it needs
+//  in stm32x_info->option_bytes and calls this. The new values are compared
+//  with what is programmed now:
+//   - nothing changed: nothing is done at all. No erase, no rewrite.
+//   - only erased half-words change: they can be programmed as they are.
+//   - a programmed half-word changes: the block has to be erased, then
+//     every half-word that isn't 0xFF is programmed back, DATA0 and DATA1
+//     included.
+//  Either way it is a single algorithm run (registers, if there is no
+//  working area). Only the low byte of each half-word counts; the hardware
+//  writes the complement itself.
+// Erasing the option bytes while the readout protection is set also mass
+//  erases the flash; that is what unlocks a device.
 static int stm32x_write_options(struct flash_bank *bank)
 {
 	struct stm32x_flash_bank *stm32x_info = NULL;
 	struct target *target = bank->target;
+	struct flash_bank *bank0 = bank;
+	struct stm32x_options wanted;
+	uint16_t current[STM32X_OB_SLOTS];
+	uint16_t slots[STM32X_OB_SLOTS];
+	uint32_t mask = 0;
+	int erase = 0;
+	int retval;
+	int i;
 
 	stm32x_info = bank->driver_priv;
 
-	/* unlock flash registers */
-	int retval = target_write_u32(target, STM32_FLASH_KEYR, KEY1);
-	if (retval != ERROR_OK)
-		return retval;
-	retval = target_write_u32(target, STM32_FLASH_KEYR, KEY2);
+	/* see what is programmed now */
+	wanted = stm32x_info->option_bytes;
+	retval = stm32x_read_options(bank);
 	if (retval != ERROR_OK)
 		return retval;
+	stm32x_options_to_slots(&stm32x_info->option_bytes, current);
+	stm32x_info->option_bytes = wanted;
+	stm32x_options_to_slots(&wanted, slots);
 
-	/* unlock option flash registers */
-	retval = target_write_u32(target, STM32_FLASH_OPTKEYR, KEY1);
-	if (retval != ERROR_OK)
-		return retval;
-	retval = target_write_u32(target, STM32_FLASH_OPTKEYR, KEY2);
-	if (retval != ERROR_OK)
-		return retval;
-
-	/* program option bytes */
-	retval = target_write_u32(target, STM32_FLASH_CR, FLASH_OPTPG | FLASH_OPTWRE);
-	if (retval != ERROR_OK)
-		return retval;
-
-	/* write user option byte */
-	retval = target_write_u16(target, STM32_OB_USER, stm32x_info->option_bytes.user_options);
-	if (retval != ERROR_OK)
-		return retval;
-
-	retval = stm32x_wait_status_busy(bank, 10);
-	if (retval != ERROR_OK)
-		return retval;
-
-	/* write protection byte 1 */
-	retval = target_write_u16(target, STM32_OB_WRP0, stm32x_info->option_bytes.protection[0]);
-	if (retval != ERROR_OK)
-		return retval;
+	for (i = 0; i < STM32X_OB_SLOTS; i++)
+	{
+		if (current[i] == 0xFFFF)
+		{
+			// An erased half-word reads as 0xFF and can still be programmed.
+			if ((slots[i] & 0xFF) != 0xFF)
+				mask |= 1 << i;
+		}
+		else if ((current[i] & 0xFF) != (slots[i] & 0xFF))
+			erase = 1;
+	}
 
-	retval = stm32x_wait_status_busy(bank, 10);
-	if (retval != ERROR_OK)
-		return retval;
+	if (!erase && mask == 0)
+	{
+		LOG_INFO("stm32x option bytes unchanged, nothing to program");
+		return ERROR_OK;
+	}
 
-	/* write protection byte 2 */
-	retval = target_write_u16(target, STM32_OB_WRP1, stm32x_info->option_bytes.protection[1]);
-	if (retval != ERROR_OK)
-		return retval;
+	if (erase)
+	{
+		mask = 0;
+		for (i = 0; i < STM32X_OB_SLOTS; i++)
+			if ((slots[i] & 0xFF) != 0xFF)
+				mask |= 1 << i;
+	}
 
-	retval = stm32x_wait_status_busy(bank, 10);
-	if (retval != ERROR_OK)
-		return retval;
+	LOG_DEBUG("stm32x option bytes: %s, program mask 0x%02" PRIx32,
+			erase ? "erase" : "no erase", mask);
 
-	/* write protection byte 3 */
-	retval = target_write_u16(target, STM32_OB_WRP2, stm32x_info->option_bytes.protection[2]);
-	if (retval != ERROR_OK)
-		return retval;
+	// The option bytes are programmed through the first bank's controller,
+	//  which may be unlocked for the session already (writing the keys
+	//  again would lock it up). Option writes always end with it locked,
+	//  which also clears OPTWRE.
+	if (stm32x_info->register_offset != FLASH_OFFSET_B0)
+		bank0 = stm32x_partner_bank(bank);
+	if (bank0 == NULL)
+		bank0 = bank;
 
-	retval = stm32x_wait_status_busy(bank, 10);
+	retval = stm32x_unlock(bank0);
 	if (retval != ERROR_OK)
 		return retval;
 
-	/* write protection byte 4 */
-	retval = target_write_u16(target, STM32_OB_WRP3, stm32x_info->option_bytes.protection[3]);
+	/* unlock option flash registers */
+	retval = target_write_u32(target, STM32_FLASH_OPTKEYR, KEY1);
 	if (retval != ERROR_OK)
 		return retval;
-
-	retval = stm32x_wait_status_busy(bank, 10);
+	retval = target_write_u32(target, STM32_FLASH_OPTKEYR, KEY2);
 	if (retval != ERROR_OK)
 		return retval;
 
-	/* write readout protection bit */
-	retval = target_write_u16(target, STM32_OB_RDP, stm32x_info->option_bytes.RDP);
-	if (retval != ERROR_OK)
-		return retval;
+	stm32x_invalidate_protection(bank);
 
-	retval = stm32x_wait_status_busy(bank, 10);
-	if (retval != ERROR_OK)
-		return retval;
+	retval = stm32x_program_options_block(bank, slots, mask, erase);
+	if (retval == ERROR_TARGET_RESOURCE_NOT_AVAILABLE)
+		retval = stm32x_program_options_regs(bank, slots, mask, erase);
 
-	retval = target_write_u32(target, STM32_FLASH_CR, FLASH_LOCK);
-	if (retval != ERROR_OK)
-		return retval;
+	/* lock again, even after a failure */
+	if (stm32x_relock(bank0) != ERROR_OK && retval == ERROR_OK)
+		retval = ERROR_FAIL;
 
-	return ERROR_OK;
+	return retval;
 }
 /////////////////////////////////////////////////////////////////////////////
 // Here begins the standard command set. These commands will be the main
@@ -482,14 +1154,24 @@ static int stm32x_protect_check(struct flash_bank *bank)
 	if (ERROR_OK != retval)
 		return retval;
 
+	// The flash core calls this often, and the answer can only change when
+	//  the option bytes are written or loaded. The sectors already show the
+	//  cached bitmap, so there is nothing to do until it is invalidated.
+	if (stm32x_info->protection_valid)
+		return ERROR_OK;
+
 	// The target_read_u32 is very commonly used to read specific registers
 	//  for a device. The error code should always be checked.
 	/* medium density - each bit refers to a 4bank protection
 	 * high density - each bit refers to a 2bank protection */
 	retval = target_read_u32(target, STM32_FLASH_WRPR, &protection);
+	stm32x_count(bank, 1, 0, 0);
 	if (retval != ERROR_OK)
 		return retval;
 
+	stm32x_info->protection = protection;
+	stm32x_info->protection_valid = true;
+
 	/* medium density - each protection bit is for 4 * 1K pages
 	 * high density - each protection bit is for 2 * 2K pages */
 	num_bits = (bank->num_sectors / stm32x_info->ppage_size);
@@ -541,12 +1223,168 @@ static int stm32x_protect_check(struct flash_bank *bank)
 
 	return ERROR_OK;
 }
+// This is a helper function for the erase function which follows. Like the
+//  block write below, it downloads a small routine into on-chip sram. The
+//  routine walks a list of sector addresses (also placed in sram) and erases
+//  each in turn, polling the busy flag locally. Only one algorithm run is
+//  needed instead of several register accesses and host side polling for
+//  every sector, so a large partial erase costs little more than the
+//  erase time of the silicon itself.
+static int stm32x_erase_block(struct flash_bank *bank, int first, int last)
+{
+	struct target *target = bank->target;
+	struct working_area *erase_algorithm;
+	struct reg_param reg_params[4];
+	struct armv7m_algorithm armv7m_info;
+	uint32_t num_sectors = last - first + 1;
+	uint8_t *addresses;
+	uint32_t erased, status;
+	int i;
+	int retval;
+
+	// Parameters:
+	//  r0 - flash controller base (in), flash status (out)
+	//  r1 - list of sector addresses
+	//  r2 - number of sectors in the list
+	//  r3 - number of sectors erased (out); on failure this is the index
+	//       of the sector that failed
+	// r4 is used as scratch.
+
+	static const uint8_t stm32x_flash_erase_code[] = {
+									/* #define STM32_FLASH_SR_OFFSET	0x0C */
+									/* #define STM32_FLASH_CR_OFFSET	0x10 */
+									/* #define STM32_FLASH_AR_OFFSET	0x14 */
+									/* erase: */
+		0x00, 0x23,					/* movs	r3, #0x00 */
+									/* erase_sector: */
+		0x02, 0x24,					/* movs	r4, #0x02 */
+		0x04, 0x61,					/* str	r4, [r0, #STM32_FLASH_CR_OFFSET] */
+		0x51, 0xf8, 0x04, 0x4b,		/* ldr	r4, [r1], #0x04 */
+		0x44, 0x61,					/* str	r4, [r0, #STM32_FLASH_AR_OFFSET] */
+		0x42, 0x24,					/* movs	r4, #0x42 */
+		0x04, 0x61,					/* str	r4, [r0, #STM32_FLASH_CR_OFFSET] */
+									/* busy: */
+		0xc4, 0x68,					/* ldr	r4, [r0, #STM32_FLASH_SR_OFFSET] */
+		0x14, 0xf0, 0x01, 0x0f,		/* tst	r4, #0x01 */
+		0xfb, 0xd1,					/* bne	busy */
+		0x14, 0xf0, 0x14, 0x0f,		/* tst	r4, #0x14 */
+		0x02, 0xd1,					/* bne	exit */
+		0x5b, 0x1c,					/* adds	r3, r3, #0x01 */
+		0x93, 0x42,					/* cmp	r3, r2 */
+		0xee, 0xd1,					/* bne	erase_sector */
+									/* exit: */
+		0x20, 0x46,					/* mov	r0, r4 */
+		0x00, 0xbe,					/* bkpt	#0x00 */
+	};
+
+	// The sector list follows the code in the same area, a batch at a time.
+	uint32_t list_offset = (sizeof(stm32x_flash_erase_code) + 3) & ~3;
+	uint32_t batch_max = (STM32X_AUX_AREA_SIZE - list_offset) / 4;
+
+	if (stm32x_alloc_aux(target, &erase_algorithm) != ERROR_OK)
+	{
+		LOG_DEBUG("no working area for the erase algorithm");
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	}
+
+	addresses = malloc(batch_max * 4);
+	if (addresses == NULL)
+	{
+		retval = ERROR_FAIL;
+		goto cleanup;
+	}
+
+	if ((retval = target_write_buffer(target, erase_algorithm->address,
+			sizeof(stm32x_flash_erase_code),
+			(uint8_t*)stm32x_flash_erase_code)) != ERROR_OK)
+		goto cleanup;
+
+	armv7m_info.common_magic = ARMV7M_COMMON_MAGIC;
+	armv7m_info.core_mode = ARMV7M_MODE_ANY;
+
+	init_reg_param(&reg_params[0], "r0", 32, PARAM_IN_OUT);
+	init_reg_param(&reg_params[1], "r1", 32, PARAM_OUT);
+	init_reg_param(&reg_params[2], "r2", 32, PARAM_OUT);
+	init_reg_param(&reg_params[3], "r3", 32, PARAM_IN);
+
+	while ((retval == ERROR_OK) && (first <= last))
+	{
+		num_sectors = last - first + 1;
+		if (num_sectors > batch_max)
+			num_sectors = batch_max;
+
+		// The list is built in target byte order so it can go down in one transfer.
+		for (i = 0; (uint32_t)i < num_sectors; i++)
+			target_buffer_set_u32(target, addresses + i * 4,
+					bank->base + bank->sectors[first + i].offset);
+
+		if ((retval = target_write_buffer(target, erase_algorithm->address + list_offset,
+				num_sectors * 4, addresses)) != ERROR_OK)
+			break;
+
+		buf_set_u32(reg_params[0].value, 0, 32,
+				stm32x_get_flash_reg(bank, STM32_FLASH_BASE));
+		buf_set_u32(reg_params[1].value, 0, 32, erase_algorithm->address + list_offset);
+		buf_set_u32(reg_params[2].value, 0, 32, num_sectors);
+
+		// Allow each sector the same 100ms the host driven loop would.
+		stm32x_count(bank, 0, 0, 1);
+		if ((retval = target_run_algorithm(target, 0, NULL, 4, reg_params,
+				erase_algorithm->address, 0,
+				1000 + num_sectors * 100, &armv7m_info)) != ERROR_OK)
+		{
+			LOG_ERROR("error executing stm32x flash erase algorithm");
+			break;
+		}
+
+		status = buf_get_u32(reg_params[0].value, 0, 32);
+		erased = buf_get_u32(reg_params[3].value, 0, 32);
+
+		for (i = 0; (uint32_t)i < erased && (uint32_t)i < num_sectors; i++)
+			bank->sectors[first + i].is_erased = 1;
+
+		if (erased < num_sectors)
+		{
+			LOG_ERROR("stm32x erase failed at sector %d", first + (int)erased);
+
+			if (status & FLASH_WRPRTERR)
+				LOG_ERROR("stm32x device protected");
+			if (status & FLASH_PGERR)
+				LOG_ERROR("stm32x device programming failed");
+
+			/* Clear but report errors */
+			target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_SR),
+					FLASH_WRPRTERR | FLASH_PGERR);
+			retval = ERROR_FLASH_OPERATION_FAILED;
+		}
+
+		first += num_sectors;
+	}
+
+	destroy_reg_param(&reg_params[0]);
+	destroy_reg_param(&reg_params[1]);
+	destroy_reg_param(&reg_params[2]);
+	destroy_reg_param(&reg_params[3]);
+
+cleanup:
+	free(addresses);
+	target_free_working_area(target, erase_algorithm);
+
+	return retval;
+}
+
 // erase is another standard function. The algorithm is of course custom to each device.
 //  Getting a working algoritm for a new chip can take some time and experimentation
 //  depending on the quality and completeness of the documentation.
-static int stm32x_erase(struct flash_bank *bank, int first, int last)
+// The sectors are erased by the sram routine above when a working area is
+//  available. The register by register loop is kept as the fallback.
+static int stm32x_erase_sectors(struct flash_bank *bank, int first, int last)
 {
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
 	struct target *target = bank->target;
+	struct duration phase_time;
+	int previous_phase;
+	uint32_t erased_bytes = 0;
 	int i;
 
 	if (bank->target->state != TARGET_HALTED)
@@ -560,305 +1398,3397 @@ static int stm32x_erase(struct flash_bank *bank, int first, int last)
 		return stm32x_mass_erase(bank);
 	}
 
-	/* unlock flash registers */
-	int retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_KEYR), KEY1);
-	if (retval != ERROR_OK)
-		return retval;
-	retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_KEYR), KEY2);
+	previous_phase = stm32x_phase_begin(bank, STM32X_PHASE_ERASE, &phase_time);
+
+	int retval = stm32x_unlock(bank);
 	if (retval != ERROR_OK)
-		return retval;
+		goto done;
 
-	for (i = first; i <= last; i++)
+	retval = stm32x_erase_block(bank, first, last);
+	if (retval == ERROR_TARGET_RESOURCE_NOT_AVAILABLE)
 	{
-		retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_PER);
-		if (retval != ERROR_OK)
-			return retval;
-		retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_AR),
-				bank->base + bank->sectors[i].offset);
-		if (retval != ERROR_OK)
-			return retval;
-		retval = target_write_u32(target,
-				stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_PER | FLASH_STRT);
-		if (retval != ERROR_OK)
-			return retval;
-
-		retval = stm32x_wait_status_busy(bank, 100);
-		if (retval != ERROR_OK)
-			return retval;
+		for (i = first; i <= last; i++)
+		{
+			retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_PER);
+			if (retval != ERROR_OK)
+				goto done;
+			retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_AR),
+					bank->base + bank->sectors[i].offset);
+			if (retval != ERROR_OK)
+				goto done;
+			retval = target_write_u32(target,
+					stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_PER | FLASH_STRT);
+			if (retval != ERROR_OK)
+				goto done;
+			stm32x_count(bank, 3, 0, 0);
+
+			retval = stm32x_wait_status_busy(bank, FLASH_ERASE_TIME, FLASH_ERASE_TIMEOUT);
+			if (retval != ERROR_OK)
+				goto done;
 
-		bank->sectors[i].is_erased = 1;
+			bank->sectors[i].is_erased = 1;
+		}
 	}
+	if (retval != ERROR_OK)
+		goto done;
 
-	retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_LOCK);
+	retval = stm32x_idle(bank);
 	if (retval != ERROR_OK)
-		return retval;
+		goto done;
 
-	return ERROR_OK;
+	for (i = first; i <= last; i++)
+		erased_bytes += bank->sectors[i].size;
+	if (stm32x_info->erase_pending)
+		memset(stm32x_info->erase_pending + first, 0, last - first + 1);
+
+done:
+	if (retval != ERROR_OK)
+		stm32x_relock(bank);
+	stm32x_phase_end(bank, previous_phase, &phase_time, erased_bytes);
+
+	return retval;
 }
 
-// The function to protect segments of memory. Some chips may not have this capability.
-//  But the function must exist!
-static int stm32x_protect(struct flash_bank *bank, int set, int first, int last)
+// With erase_ahead on, an erase within a gdb flash session only notes the
+//  sectors. A sector is really erased when the block write gets to it,
+//  while the host keeps filling the ring behind it (see
+//  stm32x_write_job_service), so the transfer of the data hides behind the
+//  20ms of each page erase. Whatever is still pending when something else
+//  looks at the flash is erased first by stm32x_erase_flush, and the end of
+//  the session erases the rest. Only gdb is sure to follow its erase with
+//  the write and to end the session before the target runs, so any other
+//  erase is done at once. So is a mass erase; MER is quicker than the pages
+//  one by one.
+static int stm32x_erase_request(struct flash_bank *bank, int first, int last)
 {
-	struct stm32x_flash_bank *stm32x_info = NULL;
-	struct target *target = bank->target;
-	uint16_t prot_reg[4] = {0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF};
-	int i, reg, bit;
-	int status;
-	uint32_t protection;
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+	int i;
 
-	stm32x_info = bank->driver_priv;
+	if (!stm32x_info->erase_ahead || !stm32x_info->gdb_flash ||
+			((first == 0) && (last == (bank->num_sectors - 1))))
+		return stm32x_erase_sectors(bank, first, last);
 
-	if (target->state != TARGET_HALTED)
+	if (bank->target->state != TARGET_HALTED)
 	{
 		LOG_ERROR("Target not halted");
 		return ERROR_TARGET_NOT_HALTED;
 	}
 
-	int retval = stm32x_check_operation_supported(bank);
-	if (ERROR_OK != retval)
-		return retval;
-
-	if ((first % stm32x_info->ppage_size) != 0)
-	{
-		LOG_WARNING("aligned start protect sector to a %d sector boundary",
-				stm32x_info->ppage_size);
-		first = first - (first % stm32x_info->ppage_size);
-	}
-	if (((last + 1) % stm32x_info->ppage_size) != 0)
+	if (stm32x_info->erase_pending == NULL)
 	{
-		LOG_WARNING("aligned end protect sector to a %d sector boundary",
-				stm32x_info->ppage_size);
-		last++;
-		last = last - (last % stm32x_info->ppage_size);
-		last--;
+		stm32x_info->erase_pending = calloc(bank->num_sectors, 1);
+		if (stm32x_info->erase_pending == NULL)
+			return ERROR_FAIL;
 	}
 
-	/* medium density - each bit refers to a 4bank protection
-	 * high density - each bit refers to a 2bank protection */
-	retval = target_read_u32(target, STM32_FLASH_WRPR, &protection);
-	if (retval != ERROR_OK)
-		return retval;
-
-	prot_reg[0] = (uint16_t)protection;
-	prot_reg[1] = (uint16_t)(protection >> 8);
-	prot_reg[2] = (uint16_t)(protection >> 16);
-	prot_reg[3] = (uint16_t)(protection >> 24);
+	// a sector known to be blank needs no erase
+	for (i = first; i <= last; i++)
+		if (bank->sectors[i].is_erased != 1)
+			stm32x_info->erase_pending[i] = 1;
 
-	if (stm32x_info->ppage_size == 2)
-	{
-		/* high density flash */
+	return ERROR_OK;
+}
 
-		/* bit 7 controls sector 62 - 255 protection */
-		if (last > 61)
-		{
-			if (set)
-				prot_reg[3] &= ~(1 << 7);
-			else
-				prot_reg[3] |= (1 << 7);
-		}
+// This is the erase function named in the flash_driver structure.
+static int stm32x_erase(struct flash_bank *bank, int first, int last)
+{
+	return stm32x_session_end(bank, stm32x_erase_request(bank, first, last));
+}
 
-		if (first > 61)
-			first = 62;
-		if (last > 61)
-			last = 61;
+// Erases the pending sectors that overlap length bytes at offset, one
+//  contiguous run at a time. Sectors outside are left pending.
+static int stm32x_erase_flush(struct flash_bank *bank, uint32_t offset, uint32_t length)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+	int retval = ERROR_OK;
+	int span_first, span_last;
+	int i;
 
-		for (i = first; i <= last; i++)
-		{
-			reg = (i / stm32x_info->ppage_size) / 8;
-			bit = (i / stm32x_info->ppage_size) - (reg * 8);
+	if ((stm32x_info->erase_pending == NULL) ||
+			!stm32x_sector_span(bank, offset, length, &span_first, &span_last))
+		return ERROR_OK;
 
-			if (set)
-				prot_reg[reg] &= ~(1 << bit);
-			else
-				prot_reg[reg] |= (1 << bit);
-		}
-	}
-	else
+	for (i = span_first; (i <= span_last) && (retval == ERROR_OK); i++)
 	{
-		/* medium density flash */
-		for (i = first; i <= last; i++)
-		{
-			reg = (i / stm32x_info->ppage_size) / 8;
-			bit = (i / stm32x_info->ppage_size) - (reg * 8);
+		int first = i;
 
-			if (set)
-				prot_reg[reg] &= ~(1 << bit);
-			else
-				prot_reg[reg] |= (1 << bit);
-		}
+		if (!stm32x_info->erase_pending[i])
+			continue;
+		while ((i + 1 <= span_last) && stm32x_info->erase_pending[i + 1])
+			i++;
+
+		retval = stm32x_erase_sectors(bank, first, i);
 	}
 
-	if ((status = stm32x_erase_options(bank)) != ERROR_OK)
-		return status;
+	return retval;
+}
 
-	stm32x_info->option_bytes.protection[0] = prot_reg[0];
-	stm32x_info->option_bytes.protection[1] = prot_reg[1];
-	stm32x_info->option_bytes.protection[2] = prot_reg[2];
-	stm32x_info->option_bytes.protection[3] = prot_reg[3];
+// Forgets the pending erases, for when the target runs again before they
+//  were done. Those sectors keep their old contents. Once the target runs,
+//  its code may program the flash too, so no sector is known to be blank.
+static void stm32x_erase_drop(struct flash_bank *bank)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+	int dropped = 0;
+	int i;
 
-	return stm32x_write_options(bank);
+	for (i = 0; i < bank->num_sectors; i++)
+	{
+		if (stm32x_info->erase_pending)
+			dropped += stm32x_info->erase_pending[i];
+		bank->sectors[i].is_erased = -1;
+	}
+	if (dropped)
+		LOG_WARNING("%s: %d pending sector erases dropped", bank->name, dropped);
+
+	free(stm32x_info->erase_pending);
+	stm32x_info->erase_pending = NULL;
 }
 
-// This is a helper function for the write function which follows.
-//  Getting write right can also take a lot of time and playing
-//  around with a new chip. 
-// The key idea is that code to be programmed into the chip is placed
-//  in a buffer in on-chip sram. A routine to do the programming is
-//  loaded into on-chip sram as well. The controlling function starts the
-//  programming code and keeps the buffer full. This is much faster than
-//  trying to program each word individually. Studying this code carefully
-//  is well worth while.
-static int stm32x_write_block(struct flash_bank *bank, uint8_t *buffer,
-		uint32_t offset, uint32_t count)
+// The sectors a write touches aren't blank any more; erase, with
+//  erase_ahead on, skips only the ones that are.
+static void stm32x_mark_written(struct flash_bank *bank, uint32_t offset, uint32_t length)
 {
+	int first, last;
+
+	if (!stm32x_sector_span(bank, offset, length, &first, &last))
+		return;
+
+	for (; first <= last; first++)
+		bank->sectors[first].is_erased = 0;
+}
+
+// The erase work for one bank, as planned by the erase_range command below
+//  or left over by an erase that is ahead of the write (see erase_ahead).
+//  pending has a flag for each sector still to be erased; sector is the one
+//  being erased, or -1 while the bank is mass erased.
+struct stm32x_erase_job
+{
+	struct flash_bank *bank;
+	uint8_t *pending;
+	bool mass;
+	bool busy;
+	bool done;
+	int sector;
+	long long started;
+	uint32_t erased_bytes;
+	int retval;
+	struct duration phase_time;
+	int previous_phase;
+};
+
+// Starts the page erase of sector i on the job's controller. The host does
+//  not wait for it; stm32x_erase_job_poll tells when it is done.
+static int stm32x_erase_job_start_sector(struct stm32x_erase_job *job, int i)
+{
+	struct flash_bank *bank = job->bank;
+	struct target *target = bank->target;
+	int retval;
+
+	retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_PER);
+	if (retval != ERROR_OK)
+		return retval;
+	retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_AR),
+			bank->base + bank->sectors[i].offset);
+	if (retval != ERROR_OK)
+		return retval;
+	retval = target_write_u32(target,
+			stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_PER | FLASH_STRT);
+	if (retval != ERROR_OK)
+		return retval;
+	stm32x_count(bank, 3, 0, 0);
+
+	job->sector = i;
+	job->busy = true;
+	job->started = timeval_ms();
+	return ERROR_OK;
+}
+
+// Starts the next erase of a job on its own controller: the whole bank with
+//  MER when the job covers it, otherwise the next pending sector with PER.
+static int stm32x_erase_job_start(struct stm32x_erase_job *job)
+{
+	struct flash_bank *bank = job->bank;
+	struct target *target = bank->target;
+	int retval;
+	int i;
+
+	if (job->mass)
+	{
+		retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_MER);
+		if (retval != ERROR_OK)
+			return retval;
+		retval = target_write_u32(target,
+				stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_MER | FLASH_STRT);
+		if (retval != ERROR_OK)
+			return retval;
+		stm32x_count(bank, 2, 0, 0);
+
+		job->sector = -1;
+		job->busy = true;
+		job->started = timeval_ms();
+		return ERROR_OK;
+	}
+
+	for (i = 0; i < bank->num_sectors; i++)
+		if (job->pending[i])
+			break;
+
+	if (i == bank->num_sectors)
+	{
+		job->done = true;
+		return ERROR_OK;
+	}
+
+	return stm32x_erase_job_start_sector(job, i);
+}
+
+// Checks a busy job. When its controller is done the result is booked and
+//  the job is idle again, ready for stm32x_erase_job_start.
+static int stm32x_erase_job_poll(struct stm32x_erase_job *job)
+{
+	struct flash_bank *bank = job->bank;
 	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
 	struct target *target = bank->target;
-	uint32_t buffer_size = 16384;
-	struct working_area *source;
-	uint32_t address = bank->base + offset;
-	struct reg_param reg_params[4];
+	uint32_t status;
+	int i;
+
+	int retval = stm32x_get_flash_status(bank, &status);
+	stm32x_count(bank, 1, 1, 0);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (status & FLASH_BSY)
+	{
+		if (timeval_ms() - job->started > FLASH_ERASE_TIMEOUT)
+		{
+			LOG_ERROR("timed out waiting for flash");
+			return ERROR_FAIL;
+		}
+		return ERROR_OK;
+	}
+
+	job->busy = false;
+
+	if (status & (FLASH_WRPRTERR | FLASH_PGERR))
+	{
+		if (status & FLASH_WRPRTERR)
+			LOG_ERROR("stm32x device protected");
+		if (status & FLASH_PGERR)
+			LOG_ERROR("stm32x device programming failed");
+
+		target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_SR),
+				FLASH_WRPRTERR | FLASH_PGERR);
+		return ERROR_FLASH_OPERATION_FAILED;
+	}
+
+	// An erase put off by erase_ahead is now done as well.
+	if (job->mass)
+	{
+		for (i = 0; i < bank->num_sectors; i++)
+			bank->sectors[i].is_erased = 1;
+		if (stm32x_info->erase_pending)
+			memset(stm32x_info->erase_pending, 0, bank->num_sectors);
+		job->erased_bytes = bank->size;
+		job->mass = false;
+		job->done = true;
+	}
+	else
+	{
+		bank->sectors[job->sector].is_erased = 1;
+		job->erased_bytes += bank->sectors[job->sector].size;
+		job->pending[job->sector] = 0;
+		if (stm32x_info->erase_pending)
+			stm32x_info->erase_pending[job->sector] = 0;
+	}
+
+	return ERROR_OK;
+}
+
+// Build the 256 entry table for the CRC32 used by image_calculate_checksum
+//  (polynomial 0x04c11db7, most significant bit first). The table goes to the
+//  target along with the checksum routine below, so it is stored in target
+//  byte order.
+static void stm32x_crc32_table(struct target *target, uint8_t *table)
+{
+	uint32_t i, j, c;
+
+	for (i = 0; i < 256; i++)
+	{
+		c = i << 24;
+		for (j = 0; j < 8; j++)
+			c = (c & 0x80000000) ? (c << 1) ^ 0x04c11db7 : (c << 1);
+		target_buffer_set_u32(target, table + i * 4, c);
+	}
+}
+
+// This helper runs a table driven CRC32 over flash in sram. It computes one
+//  checksum for each of num_blocks blocks of block_size bytes starting at
+//  address and leaves them in a table, so the host learns what the flash
+//  holds without reading it back over the debug link. The CRC is the one
+//  used by image_calculate_checksum, so the results can be compared directly
+//  with checksums of an image. Differential writes use it with one block per
+//  sector, the verify_crc command with a single block.
+// Like the block write it is split up: stm32x_crc_job_start gets the routine
+//  going and stm32x_crc_job_finish waits for it and collects the checksums,
+//  so that the gang write can checksum several targets at the same time.
+// The code, the CRC32 table and the results share one auxiliary area, which
+//  has room for the results of STM32X_CRC_BATCH blocks; stm32x_crc_blocks
+//  does more than that in batches.
+#define STM32X_CRC_BATCH	64
+
+struct stm32x_crc_job
+{
+	struct flash_bank *bank;
+	struct working_area *crc_algorithm;
+	uint32_t results;
+	struct reg_param reg_params[5];
 	struct armv7m_algorithm armv7m_info;
+	uint32_t block_size;
+	uint32_t num_blocks;
+	uint8_t *table;
+	struct duration phase_time;
+	int previous_phase;
+};
+
+static int stm32x_crc_job_start(struct stm32x_crc_job *job, struct flash_bank *bank,
+		uint32_t address, uint32_t block_size, uint32_t num_blocks)
+{
+	struct target *target = bank->target;
+	struct reg_param *reg_params = job->reg_params;
+	int retval;
+
+	// Parameters:
+	//  r0 - address of the first block
+	//  r1 - block size in bytes
+	//  r2 - number of blocks
+	//  r3 - where to store the checksums, one word per block
+	//  r4 - the CRC32 table, which follows the code
+	// r5 to r7 are used as scratch.
+
+	static const uint8_t stm32x_flash_crc_code[] = {
+									/* crc: */
+									/* next_block: */
+		0x4f, 0xf0, 0xff, 0x35,		/* mov	r5, #0xffffffff */
+		0x0e, 0x46,					/* mov	r6, r1 */
+									/* next_byte: */
+		0x10, 0xf8, 0x01, 0x7b,		/* ldrb	r7, [r0], #0x01 */
+		0x87, 0xea, 0x15, 0x67,		/* eor	r7, r7, r5, lsr #24 */
+		0x54, 0xf8, 0x27, 0x70,		/* ldr	r7, [r4, r7, lsl #2] */
+		0x87, 0xea, 0x05, 0x25,		/* eor	r5, r7, r5, lsl #8 */
+		0x76, 0x1e,					/* subs	r6, r6, #0x01 */
+		0xf5, 0xd1,					/* bne	next_byte */
+		0x43, 0xf8, 0x04, 0x5b,		/* str	r5, [r3], #0x04 */
+		0x52, 0x1e,					/* subs	r2, r2, #0x01 */
+		0xee, 0xd1,					/* bne	next_block */
+		0x00, 0xbe,					/* bkpt	#0x00 */
+	};
+	// The table starts on the first word boundary after the code.
+	uint32_t table_offset = (sizeof(stm32x_flash_crc_code) + 3) & ~3;
+
+	retval = stm32x_erase_flush(bank, address - bank->base, block_size * num_blocks);
+	if (retval != ERROR_OK)
+		return retval;
+
+	memset(job, 0, sizeof(*job));
+	job->bank = bank;
+	job->block_size = block_size;
+	job->num_blocks = num_blocks;
+
+	if (num_blocks > STM32X_CRC_BATCH)
+	{
+		LOG_ERROR("too many blocks for one stm32x checksum run");
+		return ERROR_FAIL;
+	}
+
+	if (stm32x_alloc_aux(target, &job->crc_algorithm) != ERROR_OK)
+	{
+		LOG_DEBUG("no working area for the checksum algorithm");
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	}
+	job->results = job->crc_algorithm->address + table_offset + 1024;
+
+	job->previous_phase = stm32x_phase_begin(bank, STM32X_PHASE_VERIFY, &job->phase_time);
+
+	// The code and the CRC32 table go down in one transfer; the same buffer
+	//  is big enough to collect the results afterwards.
+	job->table = calloc(1, table_offset + 1024 + num_blocks * 4);
+	if (job->table == NULL)
+	{
+		retval = ERROR_FAIL;
+		goto fail;
+	}
+	memcpy(job->table, stm32x_flash_crc_code, sizeof(stm32x_flash_crc_code));
+	stm32x_crc32_table(target, job->table + table_offset);
+
+	retval = target_write_buffer(target, job->crc_algorithm->address,
+			table_offset + 1024, job->table);
+	stm32x_count(bank, 1, 0, 0);
+	if (retval != ERROR_OK)
+		goto fail;
+
+	job->armv7m_info.common_magic = ARMV7M_COMMON_MAGIC;
+	job->armv7m_info.core_mode = ARMV7M_MODE_ANY;
+
+	init_reg_param(&reg_params[0], "r0", 32, PARAM_OUT);
+	init_reg_param(&reg_params[1], "r1", 32, PARAM_OUT);
+	init_reg_param(&reg_params[2], "r2", 32, PARAM_OUT);
+	init_reg_param(&reg_params[3], "r3", 32, PARAM_OUT);
+	init_reg_param(&reg_params[4], "r4", 32, PARAM_OUT);
+
+	buf_set_u32(reg_params[0].value, 0, 32, address);
+	buf_set_u32(reg_params[1].value, 0, 32, block_size);
+	buf_set_u32(reg_params[2].value, 0, 32, num_blocks);
+	buf_set_u32(reg_params[3].value, 0, 32, job->results);
+	buf_set_u32(reg_params[4].value, 0, 32, job->crc_algorithm->address + table_offset);
+
+	stm32x_count(bank, 0, 0, 1);
+	if ((retval = target_start_algorithm(target, 0, NULL, 5, reg_params,
+			job->crc_algorithm->address, 0, &job->armv7m_info)) != ERROR_OK)
+	{
+		LOG_ERROR("error executing stm32x flash checksum algorithm");
+		destroy_reg_param(&reg_params[0]);
+		destroy_reg_param(&reg_params[1]);
+		destroy_reg_param(&reg_params[2]);
+		destroy_reg_param(&reg_params[3]);
+		destroy_reg_param(&reg_params[4]);
+		goto fail;
+	}
+
+	return ERROR_OK;
+
+fail:
+	free(job->table);
+	target_free_working_area(target, job->crc_algorithm);
+	stm32x_phase_end(bank, job->previous_phase, &job->phase_time, 0);
+
+	return retval;
+}
+
+static int stm32x_crc_job_finish(struct stm32x_crc_job *job, uint32_t *crcs)
+{
+	struct flash_bank *bank = job->bank;
+	struct target *target = bank->target;
+	struct reg_param *reg_params = job->reg_params;
+	uint32_t i;
+	int retval;
+
+	// The loop costs about a microsecond per byte at the reset clock.
+	if ((retval = target_wait_algorithm(target, 0, NULL, 5, reg_params,
+			0, 1000 + (job->num_blocks * job->block_size) / 256,
+			&job->armv7m_info)) != ERROR_OK)
+	{
+		LOG_ERROR("error executing stm32x flash checksum algorithm");
+	}
+	else if ((retval = target_read_buffer(target, job->results,
+			job->num_blocks * 4, job->table)) == ERROR_OK)
+	{
+		stm32x_count(bank, 1, 0, 0);
+		for (i = 0; i < job->num_blocks; i++)
+			crcs[i] = target_buffer_get_u32(target, job->table + i * 4);
+	}
+
+	destroy_reg_param(&reg_params[0]);
+	destroy_reg_param(&reg_params[1]);
+	destroy_reg_param(&reg_params[2]);
+	destroy_reg_param(&reg_params[3]);
+	destroy_reg_param(&reg_params[4]);
+
+	free(job->table);
+	target_free_working_area(target, job->crc_algorithm);
+
+	stm32x_phase_end(bank, job->previous_phase, &job->phase_time,
+			(retval == ERROR_OK) ? job->num_blocks * job->block_size : 0);
+
+	return retval;
+}
+
+static int stm32x_crc_blocks(struct flash_bank *bank, uint32_t address,
+		uint32_t block_size, uint32_t num_blocks, uint32_t *crcs)
+{
+	struct stm32x_crc_job job;
 	int retval = ERROR_OK;
 
-	/* see contib/loaders/flash/stm32x.s for src */
-	// This is a very nice piece of documentation. Not all drivers provide
-	//  it. It's the source program for the assembly code that follows.
+	while ((retval == ERROR_OK) && (num_blocks > 0))
+	{
+		uint32_t batch = (num_blocks > STM32X_CRC_BATCH) ? STM32X_CRC_BATCH : num_blocks;
+
+		retval = stm32x_crc_job_start(&job, bank, address, block_size, batch);
+		if (retval != ERROR_OK)
+			break;
+		retval = stm32x_crc_job_finish(&job, crcs);
+
+		address += batch * block_size;
+		crcs += batch;
+		num_blocks -= batch;
+	}
+
+	return retval;
+}
+
+// erase_check is another standard function; the default one reads the
+//  whole bank back over the debug link and looks for 0xff. That is slow for
+//  the larger parts, so here a small routine in sram walks every sector a
+//  word at a time instead and sets a bit in a bitmap for each sector that is
+//  not blank. It stops looking at a sector at the first word that isn't
+//  0xffffffff. The bitmap is read back and the sectors' is_erased flags are
+//  filled in from it, all in a single algorithm run.
+// The default blank check is still used if there is no working area.
+static int stm32x_erase_check(struct flash_bank *bank)
+{
+	struct target *target = bank->target;
+	struct working_area *blank_check_algorithm;
+	struct reg_param reg_params[4];
+	struct armv7m_algorithm armv7m_info;
+	uint32_t num_sectors = bank->num_sectors;
+	uint32_t result_size = ((num_sectors + 31) / 32) * 4;
+	uint32_t result;
+	struct duration phase_time;
+	int previous_phase;
+	uint8_t *bitmap;
+	uint32_t i;
+	int retval;
+
+	if (target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	retval = stm32x_erase_flush(bank, 0, bank->size);
+	if (retval != ERROR_OK)
+		return retval;
+
+	// Parameters:
+	//  r0 - address of the first sector
+	//  r1 - sector size in bytes
+	//  r2 - number of sectors
+	//  r3 - bitmap of sectors found not blank, one bit per sector, cleared
+	//       by the host
+	// r4 is the current bitmap bit, r5 and r6 are used as scratch.
+
+	static const uint8_t stm32x_flash_blank_check_code[] = {
+									/* blank_check: */
+		0x01, 0x24,					/* movs	r4, #0x01 */
+									/* next_sector: */
+		0x0d, 0x46,					/* mov	r5, r1 */
+									/* next_word: */
+		0x50, 0xf8, 0x04, 0x6b,		/* ldr	r6, [r0], #0x04 */
+		0x76, 0x1c,					/* adds	r6, r6, #0x01 */
+		0x02, 0xd1,					/* bne	not_blank */
+		0x2d, 0x1f,					/* subs	r5, r5, #0x04 */
+		0xf9, 0xd1,					/* bne	next_word */
+		0x04, 0xe0,					/* b	next_bit */
+									/* not_blank: */
+		0x28, 0x44,					/* add	r0, r0, r5 */
+		0x00, 0x1f,					/* subs	r0, r0, #0x04 */
+		0x1e, 0x68,					/* ldr	r6, [r3, #0x00] */
+		0x26, 0x43,					/* orrs	r6, r6, r4 */
+		0x1e, 0x60,					/* str	r6, [r3, #0x00] */
+									/* next_bit: */
+		0x64, 0x00,					/* lsls	r4, r4, #1 */
+		0x01, 0xd1,					/* bne	count_sector */
+		0x1b, 0x1d,					/* adds	r3, r3, #0x04 */
+		0x01, 0x24,					/* movs	r4, #0x01 */
+									/* count_sector: */
+		0x52, 0x1e,					/* subs	r2, r2, #0x01 */
+		0xec, 0xd1,					/* bne	next_sector */
+		0x00, 0xbe,					/* bkpt	#0x00 */
+	};
+
+	// The bitmap follows the code in the same auxiliary area.
+	uint32_t result_offset = (sizeof(stm32x_flash_blank_check_code) + 3) & ~3;
+
+	previous_phase = stm32x_phase_begin(bank, STM32X_PHASE_VERIFY, &phase_time);
+
+	if ((result_offset + result_size > STM32X_AUX_AREA_SIZE)
+			|| (stm32x_alloc_aux(target, &blank_check_algorithm) != ERROR_OK))
+	{
+		LOG_DEBUG("no working area for the blank check algorithm");
+		retval = default_flash_mem_blank_check(bank);
+		stm32x_phase_end(bank, previous_phase, &phase_time, bank->size);
+		return retval;
+	}
+	result = blank_check_algorithm->address + result_offset;
+
+	bitmap = calloc(result_size, 1);
+	if (bitmap == NULL)
+	{
+		retval = ERROR_FAIL;
+		goto cleanup;
+	}
+
+	if ((retval = target_write_buffer(target, blank_check_algorithm->address,
+			sizeof(stm32x_flash_blank_check_code),
+			(uint8_t*)stm32x_flash_blank_check_code)) != ERROR_OK)
+		goto cleanup;
+
+	if ((retval = target_write_buffer(target, result,
+			result_size, bitmap)) != ERROR_OK)
+		goto cleanup;
+	stm32x_count(bank, 2, 0, 0);
+
+	armv7m_info.common_magic = ARMV7M_COMMON_MAGIC;
+	armv7m_info.core_mode = ARMV7M_MODE_ANY;
+
+	init_reg_param(&reg_params[0], "r0", 32, PARAM_OUT);
+	init_reg_param(&reg_params[1], "r1", 32, PARAM_OUT);
+	init_reg_param(&reg_params[2], "r2", 32, PARAM_OUT);
+	init_reg_param(&reg_params[3], "r3", 32, PARAM_OUT);
+
+	buf_set_u32(reg_params[0].value, 0, 32, bank->base);
+	buf_set_u32(reg_params[1].value, 0, 32, bank->sectors[0].size);
+	buf_set_u32(reg_params[2].value, 0, 32, num_sectors);
+	buf_set_u32(reg_params[3].value, 0, 32, result);
+
+	// A blank bank is the slowest case: every word is read.
+	stm32x_count(bank, 0, 0, 1);
+	if ((retval = target_run_algorithm(target, 0, NULL, 4, reg_params,
+			blank_check_algorithm->address, 0,
+			1000 + bank->size / 1024, &armv7m_info)) != ERROR_OK)
+	{
+		LOG_ERROR("error executing stm32x flash blank check algorithm");
+	}
+	else if ((retval = target_read_buffer(target, result,
+			result_size, bitmap)) == ERROR_OK)
+	{
+		stm32x_count(bank, 1, 0, 0);
+		for (i = 0; i < num_sectors; i++)
+			bank->sectors[i].is_erased = (bitmap[i / 8] & (1 << (i % 8))) ? 0 : 1;
+	}
+
+	destroy_reg_param(&reg_params[0]);
+	destroy_reg_param(&reg_params[1]);
+	destroy_reg_param(&reg_params[2]);
+	destroy_reg_param(&reg_params[3]);
+
+cleanup:
+	free(bitmap);
+	target_free_working_area(target, blank_check_algorithm);
+
+	stm32x_phase_end(bank, previous_phase, &phase_time,
+			(retval == ERROR_OK) ? bank->size : 0);
+
+	return retval;
+}
+
+// The function to protect segments of memory. Some chips may not have this capability.
+//  But the function must exist!
+static int stm32x_protect(struct flash_bank *bank, int set, int first, int last)
+{
+	struct stm32x_flash_bank *stm32x_info = NULL;
+	struct target *target = bank->target;
+	uint16_t prot_reg[4] = {0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF};
+	int i, reg, bit;
+	int status;
+	uint32_t protection;
+
+	stm32x_info = bank->driver_priv;
+
+	if (target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	int retval = stm32x_check_operation_supported(bank);
+	if (ERROR_OK != retval)
+		return retval;
+
+	if ((first % stm32x_info->ppage_size) != 0)
+	{
+		LOG_WARNING("aligned start protect sector to a %d sector boundary",
+				stm32x_info->ppage_size);
+		first = first - (first % stm32x_info->ppage_size);
+	}
+	if (((last + 1) % stm32x_info->ppage_size) != 0)
+	{
+		LOG_WARNING("aligned end protect sector to a %d sector boundary",
+				stm32x_info->ppage_size);
+		last++;
+		last = last - (last % stm32x_info->ppage_size);
+		last--;
+	}
+
+	/* medium density - each bit refers to a 4bank protection
+	 * high density - each bit refers to a 2bank protection */
+	// The bitmap protect_check cached is still WRPR until it is invalidated.
+	if (stm32x_info->protection_valid)
+		protection = stm32x_info->protection;
+	else
+	{
+		retval = target_read_u32(target, STM32_FLASH_WRPR, &protection);
+		stm32x_count(bank, 1, 0, 0);
+		if (retval != ERROR_OK)
+			return retval;
+	}
+
+	prot_reg[0] = (uint16_t)protection;
+	prot_reg[1] = (uint16_t)(protection >> 8);
+	prot_reg[2] = (uint16_t)(protection >> 16);
+	prot_reg[3] = (uint16_t)(protection >> 24);
+
+	if (stm32x_info->ppage_size == 2)
+	{
+		/* high density flash */
+
+		/* bit 7 controls sector 62 - 255 protection */
+		if (last > 61)
+		{
+			if (set)
+				prot_reg[3] &= ~(1 << 7);
+			else
+				prot_reg[3] |= (1 << 7);
+		}
+
+		if (first > 61)
+			first = 62;
+		if (last > 61)
+			last = 61;
+
+		for (i = first; i <= last; i++)
+		{
+			reg = (i / stm32x_info->ppage_size) / 8;
+			bit = (i / stm32x_info->ppage_size) - (reg * 8);
+
+			if (set)
+				prot_reg[reg] &= ~(1 << bit);
+			else
+				prot_reg[reg] |= (1 << bit);
+		}
+	}
+	else
+	{
+		/* medium density flash */
+		for (i = first; i <= last; i++)
+		{
+			reg = (i / stm32x_info->ppage_size) / 8;
+			bit = (i / stm32x_info->ppage_size) - (reg * 8);
+
+			if (set)
+				prot_reg[reg] &= ~(1 << bit);
+			else
+				prot_reg[reg] |= (1 << bit);
+		}
+	}
+
+	if ((status = stm32x_read_options(bank)) != ERROR_OK)
+		return status;
+
+	stm32x_info->option_bytes.protection[0] = prot_reg[0];
+	stm32x_info->option_bytes.protection[1] = prot_reg[1];
+	stm32x_info->option_bytes.protection[2] = prot_reg[2];
+	stm32x_info->option_bytes.protection[3] = prot_reg[3];
+
+	return stm32x_write_options(bank);
+}
+
+// Where a write gets its data from. The image is asked for in order, a
+//  chunk at a time: read copies the next size bytes into chunk and returns
+//  an error code. The block write below asks for a chunk only when the ring
+//  has room for it, so with a file behind the source the host reads the
+//  next part of the image while the target programs the part before, and
+//  the image never has to be in memory as a whole.
+struct stm32x_source
+{
+	int (*read)(struct stm32x_source *source, uint8_t *chunk, uint32_t size);
+	const uint8_t *buffer;	// for stm32x_buffer_read
+	struct fileio *fileio;	// for stm32x_file_read
+};
+
+// The image is a buffer in memory, as the flash core passes it to write.
+static int stm32x_buffer_read(struct stm32x_source *source, uint8_t *chunk,
+		uint32_t size)
+{
+	memcpy(chunk, source->buffer, size);
+	source->buffer += size;
+
+	return ERROR_OK;
+}
+
+// The image is read from a file as the write goes along.
+static int stm32x_file_read(struct stm32x_source *source, uint8_t *chunk,
+		uint32_t size)
+{
+	size_t read_bytes;
+	int retval;
+
+	retval = fileio_read(source->fileio, size, chunk, &read_bytes);
+	if ((retval == ERROR_OK) && (read_bytes != size))
+	{
+		LOG_ERROR("unexpected end of the image file");
+		retval = ERROR_FAIL;
+	}
+
+	return retval;
+}
+
+// With compressed_write on, the image goes through the ring packed and a
+//  loader on the target unpacks it. Flash images tend to have long runs of
+//  one value (mostly 0xffff and 0x0000 padding), and the debug adapter is
+//  usually the slow part of a write, so sending less of it pays.
+// The packed stream is made of half-word records. A header with bit 15 set
+//  is a run: the next half-word is repeated (header & 0x7fff) times. A
+//  header with bit 15 clear is followed by that many literal half-words.
+//  The image is packed STM32X_PACK_CHUNK bytes at a time; if a chunk does
+//  not get smaller it goes as a single literal record, so packing never
+//  costs more than one half-word per chunk.
+#define STM32X_PACK_CHUNK		2048
+#define STM32X_PACK_RUN_MIN		3
+
+// Packs size bytes of raw (an even number, at most STM32X_PACK_CHUNK) into
+//  out, which has room for size + 2 bytes. Returns the packed size.
+static uint32_t stm32x_pack_chunk(struct target *target, const uint8_t *raw,
+		uint32_t size, uint8_t *out)
+{
+	uint32_t count = size / 2;
+	uint32_t packed = 0;
+	uint32_t literal = 0;	// start of the literals not yet written out
+	uint32_t i = 0;
+	bool fits = true;
+
+	while (fits && (i < count))
+	{
+		uint32_t run = 1;
+		while ((i + run < count) && !memcmp(raw + 2 * (i + run), raw + 2 * i, 2))
+			run++;
+
+		if ((run < STM32X_PACK_RUN_MIN) && (i + run < count))
+		{
+			i += run;
+			continue;
+		}
+		if (run < STM32X_PACK_RUN_MIN)
+		{
+			i += run;
+			run = 0;
+		}
+
+		// The literals before the run (or up to the end) go first.
+		if (i > literal)
+		{
+			if (packed + 2 + 2 * (i - literal) + (run ? 4 : 0) > size)
+			{
+				fits = false;
+				break;
+			}
+			target_buffer_set_u16(target, out + packed, i - literal);
+			memcpy(out + packed + 2, raw + 2 * literal, 2 * (i - literal));
+			packed += 2 + 2 * (i - literal);
+		}
+		if (run)
+		{
+			if (packed + 4 > size)
+			{
+				fits = false;
+				break;
+			}
+			target_buffer_set_u16(target, out + packed, 0x8000 | run);
+			memcpy(out + packed + 2, raw + 2 * i, 2);
+			packed += 4;
+			i += run;
+		}
+		literal = i;
+	}
+
+	if (!fits)
+	{
+		// Packing did not pay; send the chunk as it is.
+		target_buffer_set_u16(target, out, count);
+		memcpy(out + 2, raw, size);
+		return size + 2;
+	}
+
+	return packed;
+}
+
+// This is a helper function for the write function which follows.
+//  Getting write right can also take a lot of time and playing
+//  around with a new chip. 
+// The key idea is that code to be programmed into the chip is placed
+//  in a buffer in on-chip sram. A routine to do the programming is
+//  loaded into on-chip sram as well. The controlling function starts the
+//  programming code and keeps the buffer full. This is much faster than
+//  trying to program each word individually. Studying this code carefully
+//  is well worth while.
+// The buffer is used as a ring (fifo). The first two words of the working
+//  area hold a write pointer (wp, owned by the host) and a read pointer (rp,
+//  owned by the target); the data follows. The algorithm is started
+//  asynchronously, so while the target is programming one part of the ring
+//  the host is already refilling another part. The host writing a wp of 0
+//  tells the target to give up, and the target writing an rp of 0 tells the
+//  host that programming failed.
+// The data is pulled from the source as the ring empties, never more at a
+//  time than the ring holds. The source isn't touched before the working
+//  areas are there, so after ERROR_TARGET_RESOURCE_NOT_AVAILABLE the
+//  caller can still take the whole image from it.
+// The write is split in three so that the gang write further down can keep
+//  the loaders of several targets going at once: stm32x_write_job_start
+//  gets the loader running, stm32x_write_job_service tops up the ring once
+//  and stm32x_write_job_finish waits for the loader and checks the result.
+//  stm32x_write_block just does the three for one bank.
+// Sectors whose erase was put off (see stm32x_erase) are erased as the
+//  write gets to them. fence is how much of the data may be handed to the
+//  target before the next of them, fence_sector. The host goes on filling
+//  the ring past the fence, but wp, which the target sees, stays at the
+//  fence until that sector is erased. wp_fill is where the host writes next.
+struct stm32x_write_job
+{
+	struct flash_bank *bank;
+	struct stm32x_source *data;
+	uint32_t offset;
+	uint32_t count;
+	uint32_t bytes_left;
+	struct working_area *source;
+	uint32_t fifo_start;
+	uint32_t fifo_end;
+	uint32_t wp;
+	uint32_t wp_fill;
+	uint8_t *chunk;
+	bool packed;
+	uint8_t *pending;	// packed data not yet in the ring
+	uint32_t pending_size;
+	uint32_t pending_pos;
+	uint32_t sent;		// bytes put in the ring
+	uint32_t published;	// bytes up to wp
+	uint32_t fence;
+	int fence_sector;
+	bool loader_ready;	// past the loader's own write to CR
+	struct stm32x_erase_job erase;
+	struct reg_param reg_params[5];
+	struct armv7m_algorithm armv7m_info;
+	long long last_progress;
+	bool done;
+	struct duration phase_time;
+	int previous_phase;
+};
+
+// Finds the first sector the job still has to erase, and the fence in front
+//  of it. Without one the fence is the end of the data.
+static void stm32x_write_job_fence(struct stm32x_write_job *job)
+{
+	struct flash_bank *bank = job->bank;
+	int i, last;
+
+	job->fence = job->count * 2;
+	job->fence_sector = -1;
+
+	if ((job->erase.pending == NULL) ||
+			!stm32x_sector_span(bank, job->offset, job->count * 2, &i, &last))
+		return;
+
+	for (; i <= last; i++)
+	{
+		uint32_t start = bank->sectors[i].offset;
+
+		if (!job->erase.pending[i])
+			continue;
+
+		job->fence = (start > job->offset) ? start - job->offset : 0;
+		job->fence_sector = i;
+		return;
+	}
+}
+
+// Gets the loader going for count half-words at offset. On success the job
+//  is running and has to be finished with stm32x_write_job_finish; on
+//  failure everything is cleaned up already.
+static int stm32x_write_job_start(struct stm32x_write_job *job,
+		struct flash_bank *bank, struct stm32x_source *data,
+		uint32_t offset, uint32_t count)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+	struct target *target = bank->target;
+	uint32_t buffer_size, chunk_size;
+	struct working_area *source;
+	uint32_t address = bank->base + offset;
+	struct reg_param *reg_params = job->reg_params;
+	struct duration phase_time;
+	int previous_phase;
+	int retval = ERROR_OK;
+
+	/* see contib/loaders/flash/stm32x.s for src */
+	// This is a very nice piece of documentation. Not all drivers provide
+	//  it. It's the source program for the assembly code that follows.
+	// Parameters:
+	//  r0 - flash controller base (in), flash status (out)
+	//  r1 - count of half-words to program
+	//  r2 - fifo start (wp at +0, rp at +4, data from +8)
+	//  r3 - fifo end
+	//  r4 - flash address to program
+	// r5 and r6 are used as scratch (rp and data).
+
+	static const uint8_t stm32x_flash_write_code[] = {
+									/* #define STM32_FLASH_SR_OFFSET	0x0C */
+									/* #define STM32_FLASH_CR_OFFSET	0x10 */
+									/* wait_fifo: */
+		0x16, 0x68,					/* ldr	r6, [r2, #0x00] */
+		0x00, 0x2e,					/* cmp	r6, #0x00 */
+		0x19, 0xd0,					/* beq	exit */
+		0x55, 0x68,					/* ldr	r5, [r2, #0x04] */
+		0xb5, 0x42,					/* cmp	r5, r6 */
+		0xf9, 0xd0,					/* beq	wait_fifo */
+		0x01, 0x26,					/* movs	r6, #0x01 */
+		0x06, 0x61,					/* str	r6, [r0, #STM32_FLASH_CR_OFFSET] */
+		0x35, 0xf8, 0x02, 0x6b,		/* ldrh	r6, [r5], #0x02 */
+		0x24, 0xf8, 0x02, 0x6b,		/* strh	r6, [r4], #0x02 */
+									/* busy: */
+		0xc6, 0x68,					/* ldr	r6, [r0, #STM32_FLASH_SR_OFFSET] */
+		0x16, 0xf0, 0x01, 0x0f,		/* tst	r6, #0x01 */
+		0xfb, 0xd1,					/* bne	busy */
+		0x16, 0xf0, 0x14, 0x0f,		/* tst	r6, #0x14 */
+		0x07, 0xd1,					/* bne	error */
+		0x9d, 0x42,					/* cmp	r5, r3 */
+		0x28, 0xbf,					/* it	cs */
+		0x02, 0xf1, 0x08, 0x05,		/* addcs	r5, r2, #0x08 */
+		0x55, 0x60,					/* str	r5, [r2, #0x04] */
+		0x49, 0x1e,					/* subs	r1, r1, #0x01 */
+		0xe5, 0xd1,					/* bne	wait_fifo */
+		0x01, 0xe0,					/* b	exit */
+									/* error: */
+		0x00, 0x25,					/* movs	r5, #0x00 */
+		0x55, 0x60,					/* str	r5, [r2, #0x04] */
+									/* exit: */
+		0x30, 0x46,					/* mov	r0, r6 */
+		0x00, 0xbe,					/* bkpt	#0x00 */
+	};
+
+	// This is a faster version of the same loader with the same parameters.
+	//  PG is set once for the whole run instead of for every half-word, and
+	//  rp is only moved on after a block of up to 32 half-words (or up to the
+	//  end of the ring). The inner loop is unrolled once, and the sticky
+	//  PGERR/WRPRTERR flags are checked once per block rather than after
+	//  every half-word. The stm32x can only program half-words, so this is
+	//  as wide as the loop can get. stm32x_probe decides which one is used.
+	// r7 is used as scratch as well (the end of the block).
+
+	static const uint8_t stm32x_flash_write_fast_code[] = {
+									/* #define STM32_FLASH_SR_OFFSET	0x0C */
+									/* #define STM32_FLASH_CR_OFFSET	0x10 */
+									/* start: */
+		0x01, 0x26,					/* movs	r6, #0x01 */
+		0x06, 0x61,					/* str	r6, [r0, #STM32_FLASH_CR_OFFSET] */
+									/* wait_fifo: */
+		0x16, 0x68,					/* ldr	r6, [r2, #0x00] */
+		0x00, 0x2e,					/* cmp	r6, #0x00 */
+		0x2f, 0xd0,					/* beq	exit */
+		0x55, 0x68,					/* ldr	r5, [r2, #0x04] */
+		0x77, 0x1b,					/* subs	r7, r6, r5 */
+		0xf9, 0xd0,					/* beq	wait_fifo */
+		0x38, 0xbf,					/* it	cc */
+		0x5f, 0x1b,					/* subcc	r7, r3, r5 */
+		0x40, 0x2f,					/* cmp	r7, #0x40 */
+		0x88, 0xbf,					/* it	hi */
+		0x40, 0x27,					/* movhi	r7, #0x40 */
+		0xb7, 0xeb, 0x41, 0x0f,		/* cmp	r7, r1, lsl #1 */
+		0x88, 0xbf,					/* it	hi */
+		0x4f, 0x00,					/* lslhi	r7, r1, #1 */
+		0xa1, 0xeb, 0x57, 0x01,		/* sub	r1, r1, r7, lsr #1 */
+		0x2f, 0x44,					/* add	r7, r7, r5 */
+									/* program: */
+		0x35, 0xf8, 0x02, 0x6b,		/* ldrh	r6, [r5], #0x02 */
+		0x24, 0xf8, 0x02, 0x6b,		/* strh	r6, [r4], #0x02 */
+									/* busy1: */
+		0xc6, 0x68,					/* ldr	r6, [r0, #STM32_FLASH_SR_OFFSET] */
+		0x16, 0xf0, 0x01, 0x0f,		/* tst	r6, #0x01 */
+		0xfb, 0xd1,					/* bne	busy1 */
+		0xbd, 0x42,					/* cmp	r5, r7 */
+		0x09, 0xd0,					/* beq	block_done */
+		0x35, 0xf8, 0x02, 0x6b,		/* ldrh	r6, [r5], #0x02 */
+		0x24, 0xf8, 0x02, 0x6b,		/* strh	r6, [r4], #0x02 */
+									/* busy2: */
+		0xc6, 0x68,					/* ldr	r6, [r0, #STM32_FLASH_SR_OFFSET] */
+		0x16, 0xf0, 0x01, 0x0f,		/* tst	r6, #0x01 */
+		0xfb, 0xd1,					/* bne	busy2 */
+		0xbd, 0x42,					/* cmp	r5, r7 */
+		0xeb, 0xd1,					/* bne	program */
+									/* block_done: */
+		0x16, 0xf0, 0x14, 0x0f,		/* tst	r6, #0x14 */
+		0x07, 0xd1,					/* bne	error */
+		0x9d, 0x42,					/* cmp	r5, r3 */
+		0x28, 0xbf,					/* it	cs */
+		0x02, 0xf1, 0x08, 0x05,		/* addcs	r5, r2, #0x08 */
+		0x55, 0x60,					/* str	r5, [r2, #0x04] */
+		0x00, 0x29,					/* cmp	r1, #0x00 */
+		0xcf, 0xd1,					/* bne	wait_fifo */
+		0x01, 0xe0,					/* b	exit */
+									/* error: */
+		0x00, 0x25,					/* movs	r5, #0x00 */
+		0x55, 0x60,					/* str	r5, [r2, #0x04] */
+									/* exit: */
+		0x00, 0x25,					/* movs	r5, #0x00 */
+		0x05, 0x61,					/* str	r5, [r0, #STM32_FLASH_CR_OFFSET] */
+		0x30, 0x46,					/* mov	r0, r6 */
+		0x00, 0xbe,					/* bkpt	#0x00 */
+	};
+
+	// This one takes the image packed (see stm32x_pack_chunk) and unpacks
+	//  it as it programs, again with PG set once for the whole run. The
+	//  parameters are the same, r1 still counting the half-words that end
+	//  up in flash rather than what goes through the ring. Each half-word
+	//  taken from the ring moves rp on right away. A run of 0xffff is not
+	//  programmed at all; the address just moves past it, which is only
+	//  right because the flash has been erased before a write.
+	// r7 holds what is left of the current record, r8 is scratch. get is
+	//  called with bl and returns the next half-word of the ring in r6.
+
+	static const uint8_t stm32x_flash_write_packed_code[] = {
+									/* #define STM32_FLASH_SR_OFFSET	0x0C */
+									/* #define STM32_FLASH_CR_OFFSET	0x10 */
+									/* start: */
+		0x01, 0x26,					/* movs	r6, #0x01 */
+		0x06, 0x61,					/* str	r6, [r0, #STM32_FLASH_CR_OFFSET] */
+		0x55, 0x68,					/* ldr	r5, [r2, #0x04] */
+									/* next_record: */
+		0x00, 0x29,					/* cmp	r1, #0x00 */
+		0x3d, 0xd0,					/* beq	exit */
+		0x00, 0xf0, 0x2d, 0xf8,		/* bl	get */
+		0x77, 0x04,					/* lsls	r7, r6, #17 */
+		0x7f, 0x0c,					/* lsrs	r7, r7, #17 */
+		0x16, 0xf4, 0x00, 0x4f,		/* tst	r6, #0x8000 */
+		0x0f, 0xd1,					/* bne	run */
+									/* literal: */
+		0x00, 0xf0, 0x26, 0xf8,		/* bl	get */
+		0x24, 0xf8, 0x02, 0x6b,		/* strh	r6, [r4], #0x02 */
+									/* literal_busy: */
+		0xd0, 0xf8, 0x0c, 0x80,		/* ldr	r8, [r0, #STM32_FLASH_SR_OFFSET] */
+		0x18, 0xf0, 0x01, 0x0f,		/* tst	r8, #0x01 */
+		0xfa, 0xd1,					/* bne	literal_busy */
+		0x18, 0xf0, 0x14, 0x0f,		/* tst	r8, #0x14 */
+		0x28, 0xd1,					/* bne	error */
+		0x49, 0x1e,					/* subs	r1, r1, #0x01 */
+		0x7f, 0x1e,					/* subs	r7, r7, #0x01 */
+		0xf0, 0xd1,					/* bne	literal */
+		0xe6, 0xe7,					/* b	next_record */
+									/* run: */
+		0x00, 0xf0, 0x16, 0xf8,		/* bl	get */
+		0x4f, 0xf6, 0xff, 0x78,		/* movw	r8, #0xffff */
+		0x46, 0x45,					/* cmp	r6, r8 */
+		0x03, 0xd1,					/* bne	run_program */
+		0x04, 0xeb, 0x47, 0x04,		/* add	r4, r4, r7, lsl #1 */
+		0xc9, 0x1b,					/* subs	r1, r1, r7 */
+		0xdc, 0xe7,					/* b	next_record */
+									/* run_program: */
+		0x24, 0xf8, 0x02, 0x6b,		/* strh	r6, [r4], #0x02 */
+									/* run_busy: */
+		0xd0, 0xf8, 0x0c, 0x80,		/* ldr	r8, [r0, #STM32_FLASH_SR_OFFSET] */
+		0x18, 0xf0, 0x01, 0x0f,		/* tst	r8, #0x01 */
+		0xfa, 0xd1,					/* bne	run_busy */
+		0x18, 0xf0, 0x14, 0x0f,		/* tst	r8, #0x14 */
+		0x10, 0xd1,					/* bne	error */
+		0x49, 0x1e,					/* subs	r1, r1, #0x01 */
+		0x7f, 0x1e,					/* subs	r7, r7, #0x01 */
+		0xf2, 0xd1,					/* bne	run_program */
+		0xce, 0xe7,					/* b	next_record */
+									/* get: */
+		0x16, 0x68,					/* ldr	r6, [r2, #0x00] */
+		0x00, 0x2e,					/* cmp	r6, #0x00 */
+		0x0b, 0xd0,					/* beq	exit */
+		0xb5, 0x42,					/* cmp	r5, r6 */
+		0xfa, 0xd0,					/* beq	get */
+		0x35, 0xf8, 0x02, 0x6b,		/* ldrh	r6, [r5], #0x02 */
+		0x9d, 0x42,					/* cmp	r5, r3 */
+		0x28, 0xbf,					/* it	cs */
+		0x02, 0xf1, 0x08, 0x05,		/* addcs	r5, r2, #0x08 */
+		0x55, 0x60,					/* str	r5, [r2, #0x04] */
+		0x70, 0x47,					/* bx	lr */
+									/* error: */
+		0x00, 0x25,					/* movs	r5, #0x00 */
+		0x55, 0x60,					/* str	r5, [r2, #0x04] */
+									/* exit: */
+		0x00, 0x25,					/* movs	r5, #0x00 */
+		0x05, 0x61,					/* str	r5, [r0, #STM32_FLASH_CR_OFFSET] */
+		0xc0, 0x68,					/* ldr	r0, [r0, #STM32_FLASH_SR_OFFSET] */
+		0x00, 0xbe,					/* bkpt	#0x00 */
+	};
+
+	const uint8_t *write_code = stm32x_flash_write_code;
+	uint32_t write_code_size = sizeof(stm32x_flash_write_code);
+	if (stm32x_info->fast_write)
+	{
+		write_code = stm32x_flash_write_fast_code;
+		write_code_size = sizeof(stm32x_flash_write_fast_code);
+	}
+	// Packing needs PG set once as well, so parts that want the classic
+	//  loader get the plain stream.
+	if (stm32x_info->fast_write && stm32x_info->compressed_write)
+	{
+		write_code = stm32x_flash_write_packed_code;
+		write_code_size = sizeof(stm32x_flash_write_packed_code);
+
+		// The packed loader moves rp before it programs, so rp doesn't tell
+		//  when a sector ahead may be erased; erase them all up front.
+		retval = stm32x_erase_flush(bank, offset, count * 2);
+		if (retval != ERROR_OK)
+			return retval;
+	}
+
+	// The loader and the fifo stay allocated between calls (see
+	//  stm32x_free_working_areas below), so a program loaded as many small
+	//  pieces pays for the allocation and the upload only once.
+	/* flash write code */
+	if (stm32x_info->write_algorithm == NULL)
+	{
+		previous_phase = stm32x_phase_begin(bank, STM32X_PHASE_ALLOC, &phase_time);
+		if (target_alloc_working_area(target, STM32X_WRITE_AREA_SIZE,
+				&stm32x_info->write_algorithm) != ERROR_OK)
+		{
+			stm32x_phase_end(bank, previous_phase, &phase_time, 0);
+			LOG_WARNING("no working area available, can't do block memory writes");
+			return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+		};
+		stm32x_phase_end(bank, previous_phase, &phase_time, write_code_size);
+
+		previous_phase = stm32x_phase_begin(bank, STM32X_PHASE_UPLOAD, &phase_time);
+		retval = target_write_buffer(target, stm32x_info->write_algorithm->address,
+				write_code_size, (uint8_t*)write_code);
+		stm32x_count(bank, 1, 0, 0);
+		stm32x_phase_end(bank, previous_phase, &phase_time,
+				(retval == ERROR_OK) ? write_code_size : 0);
+		if (retval != ERROR_OK)
+		{
+			stm32x_free_working_areas(bank);
+			return retval;
+		}
+	}
+
+	/* memory buffer */
+	if (stm32x_info->write_buffer == NULL)
+	{
+		previous_phase = stm32x_phase_begin(bank, STM32X_PHASE_ALLOC, &phase_time);
+		if (stm32x_alloc_fifo(bank, &stm32x_info->write_buffer, &buffer_size) != ERROR_OK)
+		{
+			stm32x_phase_end(bank, previous_phase, &phase_time, 0);
+
+			/* if we already allocated the writing code, but failed to get a
+			 * buffer, free the algorithm */
+			stm32x_free_working_areas(bank);
+
+			LOG_WARNING("no large enough working area available, can't do block memory writes");
+			return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+		}
+		stm32x_info->write_buffer_size = buffer_size;
+		stm32x_phase_end(bank, previous_phase, &phase_time, buffer_size);
+	}
+
+	source = stm32x_info->write_buffer;
+	buffer_size = stm32x_info->write_buffer_size;
+
+	memset(job, 0, sizeof(*job));
+	job->bank = bank;
+	job->data = data;
+	job->offset = offset;
+	job->count = count;
+	job->bytes_left = count * 2;
+	job->source = source;
+	job->packed = (write_code == stm32x_flash_write_packed_code);
+	job->erase.bank = bank;
+	job->erase.pending = stm32x_info->erase_pending;
+	job->loader_ready = !stm32x_info->fast_write;
+	stm32x_write_job_fence(job);
+
+	// From here on the time is charged to programming.
+	job->previous_phase = stm32x_phase_begin(bank, STM32X_PHASE_PROGRAM, &job->phase_time);
+
+	// The host side copy of what goes into the ring next. Packed, it holds
+	//  the raw chunk, which may be larger than a small ring.
+	chunk_size = buffer_size;
+	if (job->packed && (chunk_size < STM32X_PACK_CHUNK))
+		chunk_size = STM32X_PACK_CHUNK;
+	job->chunk = malloc(chunk_size);
+	if (job->chunk == NULL)
+	{
+		retval = ERROR_FAIL;
+		goto fail;
+	}
+
+	// pending is what the raw chunk packed into.
+	if (job->packed)
+	{
+		job->pending = malloc(STM32X_PACK_CHUNK + 2);
+		if (job->pending == NULL)
+		{
+			retval = ERROR_FAIL;
+			goto fail;
+		}
+	}
+
+	// The ring starts out empty: both pointers at the start of the data.
+	job->fifo_start = source->address + 8;
+	job->fifo_end = source->address + buffer_size;
+	job->wp = job->fifo_start;
+	job->wp_fill = job->fifo_start;
+	uint8_t fifo_header[8];
+
+	buf_set_u32(fifo_header, 0, 32, job->wp);
+	buf_set_u32(fifo_header + 4, 0, 32, job->fifo_start);
+	retval = target_write_buffer(target, source->address,
+			sizeof(fifo_header), fifo_header);
+	stm32x_count(bank, 1, 0, 0);
+	if (retval != ERROR_OK)
+		goto fail;
+
+	// I do not know exactly how the following code works. The effect seems to
+	//  be to allow placing specific values in specific registers for the call to the
+	//  assembly language routine that writes memory segments. A structure with an
+	//  entry for each register seems to be created.
+
+	job->armv7m_info.common_magic = ARMV7M_COMMON_MAGIC;
+	job->armv7m_info.core_mode = ARMV7M_MODE_ANY;
+
+	init_reg_param(&reg_params[0], "r0", 32, PARAM_IN_OUT);
+	init_reg_param(&reg_params[1], "r1", 32, PARAM_OUT);
+	init_reg_param(&reg_params[2], "r2", 32, PARAM_OUT);
+	init_reg_param(&reg_params[3], "r3", 32, PARAM_OUT);
+	init_reg_param(&reg_params[4], "r4", 32, PARAM_OUT);
+
+	buf_set_u32(reg_params[0].value, 0, 32,
+			stm32x_get_flash_reg(bank, STM32_FLASH_BASE));
+	buf_set_u32(reg_params[1].value, 0, 32, count);
+	buf_set_u32(reg_params[2].value, 0, 32, source->address);
+	buf_set_u32(reg_params[3].value, 0, 32, job->fifo_end);
+	buf_set_u32(reg_params[4].value, 0, 32, address);
+
+	// Unlike target_run_algorithm, target_start_algorithm returns as soon
+	//  as the target is running. The matching target_wait_algorithm in
+	//  stm32x_write_job_finish collects the result.
+	stm32x_count(bank, 0, 0, 1);
+	if ((retval = target_start_algorithm(target, 0, NULL, 5, reg_params,
+			stm32x_info->write_algorithm->address, 0, &job->armv7m_info)) != ERROR_OK)
+	{
+		LOG_ERROR("error starting stm32x flash write algorithm");
+		destroy_reg_param(&reg_params[0]);
+		destroy_reg_param(&reg_params[1]);
+		destroy_reg_param(&reg_params[2]);
+		destroy_reg_param(&reg_params[3]);
+		destroy_reg_param(&reg_params[4]);
+		goto fail;
+	}
+
+	job->last_progress = timeval_ms();
+
+	return ERROR_OK;
+
+fail:
+	// After a failure nothing is assumed about the state of the loader.
+	stm32x_free_working_areas(bank);
+	free(job->chunk);
+	job->chunk = NULL;
+	free(job->pending);
+	job->pending = NULL;
+	stm32x_phase_end(bank, job->previous_phase, &job->phase_time, 0);
+
+	return retval;
+}
+
+// Tops up the ring of a running job once. progress tells whether anything
+//  went into the ring or an erase ahead of the data moved on; when the ring
+//  is full there is nothing to do until the target has programmed some of
+//  it. The job is done when all of the data is handed to the target or the
+//  loader has given up.
+// The erase of the sector at the fence is started once the loader has
+//  programmed everything before it (rp is moved only after the half-word is
+//  programmed); the loader just finds an empty ring meanwhile.
+static int stm32x_write_job_service(struct stm32x_write_job *job, bool *progress)
+{
+	struct flash_bank *bank = job->bank;
+	struct target *target = bank->target;
+	uint32_t rp;
+	int retval;
+
+	*progress = false;
+
+	retval = target_read_u32(target, job->source->address + 4, &rp);
+	stm32x_count(bank, 1, 1, 0);
+	if (retval != ERROR_OK)
+		return retval;
+
+	/* the algorithm clears rp if programming failed */
+	if (rp == 0)
+	{
+		job->done = true;
+		return ERROR_OK;
+	}
+
+	if (job->erase.busy)
+	{
+		retval = stm32x_erase_job_poll(&job->erase);
+		if (retval != ERROR_OK)
+			return retval;
+
+		if (!job->erase.busy)
+		{
+			/* the page erase cleared PG, which the fast loader sets only once */
+			retval = target_write_u32(target,
+					stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_PG);
+			stm32x_count(bank, 1, 0, 0);
+			if (retval != ERROR_OK)
+				return retval;
+
+			stm32x_write_job_fence(job);
+			*progress = true;
+		}
+	}
+	else if ((job->fence_sector >= 0) && (job->published == job->fence) && (rp == job->wp))
+	{
+		// The fast loader sets PG once as it starts; CR must not be written
+		//  while the erase is busy, so the erase waits until that is done.
+		if (!job->loader_ready)
+		{
+			uint32_t cr;
+
+			retval = target_read_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), &cr);
+			stm32x_count(bank, 1, 1, 0);
+			if (retval != ERROR_OK)
+				return retval;
+			job->loader_ready = (cr & FLASH_PG) != 0;
+		}
+
+		if (job->loader_ready)
+		{
+			retval = stm32x_erase_job_start_sector(&job->erase, job->fence_sector);
+			if (retval != ERROR_OK)
+				return retval;
+			*progress = true;
+		}
+	}
+
+	/* free space up to the end of the ring or up to rp; one half-word
+	 * is always left unused so that wp == rp means "empty" */
+	uint32_t thisrun_bytes;
+	if (rp > job->wp_fill)
+		thisrun_bytes = rp - job->wp_fill - 2;
+	else
+		thisrun_bytes = job->fifo_end - job->wp_fill - ((rp == job->fifo_start) ? 2 : 0);
+
+	const uint8_t *data = job->chunk;
+	if (job->packed && (thisrun_bytes > 0))
+	{
+		// Pack the next part of the image once the last one is in the ring.
+		if ((job->pending_pos == job->pending_size) && (job->bytes_left > 0))
+		{
+			uint32_t raw_bytes = job->bytes_left;
+			if (raw_bytes > STM32X_PACK_CHUNK)
+				raw_bytes = STM32X_PACK_CHUNK;
+
+			retval = job->data->read(job->data, job->chunk, raw_bytes);
+			if (retval != ERROR_OK)
+				return retval;
+
+			job->pending_size = stm32x_pack_chunk(target, job->chunk,
+					raw_bytes, job->pending);
+			job->pending_pos = 0;
+			job->bytes_left -= raw_bytes;
+		}
+
+		if (thisrun_bytes > job->pending_size - job->pending_pos)
+			thisrun_bytes = job->pending_size - job->pending_pos;
+		data = job->pending + job->pending_pos;
+	}
+	else
+	{
+		if (thisrun_bytes > job->bytes_left)
+			thisrun_bytes = job->bytes_left;
+
+		// The target keeps programming what is in the ring meanwhile.
+		if (thisrun_bytes > 0)
+		{
+			retval = job->data->read(job->data, job->chunk, thisrun_bytes);
+			if (retval != ERROR_OK)
+				return retval;
+		}
+	}
+
+	if (thisrun_bytes > 0)
+	{
+		retval = target_write_buffer(target, job->wp_fill, thisrun_bytes, data);
+		stm32x_count(bank, 1, 0, 0);
+		if (retval != ERROR_OK)
+			return retval;
+
+		if (job->packed)
+			job->pending_pos += thisrun_bytes;
+		else
+			job->bytes_left -= thisrun_bytes;
+		job->sent += thisrun_bytes;
+		job->wp_fill += thisrun_bytes;
+		if (job->wp_fill >= job->fifo_end)
+			job->wp_fill = job->fifo_start;
+		*progress = true;
+	}
+
+	// Hand over what is in the ring, up to the fence.
+	uint32_t publish = job->sent;
+	if ((job->fence_sector >= 0) && (publish > job->fence))
+		publish = job->fence;
+
+	if (publish > job->published)
+	{
+		job->wp += publish - job->published;
+		if (job->wp >= job->fifo_end)
+			job->wp -= job->fifo_end - job->fifo_start;
+		job->published = publish;
+
+		retval = target_write_u32(target, job->source->address, job->wp);
+		stm32x_count(bank, 1, 0, 0);
+		if (retval != ERROR_OK)
+			return retval;
+		*progress = true;
+	}
+
+	if (!*progress)
+	{
+		if (timeval_ms() - job->last_progress > 10000)
+		{
+			LOG_ERROR("timed out waiting for stm32x flash write algorithm");
+			return ERROR_TARGET_TIMEOUT;
+		}
+		return ERROR_OK;
+	}
+
+	job->last_progress = timeval_ms();
+	if ((job->bytes_left == 0) && (job->pending_pos == job->pending_size) &&
+			(job->published == job->sent))
+		job->done = true;
+
+	return ERROR_OK;
+}
+
+// Ends a running job. retval is how the servicing went; anything but
+//  ERROR_OK stops the loader first. Returns the result of the whole write.
+static int stm32x_write_job_finish(struct stm32x_write_job *job, int retval)
+{
+	struct flash_bank *bank = job->bank;
+	struct target *target = bank->target;
+	struct reg_param *reg_params = job->reg_params;
+
+	if (retval != ERROR_OK)
+	{
+		// a page erase ahead of the data is let finish first
+		if (job->erase.busy)
+			stm32x_wait_status_busy(bank, FLASH_ERASE_TIME, FLASH_ERASE_TIMEOUT);
+
+		/* tell the algorithm to give up; it stops at its next fifo check */
+		target_write_u32(target, job->source->address, 0);
+	}
+
+	// Everything has been handed over to the target; wait for it to
+	//  finish programming what is still sitting in the ring.
+	int retval2 = target_wait_algorithm(target, 0, NULL, 5, reg_params,
+			0, 10000, &job->armv7m_info);
+	if (retval2 != ERROR_OK)
+	{
+		LOG_ERROR("error waiting for stm32x flash write algorithm");
+		if (retval == ERROR_OK)
+			retval = retval2;
+	}
+
+	if (retval == ERROR_OK)
+	{
+		uint32_t status = buf_get_u32(reg_params[0].value, 0, 32);
+
+		if (status & FLASH_PGERR)
+		{
+			LOG_ERROR("flash memory not erased before writing");
+			/* Clear but report errors */
+			target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_SR), FLASH_PGERR);
+			retval = ERROR_FAIL;
+		}
+
+		if (status & FLASH_WRPRTERR)
+		{
+			LOG_ERROR("flash memory write protected");
+			/* Clear but report errors */
+			target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_SR), FLASH_WRPRTERR);
+			retval = ERROR_FAIL;
+		}
+	}
+
+	destroy_reg_param(&reg_params[0]);
+	destroy_reg_param(&reg_params[1]);
+	destroy_reg_param(&reg_params[2]);
+	destroy_reg_param(&reg_params[3]);
+	destroy_reg_param(&reg_params[4]);
+
+	// After a failure nothing is assumed about the state of the loader. If the
+	//  working areas are backed up the cache is not used at all, since the
+	//  backup would otherwise be restored when the target is already running.
+	if ((retval != ERROR_OK) || target->backup_working_area)
+		stm32x_free_working_areas(bank);
+
+	free(job->chunk);
+	job->chunk = NULL;
+	free(job->pending);
+	job->pending = NULL;
+
+	stm32x_mark_written(bank, job->offset, job->count * 2);
+
+	if (job->packed)
+		LOG_DEBUG("stm32x packed write: %u bytes sent for %u",
+				(unsigned)job->sent, (unsigned)(job->count * 2));
+
+	stm32x_phase_end(bank, job->previous_phase, &job->phase_time,
+			(retval == ERROR_OK) ? job->count * 2 : 0);
+
+	return retval;
+}
+
+static int stm32x_write_block(struct flash_bank *bank, struct stm32x_source *data,
+		uint32_t offset, uint32_t count)
+{
+	struct stm32x_write_job job;
+	bool progress;
+
+	int retval = stm32x_write_job_start(&job, bank, data, offset, count);
+	if (retval != ERROR_OK)
+		return retval;
+
+	while (!job.done)
+	{
+		retval = stm32x_write_job_service(&job, &progress);
+		if (retval != ERROR_OK)
+			break;
+		if (!progress)
+			keep_alive();
+	}
+
+	return stm32x_write_job_finish(&job, retval);
+}
+
+// Block write for the two banks of an XL density part at the same time.
+//  Each bank has its own flash controller, so while one of them programs a
+//  half-word the other one can program one too. The loader keeps both
+//  controllers busy from two rings in one working area; each ring works
+//  like the one of stm32x_write_block, with its own write and read pointer.
+//  bank0 has to be the bank using the bank 0 registers and bank1 its
+//  partner; the counts are in half-words. The flash has to be unlocked.
+static int stm32x_write_block_dual(struct flash_bank *bank0, uint8_t *buffer0,
+		uint32_t offset0, uint32_t count0, struct flash_bank *bank1,
+		uint8_t *buffer1, uint32_t offset1, uint32_t count1)
+{
+	struct target *target = bank0->target;
+	uint32_t buffer_size;
+	struct working_area *dual_algorithm;
+	struct working_area *source;
+	struct reg_param reg_params[9];
+	struct armv7m_algorithm armv7m_info;
+	struct duration phase_time;
+	int previous_phase;
+	int retval;
+	int k;
+
+	// Parameters:
+	//  r0 - bank 0 flash controller base (in), flash status (out)
+	//  r1 - count of half-words for bank 0
+	//  r2 - bank 0 ring (wp at +0, rp at +4, data from +8)
+	//  r3 - bank 0 ring end
+	//  r4 - bank 0 flash address
+	//  r5 - r8 - the same for bank 1
+	// r9 - r12 are used as scratch. The loop visits the banks in turn and
+	//  programs a half-word on each one that is idle and has data waiting.
+	//  As in the other loaders a wp of 0 aborts, and on an error the rp of
+	//  the failing bank's ring is cleared. Both controllers are idle again
+	//  before PG is cleared at the exit.
+	static const uint8_t stm32x_flash_write_dual_code[] = {
+									/* #define STM32_FLASH_SR_OFFSET	0x0C */
+									/* #define STM32_FLASH_CR_OFFSET	0x10 */
+									/* #define STM32_FLASH_SR_B1_OFFSET	0x4C */
+									/* #define STM32_FLASH_CR_B1_OFFSET	0x50 */
+									/* dual_write: */
+		0x4f, 0xf0, 0x01, 0x09,		/* mov	r9, #0x01 */
+		0xc0, 0xf8, 0x10, 0x90,		/* str	r9, [r0, #STM32_FLASH_CR_OFFSET] */
+		0xc0, 0xf8, 0x50, 0x90,		/* str	r9, [r0, #STM32_FLASH_CR_B1_OFFSET] */
+									/* bank0: */
+		0x00, 0x29,					/* cmp	r1, #0x00 */
+		0x1b, 0xd0,					/* beq	bank1 */
+		0xd0, 0xf8, 0x0c, 0x90,		/* ldr	r9, [r0, #STM32_FLASH_SR_OFFSET] */
+		0x19, 0xf0, 0x01, 0x0f,		/* tst	r9, #0x01 */
+		0x16, 0xd1,					/* bne	bank1 */
+		0x19, 0xf0, 0x14, 0x0f,		/* tst	r9, #0x14 */
+		0x45, 0xd1,					/* bne	error0 */
+		0xd2, 0xf8, 0x00, 0xa0,		/* ldr	r10, [r2, #0x00] */
+		0xba, 0xf1, 0x00, 0x0f,		/* cmp	r10, #0x00 */
+		0x49, 0xd0,					/* beq	exit */
+		0xd2, 0xf8, 0x04, 0xb0,		/* ldr	r11, [r2, #0x04] */
+		0xda, 0x45,					/* cmp	r10, r11 */
+		0x0a, 0xd0,					/* beq	bank1 */
+		0x3b, 0xf8, 0x02, 0xcb,		/* ldrh	r12, [r11], #0x02 */
+		0x24, 0xf8, 0x02, 0xcb,		/* strh	r12, [r4], #0x02 */
+		0x9b, 0x45,					/* cmp	r11, r3 */
+		0x28, 0xbf,					/* it	cs */
+		0x02, 0xf1, 0x08, 0x0b,		/* addcs	r11, r2, #0x08 */
+		0xc2, 0xf8, 0x04, 0xb0,		/* str	r11, [r2, #0x04] */
+		0x49, 0x1e,					/* subs	r1, r1, #0x01 */
+									/* bank1: */
+		0x00, 0x2d,					/* cmp	r5, #0x00 */
+		0x1c, 0xd0,					/* beq	check_done */
+		0xd0, 0xf8, 0x4c, 0x90,		/* ldr	r9, [r0, #STM32_FLASH_SR_B1_OFFSET] */
+		0x19, 0xf0, 0x01, 0x0f,		/* tst	r9, #0x01 */
+		0xda, 0xd1,					/* bne	bank0 */
+		0x19, 0xf0, 0x14, 0x0f,		/* tst	r9, #0x14 */
+		0x2c, 0xd1,					/* bne	error1 */
+		0xd6, 0xf8, 0x00, 0xa0,		/* ldr	r10, [r6, #0x00] */
+		0xba, 0xf1, 0x00, 0x0f,		/* cmp	r10, #0x00 */
+		0x2b, 0xd0,					/* beq	exit */
+		0xd6, 0xf8, 0x04, 0xb0,		/* ldr	r11, [r6, #0x04] */
+		0xda, 0x45,					/* cmp	r10, r11 */
+		0xce, 0xd0,					/* beq	bank0 */
+		0x3b, 0xf8, 0x02, 0xcb,		/* ldrh	r12, [r11], #0x02 */
+		0x28, 0xf8, 0x02, 0xcb,		/* strh	r12, [r8], #0x02 */
+		0xbb, 0x45,					/* cmp	r11, r7 */
+		0x28, 0xbf,					/* it	cs */
+		0x06, 0xf1, 0x08, 0x0b,		/* addcs	r11, r6, #0x08 */
+		0xc6, 0xf8, 0x04, 0xb0,		/* str	r11, [r6, #0x04] */
+		0x6d, 0x1e,					/* subs	r5, r5, #0x01 */
+		0xc2, 0xe7,					/* b	bank0 */
+									/* check_done: */
+		0x00, 0x29,					/* cmp	r1, #0x00 */
+		0xc0, 0xd1,					/* bne	bank0 */
+									/* wait0: */
+		0xd0, 0xf8, 0x0c, 0x90,		/* ldr	r9, [r0, #STM32_FLASH_SR_OFFSET] */
+		0x19, 0xf0, 0x01, 0x0f,		/* tst	r9, #0x01 */
+		0xfa, 0xd1,					/* bne	wait0 */
+		0x19, 0xf0, 0x14, 0x0f,		/* tst	r9, #0x14 */
+		0x08, 0xd1,					/* bne	error0 */
+									/* wait1: */
+		0xd0, 0xf8, 0x4c, 0x90,		/* ldr	r9, [r0, #STM32_FLASH_SR_B1_OFFSET] */
+		0x19, 0xf0, 0x01, 0x0f,		/* tst	r9, #0x01 */
+		0xfa, 0xd1,					/* bne	wait1 */
+		0x19, 0xf0, 0x14, 0x0f,		/* tst	r9, #0x14 */
+		0x05, 0xd1,					/* bne	error1 */
+		0x08, 0xe0,					/* b	exit */
+									/* error0: */
+		0x4f, 0xf0, 0x00, 0x0a,		/* mov	r10, #0x00 */
+		0xc2, 0xf8, 0x04, 0xa0,		/* str	r10, [r2, #0x04] */
+		0x03, 0xe0,					/* b	exit */
+									/* error1: */
+		0x4f, 0xf0, 0x00, 0x0a,		/* mov	r10, #0x00 */
+		0xc6, 0xf8, 0x04, 0xa0,		/* str	r10, [r6, #0x04] */
+									/* exit: */
+		0xd0, 0xf8, 0x0c, 0xa0,		/* ldr	r10, [r0, #STM32_FLASH_SR_OFFSET] */
+		0x1a, 0xf0, 0x01, 0x0f,		/* tst	r10, #0x01 */
+		0xfa, 0xd1,					/* bne	exit */
+									/* exit_b1: */
+		0xd0, 0xf8, 0x4c, 0xa0,		/* ldr	r10, [r0, #STM32_FLASH_SR_B1_OFFSET] */
+		0x1a, 0xf0, 0x01, 0x0f,		/* tst	r10, #0x01 */
+		0xfa, 0xd1,					/* bne	exit_b1 */
+		0x4f, 0xf0, 0x00, 0x0a,		/* mov	r10, #0x00 */
+		0xc0, 0xf8, 0x10, 0xa0,		/* str	r10, [r0, #STM32_FLASH_CR_OFFSET] */
+		0xc0, 0xf8, 0x50, 0xa0,		/* str	r10, [r0, #STM32_FLASH_CR_B1_OFFSET] */
+		0x48, 0x46,					/* mov	r0, r9 */
+		0x00, 0xbe,					/* bkpt	#0x00 */
+	};
+
+	struct flash_bank *banks[2] = { bank0, bank1 };
+	uint8_t *buffers[2] = { buffer0, buffer1 };
+	uint32_t bytes_left[2] = { count0 * 2, count1 * 2 };
+	uint32_t ring[2], ring_start[2], ring_end[2], wp[2];
+	uint8_t ring_header[8];
+
+	previous_phase = stm32x_phase_begin(bank0, STM32X_PHASE_ALLOC, &phase_time);
+	if (stm32x_alloc_aux(target, &dual_algorithm) != ERROR_OK)
+	{
+		stm32x_phase_end(bank0, previous_phase, &phase_time, 0);
+		LOG_DEBUG("no working area for the dual bank write algorithm");
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	}
+	if (stm32x_alloc_fifo(bank0, &source, &buffer_size) != ERROR_OK)
+	{
+		stm32x_phase_end(bank0, previous_phase, &phase_time, 0);
+		target_free_working_area(target, dual_algorithm);
+		LOG_DEBUG("no large enough working area for the dual bank write rings");
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	}
+	stm32x_phase_end(bank0, previous_phase, &phase_time,
+			sizeof(stm32x_flash_write_dual_code) + buffer_size);
+
+	previous_phase = stm32x_phase_begin(bank0, STM32X_PHASE_UPLOAD, &phase_time);
+	retval = target_write_buffer(target, dual_algorithm->address,
+			sizeof(stm32x_flash_write_dual_code), (uint8_t*)stm32x_flash_write_dual_code);
+	stm32x_count(bank0, 1, 0, 0);
+	stm32x_phase_end(bank0, previous_phase, &phase_time,
+			(retval == ERROR_OK) ? sizeof(stm32x_flash_write_dual_code) : 0);
+	if (retval != ERROR_OK)
+		goto cleanup;
+
+	previous_phase = stm32x_phase_begin(bank0, STM32X_PHASE_PROGRAM, &phase_time);
+
+	// The working area is split in two rings of the same size.
+	for (k = 0; k < 2; k++)
+	{
+		ring[k] = source->address + k * (buffer_size / 2);
+		ring_start[k] = ring[k] + 8;
+		ring_end[k] = ring[k] + buffer_size / 2;
+		wp[k] = ring_start[k];
+
+		buf_set_u32(ring_header, 0, 32, wp[k]);
+		buf_set_u32(ring_header + 4, 0, 32, wp[k]);
+		if (retval == ERROR_OK)
+			retval = target_write_buffer(target, ring[k], sizeof(ring_header), ring_header);
+		stm32x_count(bank0, 1, 0, 0);
+	}
+	if (retval != ERROR_OK)
+		goto cleanup_phase;
+
+	armv7m_info.common_magic = ARMV7M_COMMON_MAGIC;
+	armv7m_info.core_mode = ARMV7M_MODE_ANY;
+
+	init_reg_param(&reg_params[0], "r0", 32, PARAM_IN_OUT);
+	init_reg_param(&reg_params[1], "r1", 32, PARAM_OUT);
+	init_reg_param(&reg_params[2], "r2", 32, PARAM_OUT);
+	init_reg_param(&reg_params[3], "r3", 32, PARAM_OUT);
+	init_reg_param(&reg_params[4], "r4", 32, PARAM_OUT);
+	init_reg_param(&reg_params[5], "r5", 32, PARAM_OUT);
+	init_reg_param(&reg_params[6], "r6", 32, PARAM_OUT);
+	init_reg_param(&reg_params[7], "r7", 32, PARAM_OUT);
+	init_reg_param(&reg_params[8], "r8", 32, PARAM_OUT);
+
+	buf_set_u32(reg_params[0].value, 0, 32, STM32_FLASH_BASE);
+	buf_set_u32(reg_params[1].value, 0, 32, count0);
+	buf_set_u32(reg_params[2].value, 0, 32, ring[0]);
+	buf_set_u32(reg_params[3].value, 0, 32, ring_end[0]);
+	buf_set_u32(reg_params[4].value, 0, 32, bank0->base + offset0);
+	buf_set_u32(reg_params[5].value, 0, 32, count1);
+	buf_set_u32(reg_params[6].value, 0, 32, ring[1]);
+	buf_set_u32(reg_params[7].value, 0, 32, ring_end[1]);
+	buf_set_u32(reg_params[8].value, 0, 32, bank1->base + offset1);
+
+	stm32x_count(bank0, 0, 0, 1);
+	if ((retval = target_start_algorithm(target, 0, NULL, 9, reg_params,
+			dual_algorithm->address, 0, &armv7m_info)) != ERROR_OK)
+	{
+		LOG_ERROR("error starting stm32x dual bank write algorithm");
+		goto cleanup_params;
+	}
+
+	// Top up both rings in turn, the same way stm32x_write_block does.
+	long long last_progress = timeval_ms();
+
+	while ((retval == ERROR_OK) && (bytes_left[0] || bytes_left[1]))
+	{
+		bool progress = false;
+
+		for (k = 0; k < 2; k++)
+		{
+			uint32_t rp, thisrun_bytes;
+
+			if (bytes_left[k] == 0)
+				continue;
+
+			retval = target_read_u32(target, ring[k] + 4, &rp);
+			stm32x_count(bank0, 1, 1, 0);
+			if (retval != ERROR_OK)
+				break;
+
+			/* the algorithm clears rp if programming failed */
+			if (rp == 0)
+			{
+				LOG_ERROR("stm32x dual bank write failed in %s", banks[k]->name);
+				retval = ERROR_FLASH_OPERATION_FAILED;
+				break;
+			}
+
+			if (rp > wp[k])
+				thisrun_bytes = rp - wp[k] - 2;
+			else
+				thisrun_bytes = ring_end[k] - wp[k] - ((rp == ring_start[k]) ? 2 : 0);
+			if (thisrun_bytes == 0)
+				continue;
+			if (thisrun_bytes > bytes_left[k])
+				thisrun_bytes = bytes_left[k];
+
+			retval = target_write_buffer(target, wp[k], thisrun_bytes, buffers[k]);
+			stm32x_count(bank0, 1, 0, 0);
+			if (retval != ERROR_OK)
+				break;
+
+			buffers[k] += thisrun_bytes;
+			bytes_left[k] -= thisrun_bytes;
+			wp[k] += thisrun_bytes;
+			if (wp[k] >= ring_end[k])
+				wp[k] = ring_start[k];
+
+			retval = target_write_u32(target, ring[k], wp[k]);
+			stm32x_count(bank0, 1, 0, 0);
+			if (retval != ERROR_OK)
+				break;
+
+			progress = true;
+		}
+
+		if ((retval == ERROR_OK) && !progress)
+		{
+			if (timeval_ms() - last_progress > 10000)
+			{
+				LOG_ERROR("timed out waiting for stm32x dual bank write algorithm");
+				retval = ERROR_TARGET_TIMEOUT;
+				break;
+			}
+			keep_alive();
+		}
+		else
+			last_progress = timeval_ms();
+	}
+
+	if (retval != ERROR_OK)
+	{
+		/* tell the algorithm to give up; it stops at its next ring check */
+		target_write_u32(target, ring[0], 0);
+		target_write_u32(target, ring[1], 0);
+	}
+
+	int retval2 = target_wait_algorithm(target, 0, NULL, 9, reg_params,
+			0, 10000, &armv7m_info);
+	if (retval2 != ERROR_OK)
+	{
+		LOG_ERROR("error waiting for stm32x dual bank write algorithm");
+		if (retval == ERROR_OK)
+			retval = retval2;
+	}
+
+	if ((retval == ERROR_OK) || (retval == ERROR_FLASH_OPERATION_FAILED))
+	{
+		uint32_t status = buf_get_u32(reg_params[0].value, 0, 32);
+
+		if (status & (FLASH_PGERR | FLASH_WRPRTERR))
+		{
+			if (status & FLASH_PGERR)
+				LOG_ERROR("flash memory not erased before writing");
+			if (status & FLASH_WRPRTERR)
+				LOG_ERROR("flash memory write protected");
+
+			/* Clear but report errors */
+			for (k = 0; k < 2; k++)
+				target_write_u32(target, stm32x_get_flash_reg(banks[k], STM32_FLASH_SR),
+						FLASH_PGERR | FLASH_WRPRTERR);
+			retval = ERROR_FAIL;
+		}
+	}
+
+cleanup_params:
+	for (k = 0; k < 9; k++)
+		destroy_reg_param(&reg_params[k]);
+
+cleanup_phase:
+	stm32x_phase_end(bank0, previous_phase, &phase_time,
+			(retval == ERROR_OK) ? (count0 + count1) * 2 : 0);
+
+cleanup:
+	target_free_working_area(target, source);
+	target_free_working_area(target, dual_algorithm);
+
+	return retval;
+}
+
+
+// This is the main programming routine. It uses the helper function above.
+//  The write function at the end of this group decides what reaches it.
+//  The data comes from a source (see struct stm32x_source above);
+//  stm32x_program below is the same thing for a buffer in memory.
+static int stm32x_program_source(struct flash_bank *bank, struct stm32x_source *data,
+		uint32_t offset, uint32_t count)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+	struct target *target = bank->target;
+	uint32_t words_remaining = (count / 2);
+	uint32_t bytes_remaining = (count & 0x00000001);
+	uint32_t address = bank->base + offset;
+	uint32_t bytes_written = 0;
+	struct duration phase_time;
+	int previous_phase;
+	int retval;
+
+	if (bank->target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	if (offset & 0x1)
+	{
+		LOG_WARNING("offset 0x%" PRIx32 " breaks required 2-byte alignment", offset);
+		return ERROR_FLASH_DST_BREAKS_ALIGNMENT;
+	}
+
+	retval = stm32x_unlock(bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	/* multiple half words (2-byte) to be programmed? */
+	if (words_remaining > 0)
+	{
+		/* try using a block write */
+		if ((retval = stm32x_write_block(bank, data, offset, words_remaining)) != ERROR_OK)
+		{
+			if (retval == ERROR_TARGET_RESOURCE_NOT_AVAILABLE)
+			{
+				/* if block write failed (no sufficient working area),
+				 * we use normal (slow) single dword accesses */
+				LOG_WARNING("couldn't use block writes, falling back to single memory accesses");
+			}
+		}
+		else
+		{
+			address += words_remaining * 2;
+			words_remaining = 0;
+		}
+	}
+
+	if ((retval != ERROR_OK) && (retval != ERROR_TARGET_RESOURCE_NOT_AVAILABLE))
+	{
+		stm32x_relock(bank);
+		return retval;
+	}
+
+	if ((words_remaining == 0) && (bytes_remaining == 0))
+	{
+		retval = stm32x_idle(bank);
+		if (retval != ERROR_OK)
+			stm32x_relock(bank);
+		return retval;
+	}
+
+	// Whatever the block write didn't do is programmed without a loader,
+	//  which can't erase ahead.
+	retval = stm32x_erase_flush(bank, address - bank->base,
+			words_remaining * 2 + bytes_remaining);
+	if (retval != ERROR_OK)
+	{
+		stm32x_relock(bank);
+		return retval;
+	}
+
+	previous_phase = stm32x_phase_begin(bank, STM32X_PHASE_PROGRAM, &phase_time);
+
+	// PG stays set, and a batch of half-words goes to the adapter as one
+	//  memory write. Each half-word write stalls the bus until the one
+	//  before is programmed, so SR only needs checking once per batch; its
+	//  error flags are sticky. Parts that need the classic loader also get
+	//  PG set again for every half-word, in the loop after this one.
+	if (stm32x_info->fast_write && (words_remaining > 0))
+	{
+		retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_PG);
+		stm32x_count(bank, 1, 0, 0);
+		if (retval != ERROR_OK)
+			goto done;
+
+		while (words_remaining > 0)
+		{
+			uint8_t batch[STM32X_PROGRAM_BATCH * 2];
+			uint32_t batch_words = words_remaining;
+			if (batch_words > STM32X_PROGRAM_BATCH)
+				batch_words = STM32X_PROGRAM_BATCH;
+
+			retval = data->read(data, batch, batch_words * 2);
+			if (retval != ERROR_OK)
+				goto done;
+
+			retval = target_write_memory(target, address, 2, batch_words, batch);
+			stm32x_count(bank, 1, 0, 0);
+			if (retval != ERROR_OK)
+				goto done;
+
+			retval = stm32x_wait_status_busy(bank, FLASH_PROGRAM_TIME, FLASH_PROGRAM_TIMEOUT);
+			if (retval != ERROR_OK)
+				goto done;
+
+			bytes_written += batch_words * 2;
+			words_remaining -= batch_words;
+			address += batch_words * 2;
+		}
+	}
+
+	while (words_remaining > 0)
+	{
+		uint16_t value;
+		retval = data->read(data, (uint8_t *)&value, sizeof(uint16_t));
+		if (retval != ERROR_OK)
+			goto done;
+
+		retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_PG);
+		if (retval != ERROR_OK)
+			goto done;
+		retval = target_write_u16(target, address, value);
+		if (retval != ERROR_OK)
+			goto done;
+		stm32x_count(bank, 2, 0, 0);
+
+		retval = stm32x_wait_status_busy(bank, FLASH_PROGRAM_TIME, FLASH_PROGRAM_TIMEOUT);
+		if (retval != ERROR_OK)
+			goto done;
+
+		bytes_written += 2;
+		words_remaining--;
+		address += 2;
+	}
+
+	if (bytes_remaining)
+	{
+		uint16_t value = 0xffff;
+		retval = data->read(data, (uint8_t *)&value, bytes_remaining);
+		if (retval != ERROR_OK)
+			goto done;
+
+		retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_PG);
+		if (retval != ERROR_OK)
+			goto done;
+		retval = target_write_u16(target, address, value);
+		if (retval != ERROR_OK)
+			goto done;
+		stm32x_count(bank, 2, 0, 0);
+
+		retval = stm32x_wait_status_busy(bank, FLASH_PROGRAM_TIME, FLASH_PROGRAM_TIMEOUT);
+		if (retval != ERROR_OK)
+			goto done;
+		bytes_written += bytes_remaining;
+	}
+
+	retval = stm32x_idle(bank);
+
+done:
+	if (retval != ERROR_OK)
+		stm32x_relock(bank);
+	stm32x_mark_written(bank, offset, count);
+	stm32x_phase_end(bank, previous_phase, &phase_time, bytes_written);
+
+	return retval;
+}
+
+static int stm32x_program(struct flash_bank *bank, uint8_t *buffer,
+		uint32_t offset, uint32_t count)
+{
+	struct stm32x_source source = { stm32x_buffer_read, buffer, NULL };
+
+	return stm32x_program_source(bank, &source, offset, count);
+}
+
+// Actions for one sector in a differential write.
+#define DIFF_PROGRAM	(1 << 0)
+#define DIFF_ERASE		(1 << 1)
+
+// Differential writes skip the sectors that already hold the right data.
+//  Rewriting a whole image usually changes only a few sectors, and erasing
+//  and programming the rest again is where most of the time goes.
+// Every sector the write touches is checksummed on the chip (see
+//  stm32x_crc_blocks above) and compared with the checksum of the data
+//  wanted there. A sector that matches is left alone, a blank sector is just
+//  programmed, and only a sector that really changed is erased first. This
+//  is meant to be used with a plain "flash write_image" (without the erase
+//  option), otherwise everything is blank by the time it gets here.
+// Sectors which the write only partly covers are read back and merged with
+//  the new data, so that whole sectors are compared and, if a sector has to
+//  be erased, the old data around the new data is put back.
+static int stm32x_write_differential(struct flash_bank *bank, uint8_t *buffer,
+		uint32_t offset, uint32_t count)
+{
+	struct target *target = bank->target;
+	uint32_t end = offset + count;
+	uint32_t start, length, crc, blank_crc;
+	uint32_t *crcs = NULL;
+	uint8_t *image = NULL;
+	uint8_t *action = NULL;
+	int first, last, num_sectors;
+	int unchanged = 0, programmed = 0, erased = 0;
+	int i, j;
+	int retval;
+
+	if (target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	if (count == 0)
+		return ERROR_OK;
+
+	// The span below is clipped to the bank, the copy into image is not.
+	if ((offset >= bank->size) || (count > bank->size - offset))
+		return ERROR_FLASH_DST_OUT_OF_BANK;
+
+	// The sectors are compared as they are now; an erase put off for them
+	//  is done first.
+	retval = stm32x_erase_flush(bank, offset, count);
+	if (retval != ERROR_OK)
+		return retval;
+
+	// Find the sectors the write touches.
+	if (!stm32x_sector_span(bank, offset, count, &first, &last))
+		return ERROR_FLASH_DST_OUT_OF_BANK;
+
+	num_sectors = last - first + 1;
+	start = bank->sectors[first].offset;
+	length = bank->sectors[last].offset + bank->sectors[last].size - start;
+
+	image = malloc(length);
+	crcs = malloc(num_sectors * sizeof(uint32_t));
+	action = malloc(num_sectors);
+	if ((image == NULL) || (crcs == NULL) || (action == NULL))
+	{
+		retval = ERROR_FAIL;
+		goto done;
+	}
+
+	// Build what the touched sectors should hold when the write is done.
+	if (offset > start)
+	{
+		retval = target_read_buffer(target, bank->base + start, offset - start, image);
+		if (retval != ERROR_OK)
+			goto done;
+	}
+	if (end < start + length)
+	{
+		retval = target_read_buffer(target, bank->base + end,
+				start + length - end, image + (end - start));
+		if (retval != ERROR_OK)
+			goto done;
+	}
+	memcpy(image + (offset - start), buffer, count);
+
+	// All the sectors of an stm32x are the same size.
+	retval = stm32x_crc_blocks(bank, bank->base + start,
+			bank->sectors[first].size, num_sectors, crcs);
+	if (retval == ERROR_TARGET_RESOURCE_NOT_AVAILABLE)
+	{
+		// The sectors are not blank (there is no erase option), so they
+		//  are all erased before the merged image goes back.
+		LOG_WARNING("couldn't checksum sectors, erasing and writing all of them");
+		retval = stm32x_erase_request(bank, first, last);
+		if (retval == ERROR_OK)
+			retval = stm32x_program(bank, image, start, length);
+		if (retval == ERROR_OK)
+			for (i = first; i <= last; i++)
+				bank->sectors[i].is_erased = 0;
+		goto done;
+	}
+	if (retval != ERROR_OK)
+		goto done;
+
+	// The checksum a blank sector would have.
+	uint8_t *blank = malloc(bank->sectors[first].size);
+	if (blank == NULL)
+	{
+		retval = ERROR_FAIL;
+		goto done;
+	}
+	memset(blank, 0xff, bank->sectors[first].size);
+	image_calculate_checksum(blank, bank->sectors[first].size, &blank_crc);
+	free(blank);
+
+	for (i = 0; i < num_sectors; i++)
+	{
+		struct flash_sector *sector = &bank->sectors[first + i];
+
+		image_calculate_checksum(image + (sector->offset - start), sector->size, &crc);
+		if (crc == crcs[i])
+		{
+			action[i] = 0;
+			unchanged++;
+			if (crc == blank_crc)
+				sector->is_erased = 1;
+		}
+		else if (crcs[i] == blank_crc)
+		{
+			action[i] = DIFF_PROGRAM;
+			programmed++;
+		}
+		else
+		{
+			action[i] = DIFF_PROGRAM | DIFF_ERASE;
+			programmed++;
+			erased++;
+		}
+	}
+
+	LOG_INFO("stm32x differential write: %d sectors unchanged, %d to program, %d of them to erase",
+			unchanged, programmed, erased);
+
+	// Erase runs of changed sectors, then program runs of sectors that are
+	//  blank now. Each run is a single algorithm call.
+	for (i = 0; i < num_sectors; i = j)
+	{
+		for (j = i; (j < num_sectors) && (action[j] & DIFF_ERASE); j++)
+			;
+		if (j == i)
+		{
+			j++;
+			continue;
+		}
+		retval = stm32x_erase_request(bank, first + i, first + j - 1);
+		if (retval != ERROR_OK)
+			goto done;
+	}
+
+	for (i = 0; i < num_sectors; i = j)
+	{
+		for (j = i; (j < num_sectors) && (action[j] & DIFF_PROGRAM); j++)
+			;
+		if (j == i)
+		{
+			j++;
+			continue;
+		}
+		uint32_t run_offset = bank->sectors[first + i].offset;
+		uint32_t run_end = bank->sectors[first + j - 1].offset + bank->sectors[first + j - 1].size;
+		retval = stm32x_program(bank, image + (run_offset - start),
+				run_offset, run_end - run_offset);
+		if (retval != ERROR_OK)
+			goto done;
+		while (i < j)
+			bank->sectors[first + i++].is_erased = 0;
+	}
+
+done:
+	free(action);
+	free(crcs);
+	free(image);
+
+	return retval;
+}
+
+// This is the write function named in the flash_driver structure. It just
+//  picks between a differential and a normal write for the bank.
+static int stm32x_write(struct flash_bank *bank, uint8_t *buffer,
+		uint32_t offset, uint32_t count)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+	int retval;
+
+	if (stm32x_info->differential)
+		retval = stm32x_write_differential(bank, buffer, offset, count);
+	else
+		retval = stm32x_program(bank, buffer, offset, count);
+
+	return stm32x_session_end(bank, retval);
+}
+
+// Runs of erased words shorter than this are sent as they are; see below.
+#define STM32X_RLE_RUN_MIN	8
+
+// read is another standard function. The default one reads the flash over
+//  the debug link where it is mapped, which on some adapters is a lot slower
+//  than a bulk read of sram. Here a small routine copies a window of the
+//  flash into a buffer in sram, and the host reads the buffer.
+// On the way the routine packs the runs of erased (0xFFFFFFFF) words. The
+//  buffer holds records of one header word each: a header with bit 31 set
+//  stands for that many erased words (the low 31 bits), one without it is
+//  followed by that many words as they are. Only runs of STM32X_RLE_RUN_MIN
+//  words or more are packed, so a window never grows by more than a word,
+//  and a mostly blank part costs little more than the headers. Packing can
+//  be turned off with the compressed_read command.
+// The buffer is the block write fifo if that is in sram already, otherwise
+//  the largest one that can be had. Without a working area the default
+//  read is used.
+static int stm32x_read(struct flash_bank *bank, uint8_t *buffer,
+		uint32_t offset, uint32_t count)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+	struct target *target = bank->target;
+	struct working_area *read_algorithm;
+	struct working_area *output = NULL;
+	uint32_t output_size;
+	bool own_output = false;
+	struct reg_param reg_params[4];
+	struct armv7m_algorithm armv7m_info;
+	struct duration phase_time;
+	int previous_phase;
+	uint32_t start = offset & ~3;
+	uint32_t end = (offset + count + 3) & ~3;
+	uint32_t window_words, address;
+	uint8_t *packed = NULL;
+	uint8_t *words = NULL;
+	int retval;
+	int i;
+
+	// Parameters:
+	//  r0 - flash address to start at (in), end of the records (out)
+	//  r1 - number of words
+	//  r2 - where to put the records
+	//  r3 - the shortest run of erased words to pack
+	// r4 to r7 are used as scratch (r7 is the open literal header).
+
+	static const uint8_t stm32x_flash_read_code[] = {
+		0x00, 0x27,					/* movs	r7, #0x00 */
+									/* next: */
+		0x00, 0x29,					/* cmp	r1, #0x00 */
+		0x28, 0xd0,					/* beq	exit */
+		0x00, 0x24,					/* movs	r4, #0x00 */
+		0x05, 0x46,					/* mov	r5, r0 */
+									/* scan: */
+		0x8c, 0x42,					/* cmp	r4, r1 */
+		0x05, 0xd2,					/* bhs	scanned */
+		0x2e, 0x68,					/* ldr	r6, [r5, #0x00] */
+		0x76, 0x1c,					/* adds	r6, r6, #0x01 */
+		0x02, 0xd1,					/* bne	scanned */
+		0x64, 0x1c,					/* adds	r4, r4, #0x01 */
+		0x2d, 0x1d,					/* adds	r5, r5, #0x04 */
+		0xf7, 0xe7,					/* b	scan */
+									/* scanned: */
+		0x9c, 0x42,					/* cmp	r4, r3 */
+		0x08, 0xd3,					/* blo	literal */
+		0x01, 0x26,					/* movs	r6, #0x01 */
+		0xf6, 0x07,					/* lsls	r6, r6, #31 */
+		0x26, 0x43,					/* orrs	r6, r4 */
+		0x16, 0x60,					/* str	r6, [r2, #0x00] */
+		0x12, 0x1d,					/* adds	r2, r2, #0x04 */
+		0x28, 0x46,					/* mov	r0, r5 */
+		0x09, 0x1b,					/* subs	r1, r1, r4 */
+		0x00, 0x27,					/* movs	r7, #0x00 */
+		0xe8, 0xe7,					/* b	next */
+									/* literal: */
+		0x00, 0x2c,					/* cmp	r4, #0x00 */
+		0x00, 0xd1,					/* bne	have_count */
+		0x01, 0x24,					/* movs	r4, #0x01 */
+									/* have_count: */
+		0x00, 0x2f,					/* cmp	r7, #0x00 */
+		0x03, 0xd1,					/* bne	have_header */
+		0x17, 0x46,					/* mov	r7, r2 */
+		0x00, 0x26,					/* movs	r6, #0x00 */
+		0x16, 0x60,					/* str	r6, [r2, #0x00] */
+		0x12, 0x1d,					/* adds	r2, r2, #0x04 */
+									/* have_header: */
+		0x3e, 0x68,					/* ldr	r6, [r7, #0x00] */
+		0x36, 0x19,					/* adds	r6, r6, r4 */
+		0x3e, 0x60,					/* str	r6, [r7, #0x00] */
+		0x09, 0x1b,					/* subs	r1, r1, r4 */
+									/* copy: */
+		0x06, 0x68,					/* ldr	r6, [r0, #0x00] */
+		0x16, 0x60,					/* str	r6, [r2, #0x00] */
+		0x00, 0x1d,					/* adds	r0, r0, #0x04 */
+		0x12, 0x1d,					/* adds	r2, r2, #0x04 */
+		0x64, 0x1e,					/* subs	r4, r4, #0x01 */
+		0xf9, 0xd1,					/* bne	copy */
+		0xd4, 0xe7,					/* b	next */
+									/* exit: */
+		0x10, 0x46,					/* mov	r0, r2 */
+		0x00, 0xbe,					/* bkpt	#0x00 */
+	};
+
+	// The read loader needs the core; a running target is read over the bus.
+	if (target->state != TARGET_HALTED)
+	{
+		LOG_DEBUG("target not halted, using the default read");
+		return default_flash_read(bank, buffer, offset, count);
+	}
+
+	if (count == 0)
+		return ERROR_OK;
+
+	// verify reads back what was written; nothing may be left to erase
+	retval = stm32x_erase_flush(bank, offset, count);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (stm32x_alloc_aux(target, &read_algorithm) != ERROR_OK)
+	{
+		LOG_DEBUG("no working area for the read algorithm, using the default read");
+		return default_flash_read(bank, buffer, offset, count);
+	}
+
+	if (stm32x_info->write_buffer)
+	{
+		output = stm32x_info->write_buffer;
+		output_size = stm32x_info->write_buffer_size;
+	}
+	else
+	{
+		if (stm32x_alloc_fifo(bank, &output, &output_size) != ERROR_OK)
+		{
+			target_free_working_area(target, read_algorithm);
+			LOG_DEBUG("no working area for the read buffer, using the default read");
+			return default_flash_read(bank, buffer, offset, count);
+		}
+		own_output = true;
+	}
+
+	previous_phase = stm32x_phase_begin(bank, STM32X_PHASE_READ, &phase_time);
+
+	// A window of words packs into at most one word more.
+	window_words = output_size / 4 - 1;
+	packed = malloc(output_size);
+	words = malloc(window_words * 4);
+	if ((packed == NULL) || (words == NULL))
+	{
+		retval = ERROR_FAIL;
+		goto cleanup;
+	}
+
+	retval = target_write_buffer(target, read_algorithm->address,
+			sizeof(stm32x_flash_read_code), (uint8_t *)stm32x_flash_read_code);
+	stm32x_count(bank, 1, 0, 0);
+	if (retval != ERROR_OK)
+		goto cleanup;
+
+	armv7m_info.common_magic = ARMV7M_COMMON_MAGIC;
+	armv7m_info.core_mode = ARMV7M_MODE_ANY;
+
+	init_reg_param(&reg_params[0], "r0", 32, PARAM_IN_OUT);
+	init_reg_param(&reg_params[1], "r1", 32, PARAM_OUT);
+	init_reg_param(&reg_params[2], "r2", 32, PARAM_OUT);
+	init_reg_param(&reg_params[3], "r3", 32, PARAM_OUT);
+
+	for (address = start; address < end; address += window_words * 4)
+	{
+		uint32_t num_words = (end - address) / 4;
+		uint32_t packed_size, from, to, first, last;
+
+		if (num_words > window_words)
+			num_words = window_words;
+
+		buf_set_u32(reg_params[0].value, 0, 32, bank->base + address);
+		buf_set_u32(reg_params[1].value, 0, 32, num_words);
+		buf_set_u32(reg_params[2].value, 0, 32, output->address);
+		buf_set_u32(reg_params[3].value, 0, 32,
+				stm32x_info->compressed_read ? STM32X_RLE_RUN_MIN : 0xFFFFFFFF);
+
+		stm32x_count(bank, 0, 0, 1);
+		if ((retval = target_run_algorithm(target, 0, NULL, 4, reg_params,
+				read_algorithm->address, 0, 1000, &armv7m_info)) != ERROR_OK)
+		{
+			LOG_ERROR("error executing stm32x flash read algorithm");
+			break;
+		}
+
+		packed_size = buf_get_u32(reg_params[0].value, 0, 32) - output->address;
+		if (packed_size > output_size)
+		{
+			LOG_ERROR("stm32x flash read algorithm overran its buffer");
+			retval = ERROR_FAIL;
+			break;
+		}
+
+		retval = target_read_buffer(target, output->address, packed_size, packed);
+		stm32x_count(bank, 1, 0, 0);
+		if (retval != ERROR_OK)
+			break;
+
+		// Unpack the records into the window.
+		for (from = 0, to = 0; (from + 4 <= packed_size) && (retval == ERROR_OK); )
+		{
+			uint32_t header = target_buffer_get_u32(target, packed + from);
+			uint32_t length = (header & 0x7FFFFFFF) * 4;
+
+			from += 4;
+			if ((length > num_words * 4 - to) ||
+					(!(header & 0x80000000) && (length > packed_size - from)))
+			{
+				retval = ERROR_FAIL;
+				break;
+			}
+
+			if (header & 0x80000000)
+				memset(words + to, 0xff, length);
+			else
+			{
+				memcpy(words + to, packed + from, length);
+				from += length;
+			}
+			to += length;
+		}
+		if ((retval != ERROR_OK) || (to != num_words * 4))
+		{
+			LOG_ERROR("stm32x flash read algorithm returned bad records");
+			retval = ERROR_FAIL;
+			break;
+		}
+
+		// Only the part of the window that was asked for goes to the caller.
+		first = (address < offset) ? offset : address;
+		last = address + num_words * 4;
+		if (last > offset + count)
+			last = offset + count;
+		memcpy(buffer + (first - offset), words + (first - address), last - first);
+	}
+
+	for (i = 0; i < 4; i++)
+		destroy_reg_param(&reg_params[i]);
+
+cleanup:
+	free(words);
+	free(packed);
+	if (own_output)
+		target_free_working_area(target, output);
+	target_free_working_area(target, read_algorithm);
+
+	stm32x_phase_end(bank, previous_phase, &phase_time,
+			(retval == ERROR_OK) ? count : 0);
+
+	return retval;
+}
+
+// The devices the driver knows about, sorted by device id (the low bits of
+//  DBGMCU_IDCODE) so the probe and the info function can find them with a
+//  binary search. To support a new variant, add a line here.
+//	page_size and ppage_size are the erase page size and the number of pages
+//	    covered by one write protection bit.
+//	default_size is the flash size in kbytes assumed when the flash size
+//	    register can't be read, as on some early silicon.
+//	classic_write_rev is a revision that needs the classic block write
+//	    loader instead of the fast one, or -1 if all of them take the fast one.
+//	The revision table maps the top half of the id register to a letter.
+struct stm32x_revision
+{
+	uint16_t rev_id;
+	const char *name;
+};
+
+struct stm32x_device
+{
+	uint16_t device_id;
+	const char *name;
+	int page_size;
+	int ppage_size;
+	bool has_dual_banks;
+	uint16_t default_size;
+	int classic_write_rev;
+	const struct stm32x_revision *revisions;
+};
+
+static const struct stm32x_revision stm32x_medium_revs[] = {
+	{ 0x0000, "A" }, { 0x2000, "B" }, { 0x2001, "Z" }, { 0x2003, "Y" }, { 0, NULL },
+};
+static const struct stm32x_revision stm32x_a_revs[] = {
+	{ 0x1000, "A" }, { 0, NULL },
+};
+static const struct stm32x_revision stm32x_az_revs[] = {
+	{ 0x1000, "A" }, { 0x1001, "Z" }, { 0, NULL },
+};
+
+static const struct stm32x_device stm32x_devices[] = {
+	{ 0x410, "Medium Density", 1024, 4, false,  128, 0x0000, stm32x_medium_revs },
+	{ 0x412, "Low Density",    1024, 4, false,   32, -1,     stm32x_a_revs },
+	{ 0x414, "High Density",   2048, 2, false,  512, -1,     stm32x_az_revs },
+	{ 0x418, "Connectivity",   2048, 2, false,  256, -1,     stm32x_az_revs },
+	{ 0x420, "Value",          1024, 4, false,  128, -1,     stm32x_az_revs },
+	{ 0x430, "XL",             2048, 2, true,  1024, -1,     stm32x_a_revs },
+};
+
+// Looks up a device id in the table above. Returns NULL for unknown parts.
+static const struct stm32x_device *stm32x_find_device(uint32_t device_id)
+{
+	int lo = 0;
+	int hi = (sizeof(stm32x_devices) / sizeof(stm32x_devices[0])) - 1;
+
+	device_id &= 0x7ff;
+	while (lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+
+		if (stm32x_devices[mid].device_id == device_id)
+			return &stm32x_devices[mid];
+		if (stm32x_devices[mid].device_id < device_id)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return NULL;
+}
+
+// The probe routine. If possible, an appropriate register on the chip should be
+//  read to verify the type of chip. Various flavors and sizes of chips of the same
+//  general type can be accomodated this way. It also is good to verify that the 
+//  chip is the kind that the configuration file thought it was.
+static int stm32x_probe(struct flash_bank *bank)
+{
+	struct target *target = bank->target;
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+	const struct stm32x_device *device;
+	int i;
+	uint16_t num_pages;
+	uint32_t device_id;
+	int page_size;
+	uint32_t base_address = 0x08000000;
+
+	/* read stm32 device id register */
+	int retval = target_read_u32(target, 0xE0042000, &device_id);
+	if (retval != ERROR_OK)
+		return retval;
+
+	/* get flash size from target. */
+	retval = target_read_u16(target, 0x1FFFF7E0, &num_pages);
+	if (retval != ERROR_OK)
+	{
+		LOG_WARNING("failed reading flash size, default to max target family");
+		/* failed reading flash size, default to max target family */
+		num_pages = 0xffff;
+	}
+
+	// The same chip as last time: everything the probe would work out from
+	//  these two registers is still valid, including the cached loader.
+	if (stm32x_info->probed && bank->sectors &&
+			(device_id == stm32x_info->device_id) &&
+			(num_pages == stm32x_info->flash_size_reg))
+	{
+		LOG_DEBUG("device id 0x%08" PRIx32 " unchanged, keeping the flash geometry", device_id);
+		return ERROR_OK;
+	}
+
+	stm32x_info->probed = 0;
+	stm32x_info->register_offset = FLASH_OFFSET_B0;
+	stm32x_info->device_id = device_id;
+	stm32x_invalidate_protection(bank);
+	stm32x_info->flash_size_reg = num_pages;
+
+	// A cached loader may be the wrong one for what the probe finds.
+	stm32x_free_working_areas(bank);
+
+	LOG_INFO("device id = 0x%08" PRIx32 "", device_id);
+
+	device = stm32x_find_device(device_id);
+	if (device == NULL)
+	{
+		LOG_WARNING("Cannot identify target as a STM32 family.");
+		stm32x_info->fast_write = false;
+		return ERROR_FAIL;
+	}
+
+	page_size = device->page_size;
+	stm32x_info->ppage_size = device->ppage_size;
+	stm32x_info->has_dual_banks = device->has_dual_banks;
+
+	// Every known device gets the fast block write loader, except a revision
+	//  the table says keeps the classic one (the first medium density
+	//  silicon). The revision is in the top half of the id register.
+	stm32x_info->fast_write = (device->classic_write_rev != (int)(device_id >> 16));
+
+	/* check for early silicon */
+	if (num_pages == 0xffff)
+	{
+		/* number of sectors may be incorrect on early silicon */
+		LOG_WARNING("STM32 flash size failed, probe inaccurate - assuming %dk flash",
+				device->default_size);
+		num_pages = device->default_size;
+	}
+
+	if (device->has_dual_banks)
+	{
+		/* split reported size into matching bank */
+		if (bank->base != 0x08080000)
+		{
+			/* bank 0 will be fixed 512k */
+			num_pages = 512;
+		}
+		else
+		{
+			num_pages -= 512;
+			/* bank1 also uses a register offset */
+			stm32x_info->register_offset = FLASH_OFFSET_B1;
+			base_address = 0x08080000;
+		}
+	}
+
+	LOG_INFO("flash size = %dkbytes", num_pages);
+	LOG_DEBUG("using the %s block write loader", stm32x_info->fast_write ? "fast" : "classic");
+
+	/* calculate numbers of pages */
+	num_pages /= (page_size / 1024);
+
+	// erases noted against the old sector array don't carry over
+	stm32x_erase_drop(bank);
+
+	// The flash core reads the sector array directly, so there has to be
+	//  one, but it is only laid out again when the geometry changes. A
+	//  probe of the same part just forgets the sectors' state.
+	if (bank->sectors && ((stm32x_info->geometry.page_size != (uint32_t)page_size) ||
+			(stm32x_info->geometry.num_pages != num_pages)))
+	{
+		free(bank->sectors);
+		bank->sectors = NULL;
+		bank->num_sectors = 0;
+		memset(&stm32x_info->geometry, 0, sizeof(stm32x_info->geometry));
+	}
+
+	bank->base = base_address;
+	if (bank->sectors == NULL)
+	{
+		bank->sectors = malloc(sizeof(struct flash_sector) * num_pages);
+		if (bank->sectors == NULL)
+		{
+			bank->num_sectors = 0;
+			return ERROR_FAIL;
+		}
+
+		for (i = 0; i < num_pages; i++)
+		{
+			bank->sectors[i].offset = i * page_size;
+			bank->sectors[i].size = page_size;
+		}
+	}
+
+	bank->size = (num_pages * page_size);
+	bank->num_sectors = num_pages;
+	for (i = 0; i < num_pages; i++)
+	{
+		bank->sectors[i].is_erased = -1;
+		bank->sectors[i].is_protected = 1;
+	}
+
+	stm32x_info->geometry.page_size = page_size;
+	stm32x_info->geometry.num_pages = num_pages;
+
+	// Here the probed flag is set in the bank private data.
+	//  This saves having to do the probe all the time since
+	//  other functions rely on this data existing.
+	stm32x_info->probed = 1;
+
+	return ERROR_OK;
+}
+
+// It's easy to see that auto_probe only probes if the "probed" bit isn't set.
+//  This is the function that other functions use to make sure probe data has
+//  been gathered.
+static int stm32x_auto_probe(struct flash_bank *bank)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+	if (stm32x_info->probed)
+		return ERROR_OK;
+	return stm32x_probe(bank);
+}
+
+// looks like this was going to be used, but wasn't?
+#if 0
+COMMAND_HANDLER(stm32x_handle_part_id_command)
+{
+	return ERROR_OK;
+}
+#endif
+
+
+// The info function for the chip. This appears to be redundant to the probe
+//  function, but there are differences. It might be possible to combine them, 
+//  but why?
+static int get_stm32x_info(struct flash_bank *bank, char *buf, int buf_size)
+{
+	struct target *target = bank->target;
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+	const struct stm32x_device *device;
+	const struct stm32x_revision *rev;
+	uint32_t device_id = stm32x_info->device_id;
+
+	/* read stm32 device id register, unless the probe already did */
+	if (!stm32x_info->probed)
+	{
+		int retval = target_read_u32(target, 0xE0042000, &device_id);
+		if (retval != ERROR_OK)
+			return retval;
+	}
+
+	device = stm32x_find_device(device_id);
+	if (device == NULL)
+	{
+		snprintf(buf, buf_size, "Cannot identify target as a stm32x\n");
+		return ERROR_FAIL;
+	}
+
+	for (rev = device->revisions; rev->name; rev++)
+		if (rev->rev_id == (device_id >> 16))
+			break;
+
+	snprintf(buf, buf_size, "stm32x (%s) - Rev: %s", device->name,
+			rev->name ? rev->name : "unknown");
+
+	return ERROR_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// Special commands for the stm32x start here. Most of these use the option byte manipulation
+//  routines that were defined above. Various combinations of these functions are used to 
+//  implement the functions a user might want to do.
+
+COMMAND_HANDLER(stm32x_handle_lock_command)
+{
+	struct target *target = NULL;
+	struct stm32x_flash_bank *stm32x_info = NULL;
+
+	if (CMD_ARGC < 1)
+	{
+		command_print(CMD_CTX, "stm32x lock <bank>");
+		return ERROR_OK;
+	}
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (ERROR_OK != retval)
+		return retval;
+
+	stm32x_info = bank->driver_priv;
+
+	target = bank->target;
+
+	if (target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	retval = stm32x_check_operation_supported(bank);
+	if (ERROR_OK != retval)
+		return retval;
+
+	if (stm32x_read_options(bank) != ERROR_OK)
+	{
+		command_print(CMD_CTX, "stm32x failed to read options");
+		return ERROR_OK;
+	}
+
+	/* set readout protection */
+	stm32x_info->option_bytes.RDP = 0;
+
+	if (stm32x_write_options(bank) != ERROR_OK)
+	{
+		command_print(CMD_CTX, "stm32x failed to lock device");
+		return ERROR_OK;
+	}
+
+	command_print(CMD_CTX, "stm32x locked");
+
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(stm32x_handle_unlock_command)
+{
+	struct target *target = NULL;
+	struct stm32x_flash_bank *stm32x_info = NULL;
+
+	if (CMD_ARGC < 1)
+	{
+		command_print(CMD_CTX, "stm32x unlock <bank>");
+		return ERROR_OK;
+	}
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (ERROR_OK != retval)
+		return retval;
+
+	stm32x_info = bank->driver_priv;
+
+	target = bank->target;
+
+	if (target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	retval = stm32x_check_operation_supported(bank);
+	if (ERROR_OK != retval)
+		return retval;
+
+	if (stm32x_read_options(bank) != ERROR_OK)
+	{
+		command_print(CMD_CTX, "stm32x failed to unlock device");
+		return ERROR_OK;
+	}
+
+	/* clear readout protection and complementary option bytes
+	 * this will also force a device unlock if set */
+	stm32x_info->option_bytes.RDP = 0x5AA5;
+
+	if (stm32x_write_options(bank) != ERROR_OK)
+	{
+		command_print(CMD_CTX, "stm32x failed to lock device");
+		return ERROR_OK;
+	}
+
+	command_print(CMD_CTX, "stm32x unlocked.\n"
+			"INFO: a reset or power cycle is required "
+			"for the new settings to take effect.");
+
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(stm32x_handle_options_read_command)
+{
+	uint32_t optionbyte;
+	struct target *target = NULL;
+	struct stm32x_flash_bank *stm32x_info = NULL;
+
+	if (CMD_ARGC < 1)
+	{
+		command_print(CMD_CTX, "stm32x options_read <bank>");
+		return ERROR_OK;
+	}
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (ERROR_OK != retval)
+		return retval;
+
+	stm32x_info = bank->driver_priv;
+
+	target = bank->target;
+
+	if (target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	retval = stm32x_check_operation_supported(bank);
+	if (ERROR_OK != retval)
+		return retval;
+
+	retval = target_read_u32(target, STM32_FLASH_OBR, &optionbyte);
+	if (retval != ERROR_OK)
+		return retval;
+	command_print(CMD_CTX, "Option Byte: 0x%" PRIx32 "", optionbyte);
+
+	if (buf_get_u32((uint8_t*)&optionbyte, OPT_ERROR, 1))
+		command_print(CMD_CTX, "Option Byte Complement Error");
+
+	if (buf_get_u32((uint8_t*)&optionbyte, OPT_READOUT, 1))
+		command_print(CMD_CTX, "Readout Protection On");
+	else
+		command_print(CMD_CTX, "Readout Protection Off");
+
+	if (buf_get_u32((uint8_t*)&optionbyte, OPT_RDWDGSW, 1))
+		command_print(CMD_CTX, "Software Watchdog");
+	else
+		command_print(CMD_CTX, "Hardware Watchdog");
+
+	if (buf_get_u32((uint8_t*)&optionbyte, OPT_RDRSTSTOP, 1))
+		command_print(CMD_CTX, "Stop: No reset generated");
+	else
+		command_print(CMD_CTX, "Stop: Reset generated");
+
+	if (buf_get_u32((uint8_t*)&optionbyte, OPT_RDRSTSTDBY, 1))
+		command_print(CMD_CTX, "Standby: No reset generated");
+	else
+		command_print(CMD_CTX, "Standby: Reset generated");
+
+	if (stm32x_info->has_dual_banks)
+	{
+		if (buf_get_u32((uint8_t*)&optionbyte, OPT_BFB2, 1))
+			command_print(CMD_CTX, "Boot: Bank 0");
+		else
+			command_print(CMD_CTX, "Boot: Bank 1");
+	}
+
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(stm32x_handle_options_write_command)
+{
+	struct target *target = NULL;
+	struct stm32x_flash_bank *stm32x_info = NULL;
+	uint16_t optionbyte = 0xF8;
+
+	if (CMD_ARGC < 4)
+	{
+		command_print(CMD_CTX, "stm32x options_write <bank> <SWWDG | HWWDG> "
+				"<RSTSTNDBY | NORSTSTNDBY> <RSTSTOP | NORSTSTOP> <BOOT0 | BOOT1>");
+		return ERROR_OK;
+	}
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (ERROR_OK != retval)
+		return retval;
+
+	stm32x_info = bank->driver_priv;
+
+	target = bank->target;
+
+	if (target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	retval = stm32x_check_operation_supported(bank);
+	if (ERROR_OK != retval)
+		return retval;
+
+	/* REVISIT: ignores some options which we will display...
+	 * and doesn't insist on the specified syntax.
+	 */
+
+	/* OPT_RDWDGSW */
+	if (strcmp(CMD_ARGV[1], "SWWDG") == 0)
+	{
+		optionbyte |= (1 << 0);
+	}
+	else	/* REVISIT must be "HWWDG" then ... */
+	{
+		optionbyte &= ~(1 << 0);
+	}
+
+	/* OPT_RDRSTSTOP */
+	if (strcmp(CMD_ARGV[2], "NORSTSTOP") == 0)
+	{
+		optionbyte |= (1 << 1);
+	}
+	else	/* REVISIT must be "RSTSTNDBY" then ... */
+	{
+		optionbyte &= ~(1 << 1);
+	}
+
+	/* OPT_RDRSTSTDBY */
+	if (strcmp(CMD_ARGV[3], "NORSTSTNDBY") == 0)
+	{
+		optionbyte |= (1 << 2);
+	}
+	else	/* REVISIT must be "RSTSTOP" then ... */
+	{
+		optionbyte &= ~(1 << 2);
+	}
+
+	if (CMD_ARGC > 4 && stm32x_info->has_dual_banks)
+	{
+		/* OPT_BFB2 */
+		if (strcmp(CMD_ARGV[4], "BOOT0") == 0)
+		{
+			optionbyte |= (1 << 3);
+		}
+		else
+		{
+			optionbyte &= ~(1 << 3);
+		}
+	}
+
+	if (stm32x_read_options(bank) != ERROR_OK)
+	{
+		command_print(CMD_CTX, "stm32x failed to read options");
+		return ERROR_OK;
+	}
+
+	stm32x_info->option_bytes.user_options = optionbyte;
+
+	if (stm32x_write_options(bank) != ERROR_OK)
+	{
+		command_print(CMD_CTX, "stm32x failed to write options");
+		return ERROR_OK;
+	}
+
+	command_print(CMD_CTX, "stm32x write options complete.\n"
+				"INFO: a reset or power cycle is required "
+				"for the new settings to take effect.");
+
+	return ERROR_OK;
+}
+
+// Implementation of the mass erase command for the stm32x.
+//  Invoked as a command by the next function.
+static int stm32x_mass_erase(struct flash_bank *bank)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+	struct target *target = bank->target;
+	struct duration phase_time;
+	int previous_phase;
+
+	if (target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	previous_phase = stm32x_phase_begin(bank, STM32X_PHASE_ERASE, &phase_time);
 
-	static const uint8_t stm32x_flash_write_code[] = {
-									/* #define STM32_FLASH_CR_OFFSET	0x10 */
-									/* #define STM32_FLASH_SR_OFFSET	0x0C */
-									/* write: */
-		0x08, 0x4c,					/* ldr	r4, STM32_FLASH_BASE */
-		0x1c, 0x44,					/* add	r4, r3 */
-									/* write_half_word: */
-		0x01, 0x23,					/* movs	r3, #0x01 */
-		0x23, 0x61,					/* str	r3, [r4, #STM32_FLASH_CR_OFFSET] */
-		0x30, 0xf8, 0x02, 0x3b,		/* ldrh	r3, [r0], #0x02 */
-		0x21, 0xf8, 0x02, 0x3b,		/* strh	r3, [r1], #0x02 */
-									/* busy: */
-		0xe3, 0x68,					/* ldr	r3, [r4, #STM32_FLASH_SR_OFFSET] */
-		0x13, 0xf0, 0x01, 0x0f,		/* tst	r3, #0x01 */
-		0xfb, 0xd0,					/* beq	busy */
-		0x13, 0xf0, 0x14, 0x0f,		/* tst	r3, #0x14 */
-		0x01, 0xd1,					/* bne	exit */
-		0x01, 0x3a,					/* subs	r2, r2, #0x01 */
-		0xf0, 0xd1,					/* bne	write_half_word */
-									/* exit: */
-		0x00, 0xbe,					/* bkpt	#0x00 */
-		0x00, 0x20, 0x02, 0x40,		/* STM32_FLASH_BASE: .word 0x40022000 */
-	};
+	int retval = stm32x_unlock(bank);
+	if (retval != ERROR_OK)
+		goto done;
 
-	/* flash write code */
-	if (target_alloc_working_area(target, sizeof(stm32x_flash_write_code),
-			&stm32x_info->write_algorithm) != ERROR_OK)
+	/* mass erase flash memory */
+	retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_MER);
+	if (retval != ERROR_OK)
+		goto done;
+	retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_MER | FLASH_STRT);
+	if (retval != ERROR_OK)
+		goto done;
+	stm32x_count(bank, 2, 0, 0);
+
+	retval = stm32x_wait_status_busy(bank, FLASH_ERASE_TIME, FLASH_ERASE_TIMEOUT);
+	if (retval != ERROR_OK)
+		goto done;
+
+	retval = stm32x_idle(bank);
+
+	// nothing is left to erase ahead of a write
+	if (stm32x_info->erase_pending)
+		memset(stm32x_info->erase_pending, 0, bank->num_sectors);
+
+done:
+	if (retval != ERROR_OK)
+		stm32x_relock(bank);
+	stm32x_phase_end(bank, previous_phase, &phase_time,
+			(retval == ERROR_OK) ? bank->size : 0);
+
+	return retval;
+}
+
+// Supports the mass erase command for the stm32x. Uses the function above to do the work.
+//  This function must be placed in the stm32x_exec_command_handlers structure to be 
+//  registered and made accessible to the user.
+COMMAND_HANDLER(stm32x_handle_mass_erase_command)
+{
+	int i;
+
+	if (CMD_ARGC < 1)
 	{
-		LOG_WARNING("no working area available, can't do block memory writes");
-		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
-	};
+		command_print(CMD_CTX, "stm32x mass_erase <bank>");
+		return ERROR_OK;
+	}
 
-	if ((retval = target_write_buffer(target, stm32x_info->write_algorithm->address,
-			sizeof(stm32x_flash_write_code),
-			(uint8_t*)stm32x_flash_write_code)) != ERROR_OK)
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (ERROR_OK != retval)
 		return retval;
 
-	/* memory buffer */
-	while (target_alloc_working_area_try(target, buffer_size, &source) != ERROR_OK)
+	retval = stm32x_session_end(bank, stm32x_mass_erase(bank));
+	if (retval == ERROR_OK)
 	{
-		buffer_size /= 2;
-		if (buffer_size <= 256)
+		/* set all sectors as erased */
+		for (i = 0; i < bank->num_sectors; i++)
 		{
-			/* if we already allocated the writing code, but failed to get a
-			 * buffer, free the algorithm */
-			if (stm32x_info->write_algorithm)
-				target_free_working_area(target, stm32x_info->write_algorithm);
-
-			LOG_WARNING("no large enough working area available, can't do block memory writes");
-			return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+			bank->sectors[i].is_erased = 1;
 		}
-	};
 
-	// I do not know exactly how the following code works. The effect seems to
-	//  be to allow placing specific values in specific registers for the call to the
-	//  assembly language routine that writes memory segments. A structure with an
-	//  entry for each register seems to be created.
+		command_print(CMD_CTX, "stm32x mass erase complete");
+	}
+	else
+	{
+		command_print(CMD_CTX, "stm32x mass erase failed");
+	}
 
-	armv7m_info.common_magic = ARMV7M_COMMON_MAGIC;
-	armv7m_info.core_mode = ARMV7M_MODE_ANY;
+	return retval;
+}
+// The XL density parts have two flash controllers, one per bank, each with
+//  its own KEYR, CR, AR and SR (bank 1's are 0x40 higher, see
+//  register_offset). OpenOCD sees the two banks as two flash banks, so this
+//  finds the other stm32x bank on the same target, probing it if needed.
+//  It returns NULL on single bank parts or when only one bank is configured.
+static struct flash_bank *stm32x_partner_bank(struct flash_bank *bank)
+{
+	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
+	struct flash_bank *partner;
 
-	init_reg_param(&reg_params[0], "r0", 32, PARAM_OUT);
-	init_reg_param(&reg_params[1], "r1", 32, PARAM_OUT);
-	init_reg_param(&reg_params[2], "r2", 32, PARAM_OUT);
-	init_reg_param(&reg_params[3], "r3", 32, PARAM_IN_OUT);
+	if (!stm32x_info->has_dual_banks)
+		return NULL;
 
-	// OK, I understand the code again.
-	while (count > 0)
+	for (partner = flash_bank_list(); partner; partner = partner->next)
 	{
-		uint32_t thisrun_count = (count > (buffer_size / 2)) ?
-				(buffer_size / 2) : count;
+		struct stm32x_flash_bank *partner_info;
 
-		if ((retval = target_write_buffer(target, source->address,
-				thisrun_count * 2, buffer)) != ERROR_OK)
-			break;
+		if ((partner == bank) || (partner->target != bank->target) ||
+				(partner->driver != bank->driver))
+			continue;
 
-		buf_set_u32(reg_params[0].value, 0, 32, source->address);
-		buf_set_u32(reg_params[1].value, 0, 32, address);
-		buf_set_u32(reg_params[2].value, 0, 32, thisrun_count);
-		buf_set_u32(reg_params[3].value, 0, 32, stm32x_info->register_offset);
+		if (stm32x_auto_probe(partner) != ERROR_OK)
+			continue;
 
-		if ((retval = target_run_algorithm(target, 0, NULL, 4, reg_params,
-				stm32x_info->write_algorithm->address,
-				0,
-				10000, &armv7m_info)) != ERROR_OK)
-		{
-			LOG_ERROR("error executing stm32x flash write algorithm");
-			break;
-		}
+		partner_info = partner->driver_priv;
+		if (partner_info->has_dual_banks &&
+				(partner_info->register_offset != stm32x_info->register_offset))
+			return partner;
+	}
+
+	return NULL;
+}
+
+// Drives the erase jobs of both banks at once. The two controllers have
+//  independent BSY flags, so while one bank erases a page the other can
+//  erase one too; the host just keeps both of them busy. A page erase takes
+//  about 20ms, much longer than the round trips needed to start the next.
+// The banks may as well be on different targets (see the gang write). A job
+//  that fails is dropped with its error in retval and the others go on; the
+//  first error is returned.
+static int stm32x_erase_concurrent(struct stm32x_erase_job *jobs, int num_jobs)
+{
+	int retval = ERROR_OK;
+	int j;
+
+	for (j = 0; j < num_jobs; j++)
+	{
+		struct flash_bank *bank = jobs[j].bank;
+
+		jobs[j].previous_phase = stm32x_phase_begin(bank,
+				STM32X_PHASE_ERASE, &jobs[j].phase_time);
+
+		jobs[j].retval = stm32x_unlock(bank);
+		if (jobs[j].retval != ERROR_OK)
+			jobs[j].done = true;
+	}
+
+	for (;;)
+	{
+		bool all_done = true;
+		bool started = false;
 
-		if (buf_get_u32(reg_params[3].value, 0, 32) & FLASH_PGERR)
+		for (j = 0; j < num_jobs; j++)
 		{
-			LOG_ERROR("flash memory not erased before writing");
-			/* Clear but report errors */
-			target_write_u32(target, STM32_FLASH_SR, FLASH_PGERR);
-			retval = ERROR_FAIL;
-			break;
+			struct stm32x_erase_job *job = &jobs[j];
+
+			if (job->done)
+				continue;
+
+			if (job->busy)
+				job->retval = stm32x_erase_job_poll(job);
+			if ((job->retval == ERROR_OK) && !job->busy && !job->done)
+			{
+				job->retval = stm32x_erase_job_start(job);
+				started |= job->busy;
+			}
+			if (job->retval != ERROR_OK)
+				job->done = true;
+			if (!job->done)
+				all_done = false;
 		}
 
-		if (buf_get_u32(reg_params[3].value, 0, 32) & FLASH_WRPRTERR)
-		{
-			LOG_ERROR("flash memory write protected");
-			/* Clear but report errors */
-			target_write_u32(target, STM32_FLASH_SR, FLASH_WRPRTERR);
-			retval = ERROR_FAIL;
+		if (all_done)
 			break;
-		}
 
-		buffer += thisrun_count * 2;
-		address += thisrun_count * 2;
-		count -= thisrun_count;
+		// only wait when no controller was ready for more work
+		if (!started)
+			alive_sleep(1);
 	}
 
-	target_free_working_area(target, source);
-	target_free_working_area(target, stm32x_info->write_algorithm);
+	for (j = 0; j < num_jobs; j++)
+	{
+		struct flash_bank *bank = jobs[j].bank;
+
+		if (jobs[j].retval == ERROR_OK)
+			jobs[j].retval = stm32x_idle(bank);
+		if (jobs[j].retval != ERROR_OK)
+			stm32x_relock(bank);
+		if (retval == ERROR_OK)
+			retval = jobs[j].retval;
+	}
 
-	destroy_reg_param(&reg_params[0]);
-	destroy_reg_param(&reg_params[1]);
-	destroy_reg_param(&reg_params[2]);
-	destroy_reg_param(&reg_params[3]);
+	for (j = num_jobs - 1; j >= 0; j--)
+		stm32x_phase_end(jobs[j].bank, jobs[j].previous_phase,
+				&jobs[j].phase_time, jobs[j].erased_bytes);
 
 	return retval;
 }
 
-// This is the main write routine. It uses the helper function above.
-static int stm32x_write(struct flash_bank *bank, uint8_t *buffer,
-		uint32_t offset, uint32_t count)
+// The erase planner. Each offset/length pair is a range of the flash from
+//  the start of the given bank; on XL density parts a range may run on
+//  into the other bank. The ranges have to start and end on sector
+//  boundaries. They are merged into one set of sectors per bank, and a
+//  bank whose every sector is in the set is mass erased with MER. With
+//  work for both banks the two controllers erase at the same time (see
+//  stm32x_erase_concurrent); with one, each contiguous run of sectors goes
+//  to stm32x_erase_request, which uses the sram erase loop where it can.
+/* stm32x erase_range <bank> <offset> <length> [<offset> <length> ...]
+ */
+COMMAND_HANDLER(stm32x_handle_erase_range_command)
 {
-	struct target *target = bank->target;
-	uint32_t words_remaining = (count / 2);
-	uint32_t bytes_remaining = (count & 0x00000001);
-	uint32_t address = bank->base + offset;
-	uint32_t bytes_written = 0;
-	int retval;
+	struct stm32x_erase_job jobs[2];
+	int num_jobs = 0;
+	unsigned arg;
+	int i, j;
+
+	if ((CMD_ARGC < 3) || ((CMD_ARGC % 2) != 1))
+	{
+		command_print(CMD_CTX, "stm32x erase_range <bank> <offset> <length> [<offset> <length> ...]");
+		return ERROR_OK;
+	}
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (ERROR_OK != retval)
+		return retval;
 
 	if (bank->target->state != TARGET_HALTED)
 	{
@@ -866,492 +4796,708 @@ static int stm32x_write(struct flash_bank *bank, uint8_t *buffer,
 		return ERROR_TARGET_NOT_HALTED;
 	}
 
-	if (offset & 0x1)
+	retval = stm32x_auto_probe(bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	// check the numbers before anything is allocated
+	for (arg = 1; arg < CMD_ARGC; arg++)
 	{
-		LOG_WARNING("offset 0x%" PRIx32 " breaks required 2-byte alignment", offset);
-		return ERROR_FLASH_DST_BREAKS_ALIGNMENT;
+		uint32_t value;
+		COMMAND_PARSE_NUMBER(u32, CMD_ARGV[arg], value);
 	}
 
-	/* unlock flash registers */
-	retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_KEYR), KEY1);
-	if (retval != ERROR_OK)
-		return retval;
-	retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_KEYR), KEY2);
-	if (retval != ERROR_OK)
-		return retval;
+	memset(jobs, 0, sizeof(jobs));
+	jobs[0].bank = bank;
+	jobs[1].bank = stm32x_partner_bank(bank);
 
-	/* multiple half words (2-byte) to be programmed? */
-	if (words_remaining > 0)
+	for (j = 0; j < 2; j++)
 	{
-		/* try using a block write */
-		if ((retval = stm32x_write_block(bank, buffer, offset, words_remaining)) != ERROR_OK)
+		if (jobs[j].bank == NULL)
+			continue;
+		jobs[j].pending = calloc(jobs[j].bank->num_sectors, 1);
+		if (jobs[j].pending == NULL)
 		{
-			if (retval == ERROR_TARGET_RESOURCE_NOT_AVAILABLE)
+			retval = ERROR_FAIL;
+			goto done;
+		}
+	}
+
+	for (arg = 1; arg < CMD_ARGC; arg += 2)
+	{
+		uint32_t offset, length, start, end;
+		bool start_ok = false, end_ok = false;
+
+		COMMAND_PARSE_NUMBER(u32, CMD_ARGV[arg], offset);
+		COMMAND_PARSE_NUMBER(u32, CMD_ARGV[arg + 1], length);
+
+		start = bank->base + offset;
+		end = start + length;
+		if ((length == 0) || (end < start))
+		{
+			retval = ERROR_COMMAND_SYNTAX_ERROR;
+			goto done;
+		}
+
+		for (j = 0; j < 2; j++)
+		{
+			struct flash_bank *b = jobs[j].bank;
+
+			if (b == NULL)
+				continue;
+
+			for (i = 0; i < b->num_sectors; i++)
 			{
-				/* if block write failed (no sufficient working area),
-				 * we use normal (slow) single dword accesses */
-				LOG_WARNING("couldn't use block writes, falling back to single memory accesses");
+				uint32_t sector_start = b->base + b->sectors[i].offset;
+				uint32_t sector_end = sector_start + b->sectors[i].size;
+
+				if (sector_start == start)
+					start_ok = true;
+				if (sector_end == end)
+					end_ok = true;
+				if ((sector_start >= start) && (sector_end <= end))
+					jobs[j].pending[i] = 1;
 			}
 		}
-		else
+
+		if (!start_ok || !end_ok)
 		{
-			buffer += words_remaining * 2;
-			address += words_remaining * 2;
-			words_remaining = 0;
+			command_print(CMD_CTX, "range 0x%8.8" PRIx32 "-0x%8.8" PRIx32
+					" doesn't start and end on flash sector boundaries", start, end);
+			retval = ERROR_FLASH_DST_BREAKS_ALIGNMENT;
+			goto done;
 		}
 	}
 
-	if ((retval != ERROR_OK) && (retval != ERROR_TARGET_RESOURCE_NOT_AVAILABLE))
-		return retval;
-
-	while (words_remaining > 0)
+	// drop the banks with nothing to do; note the ones to mass erase
+	for (j = 0; j < 2; j++)
 	{
-		uint16_t value;
-		memcpy(&value, buffer + bytes_written, sizeof(uint16_t));
+		int marked = 0;
 
-		retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_PG);
-		if (retval != ERROR_OK)
-			return retval;
-		retval = target_write_u16(target, address, value);
-		if (retval != ERROR_OK)
-			return retval;
+		if (jobs[j].bank == NULL)
+			continue;
 
-		retval = stm32x_wait_status_busy(bank, 5);
-		if (retval != ERROR_OK)
-			return retval;
+		for (i = 0; i < jobs[j].bank->num_sectors; i++)
+			marked += jobs[j].pending[i];
 
-		bytes_written += 2;
-		words_remaining--;
-		address += 2;
+		if (marked == 0)
+		{
+			free(jobs[j].pending);
+			jobs[j].pending = NULL;
+			continue;
+		}
+
+		jobs[j].mass = (marked == jobs[j].bank->num_sectors);
+		LOG_DEBUG("%s: %d sectors to erase%s", jobs[j].bank->name, marked,
+				jobs[j].mass ? ", using mass erase" : "");
+
+		if (j != num_jobs)
+		{
+			jobs[num_jobs] = jobs[j];
+			jobs[j].pending = NULL;
+		}
+		num_jobs++;
 	}
 
-	if (bytes_remaining)
+	if (num_jobs > 1)
+		retval = stm32x_erase_concurrent(jobs, num_jobs);
+	else if (num_jobs == 1)
 	{
-		uint16_t value = 0xffff;
-		memcpy(&value, buffer + bytes_written, bytes_remaining);
+		struct flash_bank *b = jobs[0].bank;
 
-		retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_PG);
-		if (retval != ERROR_OK)
-			return retval;
-		retval = target_write_u16(target, address, value);
-		if (retval != ERROR_OK)
-			return retval;
+		for (i = 0; (i < b->num_sectors) && (retval == ERROR_OK); i++)
+		{
+			int first = i;
 
-		retval = stm32x_wait_status_busy(bank, 5);
-		if (retval != ERROR_OK)
-			return retval;
+			if (!jobs[0].pending[i])
+				continue;
+			while ((i + 1 < b->num_sectors) && jobs[0].pending[i + 1])
+				i++;
+
+			retval = stm32x_erase_request(b, first, i);
+		}
 	}
 
-	return target_write_u32(target, STM32_FLASH_CR, FLASH_LOCK);
-}
+	for (j = 0; j < num_jobs; j++)
+		retval = stm32x_session_end(jobs[j].bank, retval);
 
-// The probe routine. If possible, an appropriate register on the chip should be
-//  read to verify the type of chip. Various flavors and sizes of chips of the same
-//  general type can be accomodated this way. It also is good to verify that the 
-//  chip is the kind that the configuration file thought it was.
-static int stm32x_probe(struct flash_bank *bank)
-{
-	struct target *target = bank->target;
-	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
-	int i;
-	uint16_t num_pages;
-	uint32_t device_id;
-	int page_size;
-	uint32_t base_address = 0x08000000;
+	if (retval == ERROR_OK)
+		command_print(CMD_CTX, "stm32x erase_range complete");
+	else
+		command_print(CMD_CTX, "stm32x erase_range failed");
 
-	stm32x_info->probed = 0;
-	stm32x_info->register_offset = FLASH_OFFSET_B0;
+done:
+	free(jobs[0].pending);
+	free(jobs[1].pending);
 
-	/* read stm32 device id register */
-	int retval = target_read_u32(target, 0xE0042000, &device_id);
-	if (retval != ERROR_OK)
-		return retval;
-	LOG_INFO("device id = 0x%08" PRIx32 "", device_id);
+	return retval;
+}
 
-	/* get flash size from target. */
-	retval = target_read_u16(target, 0x1FFFF7E0, &num_pages);
-	if (retval != ERROR_OK)
+// Writes a binary file that may straddle the two banks of an XL density
+//  part. The part for each bank is programmed by its own controller at the
+//  same time (see stm32x_write_block_dual); without a working area, or
+//  when the file fits in one bank, the banks are written one after the
+//  other as the flash write_bank command would. The flash has to be erased.
+/* stm32x write_dual <bank> <filename> [offset]
+ */
+COMMAND_HANDLER(stm32x_handle_write_dual_command)
+{
+	struct flash_bank *banks[2];
+	struct fileio fileio;
+	struct duration bench;
+	uint32_t offset = 0;
+	uint32_t start, end, length;
+	uint32_t lengths[2];
+	uint8_t *image;
+	size_t read_bytes;
+	int k;
+
+	if (CMD_ARGC < 2)
 	{
-		LOG_WARNING("failed reading flash size, default to max target family");
-		/* failed reading flash size, default to max target family */
-		num_pages = 0xffff;
+		command_print(CMD_CTX, "stm32x write_dual <bank> <filename> [offset]");
+		return ERROR_OK;
 	}
 
-	if ((device_id & 0x7ff) == 0x410)
-	{
-		/* medium density - we have 1k pages
-		 * 4 pages for a protection area */
-		page_size = 1024;
-		stm32x_info->ppage_size = 4;
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (ERROR_OK != retval)
+		return retval;
 
-		/* check for early silicon */
-		if (num_pages == 0xffff)
-		{
-			/* number of sectors incorrect on revA */
-			LOG_WARNING("STM32 flash size failed, probe inaccurate - assuming 128k flash");
-			num_pages = 128;
-		}
-	}
-	else if ((device_id & 0x7ff) == 0x412)
-	{
-		/* low density - we have 1k pages
-		 * 4 pages for a protection area */
-		page_size = 1024;
-		stm32x_info->ppage_size = 4;
+	if (CMD_ARGC > 2)
+		COMMAND_PARSE_NUMBER(u32, CMD_ARGV[2], offset);
 
-		/* check for early silicon */
-		if (num_pages == 0xffff)
-		{
-			/* number of sectors incorrect on revA */
-			LOG_WARNING("STM32 flash size failed, probe inaccurate - assuming 32k flash");
-			num_pages = 32;
-		}
+	if (offset & 0x1)
+	{
+		LOG_WARNING("offset 0x%" PRIx32 " breaks required 2-byte alignment", offset);
+		return ERROR_FLASH_DST_BREAKS_ALIGNMENT;
 	}
-	else if ((device_id & 0x7ff) == 0x414)
-	{
-		/* high density - we have 2k pages
-		 * 2 pages for a protection area */
-		page_size = 2048;
-		stm32x_info->ppage_size = 2;
 
-		/* check for early silicon */
-		if (num_pages == 0xffff)
-		{
-			/* number of sectors incorrect on revZ */
-			LOG_WARNING("STM32 flash size failed, probe inaccurate - assuming 512k flash");
-			num_pages = 512;
-		}
-	}
-	else if ((device_id & 0x7ff) == 0x418)
+	if (bank->target->state != TARGET_HALTED)
 	{
-		/* connectivity line density - we have 2k pages
-		 * 2 pages for a protection area */
-		page_size = 2048;
-		stm32x_info->ppage_size = 2;
-
-		/* check for early silicon */
-		if (num_pages == 0xffff)
-		{
-			/* number of sectors incorrect on revZ */
-			LOG_WARNING("STM32 flash size failed, probe inaccurate - assuming 256k flash");
-			num_pages = 256;
-		}
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
 	}
-	else if ((device_id & 0x7ff) == 0x420)
-	{
-		/* value line density - we have 1k pages
-		 * 4 pages for a protection area */
-		page_size = 1024;
-		stm32x_info->ppage_size = 4;
 
-		/* check for early silicon */
-		if (num_pages == 0xffff)
-		{
-			/* number of sectors may be incorrrect on early silicon */
-			LOG_WARNING("STM32 flash size failed, probe inaccurate - assuming 128k flash");
-			num_pages = 128;
-		}
-	}
-	else if ((device_id & 0x7ff) == 0x430)
+	retval = stm32x_auto_probe(bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	// banks[0] is always the one that uses the bank 0 registers
+	banks[0] = bank;
+	banks[1] = stm32x_partner_bank(bank);
+	if (banks[1] && (((struct stm32x_flash_bank *)bank->driver_priv)->register_offset
+			!= FLASH_OFFSET_B0))
 	{
-		/* xl line density - we have 2k pages
-		 * 2 pages for a protection area */
-		page_size = 2048;
-		stm32x_info->ppage_size = 2;
-		stm32x_info->has_dual_banks = true;
+		banks[1] = bank;
+		banks[0] = stm32x_partner_bank(bank);
+	}
 
-		/* check for early silicon */
-		if (num_pages == 0xffff)
-		{
-			/* number of sectors may be incorrrect on early silicon */
-			LOG_WARNING("STM32 flash size failed, probe inaccurate - assuming 1024k flash");
-			num_pages = 1024;
-		}
+	if (fileio_open(&fileio, CMD_ARGV[1], FILEIO_READ, FILEIO_BINARY) != ERROR_OK)
+		return ERROR_FAIL;
 
-		/* split reported size into matching bank */
-		if (bank->base != 0x08080000)
-		{
-			/* bank 0 will be fixed 512k */
-			num_pages = 512;
-		}
-		else
-		{
-			num_pages -= 512;
-			/* bank1 also uses a register offset */
-			stm32x_info->register_offset = FLASH_OFFSET_B1;
-			base_address = 0x08080000;
-		}
+	length = fileio.size;
+	start = bank->base + offset;
+	end = start + length;
+
+	if ((length == 0) || (offset > bank->size) || (end < start) ||
+			(end > (banks[1] ? banks[1]->base + banks[1]->size : bank->base + bank->size)))
+	{
+		fileio_close(&fileio);
+		command_print(CMD_CTX, "file doesn't fit in the flash");
+		return ERROR_FLASH_DST_OUT_OF_BANK;
 	}
-	else
+
+	// an odd length is padded to a whole half-word with the erased value
+	image = malloc(length + 1);
+	if (image == NULL)
 	{
-		LOG_WARNING("Cannot identify target as a STM32 family.");
+		fileio_close(&fileio);
 		return ERROR_FAIL;
 	}
+	image[length] = 0xff;
 
-	LOG_INFO("flash size = %dkbytes", num_pages);
+	duration_start(&bench);
 
-	/* calculate numbers of pages */
-	num_pages /= (page_size / 1024);
+	retval = fileio_read(&fileio, length, image, &read_bytes);
+	fileio_close(&fileio);
+	if ((retval == ERROR_OK) && (read_bytes != length))
+		retval = ERROR_FAIL;
+	if (retval != ERROR_OK)
+		goto done;
 
-	if (bank->sectors)
+	if ((banks[1] == NULL) || (end <= banks[1]->base) || (start >= banks[1]->base))
 	{
-		free(bank->sectors);
-		bank->sectors = NULL;
+		// all in one bank
+		struct flash_bank *b = (banks[1] && (start >= banks[1]->base)) ? banks[1] : bank;
+
+		retval = stm32x_program(b, image, start - b->base, length);
+		goto done;
 	}
 
-	bank->base = base_address;
-	bank->size = (num_pages * page_size);
-	bank->num_sectors = num_pages;
-	bank->sectors = malloc(sizeof(struct flash_sector) * num_pages);
+	lengths[0] = banks[1]->base - start;
+	lengths[1] = end - banks[1]->base;
 
-	for (i = 0; i < num_pages; i++)
+	// the dual loader doesn't erase ahead
+	retval = stm32x_erase_flush(banks[0], start - banks[0]->base, lengths[0]);
+	if (retval == ERROR_OK)
+		retval = stm32x_erase_flush(banks[1], 0, lengths[1]);
+	if (retval != ERROR_OK)
+		goto done;
+
+	for (k = 0; (k < 2) && (retval == ERROR_OK); k++)
+		retval = stm32x_unlock(banks[k]);
+	if (retval != ERROR_OK)
+		goto done;
+
+	retval = stm32x_write_block_dual(banks[0], image, start - banks[0]->base,
+			lengths[0] / 2, banks[1], image + lengths[0], 0, (lengths[1] + 1) / 2);
+	stm32x_mark_written(banks[0], start - banks[0]->base, lengths[0]);
+	stm32x_mark_written(banks[1], 0, lengths[1]);
+
+	for (k = 0; k < 2; k++)
 	{
-		bank->sectors[i].offset = i * page_size;
-		bank->sectors[i].size = page_size;
-		bank->sectors[i].is_erased = -1;
-		bank->sectors[i].is_protected = 1;
+		if ((retval == ERROR_OK) || (retval == ERROR_TARGET_RESOURCE_NOT_AVAILABLE))
+			stm32x_idle(banks[k]);
+		else
+			stm32x_relock(banks[k]);
 	}
 
-	// Here the probed flag is set in the bank private data.
-	//  This saves having to do the probe all the time since
-	//  other functions rely on this data existing.
-	stm32x_info->probed = 1;
+	if (retval == ERROR_TARGET_RESOURCE_NOT_AVAILABLE)
+	{
+		LOG_WARNING("couldn't use dual bank writes, writing the banks in turn");
+		retval = stm32x_program(banks[0], image, start - banks[0]->base, lengths[0]);
+		if (retval == ERROR_OK)
+			retval = stm32x_program(banks[1], image + lengths[0], 0, lengths[1]);
+	}
 
-	return ERROR_OK;
+done:
+	free(image);
+	for (k = 0; k < 2; k++)
+		if (banks[k])
+			retval = stm32x_session_end(banks[k], retval);
+
+	if ((retval == ERROR_OK) && (duration_measure(&bench) == ERROR_OK))
+		command_print(CMD_CTX, "wrote %" PRIu32 " bytes from file %s to flash at 0x%8.8" PRIx32
+				" in %fs (%0.3f KiB/s)", length, CMD_ARGV[1], start,
+				duration_elapsed(&bench), duration_kbps(&bench, length));
+	else if (retval != ERROR_OK)
+		command_print(CMD_CTX, "stm32x write_dual failed");
+
+	return retval;
 }
 
-// It's easy to see that auto_probe only probes if the "probed" bit isn't set.
-//  This is the function that other functions use to make sure probe data has
-//  been gathered.
-static int stm32x_auto_probe(struct flash_bank *bank)
+// Writes a binary file to one bank without reading it into memory first.
+//  The file is read a ring's worth at a time while the target programs (see
+//  struct stm32x_source), so the first half-words are programmed as soon as
+//  the loader is running and the memory used doesn't grow with the image.
+//  The flash has to be erased.
+/* stm32x write_file <bank> <filename> [offset]
+ */
+COMMAND_HANDLER(stm32x_handle_write_file_command)
 {
-	struct stm32x_flash_bank *stm32x_info = bank->driver_priv;
-	if (stm32x_info->probed)
+	struct fileio fileio;
+	struct duration bench;
+	struct stm32x_source source;
+	uint32_t offset = 0;
+	uint32_t length;
+
+	if (CMD_ARGC < 2)
+	{
+		command_print(CMD_CTX, "stm32x write_file <bank> <filename> [offset]");
 		return ERROR_OK;
-	return stm32x_probe(bank);
-}
+	}
 
-// looks like this was going to be used, but wasn't?
-#if 0
-COMMAND_HANDLER(stm32x_handle_part_id_command)
-{
-	return ERROR_OK;
-}
-#endif
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (ERROR_OK != retval)
+		return retval;
 
+	if (CMD_ARGC > 2)
+		COMMAND_PARSE_NUMBER(u32, CMD_ARGV[2], offset);
 
-// The info function for the chip. This appears to be redundant to the probe
-//  function, but there are differences. It might be possible to combine them, 
-//  but why?
-static int get_stm32x_info(struct flash_bank *bank, char *buf, int buf_size)
-{
-	struct target *target = bank->target;
-	uint32_t device_id;
-	int printed;
+	if (bank->target->state != TARGET_HALTED)
+	{
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
 
-	/* read stm32 device id register */
-	int retval = target_read_u32(target, 0xE0042000, &device_id);
+	retval = stm32x_auto_probe(bank);
 	if (retval != ERROR_OK)
 		return retval;
 
-	if ((device_id & 0x7ff) == 0x410)
+	if (fileio_open(&fileio, CMD_ARGV[1], FILEIO_READ, FILEIO_BINARY) != ERROR_OK)
+		return ERROR_FAIL;
+
+	length = fileio.size;
+	if ((length == 0) || (offset > bank->size) || (length > bank->size - offset))
 	{
-		printed = snprintf(buf, buf_size, "stm32x (Medium Density) - Rev: ");
-		buf += printed;
-		buf_size -= printed;
+		fileio_close(&fileio);
+		command_print(CMD_CTX, "file doesn't fit in the bank");
+		return ERROR_FLASH_DST_OUT_OF_BANK;
+	}
 
-		switch (device_id >> 16)
-		{
-			case 0x0000:
-				snprintf(buf, buf_size, "A");
-				break;
+	source.read = stm32x_file_read;
+	source.buffer = NULL;
+	source.fileio = &fileio;
 
-			case 0x2000:
-				snprintf(buf, buf_size, "B");
-				break;
+	duration_start(&bench);
 
-			case 0x2001:
-				snprintf(buf, buf_size, "Z");
-				break;
+	retval = stm32x_session_end(bank, stm32x_program_source(bank, &source, offset, length));
+	fileio_close(&fileio);
 
-			case 0x2003:
-				snprintf(buf, buf_size, "Y");
-				break;
+	if ((retval == ERROR_OK) && (duration_measure(&bench) == ERROR_OK))
+		command_print(CMD_CTX, "wrote %" PRIu32 " bytes from file %s to flash at 0x%8.8" PRIx32
+				" in %fs (%0.3f KiB/s)", length, CMD_ARGV[1], bank->base + offset,
+				duration_elapsed(&bench), duration_kbps(&bench, length));
+	else if (retval != ERROR_OK)
+		command_print(CMD_CTX, "stm32x write_file failed");
 
-			default:
-				snprintf(buf, buf_size, "unknown");
-				break;
-		}
-	}
-	else if ((device_id & 0x7ff) == 0x412)
+	return retval;
+}
+
+// One target of a gang write, see below. failed names the step that went
+//  wrong for it, or is NULL while all is well.
+struct stm32x_gang_target
+{
+	struct flash_bank *bank;
+	struct stm32x_source source;
+	struct stm32x_erase_job erase;
+	struct stm32x_write_job write;
+	struct stm32x_crc_job crc;
+	bool unlocked;
+	bool writing;
+	bool fallback;
+	const char *failed;
+};
+
+// Gang programming: one binary file goes to the same offset of several
+//  banks, each on a target of its own (one per adapter or per tap). The file
+//  is read and checksummed once and the image is shared by all of them.
+//  OpenOCD talks to its targets from one thread, so "at the same time" means
+//  the host keeps every target busy in turn, as the dual bank code does for
+//  two controllers:
+//   - the sectors the image covers are erased with one erase job per target
+//     (see stm32x_erase_concurrent),
+//   - the block write loaders of all targets run at once and the host tops
+//     up whichever ring has room (see stm32x_write_job_service); a target
+//     without a working area is programmed on its own afterwards,
+//   - the checksum routines run on all targets at once and their results
+//     are compared with the checksum of the file.
+//  A target that fails drops out and the others carry on. At the end there
+//  is one line per target and a summary; the command fails unless every
+//  target passed.
+/* stm32x gang_write <filename> <offset> <bank> [<bank> ...]
+ */
+COMMAND_HANDLER(stm32x_handle_gang_write_command)
+{
+	struct stm32x_gang_target *gang = NULL;
+	struct stm32x_erase_job *jobs;
+	int num_jobs = 0;
+	struct fileio fileio;
+	struct duration bench;
+	uint32_t offset, length;
+	uint32_t image_crc, flash_crc;
+	uint8_t *image = NULL;
+	size_t read_bytes;
+	int num_targets;
+	int passed = 0;
+	int i, j, k;
+
+	if (CMD_ARGC < 3)
 	{
-		printed = snprintf(buf, buf_size, "stm32x (Low Density) - Rev: ");
-		buf += printed;
-		buf_size -= printed;
+		command_print(CMD_CTX, "stm32x gang_write <filename> <offset> <bank> [<bank> ...]");
+		return ERROR_OK;
+	}
 
-		switch (device_id >> 16)
-		{
-			case 0x1000:
-				snprintf(buf, buf_size, "A");
-				break;
+	COMMAND_PARSE_NUMBER(u32, CMD_ARGV[1], offset);
 
-			default:
-				snprintf(buf, buf_size, "unknown");
-				break;
-		}
+	if (offset & 0x1)
+	{
+		LOG_WARNING("offset 0x%" PRIx32 " breaks required 2-byte alignment", offset);
+		return ERROR_FLASH_DST_BREAKS_ALIGNMENT;
 	}
-	else if ((device_id & 0x7ff) == 0x414)
+
+	num_targets = CMD_ARGC - 2;
+	gang = calloc(num_targets, sizeof(*gang));
+	if (gang == NULL)
+		return ERROR_FAIL;
+
+	int retval = ERROR_OK;
+	for (i = 0; i < num_targets; i++)
 	{
-		printed = snprintf(buf, buf_size, "stm32x (High Density) - Rev: ");
-		buf += printed;
-		buf_size -= printed;
+		retval = CALL_COMMAND_HANDLER(flash_command_get_bank, i + 2, &gang[i].bank);
+		if (retval != ERROR_OK)
+			goto done;
 
-		switch (device_id >> 16)
+		if (strcmp(gang[i].bank->driver->name, "stm32x") != 0)
 		{
-			case 0x1000:
-				snprintf(buf, buf_size, "A");
-				break;
+			command_print(CMD_CTX, "bank %s is not an stm32x bank", CMD_ARGV[i + 2]);
+			retval = ERROR_COMMAND_SYNTAX_ERROR;
+			goto done;
+		}
 
-			case 0x1001:
-				snprintf(buf, buf_size, "Z");
-				break;
+		// Only one algorithm can run on a target at a time.
+		for (j = 0; j < i; j++)
+			if (gang[j].bank->target == gang[i].bank->target)
+			{
+				command_print(CMD_CTX, "banks %s and %s are on the same target",
+						CMD_ARGV[j + 2], CMD_ARGV[i + 2]);
+				retval = ERROR_COMMAND_SYNTAX_ERROR;
+				goto done;
+			}
+	}
 
-			default:
-				snprintf(buf, buf_size, "unknown");
-				break;
-		}
+	// The image is read and checksummed once, for all of them. An odd length
+	//  is padded to a whole half-word with the erased value.
+	if (fileio_open(&fileio, CMD_ARGV[0], FILEIO_READ, FILEIO_BINARY) != ERROR_OK)
+	{
+		retval = ERROR_FAIL;
+		goto done;
 	}
-	else if ((device_id & 0x7ff) == 0x418)
+
+	length = fileio.size;
+	image = malloc(length + 1);
+	if ((length == 0) || (image == NULL))
 	{
-		printed = snprintf(buf, buf_size, "stm32x (Connectivity) - Rev: ");
-		buf += printed;
-		buf_size -= printed;
+		fileio_close(&fileio);
+		retval = ERROR_FAIL;
+		goto done;
+	}
+	image[length] = 0xff;
 
-		switch (device_id >> 16)
-		{
-			case 0x1000:
-				snprintf(buf, buf_size, "A");
-				break;
+	retval = fileio_read(&fileio, length, image, &read_bytes);
+	fileio_close(&fileio);
+	if ((retval == ERROR_OK) && (read_bytes != length))
+		retval = ERROR_FAIL;
+	if (retval == ERROR_OK)
+		retval = image_calculate_checksum(image, length, &image_crc);
+	if (retval != ERROR_OK)
+		goto done;
 
-			case 0x1001:
-				snprintf(buf, buf_size, "Z");
-				break;
+	duration_start(&bench);
 
-			default:
-				snprintf(buf, buf_size, "unknown");
-				break;
-		}
-	}
-	else if ((device_id & 0x7ff) == 0x420)
+	// Get every target ready; the ones that aren't drop out.
+	for (i = 0; i < num_targets; i++)
 	{
-		printed = snprintf(buf, buf_size, "stm32x (Value) - Rev: ");
-		buf += printed;
-		buf_size -= printed;
+		struct flash_bank *bank = gang[i].bank;
 
-		switch (device_id >> 16)
+		if (bank->target->state != TARGET_HALTED)
 		{
-			case 0x1000:
-				snprintf(buf, buf_size, "A");
-				break;
+			gang[i].failed = "target not halted";
+			continue;
+		}
+		if (stm32x_auto_probe(bank) != ERROR_OK)
+		{
+			gang[i].failed = "probe";
+			continue;
+		}
+		if ((offset > bank->size) || (length > bank->size - offset))
+		{
+			gang[i].failed = "image doesn't fit in the bank";
+			continue;
+		}
 
-			case 0x1001:
-				snprintf(buf, buf_size, "Z");
-				break;
+		gang[i].source.read = stm32x_buffer_read;
+		gang[i].source.buffer = image;
+	}
 
-			default:
-				snprintf(buf, buf_size, "unknown");
-				break;
-		}
+	// Erase. The jobs of the targets still in go into one array.
+	jobs = calloc(num_targets, sizeof(*jobs));
+	if (jobs == NULL)
+	{
+		retval = ERROR_FAIL;
+		goto done;
 	}
-	else if ((device_id & 0x7ff) == 0x430)
+	for (i = 0; i < num_targets; i++)
 	{
-		printed = snprintf(buf, buf_size, "stm32x (XL) - Rev: ");
-		buf += printed;
-		buf_size -= printed;
+		struct flash_bank *bank = gang[i].bank;
+		int marked = 0;
+
+		if (gang[i].failed)
+			continue;
 
-		switch (device_id >> 16)
+		jobs[num_jobs].bank = bank;
+		jobs[num_jobs].pending = calloc(bank->num_sectors, 1);
+		if (jobs[num_jobs].pending == NULL)
 		{
-			case 0x1000:
-				snprintf(buf, buf_size, "A");
-				break;
+			gang[i].failed = "out of memory";
+			continue;
+		}
+		for (k = 0; k < bank->num_sectors; k++)
+		{
+			uint32_t sector_start = bank->sectors[k].offset;
+			uint32_t sector_end = sector_start + bank->sectors[k].size;
 
-			default:
-				snprintf(buf, buf_size, "unknown");
-				break;
+			if ((sector_end > offset) && (sector_start < offset + length))
+			{
+				jobs[num_jobs].pending[k] = 1;
+				marked++;
+			}
 		}
+		jobs[num_jobs].mass = (marked == bank->num_sectors);
+		num_jobs++;
 	}
-	else
+
+	if (num_jobs > 0)
+		stm32x_erase_concurrent(jobs, num_jobs);
+
+	for (i = 0, j = 0; i < num_targets; i++)
 	{
-		snprintf(buf, buf_size, "Cannot identify target as a stm32x\n");
-		return ERROR_FAIL;
+		if ((j < num_jobs) && (jobs[j].bank == gang[i].bank))
+		{
+			if (jobs[j].retval != ERROR_OK)
+				gang[i].failed = "erase";
+			free(jobs[j].pending);
+			j++;
+		}
 	}
+	free(jobs);
 
-	return ERROR_OK;
-}
+	// Program. Start every loader, then keep the rings topped up.
+	for (i = 0; i < num_targets; i++)
+	{
+		struct flash_bank *bank = gang[i].bank;
 
-///////////////////////////////////////////////////////////////////////////////////////////////
-// Special commands for the stm32x start here. Most of these use the option byte manipulation
-//  routines that were defined above. Various combinations of these functions are used to 
-//  implement the functions a user might want to do.
+		if (gang[i].failed)
+			continue;
 
-COMMAND_HANDLER(stm32x_handle_lock_command)
-{
-	struct target *target = NULL;
-	struct stm32x_flash_bank *stm32x_info = NULL;
+		retval = stm32x_unlock(bank);
+		gang[i].unlocked = true;
+		if (retval == ERROR_OK)
+			retval = stm32x_write_job_start(&gang[i].write, bank, &gang[i].source,
+					offset, (length + 1) / 2);
 
-	if (CMD_ARGC < 1)
-	{
-		command_print(CMD_CTX, "stm32x lock <bank>");
-		return ERROR_OK;
+		if (retval == ERROR_OK)
+			gang[i].writing = true;
+		else if (retval == ERROR_TARGET_RESOURCE_NOT_AVAILABLE)
+			gang[i].fallback = true;
+		else
+			gang[i].failed = "program";
 	}
 
-	struct flash_bank *bank;
-	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
-	if (ERROR_OK != retval)
-		return retval;
+	for (;;)
+	{
+		bool busy = false;
+		bool progress = false;
 
-	stm32x_info = bank->driver_priv;
+		for (i = 0; i < num_targets; i++)
+		{
+			bool ring_progress;
 
-	target = bank->target;
+			if (!gang[i].writing)
+				continue;
 
-	if (target->state != TARGET_HALTED)
+			retval = stm32x_write_job_service(&gang[i].write, &ring_progress);
+			if ((retval != ERROR_OK) || gang[i].write.done)
+			{
+				gang[i].writing = false;
+				if (stm32x_write_job_finish(&gang[i].write, retval) != ERROR_OK)
+					gang[i].failed = "program";
+				continue;
+			}
+
+			busy = true;
+			progress |= ring_progress;
+		}
+
+		if (!busy)
+			break;
+		if (!progress)
+			keep_alive();
+	}
+
+	for (i = 0; i < num_targets; i++)
 	{
-		LOG_ERROR("Target not halted");
-		return ERROR_TARGET_NOT_HALTED;
+		if (gang[i].fallback && !gang[i].failed)
+		{
+			LOG_WARNING("%s: no working area, programming it on its own", gang[i].bank->name);
+			if (stm32x_program(gang[i].bank, image, offset, length) != ERROR_OK)
+				gang[i].failed = "program";
+		}
+		if (gang[i].unlocked && gang[i].failed)
+			stm32x_relock(gang[i].bank);
+		else if (gang[i].unlocked)
+		{
+			stm32x_idle(gang[i].bank);
+			stm32x_session_end(gang[i].bank, ERROR_OK);
+		}
 	}
 
-	retval = stm32x_check_operation_supported(bank);
-	if (ERROR_OK != retval)
-		return retval;
+	// Verify, with the checksum routines of all targets running at once.
+	for (i = 0; i < num_targets; i++)
+	{
+		struct flash_bank *bank = gang[i].bank;
+
+		gang[i].writing = false;
+		gang[i].fallback = false;
+		if (gang[i].failed)
+			continue;
+
+		retval = stm32x_crc_job_start(&gang[i].crc, bank, bank->base + offset, length, 1);
+		if (retval == ERROR_OK)
+			gang[i].writing = true;
+		else if (retval == ERROR_TARGET_RESOURCE_NOT_AVAILABLE)
+			gang[i].fallback = true;
+		else
+			gang[i].failed = "verify";
+	}
 
-	if (stm32x_erase_options(bank) != ERROR_OK)
+	for (i = 0; i < num_targets; i++)
 	{
-		command_print(CMD_CTX, "stm32x failed to erase options");
-		return ERROR_OK;
+		struct flash_bank *bank = gang[i].bank;
+
+		if (gang[i].writing)
+			retval = stm32x_crc_job_finish(&gang[i].crc, &flash_crc);
+		else if (gang[i].fallback)
+			retval = target_checksum_memory(bank->target, bank->base + offset,
+					length, &flash_crc);
+		else
+			continue;
+
+		if (retval != ERROR_OK)
+			gang[i].failed = "verify";
+		else if (flash_crc != image_crc)
+			gang[i].failed = "verify (crc mismatch)";
 	}
 
-	/* set readout protection */
-	stm32x_info->option_bytes.RDP = 0;
+	duration_measure(&bench);
 
-	if (stm32x_write_options(bank) != ERROR_OK)
+	// One line per target and the summary.
+	for (i = 0; i < num_targets; i++)
 	{
-		command_print(CMD_CTX, "stm32x failed to lock device");
-		return ERROR_OK;
+		if (gang[i].failed)
+			command_print(CMD_CTX, "%s (%s): FAILED at %s", gang[i].bank->name,
+					target_name(gang[i].bank->target), gang[i].failed);
+		else
+		{
+			command_print(CMD_CTX, "%s (%s): passed", gang[i].bank->name,
+					target_name(gang[i].bank->target));
+			passed++;
+		}
 	}
 
-	command_print(CMD_CTX, "stm32x locked");
+	command_print(CMD_CTX, "stm32x gang_write: %d of %d targets passed, %" PRIu32
+			" bytes from file %s in %fs", passed, num_targets, length,
+			CMD_ARGV[0], duration_elapsed(&bench));
 
-	return ERROR_OK;
+	retval = (passed == num_targets) ? ERROR_OK : ERROR_FAIL;
+
+done:
+	free(image);
+	free(gang);
+
+	return retval;
 }
 
-COMMAND_HANDLER(stm32x_handle_unlock_command)
+// Turns differential writes (see stm32x_write_differential) on or off for a
+//  bank. With no on/off argument the current setting is shown.
+COMMAND_HANDLER(stm32x_handle_differential_command)
 {
-	struct target *target = NULL;
-	struct stm32x_flash_bank *stm32x_info = NULL;
+	struct stm32x_flash_bank *stm32x_info;
 
 	if (CMD_ARGC < 1)
 	{
-		command_print(CMD_CTX, "stm32x unlock <bank>");
+		command_print(CMD_CTX, "stm32x differential <bank> ['on'|'off']");
 		return ERROR_OK;
 	}
 
@@ -1362,46 +5508,54 @@ COMMAND_HANDLER(stm32x_handle_unlock_command)
 
 	stm32x_info = bank->driver_priv;
 
-	target = bank->target;
+	if (CMD_ARGC > 1)
+		COMMAND_PARSE_ON_OFF(CMD_ARGV[1], stm32x_info->differential);
 
-	if (target->state != TARGET_HALTED)
+	command_print(CMD_CTX, "stm32x differential writes %s",
+			stm32x_info->differential ? "on" : "off");
+
+	return ERROR_OK;
+}
+
+// Turns the packing of erased words in reads (see stm32x_read) on or off for
+//  a bank. With no on/off argument the current setting is shown.
+COMMAND_HANDLER(stm32x_handle_compressed_read_command)
+{
+	struct stm32x_flash_bank *stm32x_info;
+
+	if (CMD_ARGC < 1)
 	{
-		LOG_ERROR("Target not halted");
-		return ERROR_TARGET_NOT_HALTED;
+		command_print(CMD_CTX, "stm32x compressed_read <bank> ['on'|'off']");
+		return ERROR_OK;
 	}
 
-	retval = stm32x_check_operation_supported(bank);
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
 	if (ERROR_OK != retval)
 		return retval;
 
-	if (stm32x_erase_options(bank) != ERROR_OK)
-	{
-		command_print(CMD_CTX, "stm32x failed to unlock device");
-		return ERROR_OK;
-	}
+	stm32x_info = bank->driver_priv;
 
-	if (stm32x_write_options(bank) != ERROR_OK)
-	{
-		command_print(CMD_CTX, "stm32x failed to lock device");
-		return ERROR_OK;
-	}
+	if (CMD_ARGC > 1)
+		COMMAND_PARSE_ON_OFF(CMD_ARGV[1], stm32x_info->compressed_read);
 
-	command_print(CMD_CTX, "stm32x unlocked.\n"
-			"INFO: a reset or power cycle is required "
-			"for the new settings to take effect.");
+	command_print(CMD_CTX, "stm32x compressed reads %s",
+			stm32x_info->compressed_read ? "on" : "off");
 
 	return ERROR_OK;
 }
 
-COMMAND_HANDLER(stm32x_handle_options_read_command)
+// Turns packed block writes (see stm32x_pack_chunk) on or off for a bank.
+//  The loader kept in sram is dropped on a change, so the next write
+//  uploads the right one. With no on/off argument the current setting is
+//  shown.
+COMMAND_HANDLER(stm32x_handle_compressed_write_command)
 {
-	uint32_t optionbyte;
-	struct target *target = NULL;
-	struct stm32x_flash_bank *stm32x_info = NULL;
+	struct stm32x_flash_bank *stm32x_info;
 
 	if (CMD_ARGC < 1)
 	{
-		command_print(CMD_CTX, "stm32x options_read <bank>");
+		command_print(CMD_CTX, "stm32x compressed_write <bank> ['on'|'off']");
 		return ERROR_OK;
 	}
 
@@ -1412,67 +5566,33 @@ COMMAND_HANDLER(stm32x_handle_options_read_command)
 
 	stm32x_info = bank->driver_priv;
 
-	target = bank->target;
-
-	if (target->state != TARGET_HALTED)
+	if (CMD_ARGC > 1)
 	{
-		LOG_ERROR("Target not halted");
-		return ERROR_TARGET_NOT_HALTED;
+		bool compressed_write;
+		COMMAND_PARSE_ON_OFF(CMD_ARGV[1], compressed_write);
+		if (compressed_write != stm32x_info->compressed_write)
+		{
+			stm32x_info->compressed_write = compressed_write;
+			stm32x_free_working_areas(bank);
+		}
 	}
 
-	retval = stm32x_check_operation_supported(bank);
-	if (ERROR_OK != retval)
-		return retval;
-
-	retval = target_read_u32(target, STM32_FLASH_OBR, &optionbyte);
-	if (retval != ERROR_OK)
-		return retval;
-	command_print(CMD_CTX, "Option Byte: 0x%" PRIx32 "", optionbyte);
-
-	if (buf_get_u32((uint8_t*)&optionbyte, OPT_ERROR, 1))
-		command_print(CMD_CTX, "Option Byte Complement Error");
-
-	if (buf_get_u32((uint8_t*)&optionbyte, OPT_READOUT, 1))
-		command_print(CMD_CTX, "Readout Protection On");
-	else
-		command_print(CMD_CTX, "Readout Protection Off");
-
-	if (buf_get_u32((uint8_t*)&optionbyte, OPT_RDWDGSW, 1))
-		command_print(CMD_CTX, "Software Watchdog");
-	else
-		command_print(CMD_CTX, "Hardware Watchdog");
-
-	if (buf_get_u32((uint8_t*)&optionbyte, OPT_RDRSTSTOP, 1))
-		command_print(CMD_CTX, "Stop: No reset generated");
-	else
-		command_print(CMD_CTX, "Stop: Reset generated");
-
-	if (buf_get_u32((uint8_t*)&optionbyte, OPT_RDRSTSTDBY, 1))
-		command_print(CMD_CTX, "Standby: No reset generated");
-	else
-		command_print(CMD_CTX, "Standby: Reset generated");
-
-	if (stm32x_info->has_dual_banks)
-	{
-		if (buf_get_u32((uint8_t*)&optionbyte, OPT_BFB2, 1))
-			command_print(CMD_CTX, "Boot: Bank 0");
-		else
-			command_print(CMD_CTX, "Boot: Bank 1");
-	}
+	command_print(CMD_CTX, "stm32x compressed writes %s",
+			stm32x_info->compressed_write ? "on" : "off");
 
 	return ERROR_OK;
 }
 
-COMMAND_HANDLER(stm32x_handle_options_write_command)
+// Turns erasing ahead of the gdb flash write (see stm32x_erase_request) on
+//  or off for a bank. Turning it off erases whatever is still pending. With no on/off argument
+//  the current setting is shown.
+COMMAND_HANDLER(stm32x_handle_erase_ahead_command)
 {
-	struct target *target = NULL;
-	struct stm32x_flash_bank *stm32x_info = NULL;
-	uint16_t optionbyte = 0xF8;
+	struct stm32x_flash_bank *stm32x_info;
 
-	if (CMD_ARGC < 4)
+	if (CMD_ARGC < 1)
 	{
-		command_print(CMD_CTX, "stm32x options_write <bank> <SWWDG | HWWDG> "
-				"<RSTSTNDBY | NORSTSTNDBY> <RSTSTOP | NORSTSTOP> <BOOT0 | BOOT1>");
+		command_print(CMD_CTX, "stm32x erase_ahead <bank> ['on'|'off']");
 		return ERROR_OK;
 	}
 
@@ -1483,135 +5603,133 @@ COMMAND_HANDLER(stm32x_handle_options_write_command)
 
 	stm32x_info = bank->driver_priv;
 
-	target = bank->target;
-
-	if (target->state != TARGET_HALTED)
+	if (CMD_ARGC > 1)
 	{
-		LOG_ERROR("Target not halted");
-		return ERROR_TARGET_NOT_HALTED;
+		bool erase_ahead;
+		COMMAND_PARSE_ON_OFF(CMD_ARGV[1], erase_ahead);
+		if (!erase_ahead)
+		{
+			retval = stm32x_session_end(bank, stm32x_erase_flush(bank, 0, bank->size));
+			if (retval != ERROR_OK)
+				return retval;
+		}
+		stm32x_info->erase_ahead = erase_ahead;
 	}
 
-	retval = stm32x_check_operation_supported(bank);
-	if (ERROR_OK != retval)
-		return retval;
+	command_print(CMD_CTX, "stm32x erase ahead %s",
+			stm32x_info->erase_ahead ? "on" : "off");
 
-	/* REVISIT: ignores some options which we will display...
-	 * and doesn't insist on the specified syntax.
-	 */
+	return ERROR_OK;
+}
 
-	/* OPT_RDWDGSW */
-	if (strcmp(CMD_ARGV[1], "SWWDG") == 0)
-	{
-		optionbyte |= (1 << 0);
-	}
-	else	/* REVISIT must be "HWWDG" then ... */
-	{
-		optionbyte &= ~(1 << 0);
-	}
+// Verifies flash against an image without reading it back. The CRC32 of the
+//  flash range is computed on the chip (see stm32x_crc_blocks) and compared
+//  with the CRC32 of the first <length> bytes of a binary file, which costs
+//  milliseconds instead of a full readback. Without a file the CRC of the
+//  flash is just shown.
+/* stm32x verify_crc <bank> <offset> <length> [file]
+ */
+COMMAND_HANDLER(stm32x_handle_verify_crc_command)
+{
+	struct fileio fileio;
+	uint32_t offset, length;
+	uint32_t flash_crc, image_crc;
+	uint8_t *image;
+	size_t read_bytes;
 
-	/* OPT_RDRSTSTOP */
-	if (strcmp(CMD_ARGV[2], "NORSTSTOP") == 0)
-	{
-		optionbyte |= (1 << 1);
-	}
-	else	/* REVISIT must be "RSTSTNDBY" then ... */
+	if (CMD_ARGC < 3)
 	{
-		optionbyte &= ~(1 << 1);
+		command_print(CMD_CTX, "stm32x verify_crc <bank> <offset> <length> [file]");
+		return ERROR_OK;
 	}
 
-	/* OPT_RDRSTSTDBY */
-	if (strcmp(CMD_ARGV[3], "NORSTSTNDBY") == 0)
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (ERROR_OK != retval)
+		return retval;
+
+	COMMAND_PARSE_NUMBER(u32, CMD_ARGV[1], offset);
+	COMMAND_PARSE_NUMBER(u32, CMD_ARGV[2], length);
+
+	if ((length == 0) || (offset > bank->size) || (length > bank->size - offset))
 	{
-		optionbyte |= (1 << 2);
+		command_print(CMD_CTX, "range is outside of the flash bank");
+		return ERROR_FLASH_DST_OUT_OF_BANK;
 	}
-	else	/* REVISIT must be "RSTSTOP" then ... */
+
+	if (bank->target->state != TARGET_HALTED)
 	{
-		optionbyte &= ~(1 << 2);
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
 	}
 
-	if (CMD_ARGC > 4 && stm32x_info->has_dual_banks)
+	retval = stm32x_crc_blocks(bank, bank->base + offset, length, 1, &flash_crc);
+	if (retval != ERROR_OK)
 	{
-		/* OPT_BFB2 */
-		if (strcmp(CMD_ARGV[4], "BOOT0") == 0)
-		{
-			optionbyte |= (1 << 3);
-		}
-		else
-		{
-			optionbyte &= ~(1 << 3);
-		}
+		command_print(CMD_CTX, "stm32x flash checksum failed");
+		return retval;
 	}
 
-	if (stm32x_erase_options(bank) != ERROR_OK)
+	if (CMD_ARGC < 4)
 	{
-		command_print(CMD_CTX, "stm32x failed to erase options");
+		command_print(CMD_CTX, "stm32x crc32 of 0x%" PRIx32 " bytes at 0x%8.8" PRIx32 ": 0x%8.8" PRIx32,
+				length, bank->base + offset, flash_crc);
 		return ERROR_OK;
 	}
 
-	stm32x_info->option_bytes.user_options = optionbyte;
+	// The file has to cover the whole range.
+	if (fileio_open(&fileio, CMD_ARGV[3], FILEIO_READ, FILEIO_BINARY) != ERROR_OK)
+		return ERROR_FAIL;
 
-	if (stm32x_write_options(bank) != ERROR_OK)
+	image = malloc(length);
+	if (image == NULL)
 	{
-		command_print(CMD_CTX, "stm32x failed to write options");
-		return ERROR_OK;
+		fileio_close(&fileio);
+		return ERROR_FAIL;
 	}
 
-	command_print(CMD_CTX, "stm32x write options complete.\n"
-				"INFO: a reset or power cycle is required "
-				"for the new settings to take effect.");
-
-	return ERROR_OK;
-}
-
-// Implementation of the mass erase command for the stm32x.
-//  Invoked as a command by the next function.
-static int stm32x_mass_erase(struct flash_bank *bank)
-{
-	struct target *target = bank->target;
-
-	if (target->state != TARGET_HALTED)
+	retval = fileio_read(&fileio, length, image, &read_bytes);
+	fileio_close(&fileio);
+	if ((retval == ERROR_OK) && (read_bytes != length))
 	{
-		LOG_ERROR("Target not halted");
-		return ERROR_TARGET_NOT_HALTED;
+		command_print(CMD_CTX, "file %s is shorter than 0x%" PRIx32 " bytes", CMD_ARGV[3], length);
+		retval = ERROR_FAIL;
 	}
 
-	/* unlock option flash registers */
-	int retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_KEYR), KEY1);
-	if (retval != ERROR_OK)
-		return retval;
-	retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_KEYR), KEY2);
-	if (retval != ERROR_OK)
-		return retval;
-
-	/* mass erase flash memory */
-	retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_MER);
-	if (retval != ERROR_OK)
-		return retval;
-	retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_MER | FLASH_STRT);
+	if (retval == ERROR_OK)
+		retval = image_calculate_checksum(image, length, &image_crc);
+	free(image);
 	if (retval != ERROR_OK)
 		return retval;
 
-	retval = stm32x_wait_status_busy(bank, 100);
-	if (retval != ERROR_OK)
-		return retval;
+	if (flash_crc != image_crc)
+	{
+		command_print(CMD_CTX, "stm32x verify failed: flash crc32 0x%8.8" PRIx32
+				", file crc32 0x%8.8" PRIx32, flash_crc, image_crc);
+		return ERROR_FAIL;
+	}
 
-	retval = target_write_u32(target, stm32x_get_flash_reg(bank, STM32_FLASH_CR), FLASH_LOCK);
-	if (retval != ERROR_OK)
-		return retval;
+	command_print(CMD_CTX, "stm32x verified 0x%" PRIx32 " bytes at 0x%8.8" PRIx32 " (crc32 0x%8.8" PRIx32 ")",
+			length, bank->base + offset, flash_crc);
 
 	return ERROR_OK;
 }
 
-// Supports the mass erase command for the stm32x. Uses the function above to do the work.
-//  This function must be placed in the stm32x_exec_command_handlers structure to be 
-//  registered and made accessible to the user.
-COMMAND_HANDLER(stm32x_handle_mass_erase_command)
+// Shows the statistics kept for a bank, one line per phase, and resets them
+//  if asked to. The rate is the bytes of the phase over its total time.
+/* stm32x stats <bank> ['reset']
+ */
+COMMAND_HANDLER(stm32x_handle_stats_command)
 {
+	static const char *phase_names[STM32X_NUM_PHASES] = {
+		"alloc", "upload", "erase", "program", "verify", "read",
+	};
+	struct stm32x_flash_bank *stm32x_info;
 	int i;
 
 	if (CMD_ARGC < 1)
 	{
-		command_print(CMD_CTX, "stm32x mass_erase <bank>");
+		command_print(CMD_CTX, "stm32x stats <bank> ['reset']");
 		return ERROR_OK;
 	}
 
@@ -1620,24 +5738,39 @@ COMMAND_HANDLER(stm32x_handle_mass_erase_command)
 	if (ERROR_OK != retval)
 		return retval;
 
-	retval = stm32x_mass_erase(bank);
-	if (retval == ERROR_OK)
+	stm32x_info = bank->driver_priv;
+
+	if (CMD_ARGC > 1)
 	{
-		/* set all sectors as erased */
-		for (i = 0; i < bank->num_sectors; i++)
-		{
-			bank->sectors[i].is_erased = 1;
-		}
+		if (strcmp(CMD_ARGV[1], "reset") != 0)
+			return ERROR_COMMAND_SYNTAX_ERROR;
 
-		command_print(CMD_CTX, "stm32x mass erase complete");
+		memset(stm32x_info->stats, 0, sizeof(stm32x_info->stats));
+		command_print(CMD_CTX, "stm32x statistics reset");
+		return ERROR_OK;
 	}
-	else
+
+	command_print(CMD_CTX, "%-8s %6s %9s %9s %8s %7s %5s %10s %9s",
+			"phase", "count", "total(s)", "peak(s)", "trips", "polls", "algos", "bytes", "KiB/s");
+
+	for (i = 0; i < STM32X_NUM_PHASES; i++)
 	{
-		command_print(CMD_CTX, "stm32x mass erase failed");
+		struct stm32x_phase_stats *stats = &stm32x_info->stats[i];
+		float rate = 0;
+
+		if (stats->total_time > 0)
+			rate = stats->bytes / 1024.0 / stats->total_time;
+
+		command_print(CMD_CTX, "%-8s %6" PRIu32 " %9.3f %9.3f %8" PRIu32 " %7" PRIu32
+				" %5" PRIu32 " %10" PRIu64 " %9.1f",
+				phase_names[i], stats->count, stats->total_time, stats->peak_time,
+				stats->round_trips, stats->polls, stats->algorithm_runs,
+				stats->bytes, rate);
 	}
 
-	return retval;
+	return ERROR_OK;
 }
+
 // This structure supports registering additional device-specific commands 
 //  beyond the basic, required set. This structure enumerates the commands 
 //  and associates their names. It is then used by the following structure
@@ -1682,6 +5815,83 @@ static const struct command_registration stm32x_exec_command_handlers[] = {
 			"('RSTSTOP'|'NORSTSTOP')",
 		.help = "Replace bits in device option byte.",
 	},
+	{
+		.name = "differential",
+		.handler = stm32x_handle_differential_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id ['on'|'off']",
+		.help = "Only erase and program the sectors a write changes.",
+	},
+	{
+		.name = "compressed_read",
+		.handler = stm32x_handle_compressed_read_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id ['on'|'off']",
+		.help = "Pack runs of erased words when reading the flash.",
+	},
+	{
+		.name = "compressed_write",
+		.handler = stm32x_handle_compressed_write_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id ['on'|'off']",
+		.help = "Send block writes packed and unpack them on the target.",
+	},
+	{
+		.name = "erase_ahead",
+		.handler = stm32x_handle_erase_ahead_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id ['on'|'off']",
+		.help = "Put the sector erases of a gdb load off until the write "
+			"reaches them, so the data goes to the target while they erase.",
+	},
+	{
+		.name = "verify_crc",
+		.handler = stm32x_handle_verify_crc_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id offset length [filename]",
+		.help = "Compare the CRC32 of a flash range, computed on the "
+			"target, with the CRC32 of a binary file.",
+	},
+	{
+		.name = "erase_range",
+		.handler = stm32x_handle_erase_range_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id offset length [offset length ...]",
+		.help = "Erase flash ranges, merging them per bank, mass erasing "
+			"whole banks and erasing both banks of XL parts at once.",
+	},
+	{
+		.name = "write_dual",
+		.handler = stm32x_handle_write_dual_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id filename [offset]",
+		.help = "Write a binary file that straddles the two banks of an "
+			"XL density part, programming both banks at the same time.",
+	},
+	{
+		.name = "write_file",
+		.handler = stm32x_handle_write_file_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id filename [offset]",
+		.help = "Write a binary file to erased flash, reading the file "
+			"while the target programs.",
+	},
+	{
+		.name = "gang_write",
+		.handler = stm32x_handle_gang_write_command,
+		.mode = COMMAND_EXEC,
+		.usage = "filename offset bank_id [bank_id ...]",
+		.help = "Erase, program and verify the same binary file on the "
+			"banks of several targets at the same time.",
+	},
+	{
+		.name = "stats",
+		.handler = stm32x_handle_stats_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id ['reset']",
+		.help = "Show (or reset) time and transfer statistics for each "
+			"flash operation phase.",
+	},
 	COMMAND_REGISTRATION_DONE
 };
 
@@ -1728,10 +5938,10 @@ struct flash_driver stm32x_flash = {
 	.erase = stm32x_erase,
 	.protect = stm32x_protect,
 	.write = stm32x_write,
-	.read = default_flash_read,
+	.read = stm32x_read,
 	.probe = stm32x_probe,
 	.auto_probe = stm32x_auto_probe,
-	.erase_check = default_flash_mem_blank_check,
+	.erase_check = stm32x_erase_check,
 	.protect_check = stm32x_protect_check,
 	.info = get_stm32x_info,
 };